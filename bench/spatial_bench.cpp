@@ -0,0 +1,978 @@
+// Benchmarks for the broad-phase structures in src/spatial.
+//
+// Usage: spatial_bench [num_entities] [num_frames]
+
+#include "../src/base/file_io.hpp"
+#include "../src/graphics/mesh.hpp"
+#include "../src/graphics/vertex_cache.hpp"
+#include "../src/spatial/aabb_tree.hpp"
+#include "../src/spatial/double_buffered.hpp"
+#include "../src/spatial/hash_grid.hpp"
+#include "../src/spatial/linear_quad_tree.hpp"
+#include "../src/spatial/narrow_phase.hpp"
+#include "../src/spatial/quad_tree.hpp"
+#include "../src/spatial/quad_tree_snapshot.hpp"
+#include "../src/spatial/sweep_and_prune.hpp"
+#include "../src/spatial/triangle_bvh.hpp"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <vector>
+
+using namespace kvant::spatial;
+
+namespace {
+
+    using Point = glm::vec2;
+
+    struct Entity {
+        Circle<> shape;
+        unsigned id;
+
+        Circle<> bounding_shape() const
+        {
+            return shape;
+        }
+    };
+
+    // Entities move around a few cluster centers, which themselves drift across the world.
+    class Clustered_workload {
+    public:
+        Clustered_workload(unsigned num_entities,
+                           float world_size,
+                           unsigned num_clusters = 16)
+            : world_size_(world_size)
+        {
+            std::mt19937 rng(1234);
+            std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+            for (unsigned i = 0; i < num_clusters; ++i)
+            {
+                clusters_.push_back(Point(unit(rng), unit(rng)) * (world_size * 0.8f) + Point(world_size * 0.1f));
+                cluster_velocity_.push_back((Point(unit(rng), unit(rng)) - Point(0.5f)) * 2.0f);
+            }
+
+            std::normal_distribution<float> spread(0.0f, world_size * 0.02f);
+            for (unsigned i = 0; i < num_entities; ++i)
+            {
+                const unsigned cluster = i % num_clusters;
+                const Point offset(spread(rng), spread(rng));
+                entities_.push_back({Circle<>(clusters_[cluster] + offset, 0.5f + unit(rng)), i});
+                offsets_.push_back(offset);
+                phase_.push_back(unit(rng) * 6.28f);
+            }
+        }
+
+        void step()
+        {
+            for (size_t i = 0; i < clusters_.size(); ++i)
+            {
+                Point& c = clusters_[i];
+                c += cluster_velocity_[i];
+
+                for (unsigned axis = 0; axis < 2; ++axis)
+                {
+                    if (c[axis] < world_size_ * 0.1f || world_size_ * 0.9f < c[axis])
+                    {
+                        cluster_velocity_[i][axis] = -cluster_velocity_[i][axis];
+                    }
+                }
+            }
+
+            for (size_t i = 0; i < entities_.size(); ++i)
+            {
+                phase_[i] += 0.05f;
+                const Point wobble(std::cos(phase_[i]), std::sin(phase_[i]));
+                entities_[i].shape.center = clusters_[i % clusters_.size()] + offsets_[i] + wobble;
+            }
+        }
+
+        const std::vector<Entity>& entities() const
+        {
+            return entities_;
+        }
+
+        Rectangle<Point> world() const
+        {
+            return Rectangle<Point>(Point(0.0f), Point(world_size_));
+        }
+
+    private:
+        float world_size_;
+        std::vector<Point> clusters_;
+        std::vector<Point> cluster_velocity_;
+        std::vector<Entity> entities_;
+        std::vector<Point> offsets_;
+        std::vector<float> phase_;
+    };
+
+    using Clock = std::chrono::high_resolution_clock;
+
+    double elapsed_ms(Clock::time_point since)
+    {
+        return std::chrono::duration<double, std::milli>(Clock::now() - since).count();
+    }
+
+    struct Result {
+        double build_ms{0.0};
+        double query_ms{0.0};
+        double hits_per_query{0.0};
+    };
+
+    // Rebuilds the index every frame and queries the neighbourhood of every entity.
+    template <typename Index>
+    Result run_rebuild(Index& index,
+                       Clustered_workload workload,
+                       unsigned num_frames)
+    {
+        Result result;
+        size_t hits = 0;
+
+        for (unsigned frame = 0; frame < num_frames; ++frame)
+        {
+            workload.step();
+
+            auto t = Clock::now();
+            index.clear();
+            for (const auto& entity : workload.entities())
+            {
+                index.insert(entity);
+            }
+            result.build_ms += elapsed_ms(t);
+
+            t = Clock::now();
+            for (const auto& entity : workload.entities())
+            {
+                const Circle<> query(entity.shape.center, entity.shape.radius * 2.0f);
+                index.for_each_intersecting(query, [&hits](const Entity&) { ++hits; });
+            }
+            result.query_ms += elapsed_ms(t);
+        }
+
+        const double num_queries = static_cast<double>(num_frames) * workload.entities().size();
+        result.build_ms /= num_frames;
+        result.query_ms /= num_frames;
+        result.hits_per_query = hits / num_queries;
+        return result;
+    }
+
+    void print(const char* name, const Result& result)
+    {
+        std::printf("  %-24s build %8.3f ms  query %8.3f ms  hits/query %6.2f\n",
+                    name,
+                    result.build_ms,
+                    result.query_ms,
+                    result.hits_per_query);
+    }
+
+    // Like run_rebuild, with all queries of a frame in one batch.
+    Result run_batch(Quad_tree<Entity>& tree,
+                     Clustered_workload workload,
+                     unsigned num_frames)
+    {
+        Result result;
+        size_t hits = 0;
+
+        std::vector<Circle<>> queries;
+        Quad_tree<Entity>::Batch_result batch;
+
+        for (unsigned frame = 0; frame < num_frames; ++frame)
+        {
+            workload.step();
+
+            auto t = Clock::now();
+            tree.clear();
+            for (const auto& entity : workload.entities())
+            {
+                tree.insert(entity);
+            }
+            result.build_ms += elapsed_ms(t);
+
+            t = Clock::now();
+            queries.clear();
+            for (const auto& entity : workload.entities())
+            {
+                queries.push_back(Circle<>(entity.shape.center, entity.shape.radius * 2.0f));
+            }
+            tree.query_batch(queries, batch);
+            hits += batch.items.size();
+            result.query_ms += elapsed_ms(t);
+        }
+
+        const double num_queries = static_cast<double>(num_frames) * workload.entities().size();
+        result.build_ms /= num_frames;
+        result.query_ms /= num_frames;
+        result.hits_per_query = hits / num_queries;
+        return result;
+    }
+
+    void bench_clustered(unsigned num_entities, unsigned num_frames)
+    {
+        std::printf("Clustered moving workload, %u entities:\n", num_entities);
+
+        const Clustered_workload workload(num_entities, 1000.0f);
+
+        // The layout before nodes split on demand, every node down to depth 3.
+        Quad_tree<Entity> fixed(workload.world(), 1.0f, 3, 0);
+        print("fixed depth 3", run_rebuild(fixed, workload, num_frames));
+
+        Quad_tree<Entity> strict(workload.world());
+        print("strict", run_rebuild(strict, workload, num_frames));
+        print("strict batch", run_batch(strict, workload, num_frames));
+
+        Quad_tree<Entity> loose(workload.world(), 2.0f);
+        print("loose 2x", run_rebuild(loose, workload, num_frames));
+        print("loose 2x batch", run_batch(loose, workload, num_frames));
+
+        // Cells about the size of the queries.
+        Hash_grid<Entity> grid(4.0f, num_entities);
+        print("Hash_grid", run_rebuild(grid, workload, num_frames));
+    }
+
+    // Inserts once and moves the entities with update() every frame.
+    template <typename Index>
+    Result run_update(Index& index,
+                      Clustered_workload workload,
+                      unsigned num_frames)
+    {
+        Result result;
+        size_t hits = 0;
+
+        std::vector<typename Index::Handle> handles;
+        for (const auto& entity : workload.entities())
+        {
+            handles.push_back(index.insert(entity));
+        }
+
+        for (unsigned frame = 0; frame < num_frames; ++frame)
+        {
+            workload.step();
+            const auto& entities = workload.entities();
+
+            auto t = Clock::now();
+            for (size_t i = 0; i < entities.size(); ++i)
+            {
+                index.update(handles[i], entities[i].shape);
+            }
+            result.build_ms += elapsed_ms(t);
+
+            t = Clock::now();
+            for (const auto& entity : entities)
+            {
+                const Circle<> query(entity.shape.center, entity.shape.radius * 2.0f);
+                index.for_each_intersecting(query, [&hits](const Entity&) { ++hits; });
+            }
+            result.query_ms += elapsed_ms(t);
+        }
+
+        const double num_queries = static_cast<double>(num_frames) * workload.entities().size();
+        result.build_ms /= num_frames;
+        result.query_ms /= num_frames;
+        result.hits_per_query = hits / num_queries;
+        return result;
+    }
+
+    void bench_incremental(unsigned num_entities, unsigned num_frames)
+    {
+        std::printf("Incremental updates, %u entities:\n", num_entities);
+
+        const Clustered_workload workload(num_entities, 1000.0f);
+
+        Quad_tree<Entity> tree(workload.world());
+        print("Quad_tree", run_update(tree, workload, num_frames));
+
+        Aabb_tree<Entity> aabb_tree(1.0f);
+        print("Aabb_tree", run_update(aabb_tree, workload, num_frames));
+    }
+
+    // The cost of replaying the changes of a frame on the other copy, and the memory of it.
+    void bench_double_buffered(unsigned num_entities, unsigned num_frames)
+    {
+        std::printf("Double buffered Quad_tree, %u entities:\n", num_entities);
+
+        Clustered_workload workload(num_entities, 1000.0f);
+        Double_buffered<Quad_tree<Entity>> index(workload.world());
+
+        std::vector<Quad_tree<Entity>::Handle> handles;
+        for (const auto& entity : workload.entities())
+        {
+            handles.push_back(index.insert(entity));
+        }
+        index.publish();
+
+        double update_ms = 0.0;
+        double publish_ms = 0.0;
+        for (unsigned frame = 0; frame < num_frames; ++frame)
+        {
+            workload.step();
+            const auto& entities = workload.entities();
+
+            auto t = Clock::now();
+            for (size_t i = 0; i < entities.size(); ++i)
+            {
+                index.update(handles[i], entities[i].shape);
+            }
+            update_ms += elapsed_ms(t);
+
+            t = Clock::now();
+            index.publish();
+            publish_ms += elapsed_ms(t);
+        }
+
+        const auto usage = index.memory_usage();
+        std::printf("  update %8.3f ms  publish %8.3f ms  memory %.2f MB, single tree %.2f MB\n",
+                    update_ms / num_frames,
+                    publish_ms / num_frames,
+                    usage.total() / (1024.0 * 1024.0),
+                    usage.front / (1024.0 * 1024.0));
+    }
+
+    // Inserting items one by one against building the tree in bulk, with one thread up to
+    // all of them.
+    void bench_bulk_build(unsigned num_entities)
+    {
+        std::printf("Quad_tree bulk build, %u entities:\n", num_entities);
+
+        const Clustered_workload workload(num_entities, 1000.0f);
+        const auto& entities = workload.entities();
+        const unsigned repeats = 5;
+
+        Quad_tree<Entity> tree(workload.world());
+        auto t = Clock::now();
+        for (unsigned i = 0; i < repeats; ++i)
+        {
+            tree.clear();
+            for (const auto& entity : entities)
+            {
+                tree.insert(entity);
+            }
+        }
+        const double insert_ms = elapsed_ms(t) / repeats;
+        std::printf("  insert  %8.3f ms\n", insert_ms);
+
+        auto& pool = kvant::base::Worker_pool::instance();
+        const unsigned max_threads = pool.num_threads();
+        for (unsigned threads = 1;; threads = std::min(threads * 2, max_threads))
+        {
+            pool.set_thread_limit(threads);
+
+            t = Clock::now();
+            for (unsigned i = 0; i < repeats; ++i)
+            {
+                tree.build(entities);
+            }
+            const double build_ms = elapsed_ms(t) / repeats;
+            std::printf("  build   %8.3f ms  %2u threads  %.2fx insert\n", build_ms, threads, insert_ms / build_ms);
+
+            if (threads == max_threads)
+            {
+                break;
+            }
+        }
+        pool.set_thread_limit(0);
+    }
+
+    // Loading static items: inserting them one by one against mapping a snapshot of the
+    // tree, and the first pass of queries, which reads in the pages.
+    void bench_snapshot(unsigned num_entities)
+    {
+        std::printf("Quad_tree snapshot, %u static entities:\n", num_entities);
+
+        Clustered_workload workload(num_entities, 1000.0f);
+        const auto& entities = workload.entities();
+
+        auto t = Clock::now();
+        Quad_tree<Entity> tree(workload.world());
+        for (const auto& entity : entities)
+        {
+            tree.insert(entity);
+        }
+        const double insert_ms = elapsed_ms(t);
+
+        std::vector<char> bytes;
+        Quad_tree_snapshot<Entity>::write(tree, bytes);
+        const char* filename = "spatial_bench_snapshot.bin";
+        if (!kvant::base::write_file(filename, bytes.data(), bytes.size()))
+        {
+            std::printf("  could not write %s\n", filename);
+            return;
+        }
+
+        t = Clock::now();
+        kvant::base::Mapped_file file;
+        Quad_tree_snapshot<Entity> snapshot;
+        const bool opened = file.open(filename) && snapshot.open(file.data(), file.size());
+        const double open_ms = elapsed_ms(t);
+
+        size_t hits = 0;
+        t = Clock::now();
+        for (const auto& entity : entities)
+        {
+            snapshot.for_each_intersecting(Circle<>(entity.shape.center, 2.0f), [&hits](const Entity&) { ++hits; });
+        }
+        const double query_ms = elapsed_ms(t);
+
+        t = Clock::now();
+        for (const auto& entity : entities)
+        {
+            tree.for_each_intersecting(Circle<>(entity.shape.center, 2.0f), [&hits](const Entity&) { ++hits; });
+        }
+        const double tree_query_ms = elapsed_ms(t);
+
+        std::printf("  insert %8.3f ms  map %8.3f ms (%s, %.2f MB)\n",
+                    insert_ms,
+                    open_ms,
+                    opened ? "ok" : "failed",
+                    bytes.size() / (1024.0 * 1024.0));
+        std::printf("  first queries %8.3f ms, on the tree %8.3f ms  %.1f hits/query\n",
+                    query_ms,
+                    tree_query_ms,
+                    static_cast<double>(hits) / (2 * entities.size()));
+
+        file.close();
+        std::remove(filename);
+    }
+
+    // Bulk builds every frame, and moves a tenth of the entities incrementally.
+    Result run_linear(Linear_quad_tree<Entity>& index,
+                      Clustered_workload workload,
+                      unsigned num_frames,
+                      bool incremental)
+    {
+        Result result;
+        size_t hits = 0;
+
+        index.build(workload.entities());
+
+        for (unsigned frame = 0; frame < num_frames; ++frame)
+        {
+            workload.step();
+            const auto& entities = workload.entities();
+
+            auto t = Clock::now();
+            if (incremental)
+            {
+                for (size_t i = frame % 10; i < entities.size(); i += 10)
+                {
+                    index.update(i, entities[i]);
+                }
+                index.commit();
+            }
+            else
+            {
+                index.build(entities);
+            }
+            result.build_ms += elapsed_ms(t);
+
+            t = Clock::now();
+            for (const auto& entity : entities)
+            {
+                const Circle<> query(entity.shape.center, entity.shape.radius * 2.0f);
+                index.for_each_intersecting(query, [&hits](const Entity&) { ++hits; });
+            }
+            result.query_ms += elapsed_ms(t);
+        }
+
+        const double num_queries = static_cast<double>(num_frames) * workload.entities().size();
+        result.build_ms /= num_frames;
+        result.query_ms /= num_frames;
+        result.hits_per_query = hits / num_queries;
+        return result;
+    }
+
+    void bench_linear_quad_tree(unsigned num_entities, unsigned num_frames)
+    {
+        std::printf("Linear_quad_tree vs Quad_tree, %u entities:\n", num_entities);
+
+        const Clustered_workload workload(num_entities, 1000.0f);
+
+        Quad_tree<Entity> tree(workload.world());
+        print("Quad_tree insert", run_rebuild(tree, workload, num_frames));
+
+        Linear_quad_tree<Entity> linear(workload.world());
+        print("linear bulk build", run_linear(linear, workload, num_frames, false));
+        print("linear 10% update", run_linear(linear, workload, num_frames, true));
+    }
+
+    struct Pair_result {
+        double ms{0.0};
+        double pairs{0.0};
+    };
+
+    // Rebuilds the index every frame and finds the pairs by querying with every entity.
+    template <typename Index>
+    Pair_result run_pairs_by_query(Index& index,
+                                   Clustered_workload workload,
+                                   unsigned num_frames)
+    {
+        Pair_result result;
+        size_t pairs = 0;
+
+        for (unsigned frame = 0; frame < num_frames; ++frame)
+        {
+            workload.step();
+
+            const auto t = Clock::now();
+            index.clear();
+            for (const auto& entity : workload.entities())
+            {
+                index.insert(entity);
+            }
+
+            for (const auto& entity : workload.entities())
+            {
+                const unsigned id = entity.id;
+                index.for_each_intersecting(bounding_rect(entity.shape), [&pairs, id](const Entity& other) {
+                    pairs += id < other.id;
+                });
+            }
+            result.ms += elapsed_ms(t);
+        }
+
+        result.ms /= num_frames;
+        result.pairs = static_cast<double>(pairs) / num_frames;
+        return result;
+    }
+
+    Pair_result run_pairs_sweep_and_prune(Clustered_workload workload,
+                                          unsigned num_frames)
+    {
+        Sweep_and_prune<Entity> sap;
+        std::vector<Sweep_and_prune<Entity>::Handle> handles;
+        for (const auto& entity : workload.entities())
+        {
+            handles.push_back(sap.insert(entity));
+        }
+
+        // Sorts from scratch once.
+        sap.for_each_overlapping_pair([](Sweep_and_prune<Entity>::Handle, Sweep_and_prune<Entity>::Handle) {});
+
+        Pair_result result;
+        size_t pairs = 0;
+
+        for (unsigned frame = 0; frame < num_frames; ++frame)
+        {
+            workload.step();
+
+            const auto t = Clock::now();
+            const auto& entities = workload.entities();
+            for (size_t i = 0; i < entities.size(); ++i)
+            {
+                sap.update(handles[i], entities[i].shape);
+            }
+
+            sap.for_each_overlapping_pair([&pairs](Sweep_and_prune<Entity>::Handle, Sweep_and_prune<Entity>::Handle) { ++pairs; });
+            result.ms += elapsed_ms(t);
+        }
+
+        result.ms /= num_frames;
+        result.pairs = static_cast<double>(pairs) / num_frames;
+        return result;
+    }
+
+    void print(const char* name, const Pair_result& result)
+    {
+        std::printf("  %-24s %10.3f ms  pairs %10.0f\n", name, result.ms, result.pairs);
+    }
+
+    // All overlapping pairs, with the world growing with the entity count to keep the density.
+    void bench_pairs(unsigned num_frames)
+    {
+        for (const unsigned num_entities : {10000u, 50000u, 200000u})
+        {
+            std::printf("Overlapping pairs, clustered moving workload, %u entities:\n", num_entities);
+
+            const Clustered_workload workload(num_entities, 10.0f * std::sqrt(static_cast<float>(num_entities)));
+
+            print("Sweep_and_prune", run_pairs_sweep_and_prune(workload, num_frames));
+
+            Hash_grid<Entity> grid(4.0f, num_entities);
+            print("Hash_grid", run_pairs_by_query(grid, workload, num_frames));
+
+            // The fixed depth tree takes tens of seconds per frame beyond this.
+            if (num_entities <= 50000)
+            {
+                Quad_tree<Entity> tree(workload.world());
+                print("Quad_tree", run_pairs_by_query(tree, workload, num_frames));
+            }
+        }
+    }
+
+    // Welding a triangle soup, six copies of most vertices, back into an indexed mesh.
+    void bench_mesh_weld(unsigned size)
+    {
+        kvant::graphics::Triangle_mesh<> mesh;
+        for (unsigned z = 0; z < size; ++z)
+        {
+            for (unsigned x = 0; x < size; ++x)
+            {
+                const float height = std::sin(x * 0.1f) * std::cos(z * 0.07f) * 10.0f;
+                mesh.vertices.push_back(kvant::graphics::Vertex(glm::vec3(static_cast<float>(x), height, static_cast<float>(z))));
+            }
+        }
+
+        for (unsigned z = 0; z + 1 < size; ++z)
+        {
+            for (unsigned x = 0; x + 1 < size; ++x)
+            {
+                const unsigned v0 = x + z * size;
+                mesh.triangles.push_back({v0, v0 + 1, v0 + 1 + size});
+                mesh.triangles.push_back({v0 + 1 + size, v0 + size, v0});
+            }
+        }
+
+        const auto triangles = mesh.triangles;
+        mesh.make_non_indexed();
+        for (size_t i = 0; i < triangles.size(); ++i)
+        {
+            const unsigned v0 = static_cast<unsigned>(i * 3);
+            mesh.triangles.push_back({v0, v0 + 1, v0 + 2});
+        }
+
+        std::printf("Mesh welding, %u vertices:\n", static_cast<unsigned>(mesh.vertices.size()));
+
+        const auto t = Clock::now();
+        mesh.optimize();
+        std::printf("  optimize %8.3f ms  %u vertices left\n", elapsed_ms(t), static_cast<unsigned>(mesh.vertices.size()));
+    }
+
+    void bench_vertex_normals(unsigned size)
+    {
+        kvant::graphics::Triangle_mesh<> mesh;
+        for (unsigned z = 0; z < size; ++z)
+        {
+            for (unsigned x = 0; x < size; ++x)
+            {
+                const float height = std::sin(x * 0.1f) * std::cos(z * 0.07f) * 10.0f;
+                mesh.vertices.push_back(kvant::graphics::Vertex(glm::vec3(static_cast<float>(x), height, static_cast<float>(z))));
+            }
+        }
+
+        for (unsigned z = 0; z + 1 < size; ++z)
+        {
+            for (unsigned x = 0; x + 1 < size; ++x)
+            {
+                const unsigned v0 = x + z * size;
+                mesh.triangles.push_back({v0, v0 + 1, v0 + 1 + size});
+                mesh.triangles.push_back({v0 + 1 + size, v0 + size, v0});
+            }
+        }
+
+        std::printf("Vertex normals, %u triangles:\n", static_cast<unsigned>(mesh.triangles.size()));
+
+        using kvant::graphics::Normal_weighting;
+        const Normal_weighting weightings[] = {Normal_weighting::uniform, Normal_weighting::area, Normal_weighting::angle};
+        const char* names[] = {"uniform", "area", "angle"};
+        for (unsigned i = 0; i < 3; ++i)
+        {
+            const auto t = Clock::now();
+            mesh.calculate_vertex_normals(weightings[i]);
+            std::printf("  %-8s %8.3f ms\n", names[i], elapsed_ms(t));
+        }
+    }
+
+    // Vertex cache and fetch order of patches as make_patch() generates them, row by row,
+    // merged into one mesh.
+    void bench_vertex_cache(unsigned size, unsigned num_patches)
+    {
+        struct Height_patch {
+            glm::vec3 sample(float x, float y) const
+            {
+                return glm::vec3(x, std::sin(x * 20.0f) * std::cos(y * 14.0f) * 0.1f, y);
+            }
+        };
+
+        kvant::graphics::Triangle_mesh<> mesh;
+        for (unsigned i = 0; i < num_patches; ++i)
+        {
+            kvant::graphics::Triangle_mesh<> patch;
+            patch.make_patch(Height_patch(), size, size);
+            patch.translate(glm::vec3(static_cast<float>(i), 0.0f, 0.0f));
+            mesh.merge(patch);
+        }
+
+        std::printf("Vertex cache, %u triangles:\n", static_cast<unsigned>(mesh.triangles.size()));
+
+        const auto before_32 = kvant::graphics::measure_vertex_cache(mesh.triangles, mesh.vertices.size(), 32);
+        const auto t = Clock::now();
+        const auto report = kvant::graphics::optimize_for_vertex_cache(mesh);
+        const double ms = elapsed_ms(t);
+        const auto after_32 = kvant::graphics::measure_vertex_cache(mesh.triangles, mesh.vertices.size(), 32);
+
+        std::printf("  optimize %8.3f ms\n", ms);
+        std::printf("  FIFO 16  ACMR %.3f -> %.3f  ATVR %.3f -> %.3f\n", report.before.acmr, report.after.acmr, report.before.atvr, report.after.atvr);
+        std::printf("  FIFO 32  ACMR %.3f -> %.3f  ATVR %.3f -> %.3f\n", before_32.acmr, after_32.acmr, before_32.atvr, after_32.atvr);
+    }
+
+    // Height field of 2 * (size - 1)^2 triangles, built and then hit by rays from above.
+    void bench_triangle_bvh(unsigned size, unsigned num_rays)
+    {
+        kvant::graphics::Triangle_mesh<> mesh;
+        for (unsigned z = 0; z < size; ++z)
+        {
+            for (unsigned x = 0; x < size; ++x)
+            {
+                const float height = std::sin(x * 0.1f) * std::cos(z * 0.07f) * 10.0f;
+                mesh.vertices.push_back(kvant::graphics::Vertex(glm::vec3(static_cast<float>(x), height, static_cast<float>(z))));
+            }
+        }
+
+        for (unsigned z = 0; z + 1 < size; ++z)
+        {
+            for (unsigned x = 0; x + 1 < size; ++x)
+            {
+                const unsigned v0 = x + z * size;
+                mesh.triangles.push_back({v0, v0 + 1, v0 + 1 + size});
+                mesh.triangles.push_back({v0 + 1 + size, v0 + size, v0});
+            }
+        }
+
+        std::printf("Triangle_bvh, %u triangles:\n", static_cast<unsigned>(mesh.triangles.size()));
+
+        Triangle_bvh bvh;
+        auto t = Clock::now();
+        bvh.build(mesh);
+        const double build_ms = elapsed_ms(t);
+
+        t = Clock::now();
+        bvh.refit(mesh);
+        const double refit_ms = elapsed_ms(t);
+
+        std::mt19937 rng(42);
+        std::uniform_real_distribution<float> unit(0.0f, static_cast<float>(size));
+
+        unsigned hits = 0;
+        t = Clock::now();
+        for (unsigned i = 0; i < num_rays; ++i)
+        {
+            const glm::vec3 origin(unit(rng), 50.0f, unit(rng));
+            const glm::vec3 target(unit(rng), -20.0f, unit(rng));
+            Triangle_bvh::Hit hit;
+            hits += bvh.raycast(Triangle_bvh::Ray(origin, target - origin), 1.0f, hit);
+        }
+        const double ray_ms = elapsed_ms(t);
+
+        std::printf("  build %8.3f ms  refit %8.3f ms  %u rays %8.3f ms  hits %u\n", build_ms, refit_ms, num_rays, ray_ms, hits);
+    }
+
+    // One circle against many rectangles, with the scalar test and the batch one.
+    void bench_batch_tests(unsigned num_shapes, unsigned num_queries)
+    {
+        std::mt19937 rng(11);
+        std::uniform_real_distribution<float> position(0.0f, 1000.0f);
+        std::uniform_real_distribution<float> size(0.5f, 5.0f);
+
+        std::vector<float> x, y, w, h;
+        for (unsigned i = 0; i < num_shapes; ++i)
+        {
+            x.push_back(position(rng));
+            y.push_back(position(rng));
+            w.push_back(size(rng));
+            h.push_back(size(rng));
+        }
+
+        std::vector<Point> queries;
+        for (unsigned i = 0; i < num_queries; ++i)
+        {
+            queries.push_back(Point(position(rng), position(rng)));
+        }
+
+        std::vector<std::uint32_t> hits(num_shapes);
+        std::printf("Circle against %u rectangles, %u queries, %u wide:\n", num_shapes, num_queries, simd::max_width);
+
+        size_t scalar_hits = 0;
+        auto t = Clock::now();
+        for (const Point& query : queries)
+        {
+            size_t num_hits = 0;
+            for (std::uint32_t i = 0; i < num_shapes; ++i)
+            {
+                hits[num_hits] = i;
+                num_hits += test_circle_rect(query, 20.0f, Point(x[i], y[i]), Point(w[i], h[i]));
+            }
+            scalar_hits += num_hits;
+        }
+        const double scalar_ms = elapsed_ms(t);
+
+        size_t batch_hits = 0;
+        t = Clock::now();
+        for (const Point& query : queries)
+        {
+            batch_hits += test_circle_rect_batch(query, 20.0f, x.data(), y.data(), w.data(), h.data(), num_shapes, hits.data());
+        }
+        const double batch_ms = elapsed_ms(t);
+
+        std::printf("  scalar %8.3f ms  batch %8.3f ms  hits %u %u\n", scalar_ms, batch_ms,
+                    static_cast<unsigned>(scalar_hits), static_cast<unsigned>(batch_hits));
+    }
+
+    // The narrow phase with a virtual call per shape and pair, to compare against grouping
+    // the pairs by type.
+    struct Any_shape {
+        virtual ~Any_shape() {}
+        virtual bool collide(const Any_shape& b, Contact& contact) const = 0;
+        virtual bool collide_as_b(const Circle<>& a, Contact& contact) const = 0;
+        virtual bool collide_as_b(const Capsule& a, Contact& contact) const = 0;
+        virtual bool collide_as_b(const Rectangle<>& a, Contact& contact) const = 0;
+        virtual bool collide_as_b(const Oriented_box& a, Contact& contact) const = 0;
+        virtual bool collide_as_b(const Convex_polygon& a, Contact& contact) const = 0;
+    };
+
+    template <typename Shape>
+    struct Shape_of : Any_shape {
+        explicit Shape_of(const Shape& shape_)
+            : shape(shape_)
+        {
+        }
+
+        bool collide(const Any_shape& b, Contact& contact) const override
+        {
+            return b.collide_as_b(shape, contact);
+        }
+
+        bool collide_as_b(const Circle<>& a, Contact& contact) const override
+        {
+            return kvant::spatial::collide(a, shape, contact);
+        }
+
+        bool collide_as_b(const Capsule& a, Contact& contact) const override
+        {
+            return kvant::spatial::collide(a, shape, contact);
+        }
+
+        bool collide_as_b(const Rectangle<>& a, Contact& contact) const override
+        {
+            return kvant::spatial::collide(a, shape, contact);
+        }
+
+        bool collide_as_b(const Oriented_box& a, Contact& contact) const override
+        {
+            return kvant::spatial::collide(a, shape, contact);
+        }
+
+        bool collide_as_b(const Convex_polygon& a, Contact& contact) const override
+        {
+            return kvant::spatial::collide(a, shape, contact);
+        }
+
+        Shape shape;
+    };
+
+    void bench_narrow_phase(unsigned num_shapes, unsigned num_pairs)
+    {
+        std::mt19937 rng(46);
+        std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+        Shape_set shapes;
+        std::vector<Shape_ref> refs;
+        std::vector<std::unique_ptr<Any_shape>> objects;
+
+        // Every shape overlaps some of the others.
+        const auto position = [&]() {
+            return Point(unit(rng), unit(rng)) * 10.0f;
+        };
+        const auto add = [&](Any_shape* object, Shape_ref ref) {
+            objects.emplace_back(object);
+            refs.push_back(ref);
+        };
+
+        for (unsigned i = 0; i < num_shapes; ++i)
+        {
+            const Point p = position();
+            switch (i % 5)
+            {
+            case 0:
+            {
+                const Circle<> circle(p, 0.5f + unit(rng));
+                add(new Shape_of<Circle<>>(circle), shapes.add(circle));
+                break;
+            }
+            case 1:
+            {
+                const Capsule capsule(p, p + Point(unit(rng), unit(rng)) * 2.0f, 0.3f + unit(rng) * 0.5f);
+                add(new Shape_of<Capsule>(capsule), shapes.add(capsule));
+                break;
+            }
+            case 2:
+            {
+                const Rectangle<> rect(p, p + Point(0.5f + unit(rng), 0.5f + unit(rng)));
+                add(new Shape_of<Rectangle<>>(rect), shapes.add(rect));
+                break;
+            }
+            case 3:
+            {
+                const Oriented_box box(p, Point(0.3f + unit(rng), 0.3f + unit(rng)), unit(rng) * 6.28f);
+                add(new Shape_of<Oriented_box>(box), shapes.add(box));
+                break;
+            }
+            default:
+            {
+                Point vertices[6];
+                for (unsigned v = 0; v < 6; ++v)
+                {
+                    const float angle = v * 6.2831853f / 6;
+                    vertices[v] = p + Point(std::cos(angle), std::sin(angle)) * (0.5f + unit(rng) * 0.2f);
+                }
+                const Convex_polygon polygon(vertices, 6);
+                add(new Shape_of<Convex_polygon>(polygon), shapes.add(polygon));
+                break;
+            }
+            }
+        }
+
+        std::vector<Narrow_phase::Pair> pairs;
+        std::vector<std::pair<unsigned, unsigned>> object_pairs;
+        for (unsigned i = 0; i < num_pairs; ++i)
+        {
+            const unsigned a = rng() % refs.size();
+            const unsigned b = rng() % refs.size();
+            pairs.push_back({refs[a], refs[b]});
+            object_pairs.push_back({a, b});
+        }
+
+        std::printf("Narrow phase, %u pairs of %u shapes:\n", num_pairs, num_shapes);
+
+        size_t virtual_hits = 0;
+        auto t = Clock::now();
+        for (const auto& pair : object_pairs)
+        {
+            Contact contact;
+            virtual_hits += objects[pair.first]->collide(*objects[pair.second], contact) ? 1 : 0;
+        }
+        const double virtual_ms = elapsed_ms(t);
+
+        Narrow_phase narrow_phase;
+        std::vector<Narrow_phase::Pair_contact> contacts;
+        t = Clock::now();
+        narrow_phase.collide(shapes, pairs, contacts);
+        const double grouped_ms = elapsed_ms(t);
+
+        std::printf("  virtual %8.3f ms  grouped %8.3f ms  contacts %u %u\n", virtual_ms, grouped_ms,
+                    static_cast<unsigned>(virtual_hits), static_cast<unsigned>(contacts.size()));
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    const unsigned num_entities = argc > 1 ? std::atoi(argv[1]) : 10000;
+    const unsigned num_frames = argc > 2 ? std::atoi(argv[2]) : 20;
+
+    bench_clustered(num_entities, num_frames);
+    bench_incremental(num_entities, num_frames);
+    bench_double_buffered(num_entities, num_frames);
+    bench_bulk_build(num_entities * 100);
+    bench_snapshot(num_entities * 10);
+    bench_triangle_bvh(500, 100000);
+    bench_mesh_weld(500);
+    bench_vertex_normals(1500);
+    bench_vertex_cache(256, 16);
+    bench_batch_tests(100000, 1000);
+    bench_narrow_phase(10000, 1000000);
+    bench_linear_quad_tree(num_entities * 10, num_frames);
+    bench_pairs(num_frames);
+
+    return 0;
+}
@@ -1,6 +1,17 @@
 #include "file_io.hpp"
 #include <fstream>
 
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 namespace kvant {
 namespace base {
 
@@ -20,5 +31,111 @@ namespace base {
         return result;
     }
 
+    bool write_file(const char* filename, const void* data, size_t size)
+    {
+        std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+        file.write(static_cast<const char*>(data), size);
+        return file.good();
+    }
+
+    Mapped_file::~Mapped_file()
+    {
+        close();
+    }
+
+#ifdef _WIN32
+    bool Mapped_file::open(const char* filename)
+    {
+        close();
+
+        HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            return false;
+        }
+        file_ = file;
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+        {
+            close();
+            return false;
+        }
+
+        mapping_ = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        data_ = mapping_ != nullptr ? MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0) : nullptr;
+        if (data_ == nullptr)
+        {
+            close();
+            return false;
+        }
+
+        size_ = static_cast<size_t>(size.QuadPart);
+        return true;
+    }
+
+    void Mapped_file::close()
+    {
+        if (data_ != nullptr)
+        {
+            UnmapViewOfFile(data_);
+        }
+        if (mapping_ != nullptr)
+        {
+            CloseHandle(mapping_);
+        }
+        if (file_ != nullptr)
+        {
+            CloseHandle(file_);
+        }
+
+        data_ = nullptr;
+        mapping_ = nullptr;
+        file_ = nullptr;
+        size_ = 0;
+    }
+#else
+    bool Mapped_file::open(const char* filename)
+    {
+        close();
+
+        const int file = ::open(filename, O_RDONLY);
+        if (file < 0)
+        {
+            return false;
+        }
+
+        struct stat status;
+        if (fstat(file, &status) != 0 || status.st_size == 0)
+        {
+            ::close(file);
+            return false;
+        }
+
+        // The mapping stays valid after the file is closed.
+        void* data = mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+        ::close(file);
+        if (data == MAP_FAILED)
+        {
+            return false;
+        }
+
+        data_ = data;
+        size_ = static_cast<size_t>(status.st_size);
+        return true;
+    }
+
+    void Mapped_file::close()
+    {
+        if (data_ != nullptr)
+        {
+            munmap(data_, size_);
+        }
+
+        data_ = nullptr;
+        size_ = 0;
+    }
+#endif
+
 } // namespace base
 } // namespace kvant
@@ -1,9 +1,46 @@
 #pragma once
+#include <cstddef>
 #include <string>
 
 namespace kvant {
 namespace base {
 
     std::string read_textfile(const char* filename);
+
+    // Returns false if the file could not be written in full.
+    bool write_file(const char* filename, const void* data, size_t size);
+
+    // A file mapped read only into memory. The pages are read as they are first used, and
+    // the mapping is aligned to a page.
+    class Mapped_file {
+    public:
+        Mapped_file() = default;
+        ~Mapped_file();
+
+        Mapped_file(const Mapped_file&) = delete;
+        Mapped_file& operator=(const Mapped_file&) = delete;
+
+        // Returns false if the file can't be opened or is empty.
+        bool open(const char* filename);
+        void close();
+
+        const void* data() const
+        {
+            return data_;
+        }
+
+        size_t size() const
+        {
+            return size_;
+        }
+
+    private:
+        void* data_{nullptr};
+        size_t size_{0};
+#ifdef _WIN32
+        void* file_{nullptr};
+        void* mapping_{nullptr};
+#endif
+    };
 }
 } // namespace kvant
@@ -0,0 +1,77 @@
+#pragma once
+#include "worker_pool.hpp"
+#include <array>
+#include <cstdint>
+#include <vector>
+
+namespace kvant {
+namespace base {
+
+    struct Sort_pair {
+        std::uint32_t key;
+        std::uint32_t value;
+    };
+
+    // Stable LSD radix sort on the key, eight bits per pass. Each pass is split into chunks
+    // that are histogrammed and scattered in parallel. Passes where all keys share the same
+    // digit are skipped, so keys only using the lower bits are cheap to sort.
+    inline void radix_sort(std::vector<Sort_pair>& pairs,
+                           std::vector<Sort_pair>& scratch)
+    {
+        using Histogram = std::array<size_t, 256>;
+
+        const size_t count = pairs.size();
+        scratch.resize(count);
+
+        const unsigned chunks = num_chunks(count, 16 * 1024);
+        std::vector<Histogram> histograms(chunks);
+
+        for (unsigned shift = 0; shift < 32; shift += 8)
+        {
+            parallel_for_chunks(count, chunks, [&](unsigned chunk, size_t begin, size_t end) {
+                Histogram& histogram = histograms[chunk];
+                histogram.fill(0);
+
+                for (size_t i = begin; i < end; ++i)
+                {
+                    ++histogram[(pairs[i].key >> shift) & 0xff];
+                }
+            });
+
+            // Turn the counts into scatter offsets, digit major so the sort stays stable.
+            size_t offset = 0;
+            bool skip_pass = false;
+            for (unsigned digit = 0; digit < 256; ++digit)
+            {
+                size_t digit_count = 0;
+                for (Histogram& histogram : histograms)
+                {
+                    const size_t n = histogram[digit];
+                    histogram[digit] = offset;
+                    offset += n;
+                    digit_count += n;
+                }
+
+                skip_pass = skip_pass || digit_count == count;
+            }
+
+            if (skip_pass)
+            {
+                continue;
+            }
+
+            parallel_for_chunks(count, chunks, [&](unsigned chunk, size_t begin, size_t end) {
+                Histogram& offsets = histograms[chunk];
+
+                for (size_t i = begin; i < end; ++i)
+                {
+                    scratch[offsets[(pairs[i].key >> shift) & 0xff]++] = pairs[i];
+                }
+            });
+
+            pairs.swap(scratch);
+        }
+    }
+
+} // namespace base
+} // namespace kvant
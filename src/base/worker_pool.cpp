@@ -0,0 +1,149 @@
+#include "worker_pool.hpp"
+
+namespace kvant {
+namespace base {
+
+    namespace {
+        thread_local bool inside_job = false;
+    }
+
+    Worker_pool& Worker_pool::instance()
+    {
+        static Worker_pool inst;
+        return inst;
+    }
+
+    void Worker_pool::run(unsigned num_jobs, Job job, void* context)
+    {
+        if (num_jobs == 0)
+        {
+            return;
+        }
+
+        std::unique_lock<std::mutex> run_lock(run_mutex_, std::defer_lock);
+        if (inside_job || num_threads() == 1 || num_jobs == 1 || !run_lock.try_lock())
+        {
+            for (unsigned i = 0; i < num_jobs; ++i)
+            {
+                job(context, i);
+            }
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            job_ = job;
+            context_ = context;
+            num_jobs_ = num_jobs;
+            next_job_ = 0;
+            ++generation_;
+        }
+
+        wake_.notify_all();
+
+        work(job, context, num_jobs);
+
+        // All jobs are claimed at this point, wait for the workers still running one.
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [this] { return active_workers_ == 0; });
+        job_ = nullptr;
+        context_ = nullptr;
+    }
+
+    unsigned Worker_pool::num_threads() const
+    {
+        const unsigned count = static_cast<unsigned>(workers_.size()) + 1;
+        return thread_limit_ == 0 ? count : std::min(count, thread_limit_);
+    }
+
+    void Worker_pool::set_thread_limit(unsigned limit)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        thread_limit_ = limit;
+    }
+
+    Worker_pool::~Worker_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            quit_ = true;
+        }
+
+        wake_.notify_all();
+
+        for (auto& worker : workers_)
+        {
+            worker.join();
+        }
+    }
+
+    Worker_pool::Worker_pool()
+        : next_job_(0)
+    {
+        const unsigned hardware_threads = std::thread::hardware_concurrency();
+        const unsigned num_workers = hardware_threads > 1 ? hardware_threads - 1 : 0;
+
+        for (unsigned i = 0; i < num_workers; ++i)
+        {
+            workers_.push_back(std::thread(&Worker_pool::worker_loop, this, i));
+        }
+    }
+
+    void Worker_pool::worker_loop(unsigned worker_index)
+    {
+        unsigned seen_generation = 0;
+
+        for (;;)
+        {
+            Job job = nullptr;
+            void* context = nullptr;
+            unsigned num_jobs = 0;
+
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [&] { return quit_ || generation_ != seen_generation; });
+
+                if (quit_)
+                {
+                    return;
+                }
+
+                seen_generation = generation_;
+
+                // Woke up too late, the run is already over, or left out by the limit.
+                if (job_ == nullptr || (thread_limit_ != 0 && worker_index + 1 >= thread_limit_))
+                {
+                    continue;
+                }
+
+                job = job_;
+                context = context_;
+                num_jobs = num_jobs_;
+                ++active_workers_;
+            }
+
+            work(job, context, num_jobs);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                --active_workers_;
+            }
+
+            done_.notify_one();
+        }
+    }
+
+    void Worker_pool::work(Job job, void* context, unsigned num_jobs)
+    {
+        inside_job = true;
+
+        for (unsigned i = next_job_++; i < num_jobs; i = next_job_++)
+        {
+            job(context, i);
+        }
+
+        inside_job = false;
+    }
+
+} // namespace base
+} // namespace kvant
@@ -0,0 +1,113 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace kvant {
+namespace base {
+
+    // A fixed set of worker threads for data parallel work. The calling thread takes part
+    // in the work and run() returns once every job is done. Nested calls run serially, and
+    // so do calls from other threads while the pool is busy with a run.
+    class Worker_pool {
+    public:
+        static Worker_pool& instance();
+
+    public:
+        using Job = void (*)(void* context, unsigned job_index);
+        void run(unsigned num_jobs, Job job, void* context);
+
+        // fun(job_index)
+        template <typename Fun>
+        void run(unsigned num_jobs, Fun& fun)
+        {
+            run(num_jobs, &job_stub<Fun>, &fun);
+        }
+
+        // Including the calling thread.
+        unsigned num_threads() const;
+
+        // Lets no more than the given number of threads, the calling one included, take
+        // part in run(), for measuring how work scales. Zero lifts the limit. Not to be
+        // called during a run.
+        void set_thread_limit(unsigned limit);
+
+    public:
+        ~Worker_pool();
+
+        Worker_pool(const Worker_pool&) = delete;
+        Worker_pool& operator=(const Worker_pool&) = delete;
+
+    private:
+        Worker_pool();
+
+        void worker_loop(unsigned worker_index);
+        void work(Job job, void* context, unsigned num_jobs);
+
+        template <typename Fun>
+        static void job_stub(void* context, unsigned job_index)
+        {
+            (*static_cast<Fun*>(context))(job_index);
+        }
+
+    private:
+        std::vector<std::thread> workers_;
+
+        // Held by the thread whose run the workers are taking part in.
+        std::mutex run_mutex_;
+
+        std::mutex mutex_;
+        std::condition_variable wake_;
+        std::condition_variable done_;
+
+        Job job_{nullptr};
+        void* context_{nullptr};
+        unsigned num_jobs_{0};
+        unsigned generation_{0};
+        unsigned active_workers_{0};
+        unsigned thread_limit_{0};
+        bool quit_{false};
+
+        std::atomic<unsigned> next_job_;
+    };
+
+    // Number of chunks to split count elements into, at least min_chunk_size elements each.
+    inline unsigned num_chunks(size_t count, size_t min_chunk_size)
+    {
+        const size_t max_chunks = Worker_pool::instance().num_threads() * 4;
+        return static_cast<unsigned>(std::max<size_t>(1, std::min(max_chunks, count / std::max<size_t>(1, min_chunk_size))));
+    }
+
+    // Splits [0, count) into contiguous chunks and calls fun(chunk_index, begin, end) for each, in parallel.
+    template <typename Fun>
+    void parallel_for_chunks(size_t count, unsigned chunks, Fun&& fun)
+    {
+        auto job = [&](unsigned chunk) {
+            fun(chunk, count * chunk / chunks, count * (chunk + 1) / chunks);
+        };
+
+        if (chunks <= 1)
+        {
+            job(0);
+        }
+        else
+        {
+            Worker_pool::instance().run(chunks, job);
+        }
+    }
+
+    // Calls fun(begin, end) over [0, count) in parallel, with chunks of at least min_chunk_size elements.
+    template <typename Fun>
+    void parallel_for(size_t count, size_t min_chunk_size, Fun&& fun)
+    {
+        parallel_for_chunks(count, num_chunks(count, min_chunk_size), [&fun](unsigned, size_t begin, size_t end) {
+            fun(begin, end);
+        });
+    }
+
+} // namespace base
+} // namespace kvant
@@ -1,5 +1,13 @@
 #pragma once
+#include "../base/radix_sort.hpp"
+#include "../base/worker_pool.hpp"
+#include "../spatial/simd.hpp"
 #include "my_glm.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <iterator>
 #include <vector>
 
 namespace kvant {
@@ -77,6 +85,220 @@ namespace graphics {
 
     typedef std::vector<Triangle> Triangle_array;
 
+    // How the triangles around a vertex are weighted in its normal.
+    enum class Normal_weighting {
+        uniform, // Every triangle the same.
+        area,    // By the area of the triangle.
+        angle,   // By the angle of the triangle at the vertex.
+    };
+
+    namespace detail {
+
+        // acos to within 7e-5, from Abramowitz and Stegun 4.4.45.
+        inline float approx_acos(float x)
+        {
+            const float a = std::abs(x);
+            const float r = std::sqrt(1.0f - a) * (1.5707288f + a * (-0.2121144f + a * (0.0742610f - a * 0.0187293f)));
+            return x < 0.0f ? 3.14159265f - r : r;
+        }
+
+#ifdef KVANT_SPATIAL_SSE2
+        inline __m128 approx_acos(__m128 x)
+        {
+            const __m128 sign = _mm_set1_ps(-0.0f);
+            const __m128 a = _mm_min_ps(_mm_andnot_ps(sign, x), _mm_set1_ps(1.0f));
+            __m128 p = _mm_sub_ps(_mm_set1_ps(0.0742610f), _mm_mul_ps(a, _mm_set1_ps(0.0187293f)));
+            p = _mm_add_ps(_mm_set1_ps(-0.2121144f), _mm_mul_ps(a, p));
+            p = _mm_add_ps(_mm_set1_ps(1.5707288f), _mm_mul_ps(a, p));
+            const __m128 r = _mm_mul_ps(_mm_sqrt_ps(_mm_sub_ps(_mm_set1_ps(1.0f), a)), p);
+            const __m128 negative = _mm_cmplt_ps(x, _mm_setzero_ps());
+            return _mm_or_ps(_mm_and_ps(negative, _mm_sub_ps(_mm_set1_ps(3.14159265f), r)), _mm_andnot_ps(negative, r));
+        }
+
+        // 1 / length, or zero for zero vectors.
+        inline __m128 inverse_length(__m128 x, __m128 y, __m128 z)
+        {
+            const __m128 length_sq = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z));
+            const __m128 nonzero = _mm_cmpgt_ps(length_sq, _mm_setzero_ps());
+            return _mm_and_ps(nonzero, _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(length_sq)));
+        }
+#endif
+
+        inline float inverse_length(const glm::vec3& v)
+        {
+            const float length_sq = glm::dot(v, v);
+            return length_sq > 0.0f ? 1.0f / std::sqrt(length_sq) : 0.0f;
+        }
+
+        // The normal of a triangle and the weights of its corners in the vertex normals.
+        struct Face_normal {
+            glm::vec3 normal;
+            float weights[3];
+        };
+
+        inline Face_normal face_normal(const glm::vec3& p0, const glm::vec3& p1, const glm::vec3& p2, Normal_weighting weighting)
+        {
+            // As calculate_normal(), with a length of twice the area.
+            const glm::vec3 cross = glm::cross(p2 - p0, p1 - p0);
+            Face_normal face{weighting == Normal_weighting::area ? cross : cross * inverse_length(cross), {1.0f, 1.0f, 1.0f}};
+
+            if (weighting == Normal_weighting::angle)
+            {
+                const glm::vec3 e01 = (p1 - p0) * inverse_length(p1 - p0);
+                const glm::vec3 e12 = (p2 - p1) * inverse_length(p2 - p1);
+                const glm::vec3 e20 = (p0 - p2) * inverse_length(p0 - p2);
+                face.weights[0] = approx_acos(-glm::dot(e20, e01));
+                face.weights[1] = approx_acos(-glm::dot(e01, e12));
+                face.weights[2] = approx_acos(-glm::dot(e12, e20));
+            }
+
+            return face;
+        }
+
+        // Calls add(vertex, normal, weight) for the corners of the triangles [begin, end).
+        // The normals are computed four triangles at a time, with the corners gathered into
+        // one SIMD lane each, x, y and z apart.
+        template <typename Vertex, typename Add>
+        void sum_face_normals(const Vertex* vertices,
+                              const Triangle* triangles,
+                              size_t begin,
+                              size_t end,
+                              Normal_weighting weighting,
+                              Add&& add)
+        {
+            size_t i = begin;
+
+#ifdef KVANT_SPATIAL_SSE2
+            for (; i + 4 <= end; i += 4)
+            {
+                const Triangle* t = triangles + i;
+
+                const auto corner = [vertices, t](unsigned j, unsigned k) -> const glm::vec3& {
+                    return vertices[k == 0 ? t[j].v0 : (k == 1 ? t[j].v1 : t[j].v2)].position;
+                };
+
+                __m128 x[3], y[3], z[3];
+                for (unsigned k = 0; k < 3; ++k)
+                {
+                    const glm::vec3& p0 = corner(0, k);
+                    const glm::vec3& p1 = corner(1, k);
+                    const glm::vec3& p2 = corner(2, k);
+                    const glm::vec3& p3 = corner(3, k);
+                    x[k] = _mm_setr_ps(p0.x, p1.x, p2.x, p3.x);
+                    y[k] = _mm_setr_ps(p0.y, p1.y, p2.y, p3.y);
+                    z[k] = _mm_setr_ps(p0.z, p1.z, p2.z, p3.z);
+                }
+
+                // The edges as in calculate_normal().
+                const __m128 ax = _mm_sub_ps(x[2], x[0]);
+                const __m128 ay = _mm_sub_ps(y[2], y[0]);
+                const __m128 az = _mm_sub_ps(z[2], z[0]);
+                const __m128 bx = _mm_sub_ps(x[1], x[0]);
+                const __m128 by = _mm_sub_ps(y[1], y[0]);
+                const __m128 bz = _mm_sub_ps(z[1], z[0]);
+
+                __m128 nx = _mm_sub_ps(_mm_mul_ps(ay, bz), _mm_mul_ps(az, by));
+                __m128 ny = _mm_sub_ps(_mm_mul_ps(az, bx), _mm_mul_ps(ax, bz));
+                __m128 nz = _mm_sub_ps(_mm_mul_ps(ax, by), _mm_mul_ps(ay, bx));
+
+                if (weighting != Normal_weighting::area)
+                {
+                    const __m128 scale = inverse_length(nx, ny, nz);
+                    nx = _mm_mul_ps(nx, scale);
+                    ny = _mm_mul_ps(ny, scale);
+                    nz = _mm_mul_ps(nz, scale);
+                }
+
+                alignas(16) float normals[3][4];
+                _mm_store_ps(normals[0], nx);
+                _mm_store_ps(normals[1], ny);
+                _mm_store_ps(normals[2], nz);
+
+                alignas(16) float weights[3][4] = {{1.0f, 1.0f, 1.0f, 1.0f}, {1.0f, 1.0f, 1.0f, 1.0f}, {1.0f, 1.0f, 1.0f, 1.0f}};
+                if (weighting == Normal_weighting::angle)
+                {
+                    // The angle at each corner, between its two unit edges.
+                    __m128 ex[3], ey[3], ez[3];
+                    for (unsigned k = 0; k < 3; ++k)
+                    {
+                        const unsigned next = (k + 1) % 3;
+                        ex[k] = _mm_sub_ps(x[next], x[k]);
+                        ey[k] = _mm_sub_ps(y[next], y[k]);
+                        ez[k] = _mm_sub_ps(z[next], z[k]);
+
+                        const __m128 scale = inverse_length(ex[k], ey[k], ez[k]);
+                        ex[k] = _mm_mul_ps(ex[k], scale);
+                        ey[k] = _mm_mul_ps(ey[k], scale);
+                        ez[k] = _mm_mul_ps(ez[k], scale);
+                    }
+
+                    for (unsigned k = 0; k < 3; ++k)
+                    {
+                        const unsigned prev = (k + 2) % 3;
+                        const __m128 dot = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ex[prev], ex[k]), _mm_mul_ps(ey[prev], ey[k])), _mm_mul_ps(ez[prev], ez[k]));
+                        _mm_store_ps(weights[k], approx_acos(_mm_sub_ps(_mm_setzero_ps(), dot)));
+                    }
+                }
+
+                for (unsigned j = 0; j < 4; ++j)
+                {
+                    // The other weights are one, as constants the multiplies by them fold away.
+                    const glm::vec3 n(normals[0][j], normals[1][j], normals[2][j]);
+                    if (weighting == Normal_weighting::angle)
+                    {
+                        add(t[j].v0, n, weights[0][j]);
+                        add(t[j].v1, n, weights[1][j]);
+                        add(t[j].v2, n, weights[2][j]);
+                    }
+                    else
+                    {
+                        add(t[j].v0, n, 1.0f);
+                        add(t[j].v1, n, 1.0f);
+                        add(t[j].v2, n, 1.0f);
+                    }
+                }
+            }
+#endif
+
+            for (; i < end; ++i)
+            {
+                const Triangle& t = triangles[i];
+                const Face_normal face = face_normal(vertices[t.v0].position, vertices[t.v1].position, vertices[t.v2].position, weighting);
+                add(t.v0, face.normal, face.weights[0]);
+                add(t.v1, face.normal, face.weights[1]);
+                add(t.v2, face.normal, face.weights[2]);
+            }
+        }
+
+        // Scales [0, count) to unit length, leaving zero vectors as they are.
+        inline void normalize(float* x, float* y, float* z, size_t count)
+        {
+            size_t i = 0;
+
+#ifdef KVANT_SPATIAL_SSE2
+            for (; i + 4 <= count; i += 4)
+            {
+                const __m128 vx = _mm_loadu_ps(x + i);
+                const __m128 vy = _mm_loadu_ps(y + i);
+                const __m128 vz = _mm_loadu_ps(z + i);
+                const __m128 scale = inverse_length(vx, vy, vz);
+                _mm_storeu_ps(x + i, _mm_mul_ps(vx, scale));
+                _mm_storeu_ps(y + i, _mm_mul_ps(vy, scale));
+                _mm_storeu_ps(z + i, _mm_mul_ps(vz, scale));
+            }
+#endif
+
+            for (; i < count; ++i)
+            {
+                const float scale = inverse_length(glm::vec3(x[i], y[i], z[i]));
+                x[i] *= scale;
+                y[i] *= scale;
+                z[i] *= scale;
+            }
+        }
+
+    } // namespace detail
+
     //
     template <typename Vertex = kvant::graphics::Vertex>
     struct Triangle_mesh {
@@ -124,59 +346,131 @@ namespace graphics {
             foreach_vertex([&delta](Vertex& v) { v.position += delta; });
         }
 
+        // Normals of indexed meshes are the normalized sum of the normals of the triangles
+        // around each vertex, weighted as given. The triangles are split into a chunk per
+        // thread, and each chunk sums the normals of its triangles over the range of
+        // vertices they use, the first chunk in the vertices themselves and the others apart,
+        // so no sums are shared. The sums of each vertex are then added up and normalized
+        // in parallel. The ranges of the chunks overlap little when the vertices are in the
+        // order of the triangles, as they are for generated meshes.
         //
-        void calculate_vertex_normals()
+        // Without triangles, every three vertices are a triangle of their own, with its normal.
+        void calculate_vertex_normals(Normal_weighting weighting = Normal_weighting::uniform)
         {
-            if (!triangles.empty())
+            if (triangles.empty())
+            {
+                assert(vertices.size() % 3 == 0);
+
+                base::parallel_for(vertices.size() / 3, 4 * 1024, [&](size_t begin, size_t end) {
+                    for (size_t i = begin * 3; i < end * 3; i += 3)
+                    {
+                        const auto normal = calculate_normal(vertices[i + 0].position,
+                                                             vertices[i + 1].position,
+                                                             vertices[i + 2].position);
+
+                        vertices[i + 0].normal = normal;
+                        vertices[i + 1].normal = normal;
+                        vertices[i + 2].normal = normal;
+                    }
+                });
+                return;
+            }
+
+            struct Chunk {
+                std::uint32_t first{~0u};
+                std::uint32_t last{0};
+                std::vector<glm::vec3> sums; // For [first, last], except in the first chunk.
+            };
+
+            const unsigned num_chunks = static_cast<unsigned>(std::max<size_t>(1, std::min<size_t>(base::Worker_pool::instance().num_threads(),
+                                                                                                  triangles.size() / (16 * 1024))));
+
+            // On one thread the sums stay in the vertices, and are normalized where they are.
+            if (num_chunks == 1)
             {
-                // Initialize
                 for (auto& v : vertices)
                 {
                     v.normal = glm::vec3(0.0f);
                 }
 
-                std::vector<float> denom(vertices.size(), 0.0f);
+                detail::sum_face_normals(vertices.data(), triangles.data(), 0, triangles.size(), weighting, [this](unsigned v, const glm::vec3& n, float weight) {
+                    vertices[v].normal += n * weight;
+                });
 
-                // Count and sum.
-                for (const Triangle& t : triangles)
+                for (auto& v : vertices)
                 {
-                    auto p0{vertices[t.v0].position};
-                    auto p1{vertices[t.v1].position};
-                    auto p2{vertices[t.v2].position};
-
-                    auto normal = calculate_normal(p0, p1, p2);
+                    v.normal *= detail::inverse_length(v.normal);
+                }
+                return;
+            }
 
-                    vertices[t.v0].normal += normal;
-                    vertices[t.v1].normal += normal;
-                    vertices[t.v2].normal += normal;
+            std::vector<Chunk> chunks(num_chunks);
 
-                    denom[t.v0] += 1.0f;
-                    denom[t.v1] += 1.0f;
-                    denom[t.v2] += 1.0f;
+            base::parallel_for_chunks(triangles.size(), num_chunks, [&](unsigned index, size_t begin, size_t end) {
+                Chunk& chunk = chunks[index];
+                for (size_t i = begin; i < end; ++i)
+                {
+                    const Triangle& t = triangles[i];
+                    chunk.first = std::min(chunk.first, std::min(t.v0, std::min(t.v1, t.v2)));
+                    chunk.last = std::max(chunk.last, std::max(t.v0, std::max(t.v1, t.v2)));
                 }
 
-                // Divide
-                for (unsigned i = 0; i < denom.size(); ++i)
+                if (index == 0)
                 {
-                    vertices[i].normal /= denom[i];
-                    glm::normalize(vertices[i].normal);
+                    for (std::uint32_t v = chunk.first; v <= chunk.last; ++v)
+                    {
+                        vertices[v].normal = glm::vec3(0.0f);
+                    }
+
+                    detail::sum_face_normals(vertices.data(), triangles.data(), begin, end, weighting, [this](unsigned v, const glm::vec3& n, float weight) {
+                        vertices[v].normal += n * weight;
+                    });
                 }
-            }
-            else
-            {
-                assert(vertices.size() % 3 == 0);
+                else
+                {
+                    chunk.sums.assign(chunk.last - chunk.first + 1, glm::vec3(0.0f));
 
-                for (size_t i = 0; i < vertices.size(); i += 3)
+                    detail::sum_face_normals(vertices.data(), triangles.data(), begin, end, weighting, [&chunk](unsigned v, const glm::vec3& n, float weight) {
+                        chunk.sums[v - chunk.first] += n * weight;
+                    });
+                }
+            });
+
+            base::parallel_for(vertices.size(), 16 * 1024, [&](size_t begin, size_t end) {
+                // A block at a time in SoA layout, for normalizing four at once.
+                const size_t block_size = 256;
+                float x[block_size];
+                float y[block_size];
+                float z[block_size];
+
+                for (size_t block = begin; block < end; block += block_size)
                 {
-                    const auto normal = calculate_normal(vertices[i + 0].position,
-                                                         vertices[i + 1].position,
-                                                         vertices[i + 2].position);
+                    const size_t count = std::min(block_size, end - block);
+                    for (size_t i = 0; i < count; ++i)
+                    {
+                        const size_t v = block + i;
+                        glm::vec3 sum = chunks[0].first <= v && v <= chunks[0].last ? vertices[v].normal : glm::vec3(0.0f);
+                        for (unsigned c = 1; c < num_chunks; ++c)
+                        {
+                            if (chunks[c].first <= v && v <= chunks[c].last)
+                            {
+                                sum += chunks[c].sums[v - chunks[c].first];
+                            }
+                        }
+
+                        x[i] = sum.x;
+                        y[i] = sum.y;
+                        z[i] = sum.z;
+                    }
 
-                    vertices[i + 0].normal = normal;
-                    vertices[i + 1].normal = normal;
-                    vertices[i + 2].normal = normal;
+                    detail::normalize(x, y, z, count);
+
+                    for (size_t i = 0; i < count; ++i)
+                    {
+                        vertices[block + i].normal = glm::vec3(x[i], y[i], z[i]);
+                    }
                 }
-            }
+            });
         }
 
         //
@@ -206,20 +500,104 @@ namespace graphics {
             }
         }
 
-        // Removes all "equal" vertices.
+        // Removes all "equal" vertices. Each vertex is welded to the first vertex kept
+        // before it that is close enough, and the vertices keep their order.
+        //
+        // The positions are hashed into a grid with cells twice the distance, so that the
+        // vertices close to one are in its cell or the neighbours on the nearer side of it. The grid is a counting sort
+        // of the vertices on the hash of their cell, the close vertices are then looked up
+        // for all vertices in parallel, and only the choice of which vertices to keep is
+        // made in order.
         void optimize()
         {
-            for (size_t a = 0; a < vertices.size() - 1; ++a)
+            const size_t count = vertices.size();
+            if (count == 0)
             {
-                for (size_t b = a + 1; b < vertices.size(); ++b)
+                return;
+            }
+
+            // One bucket per vertex or more, cells with the same hash share a bucket.
+            std::uint32_t num_buckets = 1;
+            while (num_buckets < count)
+            {
+                num_buckets *= 2;
+            }
+
+            std::vector<base::Sort_pair> sorted(count);
+            std::vector<base::Sort_pair> scratch;
+            base::parallel_for(count, 4 * 1024, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i)
                 {
-                    if (same_position(vertices[a].position, vertices[b].position))
+                    sorted[i].key = weld_bucket(weld_cell(vertices[i].position), num_buckets);
+                    sorted[i].value = static_cast<std::uint32_t>(i);
+                }
+            });
+
+            // Stable, so each bucket lists its vertices in order.
+            base::radix_sort(sorted, scratch);
+
+            // The vertices of bucket b are sorted[bucket_begin[b], bucket_begin[b + 1]).
+            std::vector<std::uint32_t> bucket_begin(num_buckets + 1);
+            base::parallel_for(count, 4 * 1024, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i)
+                {
+                    const std::uint32_t first = i == 0 ? 0 : sorted[i - 1].key + 1;
+                    for (std::uint32_t b = first; b <= sorted[i].key; ++b)
                     {
-                        replace_vertex(a, b);
-                        --b; // Since one vertex is removed.
+                        bucket_begin[b] = static_cast<std::uint32_t>(i);
                     }
                 }
+            });
+            std::fill(bucket_begin.begin() + sorted.back().key + 1, bucket_begin.end(), static_cast<std::uint32_t>(count));
+
+            // The first close vertex, kept or not, for every vertex.
+            std::vector<std::uint32_t> welded(count);
+            base::parallel_for(count, 1024, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i)
+                {
+                    welded[i] = find_close_vertex(static_cast<std::uint32_t>(i), sorted, bucket_begin, [](std::uint32_t) {
+                        return true;
+                    });
+                }
+            });
+
+            // If the first close vertex is kept it is the one to weld to, otherwise the close
+            // vertices are searched again for the first kept one.
+            std::vector<std::uint32_t> remap(count);
+            std::uint32_t num_kept = 0;
+            for (std::uint32_t i = 0; i < count; ++i)
+            {
+                if (welded[i] != i && welded[welded[i]] != welded[i])
+                {
+                    welded[i] = find_close_vertex(i, sorted, bucket_begin, [&welded](std::uint32_t j) {
+                        return welded[j] == j;
+                    });
+                }
+
+                remap[i] = welded[i] == i ? num_kept++ : remap[welded[i]];
             }
+
+            std::vector<Vertex> kept(num_kept);
+            base::parallel_for(count, 4 * 1024, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i)
+                {
+                    if (welded[i] == i)
+                    {
+                        kept[remap[i]] = vertices[i];
+                    }
+                }
+            });
+            vertices.swap(kept);
+
+            base::parallel_for(triangles.size(), 4 * 1024, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i)
+                {
+                    Triangle& triangle = triangles[i];
+                    triangle.v0 = remap[triangle.v0];
+                    triangle.v1 = remap[triangle.v1];
+                    triangle.v2 = remap[triangle.v2];
+                }
+            });
         }
 
         //
@@ -236,7 +614,7 @@ namespace graphics {
             }
 
             vertices.swap(tmp_vertices);
-            triangles.swap(Triangle_array());
+            Triangle_array().swap(triangles);
         }
 
     public:
@@ -283,28 +661,99 @@ namespace graphics {
         }
 
     private:
-        //
-        static bool same_position(const Vertex& a, const Vertex& b)
+        using Position = decltype(Vertex::position);
+        using Float = decltype(Vertex::position.x);
+
+        // Squared.
+        static Float weld_distance_squared()
         {
-            using Float = decltype(Vertex::position.x);
-            static const Float threshold = Float(1.0 / 10000 * 2);
-            const auto d = b.position - a.position;
-            return (d.x * d.x + d.y * d.y + d.z * d.z) < threshold;
+            return Float(1.0 / 10000 * 2);
         }
 
         //
-        void replace_vertex(size_t keep, size_t replace)
+        static bool same_position(const Position& a, const Position& b)
         {
-            assert(keep < replace);
+            const auto d = b - a;
+            return (d.x * d.x + d.y * d.y + d.z * d.z) < weld_distance_squared();
+        }
+
+        struct Weld_cell {
+            std::int64_t x;
+            std::int64_t y;
+            std::int64_t z;
+        };
+
+        // In cells, so that the integer part is the cell.
+        static Position weld_grid_position(const Position& position)
+        {
+            return position * (Float(0.5) / std::sqrt(weld_distance_squared()));
+        }
 
-            vertices[replace] = vertices.back();
-            vertices.pop_back();
+        static Weld_cell weld_cell(const Position& position)
+        {
+            const Position p = weld_grid_position(position);
+            return {static_cast<std::int64_t>(std::floor(p.x)),
+                    static_cast<std::int64_t>(std::floor(p.y)),
+                    static_cast<std::int64_t>(std::floor(p.z))};
+        }
+
+        // Towards the nearer neighbour on the axis.
+        static std::int64_t weld_side(Float p, std::int64_t cell)
+        {
+            return p - static_cast<Float>(cell) < Float(0.5) ? -1 : 1;
+        }
 
-            for (auto& triangle : triangles)
+        static std::uint32_t weld_bucket(const Weld_cell& cell, std::uint32_t num_buckets)
+        {
+            const std::uint64_t hash = static_cast<std::uint64_t>(cell.x) * 73856093u ^
+                                       static_cast<std::uint64_t>(cell.y) * 19349663u ^
+                                       static_cast<std::uint64_t>(cell.z) * 83492791u;
+            return static_cast<std::uint32_t>(hash ^ (hash >> 32)) & (num_buckets - 1);
+        }
+
+        // The first vertex up to and including i that is close to it and accepted, or i.
+        template <typename Accept>
+        std::uint32_t find_close_vertex(std::uint32_t i,
+                                        const std::vector<base::Sort_pair>& sorted,
+                                        const std::vector<std::uint32_t>& bucket_begin,
+                                        Accept accept) const
+        {
+            const Position& position = vertices[i].position;
+            const Position p = weld_grid_position(position);
+            const Weld_cell cell = weld_cell(position);
+            const Weld_cell side = {weld_side(p.x, cell.x), weld_side(p.y, cell.y), weld_side(p.z, cell.z)};
+            const std::uint32_t num_buckets = static_cast<std::uint32_t>(bucket_begin.size() - 1);
+
+            std::uint32_t found = i;
+            for (std::int64_t z = 0; z < 2; ++z)
             {
-                triangle.replace(replace, keep);
-                triangle.replace(vertices.size(), replace);
+                for (std::int64_t y = 0; y < 2; ++y)
+                {
+                    for (std::int64_t x = 0; x < 2; ++x)
+                    {
+                        const Weld_cell neighbour = {cell.x + x * side.x, cell.y + y * side.y, cell.z + z * side.z};
+                        const std::uint32_t bucket = weld_bucket(neighbour, num_buckets);
+
+                        // In order, so only the vertices before the one found so far count.
+                        for (std::uint32_t k = bucket_begin[bucket]; k < bucket_begin[bucket + 1]; ++k)
+                        {
+                            const std::uint32_t j = sorted[k].value;
+                            if (found <= j)
+                            {
+                                break;
+                            }
+
+                            if (accept(j) && same_position(vertices[j].position, position))
+                            {
+                                found = j;
+                                break;
+                            }
+                        }
+                    }
+                }
             }
+
+            return found;
         }
     };
 
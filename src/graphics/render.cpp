@@ -201,6 +201,9 @@ namespace graphics {
     public:
         Opengl_renderer() = default;
 
+        // Not hidden by the override below.
+        using Renderer::allocate_mesh;
+
     private:
         SDL_Window* window_{nullptr};
         SDL_GLContext context_{nullptr};
@@ -288,8 +291,31 @@ namespace graphics {
         std::vector<Opengl_mesh> allocated_meshes_;
         unsigned num_free_{0}; // Stupid, remove.
 
-        Mesh_id allocate_mesh(const Triangle_mesh<>& tri_mesh) override
+        Mesh_id allocate_mesh(const Triangle_mesh<>& tri_mesh,
+                              bool optimize,
+                              Vertex_cache_report* report) override
         {
+            if (optimize && !tri_mesh.triangles.empty())
+            {
+                Triangle_mesh<> optimized;
+                optimized.vertices = tri_mesh.vertices;
+                optimized.triangles = tri_mesh.triangles;
+
+                const Vertex_cache_report optimized_report = optimize_for_vertex_cache(optimized);
+                if (report != nullptr)
+                {
+                    *report = optimized_report;
+                }
+
+                return allocate_mesh(optimized, false, nullptr);
+            }
+
+            if (report != nullptr)
+            {
+                report->before = measure_vertex_cache(tri_mesh.triangles, tri_mesh.vertices.size());
+                report->after = report->before;
+            }
+
             unsigned mesh_id = invalid_mesh_id;
 
             if (num_free_ > 0)
@@ -1,6 +1,7 @@
 #pragma once
 #include "mesh.hpp"
 #include "shader.hpp"
+#include "vertex_cache.hpp"
 #include "../base/fast_delegate.hpp"
 #include <memory>
 
@@ -32,7 +33,17 @@ namespace graphics {
         static const unsigned invalid_mesh_id{~0ul};
         using Mesh_id = unsigned;
 
-        virtual Mesh_id allocate_mesh(const Triangle_mesh<>&) = 0;
+        Mesh_id allocate_mesh(const Triangle_mesh<>& tri_mesh)
+        {
+            return allocate_mesh(tri_mesh, false, nullptr);
+        }
+
+        // With optimize, the triangles and vertices of indexed meshes are reordered for the
+        // vertex cache and fetches of the GPU first, see optimize_for_vertex_cache(). The
+        // report, if given, gets the ACMR and ATVR before and after.
+        virtual Mesh_id allocate_mesh(const Triangle_mesh<>& tri_mesh,
+                                      bool optimize,
+                                      Vertex_cache_report* report) = 0;
         virtual void deallocate_mesh(Mesh_id mesh_id) = 0;
 
         virtual void render_mesh(Mesh_id mesh_id) = 0;
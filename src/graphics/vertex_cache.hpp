@@ -0,0 +1,309 @@
+#pragma once
+#include "mesh.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+namespace kvant {
+namespace graphics {
+
+    // How well the triangles of a mesh use the post-transform vertex cache of the GPU.
+    struct Vertex_cache_stats {
+        // Average cache misses per triangle. 3 at worst, towards 0.5 for large regular grids.
+        double acmr{0.0};
+
+        // Average transforms per vertex. 1 at best, when every vertex is transformed once.
+        double atvr{0.0};
+    };
+
+    // Simulates a FIFO cache of cache_size vertices, as most GPUs have, over the triangles
+    // in order.
+    inline Vertex_cache_stats measure_vertex_cache(const Triangle_array& triangles,
+                                                   size_t num_vertices,
+                                                   unsigned cache_size = 16)
+    {
+        Vertex_cache_stats stats;
+        if (triangles.empty() || num_vertices == 0)
+        {
+            return stats;
+        }
+
+        // A vertex is in the cache if it was added less than cache_size misses ago.
+        std::vector<std::uint64_t> added(num_vertices, 0);
+        std::uint64_t misses = 0;
+
+        for (const Triangle& t : triangles)
+        {
+            for (const unsigned v : {t.v0, t.v1, t.v2})
+            {
+                assert(v < num_vertices);
+                if (added[v] == 0 || misses + 1 - added[v] > cache_size)
+                {
+                    ++misses;
+                    added[v] = misses;
+                }
+            }
+        }
+
+        stats.acmr = static_cast<double>(misses) / triangles.size();
+        stats.atvr = static_cast<double>(misses) / num_vertices;
+        return stats;
+    }
+
+    namespace detail {
+
+        // The scores of Tom Forsyth, "Linear-Speed Vertex Cache Optimisation", for an LRU
+        // cache of 32 vertices.
+        const unsigned forsyth_cache_size = 32;
+        const unsigned forsyth_max_valence = 32;
+
+        struct Forsyth_scores {
+            Forsyth_scores()
+            {
+                for (unsigned i = 0; i < forsyth_cache_size; ++i)
+                {
+                    // The last triangle's vertices score the same whichever order they
+                    // were in, so that its neighbours are not favoured by the order.
+                    cache[i] = i < 3 ? 0.75f : std::pow(1.0f - static_cast<float>(i - 3) / (forsyth_cache_size - 3), 1.5f);
+                }
+
+                valence[0] = 0.0f;
+                for (unsigned i = 1; i < forsyth_max_valence; ++i)
+                {
+                    // Vertices with few triangles left are finished off first.
+                    valence[i] = 2.0f / std::sqrt(static_cast<float>(i));
+                }
+            }
+
+            // position is in the cache, or -1, remaining the triangles not yet added.
+            float vertex(int position, unsigned remaining) const
+            {
+                if (remaining == 0)
+                {
+                    return -1.0f;
+                }
+
+                const float valence_score = remaining < forsyth_max_valence ? valence[remaining] : 2.0f / std::sqrt(static_cast<float>(remaining));
+                return (position < 0 ? 0.0f : cache[position]) + valence_score;
+            }
+
+            float cache[forsyth_cache_size];
+            float valence[forsyth_max_valence];
+        };
+
+    } // namespace detail
+
+    // Reorders the triangles for the post-transform vertex cache, after Forsyth: the next
+    // triangle is the best scoring one of the vertices in a simulated LRU cache, scored by
+    // how recently they were used and how few triangles they have left. Gets within about
+    // 10% of the best possible ACMR for most cache sizes, in time linear in the triangles.
+    inline void optimize_vertex_cache(Triangle_array& triangles, size_t num_vertices)
+    {
+        const size_t num_triangles = triangles.size();
+        if (num_triangles == 0)
+        {
+            return;
+        }
+
+        static const detail::Forsyth_scores scores;
+
+        // The triangles of vertex v are adjacent[adjacent_begin[v], adjacent_begin[v] + remaining[v]),
+        // the ones not yet added first.
+        std::vector<std::uint32_t> remaining(num_vertices, 0);
+        for (const Triangle& t : triangles)
+        {
+            ++remaining[t.v0];
+            ++remaining[t.v1];
+            ++remaining[t.v2];
+        }
+
+        std::vector<std::uint32_t> adjacent_begin(num_vertices + 1, 0);
+        for (size_t v = 0; v < num_vertices; ++v)
+        {
+            adjacent_begin[v + 1] = adjacent_begin[v] + remaining[v];
+        }
+
+        std::vector<std::uint32_t> adjacent(num_triangles * 3);
+        {
+            std::vector<std::uint32_t> next(adjacent_begin.begin(), adjacent_begin.end() - 1);
+            for (size_t i = 0; i < num_triangles; ++i)
+            {
+                const Triangle& t = triangles[i];
+                adjacent[next[t.v0]++] = static_cast<std::uint32_t>(i);
+                adjacent[next[t.v1]++] = static_cast<std::uint32_t>(i);
+                adjacent[next[t.v2]++] = static_cast<std::uint32_t>(i);
+            }
+        }
+
+        std::vector<float> vertex_score(num_vertices);
+        for (size_t v = 0; v < num_vertices; ++v)
+        {
+            vertex_score[v] = scores.vertex(-1, remaining[v]);
+        }
+
+        const auto score_of = [&vertex_score](const Triangle& t) {
+            return vertex_score[t.v0] + vertex_score[t.v1] + vertex_score[t.v2];
+        };
+
+        std::vector<bool> added(num_triangles, false);
+        std::uint32_t best = 0;
+        float best_score = score_of(triangles[0]);
+        for (size_t i = 1; i < num_triangles; ++i)
+        {
+            const float score = score_of(triangles[i]);
+            if (best_score < score)
+            {
+                best = static_cast<std::uint32_t>(i);
+                best_score = score;
+            }
+        }
+
+        // Most recently used first, with room for the vertices of a triangle pushed past the end.
+        std::vector<std::uint32_t> cache;
+        std::vector<std::uint32_t> next_cache;
+        cache.reserve(detail::forsyth_cache_size + 3);
+        next_cache.reserve(detail::forsyth_cache_size + 3);
+
+        Triangle_array sorted;
+        sorted.reserve(num_triangles);
+
+        // Where to look for a triangle when none of the cached vertices have any left.
+        size_t next_unadded = 0;
+
+        for (;;)
+        {
+            const Triangle& triangle = triangles[best];
+            sorted.push_back(triangle);
+            added[best] = true;
+
+            next_cache.clear();
+            for (const unsigned v : {triangle.v0, triangle.v1, triangle.v2})
+            {
+                // Moves the triangle past the ones not yet added.
+                const std::uint32_t first = adjacent_begin[v];
+                const std::uint32_t last = first + --remaining[v];
+                std::uint32_t* const begin = adjacent.data() + first;
+                std::swap(*std::find(begin, begin + (last - first) + 1, best), adjacent[last]);
+
+                if (std::find(next_cache.begin(), next_cache.end(), v) == next_cache.end())
+                {
+                    next_cache.push_back(v);
+                }
+            }
+
+            for (const std::uint32_t v : cache)
+            {
+                if (v != triangle.v0 && v != triangle.v1 && v != triangle.v2)
+                {
+                    next_cache.push_back(v);
+                }
+            }
+            cache.swap(next_cache);
+
+            for (size_t i = 0; i < cache.size(); ++i)
+            {
+                const std::uint32_t v = cache[i];
+                vertex_score[v] = scores.vertex(i < detail::forsyth_cache_size ? static_cast<int>(i) : -1, remaining[v]);
+            }
+
+            bool found = false;
+            for (const std::uint32_t v : cache)
+            {
+                for (std::uint32_t k = adjacent_begin[v]; k < adjacent_begin[v] + remaining[v]; ++k)
+                {
+                    const std::uint32_t t = adjacent[k];
+                    const float score = score_of(triangles[t]);
+                    if (!found || best_score < score)
+                    {
+                        best = t;
+                        best_score = score;
+                        found = true;
+                    }
+                }
+            }
+
+            if (cache.size() > detail::forsyth_cache_size)
+            {
+                cache.resize(detail::forsyth_cache_size);
+            }
+
+            if (!found)
+            {
+                while (next_unadded < num_triangles && added[next_unadded])
+                {
+                    ++next_unadded;
+                }
+
+                if (next_unadded == num_triangles)
+                {
+                    break;
+                }
+
+                best = static_cast<std::uint32_t>(next_unadded);
+            }
+        }
+
+        triangles.swap(sorted);
+    }
+
+    // Reorders the vertices in the order the triangles first use them, so that the vertex
+    // fetches of the GPU run through memory in order. Vertices no triangle uses go last.
+    template <typename Vertex>
+    void optimize_vertex_fetch(Triangle_mesh<Vertex>& mesh)
+    {
+        const size_t num_vertices = mesh.vertices.size();
+        std::vector<unsigned> remap(num_vertices, ~0u);
+        std::vector<Vertex> sorted;
+        sorted.reserve(num_vertices);
+
+        for (Triangle& t : mesh.triangles)
+        {
+            for (unsigned* v : {&t.v0, &t.v1, &t.v2})
+            {
+                if (remap[*v] == ~0u)
+                {
+                    remap[*v] = static_cast<unsigned>(sorted.size());
+                    sorted.push_back(mesh.vertices[*v]);
+                }
+                *v = remap[*v];
+            }
+        }
+
+        for (size_t v = 0; v < num_vertices; ++v)
+        {
+            if (remap[v] == ~0u)
+            {
+                sorted.push_back(mesh.vertices[v]);
+            }
+        }
+
+        mesh.vertices.swap(sorted);
+    }
+
+    struct Vertex_cache_report {
+        Vertex_cache_stats before;
+        Vertex_cache_stats after;
+    };
+
+    // Both of the above, in that order, measured before and after with a cache of
+    // cache_size. Meshes without triangles are left as they are.
+    template <typename Vertex>
+    Vertex_cache_report optimize_for_vertex_cache(Triangle_mesh<Vertex>& mesh, unsigned cache_size = 16)
+    {
+        Vertex_cache_report report;
+        report.before = measure_vertex_cache(mesh.triangles, mesh.vertices.size(), cache_size);
+
+        if (!mesh.triangles.empty())
+        {
+            optimize_vertex_cache(mesh.triangles, mesh.vertices.size());
+            optimize_vertex_fetch(mesh);
+        }
+
+        report.after = measure_vertex_cache(mesh.triangles, mesh.vertices.size(), cache_size);
+        return report;
+    }
+
+} // namespace graphics
+} // namespace kvant
@@ -93,7 +93,7 @@ using namespace kvant;
 	private :
 		unsigned alloc_mesh()
 		{
-			return graphics::Renderer::instance().allocate_mesh(graphics::generate_smooth_cube(glm::vec3(1.0f)));
+			return graphics::Renderer::instance().allocate_mesh(graphics::generate_smooth_cube(glm::vec3(1.0f)), true, nullptr);
 		}
 
 	private :
@@ -0,0 +1,429 @@
+#pragma once
+#include "shapes.hpp"
+#include "visitor.hpp"
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+namespace kvant {
+namespace spatial {
+
+    // Dynamic bounding volume hierarchy. Every item is in a leaf with bounds fattened by a
+    // margin, so an item moving a little stays within its leaf and the tree is left as is.
+    // Items moving out of their leaf are taken out and inserted again. Insertion descends
+    // towards the cheapest sibling by the surface area heuristic (perimeter in 2D), and the
+    // ancestors are rebalanced with rotations on the way back up.
+    //
+    // Nodes live in a flat pool and refer to each other by 32 bit index. Has the same
+    // interface as Quad_tree for inserting and querying, but adapts to clustered items and
+    // has no world bounds.
+    //
+    // Item must provide bounding_shape(), returning a Circle or a Rectangle.
+    template <typename Item>
+    class Aabb_tree {
+        using Rectangle = spatial::Rectangle<glm::vec2>;
+
+    public:
+        // Stays valid until the item is removed.
+        using Handle = std::uint32_t;
+
+        Aabb_tree(float fat_margin = 1.0f)
+            : fat_margin_(fat_margin)
+        {
+        }
+
+    public:
+        Handle insert(const Item& item)
+        {
+            Handle handle;
+            if (free_items_.empty())
+            {
+                handle = static_cast<Handle>(items_.size());
+                items_.emplace_back();
+            }
+            else
+            {
+                handle = free_items_.back();
+                free_items_.pop_back();
+            }
+
+            Entry& entry = items_[handle];
+            entry.item = item;
+            entry.bounds = bounding_rect(item.bounding_shape());
+
+            const std::uint32_t leaf = alloc_node();
+            nodes_[leaf].bounds = fatten(entry.bounds);
+            nodes_[leaf].child[0] = null_node;
+            nodes_[leaf].child[1] = handle;
+            nodes_[leaf].height = 0;
+            entry.node = leaf;
+
+            insert_leaf(leaf);
+            ++size_;
+
+            return handle;
+        }
+
+        void remove(Handle handle)
+        {
+            const std::uint32_t leaf = items_[handle].node;
+            remove_leaf(leaf);
+            free_node(leaf);
+
+            items_[handle].node = null_node;
+            free_items_.push_back(handle);
+            --size_;
+        }
+
+        // Returns true if the item left its fattened bounds and was inserted again.
+        template <typename Shape>
+        bool update(Handle handle, const Shape& new_bounds)
+        {
+            Entry& entry = items_[handle];
+            entry.bounds = bounding_rect(new_bounds);
+
+            const std::uint32_t leaf = entry.node;
+            if (nodes_[leaf].bounds.contains(entry.bounds))
+            {
+                return false;
+            }
+
+            remove_leaf(leaf);
+            nodes_[leaf].bounds = fatten(entry.bounds);
+            insert_leaf(leaf);
+            return true;
+        }
+
+        const Item& get(Handle handle) const
+        {
+            return items_[handle].item;
+        }
+
+        Item& get(Handle handle)
+        {
+            return items_[handle].item;
+        }
+
+        size_t size() const
+        {
+            return size_;
+        }
+
+        // Keeps the allocated memory.
+        void clear()
+        {
+            nodes_.clear();
+            items_.clear();
+            free_items_.clear();
+            free_nodes_ = null_node;
+            root_ = null_node;
+            size_ = 0;
+        }
+
+        // Bytes allocated, including unused capacity.
+        size_t memory_usage() const
+        {
+            return nodes_.capacity() * sizeof(Node) +
+                   items_.capacity() * sizeof(Entry) +
+                   free_items_.capacity() * sizeof(Handle);
+        }
+
+        // Longest path from the root to a leaf, zero for a single leaf.
+        unsigned height() const
+        {
+            return root_ == null_node ? 0 : nodes_[root_].height;
+        }
+
+    public:
+        // Calls fun once for every item whose bounds intersect the shape (Circle or Rectangle).
+        // Returns false if the visitor stopped the traversal.
+        template <typename Shape, typename Fun>
+        bool for_each_intersecting(const Shape& shape, Fun&& fun) const
+        {
+            if (root_ == null_node)
+            {
+                return true;
+            }
+
+            std::array<std::uint32_t, max_stack_size> stack;
+            unsigned stack_size = 0;
+            stack[stack_size++] = root_;
+
+            while (stack_size > 0)
+            {
+                const Node& node = nodes_[stack[--stack_size]];
+                if (!intersects(shape, node.bounds))
+                {
+                    continue;
+                }
+
+                if (node.is_leaf())
+                {
+                    const Entry& entry = items_[node.child[1]];
+                    if (intersects(shape, entry.bounds) && !detail::visit(fun, entry.item))
+                    {
+                        return false;
+                    }
+                }
+                else
+                {
+                    assert(stack_size + 2 <= max_stack_size);
+                    stack[stack_size++] = node.child[1];
+                    stack[stack_size++] = node.child[0];
+                }
+            }
+
+            return true;
+        }
+
+    private:
+        static const std::uint32_t null_node = ~0u;
+
+        // The tree is kept balanced, so this is never reached in practice.
+        static const unsigned max_stack_size = 128;
+
+        struct Node {
+            Rectangle bounds;
+            std::uint32_t parent;   // Next free node while in the free list.
+            std::uint32_t child[2]; // In a leaf child[0] is null_node and child[1] the item.
+            std::uint32_t height;   // Zero for leaves.
+
+            bool is_leaf() const
+            {
+                return child[0] == null_node;
+            }
+        };
+
+        static_assert(sizeof(Node) == 32, "Nodes are expected to fit two per cache line.");
+
+        struct Entry {
+            Item item;
+            Rectangle bounds;
+            std::uint32_t node{null_node};
+        };
+
+        Rectangle fatten(const Rectangle& bounds) const
+        {
+            return Rectangle(bounds.min - glm::vec2(fat_margin_), bounds.max + glm::vec2(fat_margin_));
+        }
+
+        static Rectangle combine(const Rectangle& a, const Rectangle& b)
+        {
+            return Rectangle(glm::vec2(std::min(a.min.x, b.min.x), std::min(a.min.y, b.min.y)),
+                             glm::vec2(std::max(a.max.x, b.max.x), std::max(a.max.y, b.max.y)));
+        }
+
+        // The surface area of the heuristic, in 2D.
+        static float perimeter(const Rectangle& bounds)
+        {
+            return 2.0f * (bounds.width() + bounds.height());
+        }
+
+        std::uint32_t alloc_node()
+        {
+            if (free_nodes_ == null_node)
+            {
+                nodes_.emplace_back();
+                return static_cast<std::uint32_t>(nodes_.size() - 1);
+            }
+
+            const std::uint32_t index = free_nodes_;
+            free_nodes_ = nodes_[index].parent;
+            return index;
+        }
+
+        void free_node(std::uint32_t index)
+        {
+            nodes_[index].parent = free_nodes_;
+            free_nodes_ = index;
+        }
+
+        void insert_leaf(std::uint32_t leaf)
+        {
+            if (root_ == null_node)
+            {
+                root_ = leaf;
+                nodes_[leaf].parent = null_node;
+                return;
+            }
+
+            const Rectangle leaf_bounds = nodes_[leaf].bounds;
+            const std::uint32_t sibling = find_best_sibling(leaf_bounds);
+
+            // A new parent takes the place of the sibling, with the sibling and leaf below it.
+            const std::uint32_t old_parent = nodes_[sibling].parent;
+            const std::uint32_t new_parent = alloc_node();
+
+            Node& parent = nodes_[new_parent];
+            parent.parent = old_parent;
+            parent.child[0] = sibling;
+            parent.child[1] = leaf;
+            parent.bounds = combine(leaf_bounds, nodes_[sibling].bounds);
+            parent.height = nodes_[sibling].height + 1;
+
+            replace_child(old_parent, sibling, new_parent);
+            nodes_[sibling].parent = new_parent;
+            nodes_[leaf].parent = new_parent;
+
+            refit_ancestors(old_parent);
+        }
+
+        // Descends while placing the leaf further down is cheaper than making it a sibling
+        // here. Every ancestor of the new leaf grows by the same amount wherever it ends up
+        // below them, that is the inherited cost.
+        std::uint32_t find_best_sibling(const Rectangle& leaf_bounds) const
+        {
+            std::uint32_t index = root_;
+
+            while (!nodes_[index].is_leaf())
+            {
+                const Node& node = nodes_[index];
+                const float combined = perimeter(combine(node.bounds, leaf_bounds));
+
+                const float sibling_cost = 2.0f * combined;
+                const float inherited_cost = 2.0f * (combined - perimeter(node.bounds));
+
+                const float cost0 = descend_cost(node.child[0], leaf_bounds) + inherited_cost;
+                const float cost1 = descend_cost(node.child[1], leaf_bounds) + inherited_cost;
+
+                if (sibling_cost < cost0 && sibling_cost < cost1)
+                {
+                    break;
+                }
+
+                index = cost0 < cost1 ? node.child[0] : node.child[1];
+            }
+
+            return index;
+        }
+
+        // Lower bound of the cost of placing the leaf somewhere below the child.
+        float descend_cost(std::uint32_t child, const Rectangle& leaf_bounds) const
+        {
+            const Node& node = nodes_[child];
+            const float combined = perimeter(combine(node.bounds, leaf_bounds));
+            return node.is_leaf() ? combined : combined - perimeter(node.bounds);
+        }
+
+        void remove_leaf(std::uint32_t leaf)
+        {
+            if (leaf == root_)
+            {
+                root_ = null_node;
+                return;
+            }
+
+            // The sibling takes the place of the parent.
+            const std::uint32_t parent = nodes_[leaf].parent;
+            const std::uint32_t grandparent = nodes_[parent].parent;
+            const std::uint32_t sibling = nodes_[parent].child[0] == leaf ? nodes_[parent].child[1] : nodes_[parent].child[0];
+
+            replace_child(grandparent, parent, sibling);
+            nodes_[sibling].parent = grandparent;
+            free_node(parent);
+
+            refit_ancestors(grandparent);
+        }
+
+        // Makes new_child a child of parent in place of old_child, or the root if there is
+        // no parent.
+        void replace_child(std::uint32_t parent,
+                           std::uint32_t old_child,
+                           std::uint32_t new_child)
+        {
+            if (parent == null_node)
+            {
+                root_ = new_child;
+                return;
+            }
+
+            Node& node = nodes_[parent];
+            node.child[node.child[0] == old_child ? 0 : 1] = new_child;
+        }
+
+        void refit_ancestors(std::uint32_t index)
+        {
+            while (index != null_node)
+            {
+                index = balance(index);
+                refit(index);
+                index = nodes_[index].parent;
+            }
+        }
+
+        void refit(std::uint32_t index)
+        {
+            Node& node = nodes_[index];
+            const Node& a = nodes_[node.child[0]];
+            const Node& b = nodes_[node.child[1]];
+            node.bounds = combine(a.bounds, b.bounds);
+            node.height = std::max(a.height, b.height) + 1;
+        }
+
+        // Rotates the taller child up if the heights of the children differ by more than
+        // one. Returns the root of the subtree.
+        std::uint32_t balance(std::uint32_t index)
+        {
+            const Node& node = nodes_[index];
+            if (node.is_leaf() || node.height < 2)
+            {
+                return index;
+            }
+
+            const int difference = static_cast<int>(nodes_[node.child[1]].height) - static_cast<int>(nodes_[node.child[0]].height);
+            if (difference > 1)
+            {
+                return rotate_up(index, 1);
+            }
+            if (difference < -1)
+            {
+                return rotate_up(index, 0);
+            }
+            return index;
+        }
+
+        // Child side of a becomes the parent of a. Of its own children it keeps the taller
+        // one, the other one takes its place below a.
+        std::uint32_t rotate_up(std::uint32_t a, unsigned side)
+        {
+            const std::uint32_t c = nodes_[a].child[side];
+            std::uint32_t keep = nodes_[c].child[0];
+            std::uint32_t move = nodes_[c].child[1];
+            if (nodes_[keep].height < nodes_[move].height)
+            {
+                std::swap(keep, move);
+            }
+
+            const std::uint32_t parent = nodes_[a].parent;
+            replace_child(parent, a, c);
+            nodes_[c].parent = parent;
+
+            nodes_[c].child[0] = a;
+            nodes_[c].child[1] = keep;
+            nodes_[a].parent = c;
+
+            nodes_[a].child[side] = move;
+            nodes_[move].parent = a;
+
+            refit(a);
+            refit(c);
+            return c;
+        }
+
+    private:
+        float fat_margin_;
+
+        std::vector<Node> nodes_;
+        std::uint32_t free_nodes_{null_node};
+        std::uint32_t root_{null_node};
+
+        // By handle.
+        std::vector<Entry> items_;
+        std::vector<Handle> free_items_;
+        size_t size_{0};
+    };
+
+} // namespace spatial
+} // namespace kvant
@@ -0,0 +1,311 @@
+#pragma once
+#include "stats.hpp"
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace kvant {
+namespace spatial {
+
+    // Items are stored densely in blocks, one block per owner (e.g. a tree node), and are
+    // referred to by generational handles. A handle stays valid while its item moves within
+    // or between blocks, and becomes invalid when the item is removed, even if the slot is
+    // reused later. Removal moves the last item of the block into the hole.
+    template <typename Item>
+    class Block_storage {
+    public :
+        static const unsigned invalid_block = ~0u;
+
+        struct Handle {
+            std::uint32_t index;
+            std::uint32_t generation;
+
+            bool operator==(const Handle& other) const
+            {
+                return index == other.index && generation == other.generation;
+            }
+
+            bool operator!=(const Handle& other) const
+            {
+                return !(*this == other);
+            }
+
+            bool operator<(const Handle& other) const
+            {
+                return index < other.index || (index == other.index && generation < other.generation);
+            }
+        };
+
+        static Handle invalid_handle()
+        {
+            return {~0u, ~0u};
+        }
+
+    public :
+        // Reuses a released block if there is one, keeping its capacity.
+        unsigned alloc_block()
+        {
+            if (!free_blocks_.empty())
+            {
+                const unsigned block_index = free_blocks_.back();
+                free_blocks_.pop_back();
+                return block_index;
+            }
+
+            blocks_.emplace_back();
+            blocks_.back().items.reserve(default_block_size);
+            return static_cast<unsigned>(blocks_.size() - 1);
+        }
+
+        // Removes the items left in the block.
+        void free_block(unsigned block_index)
+        {
+            clear_block(block_index);
+            free_blocks_.push_back(block_index);
+        }
+
+        // Makes room for count items in the block, for filling it in one go.
+        void reserve(unsigned block_index, unsigned count)
+        {
+            blocks_[block_index].items.reserve(count);
+            blocks_[block_index].slots.reserve(count);
+        }
+
+        void clear_block(unsigned block_index)
+        {
+            Block& block = blocks_[block_index];
+            for (const std::uint32_t slot_index : block.slots)
+            {
+                release_slot(slot_index);
+            }
+
+            block.items.clear();
+            block.slots.clear();
+        }
+
+        // Removes all items and releases all blocks.
+        void clear()
+        {
+            free_blocks_.clear();
+            for (unsigned i = 0; i < blocks_.size(); ++i)
+            {
+                free_block(static_cast<unsigned>(blocks_.size()) - 1 - i);
+            }
+        }
+
+    public :
+        Handle add(unsigned block_index, const Item& item)
+        {
+            Block& block = blocks_[block_index];
+            const std::uint32_t slot_index = alloc_slot();
+            Slot& slot = slots_[slot_index];
+            slot.block = block_index;
+            slot.index = static_cast<std::uint32_t>(block.items.size());
+
+            block.items.push_back(item);
+            block.slots.push_back(slot_index);
+
+            return {slot_index, slot.generation};
+        }
+
+        void remove(Handle handle)
+        {
+            assert(is_valid(handle));
+            const Slot slot = slots_[handle.index];
+            remove_at(slot.block, slot.index);
+            release_slot(handle.index);
+        }
+
+        // Moves the item to another block, the handle stays valid.
+        void move(Handle handle, unsigned block_index)
+        {
+            assert(is_valid(handle));
+            Slot& slot = slots_[handle.index];
+            Block& block = blocks_[block_index];
+
+            block.items.push_back(blocks_[slot.block].items[slot.index]);
+            block.slots.push_back(handle.index);
+            remove_at(slot.block, slot.index);
+
+            slot.block = block_index;
+            slot.index = static_cast<std::uint32_t>(block.items.size() - 1);
+        }
+
+        bool is_valid(Handle handle) const
+        {
+            return handle.index < slots_.size() &&
+                   slots_[handle.index].generation == handle.generation &&
+                   slots_[handle.index].block != invalid_block;
+        }
+
+        Item& get(Handle handle)
+        {
+            assert(is_valid(handle));
+            const Slot& slot = slots_[handle.index];
+            return blocks_[slot.block].items[slot.index];
+        }
+
+        const Item& get(Handle handle) const
+        {
+            assert(is_valid(handle));
+            const Slot& slot = slots_[handle.index];
+            return blocks_[slot.block].items[slot.index];
+        }
+
+        unsigned block_of(Handle handle) const
+        {
+            assert(is_valid(handle));
+            return slots_[handle.index].block;
+        }
+
+    public :
+        // Dense access to the items of a block, in no particular order.
+        unsigned size(unsigned block_index) const
+        {
+            return static_cast<unsigned>(blocks_[block_index].items.size());
+        }
+
+        Handle handle_at(unsigned block_index, unsigned item_index) const
+        {
+            const std::uint32_t slot_index = blocks_[block_index].slots[item_index];
+            return {slot_index, slots_[slot_index].generation};
+        }
+
+        Item* block_begin(unsigned block_index)
+        {
+            return blocks_[block_index].items.data();
+        }
+
+        Item* block_end(unsigned block_index)
+        {
+            return block_begin(block_index) + size(block_index);
+        }
+
+        const Item* block_begin(unsigned block_index) const
+        {
+            return blocks_[block_index].items.data();
+        }
+
+        const Item* block_end(unsigned block_index) const
+        {
+            return block_begin(block_index) + size(block_index);
+        }
+
+        template <typename Fun>
+        void for_each_item_in_block(Fun&& fun, unsigned block_index)
+        {
+            for (auto& item : blocks_[block_index].items)
+            {
+                fun(item);
+            }
+        }
+
+        unsigned num_blocks() const
+        {
+            return static_cast<unsigned>(blocks_.size());
+        }
+
+        unsigned num_free_blocks() const
+        {
+            return static_cast<unsigned>(free_blocks_.size());
+        }
+
+        Storage_stats stats() const
+        {
+            Storage_stats stats;
+            stats.num_blocks = blocks_.size() - free_blocks_.size();
+            stats.num_free_blocks = free_blocks_.size();
+
+            for (const Block& block : blocks_)
+            {
+                stats.num_items += block.items.size();
+                stats.item_capacity += block.items.capacity();
+            }
+
+            for (const unsigned block_index : free_blocks_)
+            {
+                stats.item_capacity -= blocks_[block_index].items.capacity();
+            }
+
+            return stats;
+        }
+
+        // Bytes allocated, including unused capacity.
+        size_t memory_usage() const
+        {
+            size_t bytes = blocks_.capacity() * sizeof(Block) +
+                           free_blocks_.capacity() * sizeof(unsigned) +
+                           slots_.capacity() * sizeof(Slot) +
+                           free_slots_.capacity() * sizeof(std::uint32_t);
+
+            for (const Block& block : blocks_)
+            {
+                bytes += block.items.capacity() * sizeof(Item) + block.slots.capacity() * sizeof(std::uint32_t);
+            }
+
+            return bytes;
+        }
+
+    private :
+        struct Slot {
+            std::uint32_t block;
+            std::uint32_t index;
+            std::uint32_t generation;
+        };
+
+        struct Block {
+            std::vector<Item> items;
+            std::vector<std::uint32_t> slots; // Slot of each item.
+        };
+
+        void remove_at(unsigned block_index, unsigned item_index)
+        {
+            Block& block = blocks_[block_index];
+            assert(item_index < block.items.size());
+
+            if (item_index + 1 < block.items.size())
+            {
+                block.items[item_index] = block.items.back();
+                block.slots[item_index] = block.slots.back();
+                slots_[block.slots[item_index]].index = item_index;
+            }
+
+            block.items.pop_back();
+            block.slots.pop_back();
+        }
+
+        std::uint32_t alloc_slot()
+        {
+            if (free_slots_.empty())
+            {
+                slots_.push_back({invalid_block, 0, 0});
+                return static_cast<std::uint32_t>(slots_.size() - 1);
+            }
+
+            const std::uint32_t slot_index = free_slots_.back();
+            free_slots_.pop_back();
+            return slot_index;
+        }
+
+        // Invalidates the handles to the slot.
+        void release_slot(std::uint32_t slot_index)
+        {
+            Slot& slot = slots_[slot_index];
+            slot.block = invalid_block;
+            slot.generation += 1;
+            free_slots_.push_back(slot_index);
+        }
+
+    private :
+        static const unsigned default_block_size = 8;
+
+        std::vector<Block> blocks_;
+        std::vector<unsigned> free_blocks_;
+
+        std::vector<Slot> slots_;
+        std::vector<std::uint32_t> free_slots_;
+    };
+
+} // namespace spatial
+} // namespace kvant
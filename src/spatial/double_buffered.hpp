@@ -0,0 +1,249 @@
+#pragma once
+#include "shapes.hpp"
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace kvant {
+namespace spatial {
+
+    // Lets worker threads query a spatial index while one thread changes it. There are two
+    // copies of the index. Readers take a snapshot of the front copy, which stays as it is,
+    // and the writer changes the back copy. publish() at the frame boundary swaps them, waits
+    // for the readers still in the old front to leave, and replays the changes of the frame
+    // on it, so that both copies hold the same items again.
+    //
+    // Readers take no locks, they count themselves in and out of a copy with atomics. Only
+    // the const queries of the index may be used on a snapshot (for_each_intersecting, knn,
+    // raycast). A snapshot must be released before the next publish() can finish, so hold
+    // one for at most a frame, and never on the writer thread across publish().
+    //
+    // Both copies see the same changes in the same order, so handles are the same in both.
+    // Index is a Quad_tree or an Aabb_tree.
+    template <typename Index>
+    class Double_buffered {
+    public:
+        using Handle = typename Index::Handle;
+        using Item = typename std::decay<decltype(std::declval<const Index&>().get(std::declval<Handle>()))>::type;
+
+    private:
+        using Shape = typename std::decay<decltype(std::declval<const Item&>().bounding_shape())>::type;
+
+    public:
+        // The arguments are passed to the constructor of both copies.
+        template <typename... Args>
+        explicit Double_buffered(const Args&... args)
+            : buffers_{Index(args...), Index(args...)}
+        {
+            readers_[0].count = 0;
+            readers_[1].count = 0;
+        }
+
+        Double_buffered(const Double_buffered&) = delete;
+        Double_buffered& operator=(const Double_buffered&) = delete;
+
+    public:
+        // Counts as a reader of one copy until destroyed.
+        class Snapshot {
+        public:
+            Snapshot(Snapshot&& other)
+                : index_(other.index_)
+                , count_(other.count_)
+            {
+                other.count_ = nullptr;
+            }
+
+            Snapshot(const Snapshot&) = delete;
+            Snapshot& operator=(const Snapshot&) = delete;
+
+            ~Snapshot()
+            {
+                if (count_ != nullptr)
+                {
+                    count_->fetch_sub(1, std::memory_order_release);
+                }
+            }
+
+            const Index& index() const
+            {
+                return *index_;
+            }
+
+            const Index* operator->() const
+            {
+                return index_;
+            }
+
+        private:
+            friend class Double_buffered;
+
+            Snapshot(const Index& index, std::atomic<unsigned>& count)
+                : index_(&index)
+                , count_(&count)
+            {
+            }
+
+            const Index* index_;
+            std::atomic<unsigned>* count_;
+        };
+
+        // The index as of the last publish(). Safe to call from any thread.
+        Snapshot snapshot() const
+        {
+            for (;;)
+            {
+                const unsigned front = front_.load();
+                readers_[front].count.fetch_add(1);
+
+                // The writer may have swapped between the two lines above, and then not seen
+                // this reader. Only a copy that is still the front is safe to read.
+                if (front_.load() == front)
+                {
+                    return Snapshot(buffers_[front], readers_[front].count);
+                }
+
+                readers_[front].count.fetch_sub(1);
+            }
+        }
+
+    public:
+        // Changes the back copy, only from the writer thread.
+        Handle insert(const Item& item)
+        {
+            const Handle handle = back().insert(item);
+            changes_.push_back({Change::insert, handle, static_cast<std::uint32_t>(inserted_.size())});
+            inserted_.push_back(item);
+            return handle;
+        }
+
+        void remove(Handle handle)
+        {
+            back().remove(handle);
+            changes_.push_back({Change::remove, handle, 0});
+        }
+
+        // The shape is logged whole, not just its bounds, since knn and raycast test it.
+        void update(Handle handle, const Shape& new_shape)
+        {
+            back().update(handle, new_shape);
+            changes_.push_back({Change::update, handle, static_cast<std::uint32_t>(moved_.size())});
+            moved_.push_back(new_shape);
+        }
+
+        void clear()
+        {
+            back().clear();
+            changes_.push_back({Change::clear, Handle(), 0});
+        }
+
+        // The copy being changed, with the changes since the last publish(). Only for the
+        // writer thread.
+        const Index& back_index() const
+        {
+            return buffers_[1 - front_.load(std::memory_order_relaxed)];
+        }
+
+        // Makes the changes visible to new snapshots. Blocks until the snapshots of the old
+        // front are released.
+        void publish()
+        {
+            const unsigned old_front = front_.load(std::memory_order_relaxed);
+            front_.store(1 - old_front);
+
+            while (readers_[old_front].count.load() != 0)
+            {
+                std::this_thread::yield();
+            }
+
+            replay(buffers_[old_front]);
+
+            changes_.clear();
+            inserted_.clear();
+            moved_.clear();
+        }
+
+    public:
+        struct Memory_usage {
+            size_t front;   // Bytes in the copy read by snapshots.
+            size_t back;    // Bytes in the copy being changed.
+            size_t changes; // Bytes in the log of changes to replay.
+
+            size_t total() const
+            {
+                return front + back + changes;
+            }
+        };
+
+        // Only for the writer thread. The overhead of the snapshots is the back copy and the
+        // log, which grows with the number of changes in a frame.
+        Memory_usage memory_usage() const
+        {
+            const unsigned front = front_.load(std::memory_order_relaxed);
+            return {buffers_[front].memory_usage(),
+                    buffers_[1 - front].memory_usage(),
+                    changes_.capacity() * sizeof(Change) +
+                        inserted_.capacity() * sizeof(Item) +
+                        moved_.capacity() * sizeof(Shape)};
+        }
+
+    private:
+        struct Change {
+            enum Type { insert, remove, update, clear } type;
+            Handle handle;
+            std::uint32_t index; // In inserted_ or moved_.
+        };
+
+        Index& back()
+        {
+            return buffers_[1 - front_.load(std::memory_order_relaxed)];
+        }
+
+        void replay(Index& index)
+        {
+            for (const Change& change : changes_)
+            {
+                switch (change.type)
+                {
+                case Change::insert:
+                {
+                    const Handle handle = index.insert(inserted_[change.index]);
+                    assert(handle == change.handle);
+                    (void)handle;
+                    break;
+                }
+                case Change::remove:
+                    index.remove(change.handle);
+                    break;
+                case Change::update:
+                    index.update(change.handle, moved_[change.index]);
+                    break;
+                case Change::clear:
+                    index.clear();
+                    break;
+                }
+            }
+        }
+
+    private:
+        Index buffers_[2];
+
+        // Readers of each copy. Kept apart so that readers of one copy don't slow down the
+        // other.
+        struct alignas(64) Reader_count {
+            std::atomic<unsigned> count;
+        };
+        mutable Reader_count readers_[2];
+
+        std::atomic<unsigned> front_{0};
+
+        std::vector<Change> changes_;
+        std::vector<Item> inserted_;
+        std::vector<Shape> moved_;
+    };
+
+} // namespace spatial
+} // namespace kvant
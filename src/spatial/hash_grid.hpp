@@ -0,0 +1,295 @@
+#pragma once
+#include "shapes.hpp"
+#include "visitor.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+namespace kvant {
+namespace spatial {
+
+    // Uniform grid over an unbounded world, for items of about the same size. Only cells
+    // with items are stored, in an open addressing hash table. Items are added to every
+    // cell their bounds overlap.
+    //
+    // Meant to be cleared and rebuilt every frame, clear() is O(1). Has the same interface
+    // as Quad_tree for inserting and querying, so the two can be swapped.
+    //
+    // Item must provide bounding_shape(), returning a Circle or a Rectangle.
+    template <typename Item>
+    class Hash_grid {
+        using Rectangle = spatial::Rectangle<glm::vec2>;
+
+    public:
+        // Valid until the grid is cleared.
+        using Handle = std::uint32_t;
+
+        Hash_grid(float cell_size,
+                  unsigned expected_cells = 1024)
+            : inv_cell_size_(1.0f / cell_size)
+        {
+            assert(cell_size > 0.0f);
+
+            unsigned capacity = 16;
+            while (capacity < expected_cells * 2)
+            {
+                capacity *= 2;
+            }
+            cells_.resize(capacity);
+        }
+
+    public:
+        Handle insert(const Item& item)
+        {
+            const Handle handle = static_cast<Handle>(items_.size());
+            items_.push_back({item, bounding_rect(item.bounding_shape())});
+
+            const Cell_range range = cell_range(items_.back().bounds);
+            for (std::int32_t y = range.min_y; y <= range.max_y; ++y)
+            {
+                for (std::int32_t x = range.min_x; x <= range.max_x; ++x)
+                {
+                    Cell& cell = find_or_add_cell(x, y);
+                    refs_.push_back({handle, cell.first_ref});
+                    cell.first_ref = static_cast<std::uint32_t>(refs_.size() - 1);
+                }
+            }
+
+            return handle;
+        }
+
+        // Keeps the allocated memory.
+        void clear()
+        {
+            items_.clear();
+            refs_.clear();
+            num_used_cells_ = 0;
+
+            // Cells from earlier frames are recognized as empty by their stamp.
+            if (++stamp_ == 0)
+            {
+                std::fill(cells_.begin(), cells_.end(), Cell());
+                stamp_ = 1;
+            }
+        }
+
+        const Item& get(Handle handle) const
+        {
+            return items_[handle].item;
+        }
+
+        size_t size() const
+        {
+            return items_.size();
+        }
+
+    public:
+        // Calls fun once for every item whose bounds intersect the shape (Circle or Rectangle).
+        // Returns false if the visitor stopped the traversal.
+        template <typename Shape, typename Fun>
+        bool for_each_intersecting(const Shape& shape, Fun&& fun) const
+        {
+            const Cell_range range = cell_range(bounding_rect(shape));
+
+            // Queries over more cells than are in use look at the cells in use instead.
+            const std::uint64_t num_query_cells = static_cast<std::uint64_t>(static_cast<std::int64_t>(range.max_x) - range.min_x + 1) *
+                                                  static_cast<std::uint64_t>(static_cast<std::int64_t>(range.max_y) - range.min_y + 1);
+            if (num_used_cells_ < num_query_cells)
+            {
+                for (const Cell& cell : cells_)
+                {
+                    if (cell.stamp == stamp_ &&
+                        range.min_x <= cell.x && cell.x <= range.max_x &&
+                        range.min_y <= cell.y && cell.y <= range.max_y &&
+                        !visit_cell(cell, range, shape, fun))
+                    {
+                        return false;
+                    }
+                }
+
+                return true;
+            }
+
+            for (std::int32_t y = range.min_y; y <= range.max_y; ++y)
+            {
+                for (std::int32_t x = range.min_x; x <= range.max_x; ++x)
+                {
+                    const Cell* cell = find_cell(x, y);
+                    if (cell != nullptr && !visit_cell(*cell, range, shape, fun))
+                    {
+                        return false;
+                    }
+                }
+            }
+
+            return true;
+        }
+
+    private:
+        static const std::uint32_t invalid_ref = ~0u;
+
+        struct Entry {
+            Item item;
+            Rectangle bounds;
+        };
+
+        // Singly linked list of the items in a cell.
+        struct Ref {
+            std::uint32_t item;
+            std::uint32_t next;
+        };
+
+        struct Cell {
+            std::int32_t x{0};
+            std::int32_t y{0};
+            std::uint32_t first_ref{invalid_ref};
+            std::uint32_t stamp{0};
+        };
+
+        struct Cell_range {
+            std::int32_t min_x;
+            std::int32_t min_y;
+            std::int32_t max_x;
+            std::int32_t max_y;
+        };
+
+        template <typename Shape, typename Fun>
+        bool visit_cell(const Cell& cell, const Cell_range& range, const Shape& shape, Fun& fun) const
+        {
+            for (std::uint32_t r = cell.first_ref; r != invalid_ref; r = refs_[r].next)
+            {
+                const Entry& entry = items_[refs_[r].item];
+                if (!intersects(shape, entry.bounds))
+                {
+                    continue;
+                }
+
+                // An item in several cells is only reported from the first cell it
+                // shares with the query.
+                const Cell_range item_range = cell_range(entry.bounds);
+                if (cell.x != std::max(item_range.min_x, range.min_x) ||
+                    cell.y != std::max(item_range.min_y, range.min_y))
+                {
+                    continue;
+                }
+
+                if (!detail::visit(fun, entry.item))
+                {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        Cell_range cell_range(const Rectangle& bounds) const
+        {
+            return {to_cell(bounds.min.x), to_cell(bounds.min.y), to_cell(bounds.max.x), to_cell(bounds.max.y)};
+        }
+
+        // Cells beyond max_cell, and NaN, are clamped, so that ranges of cells can be
+        // stepped through without overflow. Bounds are tested exactly, so the edge cells
+        // only get more items to test.
+        static const std::int32_t max_cell = 1 << 30;
+
+        std::int32_t to_cell(float v) const
+        {
+            const float cell = std::floor(v * inv_cell_size_);
+            if (!(cell > -static_cast<float>(max_cell)))
+            {
+                return -max_cell;
+            }
+            return cell < static_cast<float>(max_cell) ? static_cast<std::int32_t>(cell) : max_cell;
+        }
+
+        static std::uint32_t hash(std::int32_t x, std::int32_t y)
+        {
+            std::uint32_t h = static_cast<std::uint32_t>(x) * 0x9e3779b1u;
+            h ^= static_cast<std::uint32_t>(y) * 0x85ebca6bu;
+            return h ^ (h >> 15);
+        }
+
+        const Cell* find_cell(std::int32_t x, std::int32_t y) const
+        {
+            const std::uint32_t mask = static_cast<std::uint32_t>(cells_.size() - 1);
+
+            for (std::uint32_t i = hash(x, y) & mask;; i = (i + 1) & mask)
+            {
+                const Cell& cell = cells_[i];
+                if (cell.stamp != stamp_)
+                {
+                    return nullptr;
+                }
+
+                if (cell.x == x && cell.y == y)
+                {
+                    return &cell;
+                }
+            }
+        }
+
+        Cell& find_or_add_cell(std::int32_t x, std::int32_t y)
+        {
+            // Keep the load factor at most one half, so probe sequences stay short.
+            if ((num_used_cells_ + 1) * 2 > cells_.size())
+            {
+                grow();
+            }
+
+            const std::uint32_t mask = static_cast<std::uint32_t>(cells_.size() - 1);
+
+            for (std::uint32_t i = hash(x, y) & mask;; i = (i + 1) & mask)
+            {
+                Cell& cell = cells_[i];
+                if (cell.stamp != stamp_)
+                {
+                    cell.x = x;
+                    cell.y = y;
+                    cell.first_ref = invalid_ref;
+                    cell.stamp = stamp_;
+                    ++num_used_cells_;
+                    return cell;
+                }
+
+                if (cell.x == x && cell.y == y)
+                {
+                    return cell;
+                }
+            }
+        }
+
+        void grow()
+        {
+            std::vector<Cell> old_cells(cells_.size() * 2);
+            old_cells.swap(cells_);
+
+            const std::uint32_t mask = static_cast<std::uint32_t>(cells_.size() - 1);
+            for (const Cell& cell : old_cells)
+            {
+                if (cell.stamp == stamp_)
+                {
+                    std::uint32_t i = hash(cell.x, cell.y) & mask;
+                    while (cells_[i].stamp == stamp_)
+                    {
+                        i = (i + 1) & mask;
+                    }
+                    cells_[i] = cell;
+                }
+            }
+        }
+
+    private:
+        float inv_cell_size_;
+
+        std::vector<Entry> items_;
+        std::vector<Ref> refs_;
+
+        std::vector<Cell> cells_;
+        size_t num_used_cells_{0};
+        std::uint32_t stamp_{1};
+    };
+
+} // namespace spatial
+} // namespace kvant
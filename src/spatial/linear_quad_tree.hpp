@@ -0,0 +1,328 @@
+#pragma once
+#include "../base/radix_sort.hpp"
+#include "../base/worker_pool.hpp"
+#include "morton.hpp"
+#include "shapes.hpp"
+#include "visitor.hpp"
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+namespace kvant {
+namespace spatial {
+
+    // Pointerless quad tree. Every item is keyed by the z-order code of the smallest node
+    // containing it, with the depth in the lowest bits, and the items are kept sorted by
+    // that key. A node and its whole subtree are then a contiguous range of the sorted
+    // items, with the items of the node itself first.
+    //
+    // The tree is built in bulk from an array of items, the index of an item in that array
+    // is its id. Moved items are re-keyed with update(), and commit() merges the items whose
+    // key changed back into place. Queries report items in z-order.
+    //
+    // Item must provide bounding_shape(), returning a Circle or a Rectangle.
+    template <typename Item>
+    class Linear_quad_tree {
+        using Rectangle = spatial::Rectangle<glm::vec2>;
+
+    public:
+        static const unsigned max_depth = 14;
+
+        Linear_quad_tree(const Rectangle& root_rect)
+            : root_(root_rect)
+            , cell_scale_(glm::vec2(static_cast<float>(num_cells)) / (root_rect.max - root_rect.min))
+        {
+        }
+
+    public:
+        void build(const std::vector<Item>& items)
+        {
+            build(items.data(), items.size());
+        }
+
+        void build(const Item* items, size_t count)
+        {
+            changed_.clear();
+            pairs_.resize(count);
+            changed_bounds_.resize(count);
+
+            base::parallel_for(count, 4 * 1024, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i)
+                {
+                    changed_bounds_[i] = bounding_rect(items[i].bounding_shape());
+                    pairs_[i].key = make_key(changed_bounds_[i]);
+                    pairs_[i].value = static_cast<std::uint32_t>(i);
+                }
+            });
+
+            base::radix_sort(pairs_, scratch_);
+
+            keys_.resize(count);
+            ids_.resize(count);
+            items_.resize(count);
+            bounds_.resize(count);
+            positions_.resize(count);
+            pending_keys_.resize(count);
+
+            base::parallel_for(count, 4 * 1024, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i)
+                {
+                    const std::uint32_t id = pairs_[i].value;
+                    keys_[i] = pairs_[i].key;
+                    ids_[i] = id;
+                    items_[i] = items[id];
+                    bounds_[i] = changed_bounds_[id];
+                    positions_[id] = static_cast<std::uint32_t>(i);
+                }
+            });
+        }
+
+        // Replaces the item with the given id. The order is only restored by commit(), items
+        // that stay within their node don't need it.
+        void update(size_t id, const Item& item)
+        {
+            const std::uint32_t position = positions_[id];
+            items_[position] = item;
+            bounds_[position] = bounding_rect(item.bounding_shape());
+
+            const std::uint32_t key = make_key(bounds_[position]);
+            if (key != keys_[position])
+            {
+                if (keys_[position] != dirty_key)
+                {
+                    changed_.push_back(static_cast<std::uint32_t>(id));
+                }
+
+                // The key stays invalid until commit, so the range searches are not thrown off.
+                keys_[position] = dirty_key;
+                pending_keys_[id] = key;
+            }
+        }
+
+        // Sorts the changed items and merges them with the rest in one pass.
+        void commit()
+        {
+            if (changed_.empty())
+            {
+                return;
+            }
+
+            pairs_.clear();
+            for (const std::uint32_t id : changed_)
+            {
+                pairs_.push_back({pending_keys_[id], id});
+            }
+
+            std::sort(pairs_.begin(), pairs_.end(), [](const base::Sort_pair& a, const base::Sort_pair& b) {
+                return a.key < b.key || (a.key == b.key && a.value < b.value);
+            });
+
+            // Take the changed items out before they are overwritten by the merge.
+            changed_items_.clear();
+            changed_bounds_.clear();
+            size_t first_changed = items_.size();
+            for (const base::Sort_pair& pair : pairs_)
+            {
+                const std::uint32_t position = positions_[pair.value];
+                changed_items_.push_back(items_[position]);
+                changed_bounds_.push_back(bounds_[position]);
+                first_changed = std::min<size_t>(first_changed, position);
+            }
+
+            // Close the gaps, the items before the first changed one stay where they are.
+            size_t read = first_changed;
+            for (size_t i = first_changed; i < items_.size(); ++i)
+            {
+                if (keys_[i] != dirty_key)
+                {
+                    move_entry(i, read++);
+                }
+            }
+
+            // Then merge from the back into the space left at the end.
+            size_t write = items_.size();
+            size_t changed = pairs_.size();
+
+            while (changed > 0)
+            {
+                if (read > 0 && pairs_[changed - 1].key < keys_[read - 1])
+                {
+                    --read;
+                    move_entry(read, --write);
+                }
+                else
+                {
+                    --changed;
+                    --write;
+                    keys_[write] = pairs_[changed].key;
+                    ids_[write] = pairs_[changed].value;
+                    items_[write] = changed_items_[changed];
+                    bounds_[write] = changed_bounds_[changed];
+                    positions_[pairs_[changed].value] = static_cast<std::uint32_t>(write);
+                }
+            }
+
+            changed_.clear();
+        }
+
+        size_t size() const
+        {
+            return items_.size();
+        }
+
+    public:
+        // Calls fun for every item whose bounds intersect the shape (Circle or Rectangle), in
+        // z-order. Returns false if the visitor stopped the traversal.
+        template <typename Shape, typename Fun>
+        bool for_each_intersecting(const Shape& shape, Fun&& fun) const
+        {
+            assert(changed_.empty() && "Commit before querying.");
+
+            struct Frame {
+                std::uint32_t code;
+                std::uint32_t depth;
+                std::uint32_t begin;
+                std::uint32_t end;
+            };
+
+            std::array<Frame, 3 * max_depth + 1> stack;
+            unsigned stack_size = 0;
+
+            stack[stack_size++] = {0, 0, 0, static_cast<std::uint32_t>(keys_.size())};
+
+            while (stack_size > 0)
+            {
+                const Frame frame = stack[--stack_size];
+                std::uint32_t i = frame.begin;
+
+                // Small subtrees are cheaper to scan, the entries are in z-order already.
+                const bool scan = frame.end - frame.begin <= linear_scan_size || frame.depth == max_depth;
+                const std::uint32_t own_key = scan ? ~0u : make_key(frame.code, frame.depth);
+
+                for (; i < frame.end && (scan || keys_[i] == own_key); ++i)
+                {
+                    if (intersects(shape, bounds_[i]) && !detail::visit(fun, items_[i]))
+                    {
+                        return false;
+                    }
+                }
+
+                if (i == frame.end)
+                {
+                    continue;
+                }
+
+                // Split the rest of the range between the children.
+                const unsigned child_depth = frame.depth + 1;
+                const unsigned child_shift = 2 * (max_depth - child_depth) + depth_bits;
+
+                std::array<Frame, 4> children;
+                for (std::uint32_t c = 0; c < 4; ++c)
+                {
+                    const std::uint32_t child_code = frame.code * 4 + c;
+                    const std::uint64_t child_end_key = static_cast<std::uint64_t>(child_code + 1) << child_shift;
+                    const std::uint32_t end = c == 3 ? frame.end : static_cast<std::uint32_t>(std::lower_bound(keys_.begin() + i, keys_.begin() + frame.end, child_end_key) - keys_.begin());
+                    children[c] = {child_code, child_depth, i, end};
+                    i = end;
+                }
+
+                for (unsigned c = 4; c-- > 0;)
+                {
+                    if (children[c].begin != children[c].end && intersects(shape, node_rect(children[c].code, child_depth)))
+                    {
+                        stack[stack_size++] = children[c];
+                    }
+                }
+            }
+
+            return true;
+        }
+
+    private:
+        static const unsigned depth_bits = 4;
+        static const std::uint32_t num_cells = 1u << max_depth;
+        static const std::uint32_t dirty_key = ~0u;
+        static const std::uint32_t linear_scan_size = 16;
+
+        // Shifted in 64 bits, since the shift is 32 at the root, where the code is 0.
+        static std::uint32_t make_key(std::uint32_t code, unsigned depth)
+        {
+            return static_cast<std::uint32_t>(static_cast<std::uint64_t>(code) << (2 * (max_depth - depth) + depth_bits)) | depth;
+        }
+
+        // Items not inside the root are kept in the root.
+        std::uint32_t make_key(const Rectangle& bounds) const
+        {
+            if (bounds.min.x < root_.min.x || bounds.min.y < root_.min.y ||
+                root_.max.x < bounds.max.x || root_.max.y < bounds.max.y)
+            {
+                return make_key(0, 0);
+            }
+
+            const std::uint32_t a = morton_encode(cell(bounds.min.x - root_.min.x, cell_scale_.x),
+                                                  cell(bounds.min.y - root_.min.y, cell_scale_.y));
+            const std::uint32_t b = morton_encode(cell(bounds.max.x - root_.min.x, cell_scale_.x),
+                                                  cell(bounds.max.y - root_.min.y, cell_scale_.y));
+
+            // The corners share the code prefix of the smallest node containing both.
+            unsigned depth = max_depth;
+            for (std::uint32_t diff = a ^ b; diff != 0; diff >>= 2)
+            {
+                --depth;
+            }
+
+            return make_key(a >> (2 * (max_depth - depth)), depth);
+        }
+
+        static std::uint32_t cell(float offset, float scale)
+        {
+            const float c = offset * scale;
+            return c < static_cast<float>(num_cells) ? static_cast<std::uint32_t>(c) : num_cells - 1;
+        }
+
+        Rectangle node_rect(std::uint32_t code, unsigned depth) const
+        {
+            const glm::vec2 size = (root_.max - root_.min) / glm::vec2(static_cast<float>(1u << depth));
+            const glm::vec2 min = root_.min + size * glm::vec2(static_cast<float>(morton_decode_x(code)),
+                                                               static_cast<float>(morton_decode_y(code)));
+            return Rectangle(min, min + size);
+        }
+
+        void move_entry(size_t from, size_t to)
+        {
+            if (from != to)
+            {
+                keys_[to] = keys_[from];
+                ids_[to] = ids_[from];
+                items_[to] = items_[from];
+                bounds_[to] = bounds_[from];
+                positions_[ids_[to]] = static_cast<std::uint32_t>(to);
+            }
+        }
+
+    private:
+        Rectangle root_;
+        glm::vec2 cell_scale_;
+
+        // Sorted by key.
+        std::vector<std::uint32_t> keys_;
+        std::vector<std::uint32_t> ids_;
+        std::vector<Item> items_;
+        std::vector<Rectangle> bounds_;
+
+        // Sorted position by id.
+        std::vector<std::uint32_t> positions_;
+
+        std::vector<std::uint32_t> changed_;
+        std::vector<std::uint32_t> pending_keys_;
+        std::vector<Item> changed_items_;
+        std::vector<Rectangle> changed_bounds_; // Also scratch for the bulk build.
+
+        std::vector<base::Sort_pair> pairs_;
+        std::vector<base::Sort_pair> scratch_;
+    };
+
+} // namespace spatial
+} // namespace kvant
@@ -0,0 +1,46 @@
+#pragma once
+#include <cstdint>
+
+namespace kvant {
+namespace spatial {
+
+    // Spreads the lower 16 bits of v so that there's a zero bit between each of them.
+    inline std::uint32_t spread_bits(std::uint32_t v)
+    {
+        v &= 0x0000ffff;
+        v = (v | (v << 8)) & 0x00ff00ff;
+        v = (v | (v << 4)) & 0x0f0f0f0f;
+        v = (v | (v << 2)) & 0x33333333;
+        v = (v | (v << 1)) & 0x55555555;
+        return v;
+    }
+
+    // Inverse of spread_bits.
+    inline std::uint32_t compact_bits(std::uint32_t v)
+    {
+        v &= 0x55555555;
+        v = (v | (v >> 1)) & 0x33333333;
+        v = (v | (v >> 2)) & 0x0f0f0f0f;
+        v = (v | (v >> 4)) & 0x00ff00ff;
+        v = (v | (v >> 8)) & 0x0000ffff;
+        return v;
+    }
+
+    // Z-order code of a 16 bit cell coordinate, x in the even bits.
+    inline std::uint32_t morton_encode(std::uint32_t x, std::uint32_t y)
+    {
+        return spread_bits(x) | (spread_bits(y) << 1);
+    }
+
+    inline std::uint32_t morton_decode_x(std::uint32_t code)
+    {
+        return compact_bits(code);
+    }
+
+    inline std::uint32_t morton_decode_y(std::uint32_t code)
+    {
+        return compact_bits(code >> 1);
+    }
+
+} // namespace spatial
+} // namespace kvant
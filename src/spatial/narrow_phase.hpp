@@ -0,0 +1,1179 @@
+#pragma once
+#include "shapes.hpp"
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+namespace kvant {
+namespace spatial {
+
+    // Exact overlap tests for the pairs found by the broad phase, with the direction and
+    // depth of the overlap. The shapes are in floats.
+
+    // The segment from a to b, grown by radius.
+    struct Capsule {
+        Capsule() = default;
+
+        Capsule(const glm::vec2& a_, const glm::vec2& b_, float radius_)
+            : a(a_)
+            , b(b_)
+            , radius(radius_)
+        {
+        }
+
+        glm::vec2 a;
+        glm::vec2 b;
+        float radius;
+    };
+
+    // A rectangle turned around its center. axis is the unit direction of its local x axis.
+    struct Oriented_box {
+        Oriented_box() = default;
+
+        Oriented_box(const glm::vec2& center_, const glm::vec2& half_extents_, float angle)
+            : center(center_)
+            , axis(std::cos(angle), std::sin(angle))
+            , half_extents(half_extents_)
+        {
+        }
+
+        // The local y axis.
+        glm::vec2 up() const
+        {
+            return glm::vec2(-axis.y, axis.x);
+        }
+
+        glm::vec2 center;
+        glm::vec2 axis;
+        glm::vec2 half_extents;
+    };
+
+    // A convex polygon of up to max_vertices vertices, counter-clockwise. The outward edge
+    // normals are computed once, for the separating axis test.
+    class Convex_polygon {
+    public:
+        static const unsigned max_vertices = 8;
+
+        Convex_polygon() = default;
+
+        Convex_polygon(const glm::vec2* vertices, unsigned count)
+            : size_(count)
+        {
+            assert(3 <= count && count <= max_vertices);
+
+            for (unsigned i = 0; i < count; ++i)
+            {
+                vertices_[i] = vertices[i];
+            }
+            update_normals();
+        }
+
+        unsigned size() const
+        {
+            return size_;
+        }
+
+        const glm::vec2& vertex(unsigned i) const
+        {
+            return vertices_[i];
+        }
+
+        // Of the edge from vertex i to vertex i + 1.
+        const glm::vec2& normal(unsigned i) const
+        {
+            return normals_[i];
+        }
+
+        // Moving keeps the normals.
+        void translate(const glm::vec2& offset)
+        {
+            for (unsigned i = 0; i < size_; ++i)
+            {
+                vertices_[i] += offset;
+            }
+        }
+
+    private:
+        void update_normals()
+        {
+            for (unsigned i = 0; i < size_; ++i)
+            {
+                const glm::vec2 edge = vertices_[(i + 1) % size_] - vertices_[i];
+                normals_[i] = glm::normalize(glm::vec2(edge.y, -edge.x));
+            }
+        }
+
+        std::array<glm::vec2, max_vertices> vertices_;
+        std::array<glm::vec2, max_vertices> normals_;
+        unsigned size_{0};
+    };
+
+    inline Rectangle<glm::vec2> bounding_rect(const Capsule& capsule)
+    {
+        const glm::vec2 r(capsule.radius);
+        return Rectangle<glm::vec2>(glm::min(capsule.a, capsule.b) - r, glm::max(capsule.a, capsule.b) + r);
+    }
+
+    inline Rectangle<glm::vec2> bounding_rect(const Oriented_box& box)
+    {
+        const glm::vec2 extent = glm::abs(box.axis) * box.half_extents.x + glm::abs(box.up()) * box.half_extents.y;
+        return Rectangle<glm::vec2>(box.center - extent, box.center + extent);
+    }
+
+    inline Rectangle<glm::vec2> bounding_rect(const Convex_polygon& polygon)
+    {
+        glm::vec2 min(polygon.vertex(0));
+        glm::vec2 max(polygon.vertex(0));
+        for (unsigned i = 1; i < polygon.size(); ++i)
+        {
+            min = glm::min(min, polygon.vertex(i));
+            max = glm::max(max, polygon.vertex(i));
+        }
+        return Rectangle<glm::vec2>(min, max);
+    }
+
+    struct Contact {
+        glm::vec2 normal; // Unit length, from the first shape towards the second.
+        float depth;      // How far the second shape has to move along the normal to separate.
+    };
+
+    namespace detail {
+
+        // Every shape is a convex core grown by a radius: a point for circles, a segment for
+        // capsules and a polygon with no radius for the boxes and polygons. support() is the
+        // point of the core furthest along a direction.
+        inline glm::vec2 support(const Circle<>& circle, const glm::vec2&)
+        {
+            return circle.center;
+        }
+
+        inline glm::vec2 support(const Capsule& capsule, const glm::vec2& direction)
+        {
+            return glm::dot(capsule.a, direction) >= glm::dot(capsule.b, direction) ? capsule.a : capsule.b;
+        }
+
+        inline glm::vec2 support(const Rectangle<>& rect, const glm::vec2& direction)
+        {
+            return glm::vec2(direction.x >= 0.0f ? rect.max.x : rect.min.x,
+                             direction.y >= 0.0f ? rect.max.y : rect.min.y);
+        }
+
+        inline glm::vec2 support(const Oriented_box& box, const glm::vec2& direction)
+        {
+            const float x = glm::dot(direction, box.axis) >= 0.0f ? box.half_extents.x : -box.half_extents.x;
+            const float y = glm::dot(direction, box.up()) >= 0.0f ? box.half_extents.y : -box.half_extents.y;
+            return box.center + box.axis * x + box.up() * y;
+        }
+
+        inline glm::vec2 support(const Convex_polygon& polygon, const glm::vec2& direction)
+        {
+            unsigned best = 0;
+            float best_dot = glm::dot(polygon.vertex(0), direction);
+            for (unsigned i = 1; i < polygon.size(); ++i)
+            {
+                const float d = glm::dot(polygon.vertex(i), direction);
+                if (d > best_dot)
+                {
+                    best = i;
+                    best_dot = d;
+                }
+            }
+            return polygon.vertex(best);
+        }
+
+        inline float core_radius(const Circle<>& circle)
+        {
+            return circle.radius;
+        }
+
+        inline float core_radius(const Capsule& capsule)
+        {
+            return capsule.radius;
+        }
+
+        template <typename Shape>
+        inline float core_radius(const Shape&)
+        {
+            return 0.0f;
+        }
+
+        inline glm::vec2 perpendicular(const glm::vec2& v)
+        {
+            return glm::vec2(-v.y, v.x);
+        }
+
+        // The axes of the separating axis test, which are the edge normals, and the extent of
+        // the shape along an axis.
+        struct Interval {
+            float min;
+            float max;
+        };
+
+        inline unsigned num_axes(const Rectangle<>&)
+        {
+            return 2;
+        }
+
+        inline glm::vec2 axis(const Rectangle<>&, unsigned i)
+        {
+            return i == 0 ? glm::vec2(1.0f, 0.0f) : glm::vec2(0.0f, 1.0f);
+        }
+
+        inline Interval project(const Rectangle<>& rect, const glm::vec2& axis)
+        {
+            const float center = glm::dot(rect.min + rect.max, axis) * 0.5f;
+            const float extent = (std::abs(axis.x) * (rect.max.x - rect.min.x) + std::abs(axis.y) * (rect.max.y - rect.min.y)) * 0.5f;
+            return {center - extent, center + extent};
+        }
+
+        inline unsigned num_axes(const Oriented_box&)
+        {
+            return 2;
+        }
+
+        inline glm::vec2 axis(const Oriented_box& box, unsigned i)
+        {
+            return i == 0 ? box.axis : box.up();
+        }
+
+        inline Interval project(const Oriented_box& box, const glm::vec2& axis)
+        {
+            const float center = glm::dot(box.center, axis);
+            const float extent = std::abs(glm::dot(box.axis, axis)) * box.half_extents.x +
+                                 std::abs(glm::dot(box.up(), axis)) * box.half_extents.y;
+            return {center - extent, center + extent};
+        }
+
+        inline unsigned num_axes(const Convex_polygon& polygon)
+        {
+            return polygon.size();
+        }
+
+        inline glm::vec2 axis(const Convex_polygon& polygon, unsigned i)
+        {
+            return polygon.normal(i);
+        }
+
+        inline Interval project(const Convex_polygon& polygon, const glm::vec2& axis)
+        {
+            Interval result{glm::dot(polygon.vertex(0), axis), glm::dot(polygon.vertex(0), axis)};
+            for (unsigned i = 1; i < polygon.size(); ++i)
+            {
+                const float d = glm::dot(polygon.vertex(i), axis);
+                result.min = std::min(result.min, d);
+                result.max = std::max(result.max, d);
+            }
+            return result;
+        }
+
+        // Tests the axes of shape, keeping the one with the least overlap. Returns false on
+        // finding a separating axis.
+        template <typename Axes, typename A, typename B>
+        inline bool sat_axes(const Axes& shape, const A& a, const B& b, Contact& contact)
+        {
+            for (unsigned i = 0; i < num_axes(shape); ++i)
+            {
+                const glm::vec2 n = axis(shape, i);
+                const Interval ia = project(a, n);
+                const Interval ib = project(b, n);
+
+                // b is pushed out on the side where it overlaps the least.
+                const float forward = ia.max - ib.min;
+                const float backward = ib.max - ia.min;
+                const float depth = std::min(forward, backward);
+                if (depth < 0.0f)
+                {
+                    return false;
+                }
+
+                if (depth < contact.depth)
+                {
+                    contact.depth = depth;
+                    contact.normal = forward <= backward ? n : -n;
+                }
+            }
+
+            return true;
+        }
+
+        // Separating axis test between two polygonal shapes. Only their own edge normals can
+        // separate them.
+        template <typename A, typename B>
+        inline bool collide_sat(const A& a, const B& b, Contact& contact)
+        {
+            contact.depth = std::numeric_limits<float>::max();
+            return sat_axes(a, a, b, contact) && sat_axes(b, a, b, contact);
+        }
+
+        // Closest points of the segments p1-q1 and p2-q2, which may be single points.
+        inline void closest_points_segments(const glm::vec2& p1, const glm::vec2& q1,
+                                            const glm::vec2& p2, const glm::vec2& q2,
+                                            glm::vec2& c1, glm::vec2& c2)
+        {
+            const glm::vec2 d1 = q1 - p1;
+            const glm::vec2 d2 = q2 - p2;
+            const glm::vec2 r = p1 - p2;
+            const float a = glm::dot(d1, d1);
+            const float e = glm::dot(d2, d2);
+            const float f = glm::dot(d2, r);
+            const float epsilon = 1e-12f;
+
+            float s = 0.0f;
+            float t = 0.0f;
+            if (a <= epsilon && e <= epsilon)
+            {
+                // Both are points.
+            }
+            else if (a <= epsilon)
+            {
+                t = glm::clamp(f / e, 0.0f, 1.0f);
+            }
+            else
+            {
+                const float c = glm::dot(d1, r);
+                if (e <= epsilon)
+                {
+                    s = glm::clamp(-c / a, 0.0f, 1.0f);
+                }
+                else
+                {
+                    // Closest points of the lines, clamped to the first segment, then the
+                    // second, and the first again.
+                    const float b = glm::dot(d1, d2);
+                    const float denom = a * e - b * b;
+                    s = denom > epsilon * a * e ? glm::clamp((b * f - c * e) / denom, 0.0f, 1.0f) : 0.0f;
+                    t = (b * s + f) / e;
+
+                    if (t < 0.0f)
+                    {
+                        t = 0.0f;
+                        s = glm::clamp(-c / a, 0.0f, 1.0f);
+                    }
+                    else if (t > 1.0f)
+                    {
+                        t = 1.0f;
+                        s = glm::clamp((b - c) / a, 0.0f, 1.0f);
+                    }
+                }
+            }
+
+            c1 = p1 + d1 * s;
+            c2 = p2 + d2 * t;
+        }
+
+        // Cores closer than this are taken to overlap.
+        const float core_tolerance = 1e-5f;
+
+        // Contact of two shapes whose cores have closest points ca and cb.
+        inline bool rounded_contact(const glm::vec2& ca, const glm::vec2& cb, float radius, Contact& contact)
+        {
+            const glm::vec2 d = cb - ca;
+            const float distance_sq = glm::dot(d, d);
+            if (distance_sq > radius * radius)
+            {
+                return false;
+            }
+
+            const float distance = std::sqrt(distance_sq);
+            contact.normal = distance > 0.0f ? d / distance : glm::vec2(1.0f, 0.0f);
+            contact.depth = radius - distance;
+            return true;
+        }
+
+        // A point of the Minkowski difference a - b of the cores, with the points of a and b
+        // it came from.
+        struct Gjk_vertex {
+            glm::vec2 a;
+            glm::vec2 b;
+            glm::vec2 w;
+        };
+
+        template <typename A, typename B>
+        inline Gjk_vertex minkowski_support(const A& a, const B& b, const glm::vec2& direction)
+        {
+            Gjk_vertex v;
+            v.a = support(a, direction);
+            v.b = support(b, -direction);
+            v.w = v.a - v.b;
+            return v;
+        }
+
+        struct Gjk_simplex {
+            std::array<Gjk_vertex, 3> vertices;
+            std::array<float, 3> weights;
+            unsigned size;
+
+            glm::vec2 closest() const
+            {
+                glm::vec2 p(0.0f);
+                for (unsigned i = 0; i < size; ++i)
+                {
+                    p += vertices[i].w * weights[i];
+                }
+                return p;
+            }
+
+            void keep(unsigned i, unsigned j, float weight_j)
+            {
+                const Gjk_vertex a = vertices[i];
+                const Gjk_vertex b = vertices[j];
+                vertices[0] = a;
+                vertices[1] = b;
+                weights[0] = 1.0f - weight_j;
+                weights[1] = weight_j;
+                size = 2;
+            }
+
+            void keep(unsigned i)
+            {
+                vertices[0] = vertices[i];
+                weights[0] = 1.0f;
+                size = 1;
+            }
+
+            // Reduces the simplex to the vertices of its feature closest to the origin, and
+            // weights them to give the closest point. Returns true if the origin is inside.
+            bool solve()
+            {
+                if (size == 2)
+                {
+                    const glm::vec2 a = vertices[0].w;
+                    const glm::vec2 ab = vertices[1].w - a;
+                    const float length_sq = glm::dot(ab, ab);
+                    const float t = length_sq > 0.0f ? -glm::dot(a, ab) / length_sq : 0.0f;
+                    if (t <= 0.0f)
+                    {
+                        keep(0);
+                    }
+                    else if (t >= 1.0f)
+                    {
+                        keep(1);
+                    }
+                    else
+                    {
+                        keep(0, 1, t);
+                    }
+                    return false;
+                }
+
+                if (size == 3)
+                {
+                    return solve_triangle();
+                }
+
+                weights[0] = 1.0f;
+                return false;
+            }
+
+            // Keeps the edge of the triangle closest to the origin.
+            void keep_closest_edge()
+            {
+                static const unsigned edges[3][2] = {{0, 1}, {0, 2}, {1, 2}};
+
+                unsigned best = 0;
+                float best_t = 0.0f;
+                float best_distance_sq = std::numeric_limits<float>::max();
+                for (unsigned e = 0; e < 3; ++e)
+                {
+                    const glm::vec2 p = vertices[edges[e][0]].w;
+                    const glm::vec2 d = vertices[edges[e][1]].w - p;
+                    const float length_sq = glm::dot(d, d);
+                    const float t = length_sq > 0.0f ? std::min(std::max(-glm::dot(p, d) / length_sq, 0.0f), 1.0f) : 0.0f;
+                    const glm::vec2 closest = p + d * t;
+                    const float distance_sq = glm::dot(closest, closest);
+                    if (distance_sq < best_distance_sq)
+                    {
+                        best = e;
+                        best_t = t;
+                        best_distance_sq = distance_sq;
+                    }
+                }
+
+                keep(edges[best][0], edges[best][1], best_t);
+            }
+
+            // The regions of a triangle, from Real-Time Collision Detection by Ericson.
+            bool solve_triangle()
+            {
+                const glm::vec2 a = vertices[0].w;
+                const glm::vec2 b = vertices[1].w;
+                const glm::vec2 c = vertices[2].w;
+                const glm::vec2 ab = b - a;
+                const glm::vec2 ac = c - a;
+
+                // A triangle with next to no area has no inside, and its regions can't be
+                // told apart reliably. Its closest point is on an edge.
+                const float area = ab.x * ac.y - ab.y * ac.x;
+                if (std::abs(area) <= 1e-6f * (glm::dot(ab, ab) + glm::dot(ac, ac)))
+                {
+                    keep_closest_edge();
+                    return false;
+                }
+
+                const float d1 = -glm::dot(ab, a);
+                const float d2 = -glm::dot(ac, a);
+                if (d1 <= 0.0f && d2 <= 0.0f)
+                {
+                    keep(0);
+                    return false;
+                }
+
+                const float d3 = -glm::dot(ab, b);
+                const float d4 = -glm::dot(ac, b);
+                if (d3 >= 0.0f && d4 <= d3)
+                {
+                    keep(1);
+                    return false;
+                }
+
+                const float vc = d1 * d4 - d3 * d2;
+                if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f)
+                {
+                    keep(0, 1, d1 / (d1 - d3));
+                    return false;
+                }
+
+                const float d5 = -glm::dot(ab, c);
+                const float d6 = -glm::dot(ac, c);
+                if (d6 >= 0.0f && d5 <= d6)
+                {
+                    keep(2);
+                    return false;
+                }
+
+                const float vb = d5 * d2 - d1 * d6;
+                if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f)
+                {
+                    keep(0, 2, d2 / (d2 - d6));
+                    return false;
+                }
+
+                const float va = d3 * d6 - d5 * d4;
+                if (va <= 0.0f && d4 - d3 >= 0.0f && d5 - d6 >= 0.0f)
+                {
+                    keep(1, 2, (d4 - d3) / ((d4 - d3) + (d5 - d6)));
+                    return false;
+                }
+
+                const float denom = 1.0f / (va + vb + vc);
+                weights[1] = vb * denom;
+                weights[2] = vc * denom;
+                weights[0] = 1.0f - weights[1] - weights[2];
+                return true;
+            }
+        };
+
+        // GJK: the closest points of the cores of a and b. Returns false if the cores
+        // overlap, and then leaves a simplex around the origin for EPA.
+        template <typename A, typename B>
+        inline bool gjk_closest_points(const A& a, const B& b, Gjk_simplex& simplex, glm::vec2& ca, glm::vec2& cb)
+        {
+            const unsigned max_iterations = 32;
+            const float tolerance = 1e-6f;
+            const float absolute_tolerance = 1e-10f;
+
+            simplex.vertices[0] = minkowski_support(a, b, glm::vec2(1.0f, 0.0f));
+            simplex.weights[0] = 1.0f;
+            simplex.size = 1;
+
+            for (unsigned iteration = 0; iteration < max_iterations; ++iteration)
+            {
+                const glm::vec2 v = simplex.closest();
+                const float v_sq = glm::dot(v, v);
+                if (v_sq <= tolerance * tolerance)
+                {
+                    return false;
+                }
+
+                // Stops once the new point gets no closer to the origin than the simplex, or
+                // is one of its vertices again. Rounding, as with contracted multiply-adds,
+                // can make a vertex seem to make progress, and then the simplex would
+                // collapse.
+                const Gjk_vertex next = minkowski_support(a, b, -v);
+                const float progress = v_sq - glm::dot(v, next.w);
+                if (progress <= tolerance * v_sq || progress <= absolute_tolerance)
+                {
+                    break;
+                }
+
+                bool repeated = false;
+                for (unsigned i = 0; i < simplex.size; ++i)
+                {
+                    const glm::vec2 d = next.w - simplex.vertices[i].w;
+                    repeated = repeated || glm::dot(d, d) <= tolerance * tolerance;
+                }
+                if (repeated)
+                {
+                    break;
+                }
+
+                simplex.vertices[simplex.size++] = next;
+                if (simplex.solve())
+                {
+                    return false;
+                }
+            }
+
+            ca = glm::vec2(0.0f);
+            cb = glm::vec2(0.0f);
+            for (unsigned i = 0; i < simplex.size; ++i)
+            {
+                ca += simplex.vertices[i].a * simplex.weights[i];
+                cb += simplex.vertices[i].b * simplex.weights[i];
+            }
+            return true;
+        }
+
+        // EPA: the penetration of the cores, which overlap, as the point of the boundary of
+        // their Minkowski difference closest to the origin. Grows a polygon from the final
+        // GJK simplex towards the boundary, one edge at a time.
+        template <typename A, typename B>
+        inline void epa_penetration(const A& a, const B& b, const Gjk_simplex& simplex, Contact& contact)
+        {
+            const unsigned max_vertices = 32;
+            const float tolerance = 1e-5f;
+
+            std::array<glm::vec2, max_vertices> polygon;
+            unsigned size = 0;
+            for (unsigned i = 0; i < simplex.size; ++i)
+            {
+                polygon[size++] = simplex.vertices[i].w;
+            }
+
+            // The origin was on a vertex or an edge. Widen to a triangle with the support
+            // points across the edge, or around the vertex.
+            if (size == 1)
+            {
+                polygon[size++] = minkowski_support(a, b, polygon[0] == glm::vec2(0.0f) ? glm::vec2(1.0f, 0.0f) : -polygon[0]).w;
+            }
+            if (size == 2)
+            {
+                glm::vec2 across = perpendicular(polygon[1] - polygon[0]);
+                if (across == glm::vec2(0.0f))
+                {
+                    across = glm::vec2(0.0f, 1.0f);
+                }
+
+                polygon[size] = minkowski_support(a, b, across).w;
+                if (std::abs(glm::dot(polygon[size] - polygon[0], across)) <= tolerance)
+                {
+                    polygon[size] = minkowski_support(a, b, -across).w;
+                }
+                ++size;
+            }
+
+            // Counter-clockwise, so the outward normal of an edge is to its right.
+            const glm::vec2 e0 = polygon[1] - polygon[0];
+            const glm::vec2 e1 = polygon[2] - polygon[0];
+            if (e0.x * e1.y - e0.y * e1.x < 0.0f)
+            {
+                std::swap(polygon[1], polygon[2]);
+            }
+
+            for (;;)
+            {
+                unsigned closest = 0;
+                float closest_distance = std::numeric_limits<float>::max();
+                glm::vec2 closest_normal(1.0f, 0.0f);
+
+                for (unsigned i = 0; i < size; ++i)
+                {
+                    const glm::vec2 edge = polygon[(i + 1) % size] - polygon[i];
+                    const float length = glm::length(edge);
+                    if (length <= 0.0f)
+                    {
+                        continue;
+                    }
+
+                    const glm::vec2 n = glm::vec2(edge.y, -edge.x) / length;
+                    const float distance = glm::dot(n, polygon[i]);
+                    if (distance < closest_distance)
+                    {
+                        closest = i;
+                        closest_distance = distance;
+                        closest_normal = n;
+                    }
+                }
+
+                // Every point is at the origin, as for two circles with the same center.
+                if (closest_distance == std::numeric_limits<float>::max())
+                {
+                    contact.normal = glm::vec2(1.0f, 0.0f);
+                    contact.depth = 0.0f;
+                    return;
+                }
+
+                const glm::vec2 w = minkowski_support(a, b, closest_normal).w;
+                const float extent = glm::dot(w, closest_normal);
+                if (extent - closest_distance <= tolerance * std::max(1.0f, extent) || size == max_vertices)
+                {
+                    // Moving b along the normal by the distance moves the origin out of a - b.
+                    contact.normal = closest_normal;
+                    contact.depth = std::max(0.0f, closest_distance);
+                    return;
+                }
+
+                for (unsigned i = size; i > closest + 1; --i)
+                {
+                    polygon[i] = polygon[i - 1];
+                }
+                polygon[closest + 1] = w;
+                ++size;
+            }
+        }
+
+        // Cores and radii: GJK while the cores are apart, and EPA on the cores once they
+        // overlap. Growing both cores by their radii grows the depth by the same amount.
+        template <typename A, typename B>
+        inline bool collide_gjk(const A& a, const B& b, Contact& contact)
+        {
+            const float radius = core_radius(a) + core_radius(b);
+
+            Gjk_simplex simplex;
+            glm::vec2 ca, cb;
+            if (gjk_closest_points(a, b, simplex, ca, cb))
+            {
+                const bool hit = rounded_contact(ca, cb, radius, contact);
+                if (!hit || contact.depth < radius - core_tolerance)
+                {
+                    return hit;
+                }
+
+                // The cores touch, so the closest points give no direction.
+            }
+
+            epa_penetration(a, b, simplex, contact);
+            contact.depth += radius;
+            return true;
+        }
+
+        inline void segment(const Circle<>& circle, glm::vec2& p, glm::vec2& q)
+        {
+            p = circle.center;
+            q = circle.center;
+        }
+
+        inline void segment(const Capsule& capsule, glm::vec2& p, glm::vec2& q)
+        {
+            p = capsule.a;
+            q = capsule.b;
+        }
+
+        // Circles and capsules have segments for cores, and their closest points are found
+        // directly.
+        template <typename A, typename B>
+        inline bool collide_segments(const A& a, const B& b, Contact& contact)
+        {
+            glm::vec2 p1, q1, p2, q2, c1, c2;
+            segment(a, p1, q1);
+            segment(b, p2, q2);
+            closest_points_segments(p1, q1, p2, q2, c1, c2);
+
+            const float radius = core_radius(a) + core_radius(b);
+            if (!rounded_contact(c1, c2, radius, contact))
+            {
+                return false;
+            }
+
+            if (contact.depth < radius - core_tolerance)
+            {
+                return true;
+            }
+
+            // The cores cross, so the closest points give no direction.
+            return collide_gjk(a, b, contact);
+        }
+
+        inline bool collide_impl(const Circle<>& a, const Circle<>& b, Contact& contact)
+        {
+            return collide_segments(a, b, contact);
+        }
+
+        inline bool collide_impl(const Circle<>& a, const Capsule& b, Contact& contact)
+        {
+            return collide_segments(a, b, contact);
+        }
+
+        inline bool collide_impl(const Capsule& a, const Capsule& b, Contact& contact)
+        {
+            return collide_segments(a, b, contact);
+        }
+
+        inline bool collide_impl(const Rectangle<>& a, const Rectangle<>& b, Contact& contact)
+        {
+            return collide_sat(a, b, contact);
+        }
+
+        inline bool collide_impl(const Rectangle<>& a, const Oriented_box& b, Contact& contact)
+        {
+            return collide_sat(a, b, contact);
+        }
+
+        inline bool collide_impl(const Rectangle<>& a, const Convex_polygon& b, Contact& contact)
+        {
+            return collide_sat(a, b, contact);
+        }
+
+        inline bool collide_impl(const Oriented_box& a, const Oriented_box& b, Contact& contact)
+        {
+            return collide_sat(a, b, contact);
+        }
+
+        inline bool collide_impl(const Oriented_box& a, const Convex_polygon& b, Contact& contact)
+        {
+            return collide_sat(a, b, contact);
+        }
+
+        inline bool collide_impl(const Convex_polygon& a, const Convex_polygon& b, Contact& contact)
+        {
+            return collide_sat(a, b, contact);
+        }
+
+        // A rounded shape against a polygonal one.
+        template <typename Polygon>
+        inline bool collide_impl(const Circle<>& a, const Polygon& b, Contact& contact)
+        {
+            return collide_gjk(a, b, contact);
+        }
+
+        template <typename Polygon>
+        inline bool collide_impl(const Capsule& a, const Polygon& b, Contact& contact)
+        {
+            return collide_gjk(a, b, contact);
+        }
+
+        // The order of the shapes in collide_impl.
+        template <typename Shape>
+        struct Shape_order;
+
+        template <>
+        struct Shape_order<Circle<>> {
+            static const unsigned value = 0;
+        };
+
+        template <>
+        struct Shape_order<Capsule> {
+            static const unsigned value = 1;
+        };
+
+        template <>
+        struct Shape_order<Rectangle<>> {
+            static const unsigned value = 2;
+        };
+
+        template <>
+        struct Shape_order<Oriented_box> {
+            static const unsigned value = 3;
+        };
+
+        template <>
+        struct Shape_order<Convex_polygon> {
+            static const unsigned value = 4;
+        };
+
+        template <typename A, typename B, bool in_order = Shape_order<A>::value <= Shape_order<B>::value>
+        struct Ordered_collide {
+            static bool collide(const A& a, const B& b, Contact& contact)
+            {
+                return collide_impl(a, b, contact);
+            }
+        };
+
+        template <typename A, typename B>
+        struct Ordered_collide<A, B, false> {
+            static bool collide(const A& a, const B& b, Contact& contact)
+            {
+                const bool hit = collide_impl(b, a, contact);
+                contact.normal = -contact.normal;
+                return hit;
+            }
+        };
+
+    } // namespace detail
+
+    // Tests two shapes (Circle, Capsule, Rectangle, Oriented_box or Convex_polygon) for
+    // overlap, touching counts. On overlap, contact gets the direction and depth of the
+    // smallest move of b that separates them.
+    //
+    // Boxes and polygons are tested with separating axes, their edge normals. Circles and
+    // capsules against each other use the closest points of their center segments, and
+    // against boxes and polygons GJK, with EPA for the depth once their cores overlap.
+    template <typename A, typename B>
+    inline bool collide(const A& a, const B& b, Contact& contact)
+    {
+        return detail::Ordered_collide<A, B>::collide(a, b, contact);
+    }
+
+    enum class Shape_type : std::uint8_t {
+        circle,
+        capsule,
+        rectangle,
+        oriented_box,
+        convex_polygon
+    };
+
+    const unsigned num_shape_types = 5;
+
+    struct Shape_ref {
+        Shape_type type;
+        std::uint32_t index; // In the array of the type in the Shape_set.
+    };
+
+    // Shapes of all types, each type in an array of its own.
+    class Shape_set {
+    public:
+        Shape_ref add(const Circle<>& shape)
+        {
+            return add_to<0>(shape);
+        }
+
+        Shape_ref add(const Capsule& shape)
+        {
+            return add_to<1>(shape);
+        }
+
+        Shape_ref add(const Rectangle<>& shape)
+        {
+            return add_to<2>(shape);
+        }
+
+        Shape_ref add(const Oriented_box& shape)
+        {
+            return add_to<3>(shape);
+        }
+
+        Shape_ref add(const Convex_polygon& shape)
+        {
+            return add_to<4>(shape);
+        }
+
+        template <typename Shape>
+        const std::vector<Shape>& shapes() const
+        {
+            return std::get<detail::Shape_order<Shape>::value>(shapes_);
+        }
+
+        template <typename Shape>
+        std::vector<Shape>& shapes()
+        {
+            return std::get<detail::Shape_order<Shape>::value>(shapes_);
+        }
+
+        void clear()
+        {
+            std::get<0>(shapes_).clear();
+            std::get<1>(shapes_).clear();
+            std::get<2>(shapes_).clear();
+            std::get<3>(shapes_).clear();
+            std::get<4>(shapes_).clear();
+        }
+
+    private:
+        template <unsigned Type, typename Shape>
+        Shape_ref add_to(const Shape& shape)
+        {
+            auto& shapes = std::get<Type>(shapes_);
+            shapes.push_back(shape);
+            return {static_cast<Shape_type>(Type), static_cast<std::uint32_t>(shapes.size() - 1)};
+        }
+
+        std::tuple<std::vector<Circle<>>,
+                   std::vector<Capsule>,
+                   std::vector<Rectangle<>>,
+                   std::vector<Oriented_box>,
+                   std::vector<Convex_polygon>> shapes_;
+    };
+
+    // Runs the narrow phase over the pairs from the broad phase. The pairs are grouped by
+    // their combination of shape types, and each group is tested in one loop over the
+    // arrays of its two types, so there is no dispatch per pair.
+    class Narrow_phase {
+    public:
+        struct Pair {
+            Shape_ref a;
+            Shape_ref b;
+        };
+
+        struct Pair_contact {
+            std::uint32_t pair; // Index in the pairs.
+            Contact contact;    // From a towards b.
+        };
+
+        // Replaces contacts with the overlapping pairs, in the order of the pairs.
+        void collide(const Shape_set& shapes, const std::vector<Pair>& pairs, std::vector<Pair_contact>& contacts)
+        {
+            contacts.clear();
+
+            // Counting sort on the type combination, with a before b in collide_impl order.
+            std::array<std::uint32_t, num_combinations + 1> offsets;
+            offsets.fill(0);
+            for (const Pair& pair : pairs)
+            {
+                ++offsets[combination(pair) + 1];
+            }
+            for (unsigned i = 0; i < num_combinations; ++i)
+            {
+                offsets[i + 1] += offsets[i];
+            }
+
+            // The groups hold the shape indices in collide_impl order, so that the tests read
+            // them in sequence.
+            grouped_.resize(pairs.size());
+            std::array<std::uint32_t, num_combinations> cursors;
+            std::copy(offsets.begin(), offsets.end() - 1, cursors.begin());
+            for (std::uint32_t i = 0; i < pairs.size(); ++i)
+            {
+                const Pair& pair = pairs[i];
+                const bool swapped = pair.b.type < pair.a.type;
+                Grouped_pair& grouped = grouped_[cursors[combination(pair)]++];
+                grouped.a = swapped ? pair.b.index : pair.a.index;
+                grouped.b = swapped ? pair.a.index : pair.b.index;
+                grouped.pair = i;
+                grouped.swapped = swapped;
+            }
+
+            for (unsigned c = 0; c < num_combinations; ++c)
+            {
+                if (offsets[c] != offsets[c + 1])
+                {
+                    collide_group(c / num_shape_types, c % num_shape_types, shapes, offsets[c], offsets[c + 1], contacts);
+                }
+            }
+
+            std::sort(contacts.begin(), contacts.end(), [](const Pair_contact& a, const Pair_contact& b) {
+                return a.pair < b.pair;
+            });
+        }
+
+    private:
+        static const unsigned num_combinations = num_shape_types * num_shape_types;
+
+        static unsigned combination(const Pair& pair)
+        {
+            const unsigned a = static_cast<unsigned>(pair.a.type);
+            const unsigned b = static_cast<unsigned>(pair.b.type);
+            return std::min(a, b) * num_shape_types + std::max(a, b);
+        }
+
+        template <typename A, typename B>
+        void collide_pairs(const Shape_set& shapes,
+                           std::uint32_t begin,
+                           std::uint32_t end,
+                           std::vector<Pair_contact>& contacts) const
+        {
+            const std::vector<A>& as = shapes.shapes<A>();
+            const std::vector<B>& bs = shapes.shapes<B>();
+
+            for (std::uint32_t i = begin; i < end; ++i)
+            {
+                const Grouped_pair& grouped = grouped_[i];
+
+                Pair_contact result;
+                if (detail::collide_impl(as[grouped.a], bs[grouped.b], result.contact))
+                {
+                    // Pairs given the other way around have their normal turned.
+                    if (grouped.swapped)
+                    {
+                        result.contact.normal = -result.contact.normal;
+                    }
+                    result.pair = grouped.pair;
+                    contacts.push_back(result);
+                }
+            }
+        }
+
+        template <typename A>
+        void collide_group_with(unsigned type_b,
+                                const Shape_set& shapes,
+                                std::uint32_t begin,
+                                std::uint32_t end,
+                                std::vector<Pair_contact>& contacts) const
+        {
+            switch (type_b)
+            {
+            case 0:
+                collide_ordered<A, Circle<>>(shapes, begin, end, contacts);
+                break;
+            case 1:
+                collide_ordered<A, Capsule>(shapes, begin, end, contacts);
+                break;
+            case 2:
+                collide_ordered<A, Rectangle<>>(shapes, begin, end, contacts);
+                break;
+            case 3:
+                collide_ordered<A, Oriented_box>(shapes, begin, end, contacts);
+                break;
+            case 4:
+                collide_ordered<A, Convex_polygon>(shapes, begin, end, contacts);
+                break;
+            }
+        }
+
+        // Only the combinations with A first in collide_impl order are grouped, the others
+        // are never called.
+        template <typename A, typename B>
+        typename std::enable_if<detail::Shape_order<A>::value <= detail::Shape_order<B>::value>::type
+        collide_ordered(const Shape_set& shapes,
+                        std::uint32_t begin,
+                        std::uint32_t end,
+                        std::vector<Pair_contact>& contacts) const
+        {
+            collide_pairs<A, B>(shapes, begin, end, contacts);
+        }
+
+        template <typename A, typename B>
+        typename std::enable_if<(detail::Shape_order<A>::value > detail::Shape_order<B>::value)>::type
+        collide_ordered(const Shape_set&,
+                        std::uint32_t,
+                        std::uint32_t,
+                        std::vector<Pair_contact>&) const
+        {
+            assert(false);
+        }
+
+        void collide_group(unsigned type_a,
+                           unsigned type_b,
+                           const Shape_set& shapes,
+                           std::uint32_t begin,
+                           std::uint32_t end,
+                           std::vector<Pair_contact>& contacts) const
+        {
+            switch (type_a)
+            {
+            case 0:
+                collide_group_with<Circle<>>(type_b, shapes, begin, end, contacts);
+                break;
+            case 1:
+                collide_group_with<Capsule>(type_b, shapes, begin, end, contacts);
+                break;
+            case 2:
+                collide_group_with<Rectangle<>>(type_b, shapes, begin, end, contacts);
+                break;
+            case 3:
+                collide_group_with<Oriented_box>(type_b, shapes, begin, end, contacts);
+                break;
+            case 4:
+                collide_group_with<Convex_polygon>(type_b, shapes, begin, end, contacts);
+                break;
+            }
+        }
+
+    private:
+        struct Grouped_pair {
+            std::uint32_t a;
+            std::uint32_t b;
+            std::uint32_t pair;
+            bool swapped;
+        };
+
+        std::vector<Grouped_pair> grouped_;
+    };
+
+} // namespace spatial
+} // namespace kvant
@@ -0,0 +1,92 @@
+#pragma once
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+namespace kvant {
+namespace spatial {
+
+    // Remembers the overlapping pairs of the last frame, to tell which contacts began, which
+    // stayed and which ended. Pair is any struct with two handles a and b, such as
+    // Quad_tree::Pair, where the handles can be ordered.
+    template <typename Pair>
+    class Pair_cache {
+    public:
+        // Takes the pairs of this frame, in any order and with a and b in any order. Calls
+        // on_begin(pair), on_stay(pair) and on_end(pair) in pair order.
+        template <typename Begin, typename Stay, typename End>
+        void update(std::vector<Pair>& pairs,
+                    Begin&& on_begin,
+                    Stay&& on_stay,
+                    End&& on_end)
+        {
+            for (Pair& pair : pairs)
+            {
+                if (pair.b < pair.a)
+                {
+                    std::swap(pair.a, pair.b);
+                }
+            }
+
+            std::sort(pairs.begin(), pairs.end(), &less);
+            pairs.erase(std::unique(pairs.begin(), pairs.end(), &equal), pairs.end());
+
+            // Both are sorted, so one merge pass finds the differences.
+            auto prev = pairs_.begin();
+            auto curr = pairs.begin();
+
+            while (prev != pairs_.end() || curr != pairs.end())
+            {
+                if (curr == pairs.end() || (prev != pairs_.end() && less(*prev, *curr)))
+                {
+                    on_end(*prev++);
+                }
+                else if (prev == pairs_.end() || less(*curr, *prev))
+                {
+                    on_begin(*curr++);
+                }
+                else
+                {
+                    on_stay(*curr++);
+                    ++prev;
+                }
+            }
+
+            pairs_.assign(pairs.begin(), pairs.end());
+        }
+
+        // Ends all contacts.
+        template <typename End>
+        void clear(End&& on_end)
+        {
+            for (const Pair& pair : pairs_)
+            {
+                on_end(pair);
+            }
+
+            pairs_.clear();
+        }
+
+        // The pairs of the last update, sorted.
+        const std::vector<Pair>& pairs() const
+        {
+            return pairs_;
+        }
+
+    private:
+        static bool less(const Pair& x, const Pair& y)
+        {
+            return x.a < y.a || (!(y.a < x.a) && x.b < y.b);
+        }
+
+        static bool equal(const Pair& x, const Pair& y)
+        {
+            return !less(x, y) && !less(y, x);
+        }
+
+    private:
+        std::vector<Pair> pairs_;
+    };
+
+} // namespace spatial
+} // namespace kvant
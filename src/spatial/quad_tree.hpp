@@ -1,238 +1,1749 @@
 #pragma once
-#include "../base/static_pow.hpp"
+#include "../base/radix_sort.hpp"
+#include "../base/worker_pool.hpp"
+#include "block_storage.hpp"
 #include "shapes.hpp"
+#include "simd.hpp"
+#include "stats.hpp"
+#include "morton.hpp"
+#include "visitor.hpp"
+#include <glm/gtc/type_precision.hpp>
+#include <algorithm>
 #include <array>
 #include <vector>
 #include <cassert>
+#include <cmath>
+#include <limits>
+#include <type_traits>
+#include <utility>
 
 namespace kvant {
 namespace spatial {
 
+    namespace detail {
+
+        // Bounds of four sibling nodes in SoA layout, so that a query shape can be tested
+        // against all of them at once.
+        template <typename Coordinate>
+        struct Bounds4 {
+            Coordinate min_x[4];
+            Coordinate min_y[4];
+            Coordinate max_x[4];
+            Coordinate max_y[4];
+        };
+
+        // Bit i is set if the shape overlaps bounds i.
+        template <typename Point>
+        inline unsigned overlap_mask(const Bounds4<decltype(Point::x)>& b,
+                                     const Rectangle<Point>& rect)
+        {
+            unsigned mask = 0;
+            for (unsigned i = 0; i < 4; ++i)
+            {
+                const bool overlap = rect.min.x <= b.max_x[i] && b.min_x[i] <= rect.max.x &&
+                                     rect.min.y <= b.max_y[i] && b.min_y[i] <= rect.max.y;
+                mask |= static_cast<unsigned>(overlap) << i;
+            }
+            return mask;
+        }
+
+        template <typename Point>
+        inline unsigned overlap_mask(const Bounds4<decltype(Point::x)>& b,
+                                     const Circle<Point>& circle)
+        {
+            using Traits = Point_traits<Point>;
+
+            unsigned mask = 0;
+            for (unsigned i = 0; i < 4; ++i)
+            {
+                const auto dx = Traits::difference(limit(circle.center.x, b.min_x[i], b.max_x[i]), circle.center.x);
+                const auto dy = Traits::difference(limit(circle.center.y, b.min_y[i], b.max_y[i]), circle.center.y);
+                const bool overlap = Traits::squared_length(dx, dy) <= Traits::square(circle.radius);
+                mask |= static_cast<unsigned>(overlap) << i;
+            }
+            return mask;
+        }
+
+#ifdef KVANT_SPATIAL_SSE2
+        inline unsigned overlap_mask(const Bounds4<float>& b,
+                                     const Rectangle<glm::vec2>& rect)
+        {
+            const __m128 x = _mm_and_ps(_mm_cmple_ps(_mm_set1_ps(rect.min.x), _mm_loadu_ps(b.max_x)),
+                                        _mm_cmple_ps(_mm_loadu_ps(b.min_x), _mm_set1_ps(rect.max.x)));
+            const __m128 y = _mm_and_ps(_mm_cmple_ps(_mm_set1_ps(rect.min.y), _mm_loadu_ps(b.max_y)),
+                                        _mm_cmple_ps(_mm_loadu_ps(b.min_y), _mm_set1_ps(rect.max.y)));
+            return static_cast<unsigned>(_mm_movemask_ps(_mm_and_ps(x, y)));
+        }
+
+        inline unsigned overlap_mask(const Bounds4<float>& b,
+                                     const Circle<glm::vec2>& circle)
+        {
+            const __m128 cx = _mm_set1_ps(circle.center.x);
+            const __m128 cy = _mm_set1_ps(circle.center.y);
+            const __m128 dx = _mm_sub_ps(_mm_min_ps(_mm_max_ps(cx, _mm_loadu_ps(b.min_x)), _mm_loadu_ps(b.max_x)), cx);
+            const __m128 dy = _mm_sub_ps(_mm_min_ps(_mm_max_ps(cy, _mm_loadu_ps(b.min_y)), _mm_loadu_ps(b.max_y)), cy);
+            const __m128 dist_sq = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+            const __m128 inside = _mm_cmple_ps(dist_sq, _mm_set1_ps(circle.radius * circle.radius));
+            return static_cast<unsigned>(_mm_movemask_ps(inside));
+        }
+
+        // Sixteen bit bounds are half the size, so x and y of all four are compared at once:
+        // min_x and min_y are eight adjacent lanes, and so are max_x and max_y.
+        inline unsigned overlap_mask(const Bounds4<std::int16_t>& b,
+                                     const Rectangle<glm::i16vec2>& rect)
+        {
+            const __m128i mins = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b.min_x));
+            const __m128i maxs = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b.max_x));
+            const __m128i rect_min = _mm_setr_epi16(rect.min.x, rect.min.x, rect.min.x, rect.min.x,
+                                                    rect.min.y, rect.min.y, rect.min.y, rect.min.y);
+            const __m128i rect_max = _mm_setr_epi16(rect.max.x, rect.max.x, rect.max.x, rect.max.x,
+                                                    rect.max.y, rect.max.y, rect.max.y, rect.max.y);
+
+            // Apart on an axis if either minimum is past the other maximum. Packed to a byte
+            // per lane, with x in the low four bits and y in the high four.
+            const __m128i apart = _mm_or_si128(_mm_cmpgt_epi16(mins, rect_max), _mm_cmpgt_epi16(rect_min, maxs));
+            const unsigned overlap = ~static_cast<unsigned>(_mm_movemask_epi8(_mm_packs_epi16(apart, apart)));
+            return overlap & (overlap >> 4) & 0xfu;
+        }
+#endif
+
+    } // namespace detail
+
     template <typename Item>
-    class Block_storage {
-    public :
-        Block_storage()
+    class Quad_tree_snapshot;
+
+    // Item must provide bounding_shape(), returning a Circle or a Rectangle. The shape is
+    // captured on insert, and changed with update(); the queries use the captured shape,
+    // not the item, so an item moves only through update(). The tree uses the coordinates of
+    // the shape, floating point or 16 or 32 bit integers. Integer coordinates compare
+    // exactly, and 16 bit ones test all four children of a node in one instruction.
+    //
+    // Nodes split when they get more than split_threshold items, down to max_depth, and
+    // merge back once their subtree has half of that or less. A threshold of zero splits
+    // every node with items, like a fixed grid. The nodes are kept in a pool, four
+    // siblings at a time.
+    //
+    // With a looseness above 1 the tree is a loose quad tree: the bounds of every node
+    // are grown by that factor and items are placed by size and center, so that items
+    // crossing a split line don't get stuck high up in the tree.
+    //
+    // Counters are the query counters of stats.hpp, counting or not as KVANT_SPATIAL_STATS
+    // is defined.
+    template <typename Item, template <typename> class Storage = Block_storage, typename Counters = Query_counters>
+    class Quad_tree {
+    public:
+        using Bounding_shape = typename std::decay<decltype(std::declval<const Item&>().bounding_shape())>::type;
+        using Point = typename Shape_point<Bounding_shape>::type;
+
+    private:
+        using Coordinate = decltype(Point::x);
+        using Traits = Point_traits<Point>;
+        using Rectangle = spatial::Rectangle<Point>;
+        using Bounds4 = detail::Bounds4<Coordinate>;
+        using Query_count = typename Counters::Count;
+
+    public:
+        // Bounds the traversal stacks.
+        static const unsigned max_depth_limit = 16;
+
+        Quad_tree(const Rectangle& root_rect,
+                  float looseness = 1.0f,
+                  unsigned max_depth = 8,
+                  unsigned split_threshold = 8)
+            : looseness_(looseness)
+            , max_depth_(max_depth)
+            , split_threshold_(split_threshold)
+        {
+            assert(looseness >= 1.0f);
+            assert(max_depth <= max_depth_limit);
+
+            nodes_.resize(1);
+            nodes_[0].rect = root_rect;
+        }
+
+    private:
+        template <typename>
+        friend class Quad_tree_snapshot;
+
+        struct Entry {
+            Item item;
+            Bounding_shape shape;
+            Rectangle bounds;
+            unsigned node;
+        };
+
+    public:
+        // Stays valid until the item is removed.
+        using Handle = typename Storage<Entry>::Handle;
+
+        //
+        //
+        //
+        Handle insert(const Item& item)
+        {
+            const Bounding_shape shape(item.bounding_shape());
+            const Rectangle bounds(bounding_rect(shape));
+            const unsigned node_index = find_node(bounds, 0);
+            const Handle handle = items_.add(acquire_block(node_index), Entry{item, shape, bounds, node_index});
+            split_if_full(node_index);
+            return handle;
+        }
+
+        void remove(Handle handle)
+        {
+            const unsigned node_index = items_.get(handle).node;
+            items_.remove(handle);
+            release_block(node_index);
+            merge_if_sparse(node_index);
+        }
+
+        bool is_valid(Handle handle) const
+        {
+            return items_.is_valid(handle);
+        }
+
+        // Moves an item to a new bounding shape. The item is only relocated if it no longer
+        // fits its node, or fits a child of it; the search then starts from the nearest
+        // ancestor that holds it instead of from the root.
+        void update(Handle handle, const Bounding_shape& new_shape)
+        {
+            Entry& entry = items_.get(handle);
+            entry.shape = new_shape;
+            entry.bounds = bounding_rect(new_shape);
+
+            const unsigned prev_node_index = entry.node;
+            unsigned node_index = prev_node_index;
+            if (!is_loose())
+            {
+                while (node_index != 0 && !nodes_[node_index].contains(entry.bounds))
+                {
+                    node_index = get_parent_index(node_index);
+                }
+            }
+
+            node_index = find_node(entry.bounds, node_index);
+            if (node_index != prev_node_index)
+            {
+                entry.node = node_index;
+                items_.move(handle, acquire_block(node_index));
+                release_block(prev_node_index);
+
+                split_if_full(node_index);
+                merge_if_sparse(prev_node_index);
+            }
+        }
+
+        const Item& get(Handle handle) const
+        {
+            return items_.get(handle).item;
+        }
+
+        Item& get(Handle handle)
+        {
+            return items_.get(handle).item;
+        }
+
+        // Removes all items, but keeps the allocated storage. Meant for rebuilding the
+        // tree every frame.
+        void clear()
+        {
+            const Rectangle root_rect(nodes_[0].rect);
+            nodes_.resize(1);
+            nodes_[0] = Node();
+            nodes_[0].rect = root_rect;
+
+            child_bounds_.clear();
+            free_children_.clear();
+            items_.clear();
+        }
+
+        // Replaces the items of the tree with the given ones, building it top down instead
+        // of splitting nodes as they fill up. The items are sorted into the quadrants of the
+        // root in one parallel pass, then the subtree of each quadrant is partitioned on a
+        // worker of its own, and items crossing a split line stay in the parent. The result
+        // is the tree inserting the items one by one gives.
+        //
+        // If handles is given, it must have room for count, and gets the handle of each item.
+        void build(const Item* items, size_t count, Handle* handles = nullptr)
+        {
+            clear();
+
+            build_items_.resize(count);
+            build_classes_.resize(count);
+            build_buffers_[0].resize(count);
+            build_buffers_[1].resize(count);
+
+            const bool split_root = count > split_threshold_ && max_depth_ > 0;
+            if (split_root)
+            {
+                alloc_children(0);
+            }
+
+            const Rectangle& root = nodes_[0].rect;
+            const std::array<Rectangle, 4> sub_rects(root.split());
+
+            // Counting sort into the items of the root followed by the four quadrants.
+            const unsigned chunks = base::num_chunks(count, 4 * 1024);
+            build_counts_.assign(chunks, Build_counts());
+
+            base::parallel_for_chunks(count, chunks, [&](unsigned chunk, size_t begin, size_t end) {
+                Build_counts& counts = build_counts_[chunk];
+                for (size_t i = begin; i < end; ++i)
+                {
+                    Build_item& item = build_items_[i];
+                    item.bounds = bounding_rect(items[i].bounding_shape());
+                    item.index = static_cast<std::uint32_t>(i);
+                    item.fit_depth = fit_depth(item.bounds);
+                    build_classes_[i] = static_cast<std::uint8_t>(split_root ? classify(root, sub_rects, 0, item) : 0);
+                    ++counts[build_classes_[i]];
+                }
+            });
+
+            std::uint32_t offset = 0;
+            for (unsigned c = 0; c < 5; ++c)
+            {
+                for (Build_counts& counts : build_counts_)
+                {
+                    const std::uint32_t n = counts[c];
+                    counts[c] = offset;
+                    offset += n;
+                }
+            }
+
+            base::parallel_for_chunks(count, chunks, [&](unsigned chunk, size_t begin, size_t end) {
+                Build_counts& cursors = build_counts_[chunk];
+                for (size_t i = begin; i < end; ++i)
+                {
+                    build_buffers_[0][cursors[build_classes_[i]]++] = build_items_[i];
+                }
+            });
+
+            // The cursors of the last chunk end where each class ends.
+            const Build_counts& ends = build_counts_.back();
+            const std::uint32_t own_end = ends[0];
+
+            if (split_root)
+            {
+                // Each quadrant partitions its own range of the buffers, into nodes of its own.
+                const unsigned child_index = get_child_index(0);
+                auto job = [&](unsigned quadrant) {
+                    Build_subtree& subtree = build_subtrees_[quadrant];
+                    subtree.nodes.clear();
+
+                    Build_node node;
+                    node.rect = nodes_[child_index + quadrant].rect;
+                    node.depth = 1;
+                    node.begin = ends[quadrant];
+                    node.end = ends[quadrant + 1];
+                    subtree.nodes.push_back(node);
+
+                    partition(subtree, 0);
+                };
+                base::Worker_pool::instance().run(4, job);
+            }
+
+            // Linking the subtrees into the tree, and storing the items, is left to one thread.
+            graft_items(0, build_buffers_[0], 0, own_end, items, handles);
+            nodes_[0].subtree_count = static_cast<unsigned>(count);
+
+            if (split_root)
+            {
+                const unsigned child_index = get_child_index(0);
+                for (unsigned i = 0; i < 4; ++i)
+                {
+                    graft(child_index + i, build_subtrees_[i], 0, items, handles);
+                }
+            }
+        }
+
+        void build(const std::vector<Item>& items, std::vector<Handle>* handles = nullptr)
         {
-            assert(blocks_[0].capacity() == 0);
+            if (handles != nullptr)
+            {
+                handles->resize(items.size());
+            }
+            build(items.data(), items.size(), handles != nullptr ? handles->data() : nullptr);
         }
 
-    public :
-        unsigned alloc_block()
-        {
-            for (unsigned i = 0; i < num_blocks; ++i)
+    private:
+        // Item counts of the root and each quadrant.
+        using Build_counts = std::array<std::uint32_t, 5>;
+
+        // The bounds travel with the items while they are partitioned, so that each pass
+        // reads them in order. Each level of the tree moves the items to the other buffer.
+        struct Build_item {
+            Rectangle bounds;
+            std::uint32_t index;
+            std::uint8_t fit_depth;
+        };
+
+        // A node of a subtree being built. Its items are build_buffers_[buffer][begin, end),
+        // the ones kept in the node itself first.
+        struct Build_node {
+            Rectangle rect;
+            unsigned depth;
+            unsigned children{invalid_index}; // The first of four in the subtree.
+            unsigned buffer{0};
+            std::uint32_t begin;
+            std::uint32_t own_end;
+            std::uint32_t end;
+        };
+
+        struct Build_subtree {
+            std::vector<Build_node> nodes;
+            std::vector<std::uint8_t> classes;
+        };
+
+        // The depth the loose tree keeps the item at, or zero if its center is outside the
+        // root. Only used by loose trees.
+        std::uint8_t fit_depth(const Rectangle& bounds) const
+        {
+            if (!is_loose())
+            {
+                return 0;
+            }
+
+            const Rectangle& root = nodes_[0].rect;
+            const Point center(bounds.center());
+            if (!root.contains(Rectangle(center, center)))
+            {
+                return 0;
+            }
+
+            return static_cast<std::uint8_t>(std::min(loose_fit_depth(static_cast<float>(root.width()), static_cast<float>(bounds.width())),
+                                                      loose_fit_depth(static_cast<float>(root.height()), static_cast<float>(bounds.height()))));
+        }
+
+        // Zero if the item stays in the node, or one plus the quadrant it goes down into.
+        // The same choice as find_node() makes in a node with children.
+        unsigned classify(const Rectangle& rect,
+                          const std::array<Rectangle, 4>& sub_rects,
+                          unsigned depth,
+                          const Build_item& item) const
+        {
+            const unsigned quadrant = get_quadrant(rect, item.bounds.center());
+
+            if (is_loose())
+            {
+                return depth < item.fit_depth ? quadrant + 1 : 0;
+            }
+
+            return sub_rects[quadrant].contains(item.bounds) ? quadrant + 1 : 0;
+        }
+
+        // Splits the node like split_if_full() would, and its children after it.
+        void partition(Build_subtree& subtree, unsigned node_index)
+        {
+            const Build_node node = subtree.nodes[node_index];
+            const std::uint32_t count = node.end - node.begin;
+
+            if (count <= split_threshold_ || node.depth >= max_depth_)
+            {
+                subtree.nodes[node_index].own_end = node.end;
+                return;
+            }
+
+            const std::array<Rectangle, 4> sub_rects(node.rect.split());
+            const Build_item* source = build_buffers_[node.buffer].data() + node.begin;
+            Build_item* target = build_buffers_[node.buffer ^ 1].data() + node.begin;
+
+            Build_counts cursors;
+            cursors.fill(0);
+            subtree.classes.resize(count);
+            for (std::uint32_t i = 0; i < count; ++i)
+            {
+                const unsigned c = classify(node.rect, sub_rects, node.depth, source[i]);
+                subtree.classes[i] = static_cast<std::uint8_t>(c);
+                ++cursors[c];
+            }
+
+            std::uint32_t offset = 0;
+            for (std::uint32_t& cursor : cursors)
+            {
+                const std::uint32_t n = cursor;
+                cursor = offset;
+                offset += n;
+            }
+
+            for (std::uint32_t i = 0; i < count; ++i)
+            {
+                target[cursors[subtree.classes[i]]++] = source[i];
+            }
+
+            const unsigned children = static_cast<unsigned>(subtree.nodes.size());
+            subtree.nodes[node_index].children = children;
+            subtree.nodes[node_index].buffer = node.buffer ^ 1;
+            subtree.nodes[node_index].own_end = node.begin + cursors[0];
+
+            for (unsigned i = 0; i < 4; ++i)
+            {
+                Build_node child;
+                child.rect = sub_rects[i];
+                child.depth = node.depth + 1;
+                child.buffer = node.buffer ^ 1;
+                child.begin = node.begin + cursors[i];
+                child.end = node.begin + cursors[i + 1];
+                subtree.nodes.push_back(child);
+            }
+
+            for (unsigned i = 0; i < 4; ++i)
+            {
+                partition(subtree, children + i);
+            }
+        }
+
+        // Gives the node the children and items of the built one.
+        void graft(unsigned node_index, const Build_subtree& subtree, unsigned built_index, const Item* items, Handle* handles)
+        {
+            const Build_node& built = subtree.nodes[built_index];
+            graft_items(node_index, build_buffers_[built.buffer], built.begin, built.own_end, items, handles);
+            nodes_[node_index].subtree_count = built.end - built.begin;
+
+            if (built.children != invalid_index)
+            {
+                alloc_children(node_index);
+
+                const unsigned child_index = get_child_index(node_index);
+                for (unsigned i = 0; i < 4; ++i)
+                {
+                    graft(child_index + i, subtree, built.children + i, items, handles);
+                }
+            }
+        }
+
+        void graft_items(unsigned node_index,
+                         const std::vector<Build_item>& buffer,
+                         std::uint32_t begin,
+                         std::uint32_t end,
+                         const Item* items,
+                         Handle* handles)
+        {
+            if (begin == end)
+            {
+                return;
+            }
+
+            Node& node = nodes_[node_index];
+            node.storage_id = items_.alloc_block();
+            node.item_count = end - begin;
+            items_.reserve(node.storage_id, node.item_count);
+
+            for (std::uint32_t i = begin; i < end; ++i)
+            {
+                const Build_item& item = buffer[i];
+                const Handle handle = items_.add(node.storage_id, Entry{items[item.index], items[item.index].bounding_shape(), item.bounds, node_index});
+                if (handles != nullptr)
+                {
+                    handles[item.index] = handle;
+                }
+            }
+        }
+
+    public:
+        bool is_loose() const
+        {
+            return looseness_ > 1.0f;
+        }
+
+        // Nodes in the tree, not counting the ones in the pool.
+        size_t num_nodes() const
+        {
+            return nodes_.size() - 4 * free_children_.size();
+        }
+
+        // Bytes allocated by the tree, including unused capacity and the buffers kept for
+        // pairs and batch queries.
+        size_t memory_usage() const
+        {
+            size_t bytes = nodes_.capacity() * sizeof(Node) +
+                           child_bounds_.capacity() * sizeof(Bounds4) +
+                           free_children_.capacity() * sizeof(unsigned) +
+                           items_.memory_usage();
+
+            bytes += pair_buffers_.capacity() * sizeof(std::vector<Pair>) +
+                     (pair_top_nodes_.capacity() + pair_subtrees_.capacity()) * sizeof(unsigned);
+            for (const auto& buffer : pair_buffers_)
+            {
+                bytes += buffer.capacity() * sizeof(Pair);
+            }
+
+            bytes += (batch_order_.capacity() + batch_scratch_.capacity()) * sizeof(base::Sort_pair) +
+                     batch_chunks_.capacity() * sizeof(Batch_chunk) +
+                     batch_cursors_.capacity() * sizeof(unsigned);
+            for (const Batch_chunk& chunk : batch_chunks_)
+            {
+                bytes += chunk.hits.capacity() * sizeof(Batch_hit) + chunk.active.capacity() * sizeof(Active_query);
+            }
+
+            return bytes;
+        }
+
+        // The shape of the tree, and with KVANT_SPATIAL_STATS the counts of the queries since
+        // the last reset_query_stats().
+        Quad_tree_stats stats() const
+        {
+            Quad_tree_stats stats;
+            stats.items_per_node.assign(std::max(2 * split_threshold_, 8u) + 1, 0);
+
+            std::vector<unsigned> stack(1, 0);
+            while (!stack.empty())
+            {
+                const unsigned node_index = stack.back();
+                stack.pop_back();
+                const Node& node = nodes_[node_index];
+
+                if (stats.nodes_per_depth.size() <= node.depth)
+                {
+                    stats.nodes_per_depth.resize(node.depth + 1, 0);
+                    stats.items_per_depth.resize(node.depth + 1, 0);
+                }
+
+                stats.num_nodes += 1;
+                stats.num_items += node.item_count;
+                stats.nodes_per_depth[node.depth] += 1;
+                stats.items_per_depth[node.depth] += node.item_count;
+                stats.items_per_node[std::min<size_t>(node.item_count, stats.items_per_node.size() - 1)] += 1;
+
+                if (is_leaf(node_index))
+                {
+                    stats.num_leaves += 1;
+                    continue;
+                }
+
+                stats.items_in_inner_nodes += node.item_count;
+                for (unsigned i = 0; i < 4; ++i)
+                {
+                    stack.push_back(get_child_index(node_index) + i);
+                }
+            }
+
+            stats.queries = query_counters_.queries;
+            stats.nodes_visited = query_counters_.nodes_visited;
+            stats.shape_tests = query_counters_.shape_tests;
+            stats.storage = items_.stats();
+            return stats;
+        }
+
+        void reset_query_stats()
+        {
+            query_counters_.reset();
+        }
+
+        // Depth of the deepest node with items.
+        unsigned depth() const
+        {
+            unsigned depth = 0;
+            for (const Node& node : nodes_)
+            {
+                if (node.item_count > 0)
+                {
+                    depth = std::max(depth, node.depth);
+                }
+            }
+            return depth;
+        }
+
+    public:
+        // Keeps the items for which fun returns true.
+        template <typename Fun>
+        void integrate_items(Fun& fun)
+        {
+            for (unsigned node_index = 0; node_index < nodes_.size(); ++node_index)
+            {
+                Node& node = nodes_[node_index];
+
+                for (unsigned i = 0; i < node.item_count;)
+                {
+                    if (fun(items_.block_begin(node.storage_id)[i].item))
+                    {
+                        ++i;
+                        continue;
+                    }
+
+                    // The last item is moved into the hole.
+                    items_.remove(items_.handle_at(node.storage_id, i));
+                    node.item_count -= 1;
+                }
+
+                if (node.item_count == 0 && node.storage_id != Storage<Entry>::invalid_block)
+                {
+                    items_.free_block(node.storage_id);
+                    node.storage_id = Storage<Entry>::invalid_block;
+                }
+            }
+
+            update_subtree_counts(0);
+        }
+
+    public:
+        // Calls fun for every item whose bounds intersect the shape (Circle or Rectangle).
+        // Returns false if the visitor stopped the traversal.
+        template <typename Shape, typename Fun>
+        bool for_each_intersecting(const Shape& shape, Fun&& fun) const
+        {
+            return for_each_intersecting_entry(shape, [&fun](unsigned, const Entry* entry) {
+                return detail::visit(fun, entry->item);
+            });
+        }
+
+    public:
+        struct Neighbour {
+            Handle handle;
+            typename Traits::Squared distance_squared;
+        };
+
+        // Finds the k items nearest to the point, no further away than max_distance, and
+        // writes them closest first to result, which must have room for k. Returns the
+        // number found. The distance is to the bounding shape of the item.
+        //
+        // Nodes are visited in order of their distance to the point, and the search stops
+        // once the nearest remaining node is further away than the k:th item found so far.
+        size_t knn(const Point& point,
+                   size_t k,
+                   Neighbour* result,
+                   Coordinate max_distance = std::numeric_limits<Coordinate>::max()) const
+        {
+            using Squared = typename Traits::Squared;
+
+            if (k == 0)
+            {
+                return 0;
+            }
+
+            const Squared max_distance_sq = Traits::square(max_distance);
+
+            // Result is kept as a max heap until the end.
+            auto further = [](const Neighbour& a, const Neighbour& b) {
+                return a.distance_squared < b.distance_squared;
+            };
+            size_t found = 0;
+
+            // Anything further away than this can be skipped.
+            auto bound = [&]() {
+                return found == k ? result[0].distance_squared : max_distance_sq;
+            };
+
+            // Min heap of nodes to visit. Kept per thread, so that it only allocates while
+            // growing to the size of the tree.
+            struct Queued_node {
+                Squared distance_squared;
+                unsigned index;
+
+                bool operator<(const Queued_node& other) const
+                {
+                    return other.distance_squared < distance_squared;
+                }
+            };
+            static thread_local std::vector<Queued_node> queue;
+            queue.clear();
+
+            // The root is always visited since it also holds items outside of its bounds.
+            queue.push_back({Squared(0), 0});
+
+            Query_count count(query_counters_);
+
+            while (!queue.empty())
+            {
+                std::pop_heap(queue.begin(), queue.end());
+                const Queued_node next = queue.back();
+                queue.pop_back();
+
+                if (bound() < next.distance_squared)
+                {
+                    break;
+                }
+
+                const Node& node = nodes_[next.index];
+                count.visit();
+
+                if (node.item_count > 0)
+                {
+                    const Entry* end = items_.block_end(node.storage_id);
+                    for (const Entry* it = items_.block_begin(node.storage_id); it != end; ++it)
+                    {
+                        // The bounds are cheaper to test and never further away than the shape.
+                        count.test();
+                        if (bound() < distance_squared(point, it->bounds))
+                        {
+                            continue;
+                        }
+
+                        const Squared d = distance_squared(point, it->shape);
+                        if (found < k)
+                        {
+                            if (d <= max_distance_sq)
+                            {
+                                result[found++] = {handle_of(node.storage_id, it), d};
+                                std::push_heap(result, result + found, further);
+                            }
+                        }
+                        else if (d < result[0].distance_squared)
+                        {
+                            std::pop_heap(result, result + found, further);
+                            result[found - 1] = {handle_of(node.storage_id, it), d};
+                            std::push_heap(result, result + found, further);
+                        }
+                    }
+                }
+
+                if (!is_leaf(next.index))
+                {
+                    const unsigned child_index = get_child_index(next.index);
+                    for (unsigned i = 0; i < 4; ++i)
+                    {
+                        if (nodes_[child_index + i].subtree_count == 0)
+                        {
+                            continue;
+                        }
+
+                        count.test();
+                        const Squared d = distance_squared(point, get_query_bounds(child_index + i));
+                        if (d <= bound())
+                        {
+                            queue.push_back({d, child_index + i});
+                            std::push_heap(queue.begin(), queue.end());
+                        }
+                    }
+                }
+            }
+
+            std::sort_heap(result, result + found, further);
+            return found;
+        }
+
+        // Finds the item nearest to the point, no further away than max_distance. Returns
+        // false if there is none.
+        bool nearest(const Point& point,
+                     Coordinate max_distance,
+                     Neighbour& result) const
+        {
+            return knn(point, 1, &result, max_distance) == 1;
+        }
+
+    public:
+        using Ray = spatial::Ray<Point>;
+
+        struct Ray_hit {
+            Handle handle;
+            Coordinate t;
+        };
+
+        // Finds the first item whose bounding shape the ray enters within [0, max_t]. Nodes
+        // are walked front to back, and nodes entered beyond the nearest hit so far are
+        // skipped.
+        bool raycast(const Ray& ray,
+                     Coordinate max_t,
+                     Ray_hit& hit) const
+        {
+            static_assert(std::is_floating_point<Coordinate>::value, "Raycasts need floating point coordinates.");
+
+            struct Queued_node {
+                unsigned index;
+                Coordinate t;
+            };
+
+            std::array<Queued_node, 3 * max_depth_limit + 1> stack;
+            unsigned stack_size = 0;
+
+            // The root is always visited since it also holds items outside of its bounds.
+            stack[stack_size++] = {0, Coordinate(0)};
+
+            hit.handle = invalid_handle();
+            hit.t = max_t;
+            bool found = false;
+
+            Query_count count(query_counters_);
+
+            while (stack_size > 0)
+            {
+                const Queued_node next = stack[--stack_size];
+                if (hit.t < next.t)
+                {
+                    continue;
+                }
+
+                const Node& node = nodes_[next.index];
+                count.visit();
+
+                if (node.item_count > 0)
+                {
+                    const Entry* end = items_.block_end(node.storage_id);
+                    for (const Entry* it = items_.block_begin(node.storage_id); it != end; ++it)
+                    {
+                        // The bounds are cheaper to test, and entered no later than the shape.
+                        count.test();
+                        Coordinate t;
+                        if (spatial::raycast(ray, it->bounds, hit.t, t) &&
+                            spatial::raycast(ray, it->shape, hit.t, t) &&
+                            (!found || t < hit.t))
+                        {
+                            hit.handle = handle_of(node.storage_id, it);
+                            hit.t = t;
+                            found = true;
+                        }
+                    }
+                }
+
+                if (is_leaf(next.index))
+                {
+                    continue;
+                }
+
+                std::array<Queued_node, 4> children;
+                unsigned num_children = 0;
+                count.test(4);
+
+                const unsigned child_index = get_child_index(next.index);
+                for (unsigned i = 0; i < 4; ++i)
+                {
+                    Coordinate t;
+                    if (nodes_[child_index + i].subtree_count > 0 &&
+                        spatial::raycast(ray, get_query_bounds(child_index + i), hit.t, t))
+                    {
+                        children[num_children++] = {child_index + i, t};
+                    }
+                }
+
+                // Pushed furthest first, so the nearest child is visited next. At most four, in
+                // an insertion sort.
+                for (unsigned i = 1; i < num_children; ++i)
+                {
+                    const Queued_node child = children[i];
+                    unsigned j = i;
+                    for (; j > 0 && children[j - 1].t < child.t; --j)
+                    {
+                        children[j] = children[j - 1];
+                    }
+                    children[j] = child;
+                }
+
+                for (unsigned i = 0; i < num_children; ++i)
+                {
+                    stack[stack_size++] = children[i];
+                }
+            }
+
+            return found;
+        }
+
+        // Casts every ray in parallel. The handle of a ray that hits nothing is
+        // invalid_handle().
+        void raycast_batch(const std::vector<Ray>& rays,
+                           Coordinate max_t,
+                           std::vector<Ray_hit>& hits) const
+        {
+            hits.resize(rays.size());
+
+            base::parallel_for(rays.size(), 256, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i)
+                {
+                    raycast(rays[i], max_t, hits[i]);
+                }
+            });
+        }
+
+        static Handle invalid_handle()
+        {
+            return Storage<Entry>::invalid_handle();
+        }
+
+    public:
+        // Results of query_batch in CSR form. The items intersecting query i are
+        // items[offsets[i]] to items[offsets[i + 1]].
+        struct Batch_result {
+            std::vector<unsigned> offsets;
+            std::vector<Handle> items;
+        };
+
+        // Runs many queries (Circles or Rectangles) at once. The queries are sorted along a
+        // z-order curve and split into chunks of nearby queries, run in parallel. Each chunk
+        // walks the tree once, carrying down a branch only the queries that overlap it.
+        template <typename Shape>
+        void query_batch(const std::vector<Shape>& shapes, Batch_result& result)
+        {
+            const size_t count = shapes.size();
+            result.offsets.assign(count + 1, 0);
+
+            // Sort on the query centers.
+            const glm::vec2 root_min(nodes_[0].rect.min);
+            const glm::vec2 scale = glm::vec2(65535.0f) / (glm::vec2(nodes_[0].rect.max) - root_min);
+
+            batch_order_.resize(count);
+            base::parallel_for(count, 4 * 1024, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i)
+                {
+                    const Rectangle bounds(bounding_rect(shapes[i]));
+                    const glm::vec2 cell = glm::clamp(((glm::vec2(bounds.min) + glm::vec2(bounds.max)) * 0.5f - root_min) * scale, 0.0f, 65535.0f);
+                    batch_order_[i].key = morton_encode(static_cast<std::uint32_t>(cell.x), static_cast<std::uint32_t>(cell.y));
+                    batch_order_[i].value = static_cast<std::uint32_t>(i);
+                }
+            });
+
+            base::radix_sort(batch_order_, batch_scratch_);
+
+            const unsigned chunks = base::num_chunks(count, batch_chunk_size);
+            batch_chunks_.resize(chunks);
+
+            // Each query belongs to a single chunk, so the counts are written without races.
+            base::parallel_for_chunks(count, chunks, [&](unsigned chunk, size_t begin, size_t end) {
+                Batch_chunk& state = batch_chunks_[chunk];
+                state.hits.clear();
+                state.active.clear();
+
+                for (size_t i = begin; i < end; ++i)
+                {
+                    state.active.push_back({batch_order_[i].value, 0});
+                }
+
+                Query_count count(query_counters_, static_cast<unsigned>(end - begin));
+                batch_visit(0, shapes.data(), 0, static_cast<unsigned>(state.active.size()), state, count);
+
+                for (const Batch_hit& hit : state.hits)
+                {
+                    ++result.offsets[hit.query + 1];
+                }
+            });
+
+            for (size_t i = 0; i < count; ++i)
+            {
+                result.offsets[i + 1] += result.offsets[i];
+            }
+
+            result.items.resize(result.offsets[count]);
+            batch_cursors_.assign(result.offsets.begin(), result.offsets.end() - 1);
+
+            base::parallel_for_chunks(count, chunks, [&](unsigned chunk, size_t, size_t) {
+                for (const Batch_hit& hit : batch_chunks_[chunk].hits)
+                {
+                    result.items[batch_cursors_[hit.query]++] = hit.item;
+                }
+            });
+        }
+
+    private:
+        static const size_t batch_chunk_size = 256;
+
+        struct Batch_hit {
+            std::uint32_t query;
+            Handle item;
+        };
+
+        struct Active_query {
+            std::uint32_t query;
+            unsigned child_mask;
+        };
+
+        struct Batch_chunk {
+            std::vector<Batch_hit> hits;
+
+            // The queries active in each node on the path from the root, one range per node.
+            std::vector<Active_query> active;
+        };
+
+        // The queries active in the node are state.active[begin, end).
+        template <typename Shape>
+        void batch_visit(unsigned node_index,
+                         const Shape* shapes,
+                         unsigned begin,
+                         unsigned end,
+                         Batch_chunk& state,
+                         Query_count& count) const
+        {
+            const Node& node = nodes_[node_index];
+            count.visit(end - begin);
+
+            if (node.item_count > 0)
+            {
+                count.test(node.item_count * (end - begin));
+                const Entry* items_end = items_.block_end(node.storage_id);
+                for (const Entry* it = items_.block_begin(node.storage_id); it != items_end; ++it)
+                {
+                    for (unsigned i = begin; i < end; ++i)
+                    {
+                        const std::uint32_t query = state.active[i].query;
+                        if (intersects(shapes[query], it->bounds))
+                        {
+                            state.hits.push_back({query, handle_of(node.storage_id, it)});
+                        }
+                    }
+                }
+            }
+
+            if (is_leaf(node_index) || node.subtree_count == node.item_count)
+            {
+                return;
+            }
+
+            const unsigned child_index = get_child_index(node_index);
+            const Bounds4& bounds = child_bounds(node_index);
+
+            count.test(4 * (end - begin));
+            for (unsigned i = begin; i < end; ++i)
+            {
+                state.active[i].child_mask = detail::overlap_mask(bounds, shapes[state.active[i].query]);
+            }
+
+            for (unsigned c = 0; c < 4; ++c)
             {
-                if (blocks_[i].capacity() == 0)
+                if (nodes_[child_index + c].subtree_count == 0)
+                {
+                    continue;
+                }
+
+                // The queries of the child are appended, and dropped again after the visit.
+                const unsigned child_begin = static_cast<unsigned>(state.active.size());
+                for (unsigned i = begin; i < end; ++i)
                 {
-                    blocks_[i].reserve(default_block_size); 
-                    return i;
+                    if (state.active[i].child_mask & (1u << c))
+                    {
+                        state.active.push_back({state.active[i].query, 0});
+                    }
+                }
+
+                const unsigned child_end = static_cast<unsigned>(state.active.size());
+                if (child_begin != child_end)
+                {
+                    batch_visit(child_index + c, shapes, child_begin, child_end, state, count);
                 }
+
+                state.active.resize(child_begin);
             }
         }
 
-        void add(unsigned block_index, const Item& item)
+    private:
+        // fun(storage_id, entry) returns false to stop.
+        template <typename Shape, typename Fun>
+        bool for_each_intersecting_entry(const Shape& shape, Fun&& fun) const
         {
-            blocks_[block_index].push_back(item);
+            std::array<unsigned, 3 * max_depth_limit + 1> stack;
+            unsigned stack_size = 0;
+
+            // The root is always visited since it also holds items outside of its bounds.
+            stack[stack_size++] = 0;
+
+            Query_count count(query_counters_);
+
+            while (stack_size > 0)
+            {
+                const unsigned node_index = stack[--stack_size];
+                const Node& node = nodes_[node_index];
+                count.visit();
+
+                if (node.item_count > 0)
+                {
+                    count.test(node.item_count);
+                    const Entry* end = items_.block_end(node.storage_id);
+                    for (const Entry* it = items_.block_begin(node.storage_id); it != end; ++it)
+                    {
+                        if (intersects(shape, it->bounds) && !fun(node.storage_id, it))
+                        {
+                            return false;
+                        }
+                    }
+                }
+
+                if (!is_leaf(node_index))
+                {
+                    const unsigned child_index = get_child_index(node_index);
+                    const unsigned mask = detail::overlap_mask(child_bounds(node_index), shape);
+                    count.test(4);
+
+                    // Pushed in reverse to visit the children in order.
+                    for (unsigned i = 4; i-- > 0;)
+                    {
+                        if ((mask & (1u << i)) && nodes_[child_index + i].subtree_count > 0)
+                        {
+                            stack[stack_size++] = child_index + i;
+                        }
+                    }
+                }
+            }
+
+            return true;
         }
 
-        void remove(unsigned block_index, const Item& item) 
+    public:
+        struct Pair {
+            Handle a;
+            Handle b;
+        };
+
+        // Finds every pair of items with overlapping bounds. In a strict tree the items of a
+        // node can only overlap items in the same node, its ancestors and its descendants, so
+        // every node is paired with itself and its ancestors. The loose bounds of siblings
+        // overlap, so in a loose tree every item queries the tree instead.
+        //
+        // The subtrees at pair_split_depth are processed in parallel, each into a buffer of
+        // its own, and the buffers are then concatenated.
+        void find_overlapping_pairs(std::vector<Pair>& pairs)
         {
-            Block& block = blocks_[block_index];
-            for (size_t i = 0; i < block.size(); ++i)
+            pair_top_nodes_.clear();
+            pair_subtrees_.clear();
+
+            std::array<unsigned, 3 * max_depth_limit + 1> stack;
+            unsigned stack_size = 0;
+            stack[stack_size++] = 0;
+
+            while (stack_size > 0)
             {
-                if (&block[i] == &item)
+                const unsigned node_index = stack[--stack_size];
+                if (nodes_[node_index].depth == pair_split_depth)
+                {
+                    pair_subtrees_.push_back(node_index);
+                    continue;
+                }
+
+                pair_top_nodes_.push_back(node_index);
+                if (!is_leaf(node_index))
+                {
+                    for (unsigned i = 0; i < 4; ++i)
+                    {
+                        stack[stack_size++] = get_child_index(node_index) + i;
+                    }
+                }
+            }
+
+            const unsigned num_jobs = static_cast<unsigned>(pair_subtrees_.size()) + 1;
+            pair_buffers_.resize(num_jobs);
+
+            auto job = [&](unsigned job_index) {
+                std::vector<Pair>& buffer = pair_buffers_[job_index];
+                buffer.clear();
+
+                // The first job takes the nodes above the subtrees.
+                if (job_index == 0)
                 {
-                    block.erase(block.begin() + i);
+                    for (const unsigned node_index : pair_top_nodes_)
+                    {
+                        find_node_pairs(node_index, buffer);
+                    }
                     return;
                 }
+
+                std::array<unsigned, 3 * max_depth_limit + 1> stack;
+                unsigned stack_size = 0;
+                stack[stack_size++] = pair_subtrees_[job_index - 1];
+
+                while (stack_size > 0)
+                {
+                    const unsigned node_index = stack[--stack_size];
+                    if (nodes_[node_index].subtree_count == 0)
+                    {
+                        continue;
+                    }
+
+                    find_node_pairs(node_index, buffer);
+
+                    if (!is_leaf(node_index))
+                    {
+                        for (unsigned i = 0; i < 4; ++i)
+                        {
+                            stack[stack_size++] = get_child_index(node_index) + i;
+                        }
+                    }
+                }
+            };
+
+            base::Worker_pool::instance().run(num_jobs, job);
+
+            std::vector<size_t> offsets(num_jobs + 1, 0);
+            for (unsigned i = 0; i < num_jobs; ++i)
+            {
+                offsets[i + 1] = offsets[i] + pair_buffers_[i].size();
             }
+
+            pairs.resize(offsets[num_jobs]);
+
+            auto copy = [&](unsigned job_index) {
+                std::copy(pair_buffers_[job_index].begin(), pair_buffers_[job_index].end(), pairs.begin() + offsets[job_index]);
+            };
+
+            base::Worker_pool::instance().run(num_jobs, copy);
         }
 
-        template <typename Fun>
-        void remove_if_not(Fun&& fun)
+    private:
+        static const unsigned pair_split_depth = 2;
+
+        void find_node_pairs(unsigned node_index, std::vector<Pair>& pairs) const
         {
-            for (size_t i = 0; i < num_blocks; ++i)
+            const Node& node = nodes_[node_index];
+            if (node.item_count == 0)
+            {
+                return;
+            }
+
+            const Entry* begin = items_.block_begin(node.storage_id);
+            const Entry* end = items_.block_end(node.storage_id);
+
+            if (is_loose())
             {
-                Block& block = blocks_[i];
-                if (block.capacity() == 0)
+                // Each pair is found from both sides, keep it on the side with the lower handle.
+                for (const Entry* a = begin; a != end; ++a)
                 {
-                    return;
+                    const Handle handle = handle_of(node.storage_id, a);
+
+                    for_each_intersecting_entry(a->bounds, [&](unsigned storage_id, const Entry* b) {
+                        const Handle other = handle_of(storage_id, b);
+                        if (handle < other)
+                        {
+                            pairs.push_back({handle, other});
+                        }
+                        return true;
+                    });
+                }
+
+                return;
+            }
+
+            for (const Entry* a = begin; a != end; ++a)
+            {
+                for (const Entry* b = a + 1; b != end; ++b)
+                {
+                    if (intersects(a->bounds, b->bounds))
+                    {
+                        pairs.push_back({handle_of(node.storage_id, a), handle_of(node.storage_id, b)});
+                    }
+                }
+            }
+
+            if (node_index == 0)
+            {
+                return;
+            }
+
+            // Ancestor items not reaching into the node can be skipped.
+            const Rectangle node_bounds(get_query_bounds(node_index));
+
+            for (unsigned parent_index = node_index; parent_index != 0;)
+            {
+                parent_index = get_parent_index(parent_index);
+                const Node& parent = nodes_[parent_index];
+                if (parent.item_count == 0)
+                {
+                    continue;
                 }
 
-                for (auto it = block.begin(); it != block.end();)
+                const Entry* parent_end = items_.block_end(parent.storage_id);
+                for (const Entry* p = items_.block_begin(parent.storage_id); p != parent_end; ++p)
                 {
-                    if (!fun(*it))
+                    if (!intersects(p->bounds, node_bounds))
                     {
-                        it = block.erase(it);
+                        continue;
                     }
-                    else
+
+                    for (const Entry* a = begin; a != end; ++a)
                     {
-                        ++it;
+                        if (intersects(a->bounds, p->bounds))
+                        {
+                            pairs.push_back({handle_of(parent.storage_id, p), handle_of(node.storage_id, a)});
+                        }
                     }
-                } 
+                }
             }
         }
 
-        template <typename Fun>
-        void for_each_item_in_block(Fun&& fun, unsigned block_index)
-        {
-            for (auto& item : blocks_[block_index])
-            {
-                fun(item);
-            }
-        }
-
-    private :
-        using Block = std::vector<Item>;
-        const unsigned num_blocks = 64;
-        const unsigned default_block_size = 8;
-        Block blocks_[num_blocks];
-    }; 
-
-	//
-	template <typename Item, typename Storage = Block_storage>
-	class Quad_tree
-	{
-		// NOTES:
-		//
-
-		using Rectangle = spatial::shapes::Rectangle<float>;
-        const unsigned max_depth{3};
-
-	public: 
-		Quad_tree(const Rectangle& root_rect)
-		{
-			initialize(0, root_rect);
-		}
-
-	public:
-		//
-		//
-		//
-		void insert(const Item& item)
-		{
-			add_item(find_best_fit(item, 0, 0), item);
-		} 
-
-	public:
-		template <typename Fun>
-		void integrate_items(Fun& fun)
-		{
-            items_.remove_if_not(fun); 
-		}
-
-	public:
-		template <typename Shape, typename Fun>
-        void for_each_intersecting(const Shape& shape, Fun& fun) const
-		{
-			// TODO
-		}
-
-	private:
-		//
-		unsigned find_best_fit(const Item& item, unsigned node_index) const
-		{
-			const Node& node = nodes_[node_index];
-
-			if (node.contains(item.bounding_shape()))
-			{
-				if (!is_leaf(node_index))
-				{
-					const unsigned child_node_index = get_child_index(node_index);
-
-                    // Check if there's a better fit among the child nodes.
-					for (unsigned i = 0; i < 4; ++i)
-					{
-						const unsigned tmp = find_best_fit(item, child_node_index + i); 
-						if (tmp != invalid_index)
-						{
-							return tmp;
-						}
-					}
-				}
+        Handle handle_of(unsigned storage_id, const Entry* entry) const
+        {
+            return items_.handle_at(storage_id, static_cast<unsigned>(entry - items_.block_begin(storage_id)));
+        }
+
+        // The bounds queries are tested against, loose in a loose tree.
+        Rectangle get_query_bounds(unsigned node_index) const
+        {
+            if (node_index == 0)
+            {
+                return nodes_[0].rect;
+            }
+
+            const unsigned parent_index = get_parent_index(node_index);
+            const Bounds4& bounds = child_bounds(parent_index);
+            const unsigned i = node_index - get_child_index(parent_index);
+            return Rectangle(Point(bounds.min_x[i], bounds.min_y[i]), Point(bounds.max_x[i], bounds.max_y[i]));
+        }
+
+    private:
+        // Searches for the node to store the bounds in, starting from the given node. That
+        // node must contain the bounds, unless it is the root.
+        unsigned find_node(const Rectangle& bounds, unsigned node_index) const
+        {
+            if (is_loose())
+            {
+                return find_loose_fit(bounds);
+            }
 
+            // Items outside of the root are kept in the root.
+            if (!nodes_[node_index].contains(bounds))
+            {
                 return node_index;
-			}
+            }
+
+            // Only the child containing the center can hold the whole item.
+            while (!is_leaf(node_index))
+            {
+                const unsigned child_index = get_child_index(node_index) + get_quadrant(node_index, bounds.center());
+                if (!nodes_[child_index].contains(bounds))
+                {
+                    break;
+                }
+
+                node_index = child_index;
+            }
+
+            return node_index;
+        }
+
+        // The depth of the deepest node whose loose bounds hold the item is found from the
+        // size of the item, and the way there from its center.
+        unsigned find_loose_fit(const Rectangle& bounds) const
+        {
+            const Rectangle& root = nodes_[0].rect;
+            const Point center(bounds.center());
+
+            if (!root.contains(Rectangle(center, center)))
+            {
+                return 0;
+            }
+
+            const unsigned depth = std::min(loose_fit_depth(static_cast<float>(root.width()), static_cast<float>(bounds.width())),
+                                            loose_fit_depth(static_cast<float>(root.height()), static_cast<float>(bounds.height())));
+
+            unsigned node_index = 0;
+            while (nodes_[node_index].depth < depth && !is_leaf(node_index))
+            {
+                node_index = get_child_index(node_index) + get_quadrant(node_index, center);
+            }
+
+            return node_index;
+        }
+
+        // A node of extent e holds items up to (looseness - 1)*e in size.
+        unsigned loose_fit_depth(float root_extent, float item_extent) const
+        {
+            if (item_extent <= 0.0f)
+            {
+                return max_depth_;
+            }
 
-			return invalid_index;
-		} 
+            const float ratio = (looseness_ - 1.0f) * root_extent / item_extent;
+            if (ratio < 2.0f)
+            {
+                return 0;
+            }
+
+            return std::min(max_depth_, static_cast<unsigned>(std::log2(ratio)));
+        }
+
+        // The child containing the point, in the order of Rectangle::split().
+        unsigned get_quadrant(unsigned node_index, const Point& point) const
+        {
+            return get_quadrant(nodes_[node_index].rect, point);
+        }
+
+        static unsigned get_quadrant(const Rectangle& rect, const Point& point)
+        {
+            const Point center(rect.center());
+            return (center.x <= point.x ? 1u : 0u) + (point.y < center.y ? 2u : 0u);
+        }
+
+    private:
+        static const unsigned invalid_index = ~0u;
+
+        struct Node {
+            Rectangle rect;
+            unsigned parent{invalid_index};
+            unsigned children{invalid_index}; // The first of four siblings, invalid for leaves.
+            unsigned depth{0};
+            unsigned item_count{0};
+            unsigned subtree_count{0}; // Items in this node and its descendants.
+            unsigned storage_id{Storage<Entry>::invalid_block};
+
+            bool contains(const Rectangle& shape) const
+            {
+                return rect.contains(shape);
+            }
+        };
+
+        // The root, followed by groups of four siblings.
+        std::vector<Node> nodes_;
+
+        // Loose bounds of each group of siblings, for testing all four at once.
+        std::vector<Bounds4> child_bounds_;
+
+        // Groups of siblings no longer in the tree, by first index.
+        std::vector<unsigned> free_children_;
+
+        Storage<Entry> items_;
+
+        std::vector<std::vector<Pair>> pair_buffers_;
+        std::vector<unsigned> pair_top_nodes_;
+        std::vector<unsigned> pair_subtrees_;
+
+        std::vector<base::Sort_pair> batch_order_;
+        std::vector<base::Sort_pair> batch_scratch_;
+        std::vector<Batch_chunk> batch_chunks_;
+        std::vector<unsigned> batch_cursors_;
+
+        std::vector<Build_item> build_items_;
+        std::vector<std::uint8_t> build_classes_;
+        std::array<std::vector<Build_item>, 2> build_buffers_;
+        std::vector<Build_counts> build_counts_;
+        std::array<Build_subtree, 4> build_subtrees_;
+
+        float looseness_;
+        unsigned max_depth_;
+        unsigned split_threshold_;
+
+        mutable Counters query_counters_;
+
+    private:
+        // Gives a leaf with too many items children, and moves the items that fit in them
+        // down.
+        void split_if_full(unsigned node_index)
+        {
+            if (nodes_[node_index].item_count <= split_threshold_ ||
+                nodes_[node_index].depth >= max_depth_ ||
+                !is_leaf(node_index))
+            {
+                return;
+            }
+
+            alloc_children(node_index);
+
+            // Backwards, since moving an item out fills its place with the last one.
+            const unsigned storage_id = nodes_[node_index].storage_id;
+            for (unsigned i = nodes_[node_index].item_count; i-- > 0;)
+            {
+                Entry& entry = items_.block_begin(storage_id)[i];
+                const unsigned child_index = find_node(entry.bounds, node_index);
+                if (child_index != node_index)
+                {
+                    entry.node = child_index;
+                    items_.move(items_.handle_at(storage_id, i), acquire_block(child_index));
+                    release_block(node_index);
+                }
+            }
+
+            const unsigned child_index = get_child_index(node_index);
+            for (unsigned i = 0; i < 4; ++i)
+            {
+                split_if_full(child_index + i);
+            }
+        }
+
+        // Takes the items of the children of a node back up once its subtree has few enough,
+        // and returns the children to the pool. Continues with the parents as long as they
+        // qualify as well. Starts from the parent of a leaf.
+        void merge_if_sparse(unsigned node_index)
+        {
+            if (is_leaf(node_index))
+            {
+                if (node_index == 0)
+                {
+                    return;
+                }
+                node_index = get_parent_index(node_index);
+            }
+
+            for (;;)
+            {
+                if (nodes_[node_index].subtree_count > split_threshold_ / 2 || !has_leaf_children(node_index))
+                {
+                    return;
+                }
+
+                merge_children(node_index);
+
+                if (node_index == 0)
+                {
+                    return;
+                }
+                node_index = get_parent_index(node_index);
+            }
+        }
+
+        bool has_leaf_children(unsigned node_index) const
+        {
+            const unsigned child_index = get_child_index(node_index);
+            for (unsigned i = 0; i < 4; ++i)
+            {
+                if (!is_leaf(child_index + i))
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
 
-	private:
-		static const unsigned invalid_index = ~(0ul);
+        void merge_children(unsigned node_index)
+        {
+            const unsigned child_index = get_child_index(node_index);
+
+            for (unsigned i = 0; i < 4; ++i)
+            {
+                const unsigned child = child_index + i;
+                while (nodes_[child].item_count > 0)
+                {
+                    const Handle handle = items_.handle_at(nodes_[child].storage_id, nodes_[child].item_count - 1);
+                    items_.get(handle).node = node_index;
+                    items_.move(handle, acquire_block(node_index));
+                    release_block(child);
+                }
+            }
+
+            free_children_.push_back(child_index);
+            nodes_[node_index].children = invalid_index;
+        }
+
+        void alloc_children(unsigned node_index)
+        {
+            unsigned child_index;
+            if (free_children_.empty())
+            {
+                child_index = static_cast<unsigned>(nodes_.size());
+                nodes_.resize(nodes_.size() + 4);
+                child_bounds_.emplace_back();
+            }
+            else
+            {
+                child_index = free_children_.back();
+                free_children_.pop_back();
+            }
+
+            Node& node = nodes_[node_index];
+            node.children = child_index;
 
-		struct Node
-		{
-			Rectangle rect;
-			short item_count{ 0 };
-			short storage_id{ 0 };
+            const std::array<Rectangle, 4> sub_rects(node.rect.split());
+            Bounds4& bounds = child_bounds(node_index);
 
-            template <typename T>
-            bool contains(const T& shape)
+            for (unsigned i = 0; i < 4; ++i)
             {
-                return rect.contains(shape); 
+                Node& child = nodes_[child_index + i];
+                child = Node();
+                child.rect = sub_rects[i];
+                child.parent = node_index;
+                child.depth = node.depth + 1;
+
+                // Queries test against the loose bounds.
+                const float scale = (looseness_ - 1.0f) * 0.5f;
+                const float margin_x = static_cast<float>(sub_rects[i].width()) * scale;
+                const float margin_y = static_cast<float>(sub_rects[i].height()) * scale;
+                bounds.min_x[i] = add_margin(sub_rects[i].min.x, -margin_x);
+                bounds.min_y[i] = add_margin(sub_rects[i].min.y, -margin_y);
+                bounds.max_x[i] = add_margin(sub_rects[i].max.x, margin_x);
+                bounds.max_y[i] = add_margin(sub_rects[i].max.y, margin_y);
             }
-		};
+        }
+
+        static Coordinate add_margin(Coordinate v, float margin)
+        {
+            return add_margin(v, margin, std::is_floating_point<Coordinate>());
+        }
+
+        static Coordinate add_margin(Coordinate v, float margin, std::true_type)
+        {
+            return v + margin;
+        }
 
-		//
-		std::array<node, base::static_pow<4, max_depth>> nodes_;
+        // Rounded outwards, and kept within the range of the coordinates.
+        static Coordinate add_margin(Coordinate v, float margin, std::false_type)
+        {
+            const double grown = margin < 0.0f ? std::floor(v + static_cast<double>(margin)) : std::ceil(v + static_cast<double>(margin));
+            return static_cast<Coordinate>(limit(grown,
+                                                 static_cast<double>(std::numeric_limits<Coordinate>::lowest()),
+                                                 static_cast<double>(std::numeric_limits<Coordinate>::max())));
+        }
+
+        // Recounts the items of the subtree, and merges the nodes left with too few on the
+        // way back up. Returns the count.
+        unsigned update_subtree_counts(unsigned node_index)
+        {
+            unsigned count = nodes_[node_index].item_count;
+
+            if (!is_leaf(node_index))
+            {
+                const unsigned child_index = get_child_index(node_index);
+                for (unsigned i = 0; i < 4; ++i)
+                {
+                    count += update_subtree_counts(child_index + i);
+                }
+            }
 
-		Storage<Item> items_;
+            nodes_[node_index].subtree_count = count;
 
-		//
-		void initialize(unsigned node_index,
-						const Rectangle& rect)
-		{
-			nodes_[node_index].rect = rect;
+            if (!is_leaf(node_index) && count <= split_threshold_ / 2 && has_leaf_children(node_index))
+            {
+                merge_children(node_index);
+            }
 
-			if (!is_leaf(node_index))
-			{
-				const std::array<Rectangle, 4> sub_rects{ rect.split() };
-				initialize(get_child_index(node_index) + 0, sub_rects[0]);
-				initialize(get_child_index(node_index) + 1, sub_rects[1]);
-				initialize(get_child_index(node_index) + 2, sub_rects[2]);
-				initialize(get_child_index(node_index) + 3, sub_rects[3]);
-			}
-		}
+            return count;
+        }
 
-	private:
-		void add_item(unsigned node_index, const Item& item)
-		{
+    private:
+        // Nodes only hold a block while they have items.
+        unsigned acquire_block(unsigned node_index)
+        {
             Node& node = nodes_[node_index];
 
-            if (node.storage_id == invalid_index)
+            if (node.storage_id == Storage<Entry>::invalid_block)
             {
                 node.storage_id = items_.alloc_block();
             }
 
-            items_.add(node.storage_id, item);
             node.item_count += 1;
-		}
+            add_to_subtree_counts(node_index, 1);
+
+            return node.storage_id;
+        }
 
-		void remove_item(unsigned node_index, const Item& item)
-		{
+        // After an item has been taken out of the node.
+        void release_block(unsigned node_index)
+        {
             Node& node = nodes_[node_index];
-			items_.remove(node.storage_segment, item);
             node.item_count -= 1;
-		}
-
-	private:
-		// If nodes are placed in a flat array, child nodes is calculated as: i*4 + 1 if i is the current node index.
-
-		static unsigned get_child_index(unsigned parent_index)
-		{
-			assert(parent_index != invalid_index);
-			return parent_index * 4 + 1;
-		}
-
-		static unsigned get_parent_index(unsigned child_index)
-		{
-			assert(child_index != invalid_index);
-			return (child_index - 1) / 4;
-		}
-
-		bool is_leaf(unsigned node_index) const
-		{
-			return !(get_child_index(node_index) < nodes_.size());
-		}
-	};
+            add_to_subtree_counts(node_index, -1);
+
+            if (node.item_count == 0)
+            {
+                items_.free_block(node.storage_id);
+                node.storage_id = Storage<Entry>::invalid_block;
+            }
+        }
+
+        void add_to_subtree_counts(unsigned node_index, int delta)
+        {
+            for (unsigned i = node_index; i != invalid_index; i = nodes_[i].parent)
+            {
+                nodes_[i].subtree_count += delta;
+            }
+        }
+
+    private:
+        unsigned get_child_index(unsigned parent_index) const
+        {
+            assert(!is_leaf(parent_index));
+            return nodes_[parent_index].children;
+        }
+
+        unsigned get_parent_index(unsigned child_index) const
+        {
+            assert(child_index != 0);
+            return nodes_[child_index].parent;
+        }
+
+        const Bounds4& child_bounds(unsigned parent_index) const
+        {
+            return child_bounds_[(get_child_index(parent_index) - 1) / 4];
+        }
+
+        Bounds4& child_bounds(unsigned parent_index)
+        {
+            return child_bounds_[(get_child_index(parent_index) - 1) / 4];
+        }
+
+        bool is_leaf(unsigned node_index) const
+        {
+            return nodes_[node_index].children == invalid_index;
+        }
+    };
 
 } }
@@ -0,0 +1,562 @@
+#pragma once
+#include "quad_tree.hpp"
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+#include <vector>
+
+namespace kvant {
+namespace spatial {
+
+    namespace detail {
+
+        // The layout of a snapshot: the header, the nodes, the bounds of each group of
+        // siblings and the items, each section starting at a multiple of
+        // snapshot_alignment. Every position is an index or an offset from the start of
+        // the header, so the bytes can be used wherever they are loaded or mapped.
+        struct Snapshot_header {
+            std::uint32_t magic;
+            std::uint32_t version;
+
+            // Checked on open, to catch files written for items of another size or with
+            // another type of coordinates.
+            std::uint32_t coordinate_type;
+            std::uint32_t node_size;
+            std::uint32_t bounds_size;
+            std::uint32_t entry_size;
+
+            std::uint32_t num_nodes;
+            std::uint32_t num_items;
+
+            std::uint32_t nodes_offset;
+            std::uint32_t bounds_offset;
+            std::uint32_t items_offset;
+            std::uint64_t size;
+        };
+
+        struct Snapshot_node {
+            std::uint32_t children;      // The first of four siblings, zero for leaves.
+            std::uint32_t first_item;
+            std::uint32_t item_count;
+            std::uint32_t subtree_count;
+        };
+
+        const std::uint32_t snapshot_magic = 0x5451564b; // "KVQT"
+        const std::uint32_t snapshot_version = 2;
+        const size_t snapshot_alignment = 16;
+
+        inline size_t align_snapshot_offset(size_t offset)
+        {
+            return (offset + snapshot_alignment - 1) & ~(snapshot_alignment - 1);
+        }
+
+    } // namespace detail
+
+    // A read only Quad_tree stored in one block of memory, for static items that are
+    // loaded rather than inserted. write() flattens a tree into bytes, and open() uses
+    // those bytes in place: a level loads by reading or mapping the file, with no work
+    // per item and no pointers to fix up.
+    //
+    // Item must be trivially copyable, since it is copied as bytes. The bytes are in the
+    // layout of the machine that wrote them, and must be aligned for the nodes, bounds
+    // and items, which file mappings and heap blocks are. Queries work as on the Quad_tree, but
+    // items are identified by their index in the snapshot.
+    template <typename Item>
+    class Quad_tree_snapshot {
+    public:
+        using Point = typename Quad_tree<Item>::Point;
+        using Bounding_shape = typename Quad_tree<Item>::Bounding_shape;
+
+    private:
+        using Coordinate = decltype(Point::x);
+        using Traits = Point_traits<Point>;
+        using Rectangle = spatial::Rectangle<Point>;
+        using Bounds4 = detail::Bounds4<Coordinate>;
+        using Node = detail::Snapshot_node;
+
+        struct Entry {
+            Item item;
+            Bounding_shape shape;
+            Rectangle bounds;
+        };
+
+        static_assert(std::is_trivially_copyable<Item>::value, "Snapshot items are copied as bytes.");
+
+        static const size_t alignment = alignof(Entry) > alignof(Bounds4) ? alignof(Entry) : alignof(Bounds4);
+        static_assert(alignment <= detail::snapshot_alignment, "The sections are not aligned for the items.");
+
+    public:
+        // Copies the items of the tree into out, replacing its contents. Children with no
+        // items below them are left out.
+        template <template <typename> class Storage, typename Counters>
+        static void write(const Quad_tree<Item, Storage, Counters>& tree, std::vector<char>& out)
+        {
+            std::vector<Node> nodes;
+            std::vector<Bounds4> bounds;
+            std::vector<Entry> items;
+
+            // Breadth first, so that each group of siblings gets consecutive indices.
+            std::vector<unsigned> order(1, 0);
+            nodes.reserve(tree.num_nodes());
+            items.reserve(tree.nodes_[0].subtree_count);
+
+            for (size_t i = 0; i < order.size(); ++i)
+            {
+                const unsigned node_index = order[i];
+                const auto& node = tree.nodes_[node_index];
+
+                Node flat;
+                flat.children = 0;
+                flat.first_item = static_cast<std::uint32_t>(items.size());
+                flat.item_count = node.item_count;
+                flat.subtree_count = node.subtree_count;
+
+                if (node.item_count > 0)
+                {
+                    const auto* end = tree.items_.block_end(node.storage_id);
+                    for (const auto* it = tree.items_.block_begin(node.storage_id); it != end; ++it)
+                    {
+                        items.push_back({it->item, it->shape, it->bounds});
+                    }
+                }
+
+                if (!tree.is_leaf(node_index) && node.subtree_count > node.item_count)
+                {
+                    // Each group added so far has its bounds, so this group gets the next.
+                    assert(order.size() == 1 + 4 * bounds.size());
+                    flat.children = static_cast<std::uint32_t>(order.size());
+                    bounds.push_back(tree.child_bounds(node_index));
+
+                    const unsigned child_index = tree.get_child_index(node_index);
+                    for (unsigned c = 0; c < 4; ++c)
+                    {
+                        order.push_back(child_index + c);
+                    }
+                }
+
+                nodes.push_back(flat);
+            }
+
+            detail::Snapshot_header header;
+            std::memset(&header, 0, sizeof(header));
+            header.magic = detail::snapshot_magic;
+            header.version = detail::snapshot_version;
+            header.coordinate_type = coordinate_type();
+            header.node_size = sizeof(Node);
+            header.bounds_size = sizeof(Bounds4);
+            header.entry_size = sizeof(Entry);
+            header.num_nodes = static_cast<std::uint32_t>(nodes.size());
+            header.num_items = static_cast<std::uint32_t>(items.size());
+
+            const size_t nodes_offset = detail::align_snapshot_offset(sizeof(header));
+            const size_t bounds_offset = detail::align_snapshot_offset(nodes_offset + nodes.size() * sizeof(Node));
+            const size_t items_offset = detail::align_snapshot_offset(bounds_offset + bounds.size() * sizeof(Bounds4));
+            const size_t size = items_offset + items.size() * sizeof(Entry);
+            assert(size <= std::numeric_limits<std::uint32_t>::max());
+
+            header.nodes_offset = static_cast<std::uint32_t>(nodes_offset);
+            header.bounds_offset = static_cast<std::uint32_t>(bounds_offset);
+            header.items_offset = static_cast<std::uint32_t>(items_offset);
+            header.size = size;
+
+            // The gaps between the sections are zeroed. Empty sections are not copied, their
+            // data() may be null.
+            out.assign(size, 0);
+            std::memcpy(out.data(), &header, sizeof(header));
+            std::memcpy(out.data() + nodes_offset, nodes.data(), nodes.size() * sizeof(Node));
+            if (!bounds.empty())
+            {
+                std::memcpy(out.data() + bounds_offset, bounds.data(), bounds.size() * sizeof(Bounds4));
+            }
+            if (!items.empty())
+            {
+                std::memcpy(out.data() + items_offset, items.data(), items.size() * sizeof(Entry));
+            }
+        }
+
+    public:
+        Quad_tree_snapshot() = default;
+
+        // Uses the bytes in place, they must outlive the snapshot. Returns false, and
+        // leaves the snapshot empty, if they don't hold a snapshot written for Item. The
+        // sections and the nodes are checked, in one pass over the nodes, so that corrupt
+        // or truncated bytes are rejected rather than read out of bounds. The items are
+        // used as they are.
+        bool open(const void* data, size_t size)
+        {
+            *this = Quad_tree_snapshot();
+
+            if (data == nullptr || size < sizeof(detail::Snapshot_header))
+            {
+                return false;
+            }
+
+            assert(reinterpret_cast<std::uintptr_t>(data) % alignment == 0);
+
+            const char* bytes = static_cast<const char*>(data);
+            const auto& header = *reinterpret_cast<const detail::Snapshot_header*>(bytes);
+
+            const size_t num_groups = (header.num_nodes - 1) / 4;
+            if (header.magic != detail::snapshot_magic ||
+                header.version != detail::snapshot_version ||
+                header.coordinate_type != coordinate_type() ||
+                header.node_size != sizeof(Node) ||
+                header.bounds_size != sizeof(Bounds4) ||
+                header.entry_size != sizeof(Entry) ||
+                header.size > size ||
+                header.num_nodes % 4 != 1 ||
+                header.nodes_offset + static_cast<std::uint64_t>(header.num_nodes) * sizeof(Node) > header.size ||
+                header.bounds_offset + static_cast<std::uint64_t>(num_groups) * sizeof(Bounds4) > header.size ||
+                header.items_offset + static_cast<std::uint64_t>(header.num_items) * sizeof(Entry) > header.size ||
+                header.nodes_offset % detail::snapshot_alignment != 0 ||
+                header.bounds_offset % detail::snapshot_alignment != 0 ||
+                header.items_offset % detail::snapshot_alignment != 0 ||
+                !valid_nodes(reinterpret_cast<const Node*>(bytes + header.nodes_offset), header.num_nodes, header.num_items))
+            {
+                return false;
+            }
+
+            nodes_ = reinterpret_cast<const Node*>(bytes + header.nodes_offset);
+            bounds_ = reinterpret_cast<const Bounds4*>(bytes + header.bounds_offset);
+            items_ = reinterpret_cast<const Entry*>(bytes + header.items_offset);
+            num_nodes_ = header.num_nodes;
+            num_items_ = header.num_items;
+            return true;
+        }
+
+        bool is_open() const
+        {
+            return nodes_ != nullptr;
+        }
+
+        size_t size() const
+        {
+            return num_items_;
+        }
+
+        size_t num_nodes() const
+        {
+            return num_nodes_;
+        }
+
+        const Item& get(unsigned index) const
+        {
+            assert(index < num_items_);
+            return items_[index].item;
+        }
+
+    public:
+        // Calls fun for every item whose bounds intersect the shape (Circle or Rectangle).
+        // Returns false if the visitor stopped the traversal.
+        template <typename Shape, typename Fun>
+        bool for_each_intersecting(const Shape& shape, Fun&& fun) const
+        {
+            if (!is_open())
+            {
+                return true;
+            }
+
+            std::array<unsigned, 3 * Quad_tree<Item>::max_depth_limit + 1> stack;
+            unsigned stack_size = 0;
+            stack[stack_size++] = 0;
+
+            while (stack_size > 0)
+            {
+                const Node& node = nodes_[stack[--stack_size]];
+
+                const Entry* end = items_ + node.first_item + node.item_count;
+                for (const Entry* it = items_ + node.first_item; it != end; ++it)
+                {
+                    if (intersects(shape, it->bounds) && !detail::visit(fun, it->item))
+                    {
+                        return false;
+                    }
+                }
+
+                if (node.children != 0)
+                {
+                    const unsigned mask = detail::overlap_mask(bounds_[(node.children - 1) / 4], shape);
+
+                    // Pushed in reverse to visit the children in order.
+                    for (unsigned i = 4; i-- > 0;)
+                    {
+                        if ((mask & (1u << i)) && nodes_[node.children + i].subtree_count > 0)
+                        {
+                            stack[stack_size++] = node.children + i;
+                        }
+                    }
+                }
+            }
+
+            return true;
+        }
+
+    public:
+        struct Neighbour {
+            unsigned index;
+            typename Traits::Squared distance_squared;
+        };
+
+        // Finds the k items nearest to the point, like Quad_tree::knn.
+        size_t knn(const Point& point,
+                   size_t k,
+                   Neighbour* result,
+                   Coordinate max_distance = std::numeric_limits<Coordinate>::max()) const
+        {
+            using Squared = typename Traits::Squared;
+
+            if (k == 0 || !is_open())
+            {
+                return 0;
+            }
+
+            const Squared max_distance_sq = Traits::square(max_distance);
+
+            auto further = [](const Neighbour& a, const Neighbour& b) {
+                return a.distance_squared < b.distance_squared;
+            };
+            size_t found = 0;
+
+            auto bound = [&]() {
+                return found == k ? result[0].distance_squared : max_distance_sq;
+            };
+
+            struct Queued_node {
+                Squared distance_squared;
+                unsigned index;
+
+                bool operator<(const Queued_node& other) const
+                {
+                    return other.distance_squared < distance_squared;
+                }
+            };
+            static thread_local std::vector<Queued_node> queue;
+            queue.clear();
+            queue.push_back({Squared(0), 0});
+
+            while (!queue.empty())
+            {
+                std::pop_heap(queue.begin(), queue.end());
+                const Queued_node next = queue.back();
+                queue.pop_back();
+
+                if (bound() < next.distance_squared)
+                {
+                    break;
+                }
+
+                const Node& node = nodes_[next.index];
+
+                for (unsigned index = node.first_item; index < node.first_item + node.item_count; ++index)
+                {
+                    const Entry& entry = items_[index];
+                    if (bound() < distance_squared(point, entry.bounds))
+                    {
+                        continue;
+                    }
+
+                    const Squared d = distance_squared(point, entry.shape);
+                    if (found < k)
+                    {
+                        if (d <= max_distance_sq)
+                        {
+                            result[found++] = {index, d};
+                            std::push_heap(result, result + found, further);
+                        }
+                    }
+                    else if (d < result[0].distance_squared)
+                    {
+                        std::pop_heap(result, result + found, further);
+                        result[found - 1] = {index, d};
+                        std::push_heap(result, result + found, further);
+                    }
+                }
+
+                if (node.children != 0)
+                {
+                    for (unsigned i = 0; i < 4; ++i)
+                    {
+                        if (nodes_[node.children + i].subtree_count == 0)
+                        {
+                            continue;
+                        }
+
+                        const Squared d = distance_squared(point, child_rect(node.children, i));
+                        if (d <= bound())
+                        {
+                            queue.push_back({d, node.children + i});
+                            std::push_heap(queue.begin(), queue.end());
+                        }
+                    }
+                }
+            }
+
+            std::sort_heap(result, result + found, further);
+            return found;
+        }
+
+    public:
+        using Ray = spatial::Ray<Point>;
+
+        struct Ray_hit {
+            unsigned index;
+            Coordinate t;
+        };
+
+        // Finds the first item whose bounding shape the ray enters within [0, max_t], like
+        // Quad_tree::raycast.
+        bool raycast(const Ray& ray,
+                     Coordinate max_t,
+                     Ray_hit& hit) const
+        {
+            static_assert(std::is_floating_point<Coordinate>::value, "Raycasts need floating point coordinates.");
+
+            struct Queued_node {
+                unsigned index;
+                Coordinate t;
+            };
+
+            std::array<Queued_node, 3 * Quad_tree<Item>::max_depth_limit + 1> stack;
+            unsigned stack_size = 0;
+            stack[stack_size++] = {0, Coordinate(0)};
+
+            hit.index = invalid_index;
+            hit.t = max_t;
+            bool found = false;
+
+            while (is_open() && stack_size > 0)
+            {
+                const Queued_node next = stack[--stack_size];
+                if (hit.t < next.t)
+                {
+                    continue;
+                }
+
+                const Node& node = nodes_[next.index];
+
+                for (unsigned index = node.first_item; index < node.first_item + node.item_count; ++index)
+                {
+                    const Entry& entry = items_[index];
+                    Coordinate t;
+                    if (spatial::raycast(ray, entry.bounds, hit.t, t) &&
+                        spatial::raycast(ray, entry.shape, hit.t, t) &&
+                        (!found || t < hit.t))
+                    {
+                        hit.index = index;
+                        hit.t = t;
+                        found = true;
+                    }
+                }
+
+                if (node.children == 0)
+                {
+                    continue;
+                }
+
+                std::array<Queued_node, 4> children;
+                unsigned num_children = 0;
+
+                for (unsigned i = 0; i < 4; ++i)
+                {
+                    Coordinate t;
+                    if (nodes_[node.children + i].subtree_count > 0 &&
+                        spatial::raycast(ray, child_rect(node.children, i), hit.t, t))
+                    {
+                        children[num_children++] = {node.children + i, t};
+                    }
+                }
+
+                // Pushed furthest first, so the nearest child is visited next. At most four, in
+                // an insertion sort.
+                for (unsigned i = 1; i < num_children; ++i)
+                {
+                    const Queued_node child = children[i];
+                    unsigned j = i;
+                    for (; j > 0 && children[j - 1].t < child.t; --j)
+                    {
+                        children[j] = children[j - 1];
+                    }
+                    children[j] = child;
+                }
+
+                for (unsigned i = 0; i < num_children; ++i)
+                {
+                    stack[stack_size++] = children[i];
+                }
+            }
+
+            return found;
+        }
+
+        static const unsigned invalid_index = ~0u;
+
+    private:
+        // The size in bytes, and a flag for floating point.
+        static std::uint32_t coordinate_type()
+        {
+            return static_cast<std::uint32_t>(sizeof(Coordinate)) | (std::is_floating_point<Coordinate>::value ? 0x100u : 0u);
+        }
+
+        // The nodes must be as write() lays them out: breadth first, with the n-th node
+        // that has children having the n-th group of four after the root. That makes them
+        // a tree, no deeper than the traversal stacks allow, with its items in range.
+        static bool valid_nodes(const Node* nodes, std::uint32_t num_nodes, std::uint32_t num_items)
+        {
+            std::uint32_t num_groups = 0;
+            std::uint32_t level_end = 1;
+            unsigned depth = 0;
+
+            for (std::uint32_t i = 0; i < num_nodes; ++i)
+            {
+                if (i == level_end)
+                {
+                    // Nodes past the last level would have no parent.
+                    level_end = 1 + 4 * num_groups;
+                    if (i == level_end)
+                    {
+                        return false;
+                    }
+                    ++depth;
+                }
+
+                const Node& node = nodes[i];
+                if (static_cast<std::uint64_t>(node.first_item) + node.item_count > num_items)
+                {
+                    return false;
+                }
+
+                if (node.children != 0)
+                {
+                    if (node.children != 1 + 4 * num_groups ||
+                        static_cast<std::uint64_t>(node.children) + 4 > num_nodes ||
+                        Quad_tree<Item>::max_depth_limit <= depth)
+                    {
+                        return false;
+                    }
+                    ++num_groups;
+                }
+            }
+
+            return 1 + 4 * static_cast<std::uint64_t>(num_groups) == num_nodes;
+        }
+
+        Rectangle child_rect(unsigned first_child, unsigned i) const
+        {
+            const Bounds4& bounds = bounds_[(first_child - 1) / 4];
+            return Rectangle(Point(bounds.min_x[i], bounds.min_y[i]), Point(bounds.max_x[i], bounds.max_y[i]));
+        }
+
+    private:
+        const Node* nodes_{nullptr};
+        const Bounds4* bounds_{nullptr};
+        const Entry* items_{nullptr};
+        size_t num_nodes_{0};
+        size_t num_items_{0};
+    };
+
+} // namespace spatial
+} // namespace kvant
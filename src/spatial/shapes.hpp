@@ -1,6 +1,12 @@
 #pragma once
+#include "simd.hpp"
 #include <glm/glm.hpp>
+#include <algorithm>
 #include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
 
 #undef min
 #undef max
@@ -10,31 +16,137 @@ namespace spatial {
 
 	using Point = glm::vec2;
 
+	// Math on coordinates that can not overflow. The difference of two integer coordinates
+	// needs twice the bits, squares are unsigned and sums of squares saturate, so squared
+	// distances compare exactly. Floating point coordinates are used as they are.
+	template <typename Coordinate>
+	struct Coordinate_traits
+	{
+		using Difference = Coordinate;
+		using Squared = Coordinate;
+
+		static Difference difference(Coordinate a, Coordinate b)
+		{
+			return a - b;
+		}
+
+		static Coordinate add(Coordinate a, Coordinate b)
+		{
+			return a + b;
+		}
+
+		static Coordinate subtract(Coordinate a, Coordinate b)
+		{
+			return a - b;
+		}
+
+		static Squared squared_length(Difference dx, Difference dy)
+		{
+			return dx*dx + dy*dy;
+		}
+
+		static Squared square(Difference d)
+		{
+			return d*d;
+		}
+	};
+
+	namespace detail {
+
+		template <typename Coordinate, typename Wide, typename Unsigned>
+		struct Integer_coordinate_traits
+		{
+			using Difference = Wide;
+			using Squared = Unsigned;
+
+			static Difference difference(Coordinate a, Coordinate b)
+			{
+				return static_cast<Difference>(a) - static_cast<Difference>(b);
+			}
+
+			// Sums and differences of coordinates saturate to the range of Coordinate.
+			static Coordinate add(Coordinate a, Coordinate b)
+			{
+				return saturate(static_cast<Difference>(a) + static_cast<Difference>(b));
+			}
+
+			static Coordinate subtract(Coordinate a, Coordinate b)
+			{
+				return saturate(difference(a, b));
+			}
+
+			static Coordinate saturate(Difference d)
+			{
+				const Difference lowest = std::numeric_limits<Coordinate>::lowest();
+				const Difference highest = std::numeric_limits<Coordinate>::max();
+				return static_cast<Coordinate>(d < lowest ? lowest : (highest < d ? highest : d));
+			}
+
+			static Squared squared_length(Difference dx, Difference dy)
+			{
+				const Squared x = square(dx);
+				const Squared sum = x + square(dy);
+				return sum < x ? std::numeric_limits<Squared>::max() : sum;
+			}
+
+			// The magnitude of a difference of two coordinates is below 2^(bits/2), so its
+			// square fits.
+			static Squared square(Difference d)
+			{
+				const Squared magnitude = d < 0 ? Squared(0) - static_cast<Squared>(d) : static_cast<Squared>(d);
+				return magnitude*magnitude;
+			}
+		};
+	}
+
+	template <>
+	struct Coordinate_traits<std::int16_t> : detail::Integer_coordinate_traits<std::int16_t, std::int32_t, std::uint32_t> {};
+
+	template <>
+	struct Coordinate_traits<std::uint16_t> : detail::Integer_coordinate_traits<std::uint16_t, std::int32_t, std::uint32_t> {};
+
+	template <>
+	struct Coordinate_traits<std::int32_t> : detail::Integer_coordinate_traits<std::int32_t, std::int64_t, std::uint64_t> {};
+
+	template <>
+	struct Coordinate_traits<std::uint32_t> : detail::Integer_coordinate_traits<std::uint32_t, std::int64_t, std::uint64_t> {};
+
+	template <typename Point>
+	using Point_traits = Coordinate_traits<decltype(Point::x)>;
+
 	//
+	template <typename Point>
 	inline bool test_point_circle(	const Point& point,
 									const Point& circle_center,
-									float radius)
+									decltype(Point::x) radius)
 	{
-		const auto v = circle_center - point;
-		return glm::dot(v, v) <= radius*radius;
+		using Traits = Point_traits<Point>;
+		return	Traits::squared_length(	Traits::difference(circle_center.x, point.x),
+										Traits::difference(circle_center.y, point.y)) <= Traits::square(radius);
 	}
 
 	//
-	inline bool test_circle_circle( const Point& center_a, float radius_a,
-									const Point& center_b, float radius_b)
+	template <typename Point>
+	inline bool test_circle_circle( const Point& center_a, decltype(Point::x) radius_a,
+									const Point& center_b, decltype(Point::x) radius_b)
 	{
-		return test_point_circle(center_a, center_b, radius_a + radius_b);
+		using Traits = Point_traits<Point>;
+		const typename Traits::Difference radius = static_cast<typename Traits::Difference>(radius_a) + radius_b;
+		return	Traits::squared_length(	Traits::difference(center_b.x, center_a.x),
+										Traits::difference(center_b.y, center_a.y)) <= Traits::square(radius);
 	}
 
 	//
+	template <typename Point>
 	inline bool test_point_rect(const Point& point,
 								const Point& rect_center,
 								const Point& rect_dim)
 	{
-		return	point.x < (rect_center.x + rect_dim.x) &&
-				(rect_center.x - rect_dim.x) <= point.x &&
-				point.y < (rect_center.y + rect_dim.y) &&
-				(rect_center.y - rect_dim.y) <= point.y;
+		using Difference = typename Point_traits<Point>::Difference;
+		return	point.x < (static_cast<Difference>(rect_center.x) + rect_dim.x) &&
+				(static_cast<Difference>(rect_center.x) - rect_dim.x) <= point.x &&
+				point.y < (static_cast<Difference>(rect_center.y) + rect_dim.y) &&
+				(static_cast<Difference>(rect_center.y) - rect_dim.y) <= point.y;
 	}
 
 	template <typename Value>
@@ -47,18 +159,23 @@ namespace spatial {
 		return v;
 	}
 
-	//
+	// The nearest point is between the point and the rectangle, so it is in range even if
+	// the edges of the rectangle are not.
+	template <typename Point>
 	inline Point nearest_point_rect(const Point& point,
 									const Point& rect_center,
 									const Point& rect_dim)
 	{
-		return Point( 	limit(point.x, rect_center.x - rect_dim.x, rect_center.x + rect_dim.x),
-						limit(point.y, rect_center.y - rect_dim.y, rect_center.y + rect_dim.y));
+		using Coordinate = decltype(Point::x);
+		using Difference = typename Point_traits<Point>::Difference;
+		return Point( 	static_cast<Coordinate>(limit<Difference>(point.x, static_cast<Difference>(rect_center.x) - rect_dim.x, static_cast<Difference>(rect_center.x) + rect_dim.x)),
+						static_cast<Coordinate>(limit<Difference>(point.y, static_cast<Difference>(rect_center.y) - rect_dim.y, static_cast<Difference>(rect_center.y) + rect_dim.y)));
 	}
 
 	//
+	template <typename Point>
 	inline bool test_circle_rect(	const Point& circle_center,
-									float radius,
+									decltype(Point::x) radius,
 									const Point& rect_center,
 									const Point& rect_dim)
 	{
@@ -66,25 +183,305 @@ namespace spatial {
 		return test_point_circle(nearest, circle_center, radius);
 	}
 
+	// Batch variants of the tests above, one shape against many laid out as one array per
+	// component. The _mask functions test Width shapes (4, 8 or 16) from the start of the
+	// arrays and set bit i for a hit on shape i, using instructions that wide where there
+	// are any. The _batch functions test count shapes and write the indices of the hits to
+	// hits, which needs room for count indices, and return the number of hits.
+	namespace detail {
+
+		struct Point_circle_lanes
+		{
+			Point point;
+			const float* center_x;
+			const float* center_y;
+			const float* radius;
+
+			template <typename Floats>
+			std::uint32_t test(size_t i) const
+			{
+				const Floats dx = Floats::load(center_x + i) - Floats::set(point.x);
+				const Floats dy = Floats::load(center_y + i) - Floats::set(point.y);
+				const Floats r = Floats::load(radius + i);
+				return simd::bits(dx*dx + dy*dy <= r*r);
+			}
+		};
+
+		struct Circle_circle_lanes
+		{
+			Point center;
+			float radius;
+			const float* center_x;
+			const float* center_y;
+			const float* radii;
+
+			template <typename Floats>
+			std::uint32_t test(size_t i) const
+			{
+				const Floats dx = Floats::load(center_x + i) - Floats::set(center.x);
+				const Floats dy = Floats::load(center_y + i) - Floats::set(center.y);
+				const Floats r = Floats::set(radius) + Floats::load(radii + i);
+				return simd::bits(dx*dx + dy*dy <= r*r);
+			}
+		};
+
+		struct Point_rect_lanes
+		{
+			Point point;
+			const float* center_x;
+			const float* center_y;
+			const float* dim_x;
+			const float* dim_y;
+
+			template <typename Floats>
+			std::uint32_t test(size_t i) const
+			{
+				const Floats x = Floats::set(point.x);
+				const Floats y = Floats::set(point.y);
+				const Floats cx = Floats::load(center_x + i);
+				const Floats cy = Floats::load(center_y + i);
+				const Floats dx = Floats::load(dim_x + i);
+				const Floats dy = Floats::load(dim_y + i);
+				return simd::bits(	(x < cx + dx) & (cx - dx <= x) &
+									(y < cy + dy) & (cy - dy <= y));
+			}
+		};
+
+		struct Circle_rect_lanes
+		{
+			Point center;
+			float radius;
+			const float* center_x;
+			const float* center_y;
+			const float* dim_x;
+			const float* dim_y;
+
+			template <typename Floats>
+			std::uint32_t test(size_t i) const
+			{
+				const Floats x = Floats::set(center.x);
+				const Floats y = Floats::set(center.y);
+				const Floats cx = Floats::load(center_x + i);
+				const Floats cy = Floats::load(center_y + i);
+				const Floats dx = Floats::load(dim_x + i);
+				const Floats dy = Floats::load(dim_y + i);
+
+				// Same as limit() as long as the dimensions are not negative.
+				const Floats vx = x - simd::max(simd::min(x, cx + dx), cx - dx);
+				const Floats vy = y - simd::max(simd::min(y, cy + dy), cy - dy);
+				const Floats r = Floats::set(radius);
+				return simd::bits(vx*vx + vy*vy <= r*r);
+			}
+		};
+
+		// Halves the width until there are instructions that wide.
+		template <unsigned Width>
+		struct Lanes
+		{
+			template <typename Test>
+			static std::uint32_t test(const Test& t, size_t i)
+			{
+				return	Lanes<Width / 2>::test(t, i) |
+						Lanes<Width / 2>::test(t, i + Width / 2) << (Width / 2);
+			}
+		};
+
+		template <>
+		struct Lanes<1>
+		{
+			template <typename Test>
+			static std::uint32_t test(const Test& t, size_t i)
+			{
+				return t.template test<simd::Float1>(i);
+			}
+		};
+
+#ifdef KVANT_SPATIAL_SSE2
+		template <>
+		struct Lanes<4>
+		{
+			template <typename Test>
+			static std::uint32_t test(const Test& t, size_t i)
+			{
+				return t.template test<simd::Float4>(i);
+			}
+		};
+#endif
+
+#ifdef KVANT_SPATIAL_AVX
+		template <>
+		struct Lanes<8>
+		{
+			template <typename Test>
+			static std::uint32_t test(const Test& t, size_t i)
+			{
+				return t.template test<simd::Float8>(i);
+			}
+		};
+#endif
+
+#ifdef KVANT_SPATIAL_AVX512
+		template <>
+		struct Lanes<16>
+		{
+			template <typename Test>
+			static std::uint32_t test(const Test& t, size_t i)
+			{
+				return t.template test<simd::Float16>(i);
+			}
+		};
+#endif
+
+		template <unsigned Width, typename Test>
+		inline std::uint32_t test_mask(const Test& t)
+		{
+			static_assert(Width == 4 || Width == 8 || Width == 16, "Batches are 4, 8 or 16 wide.");
+			return Lanes<Width>::test(t, 0);
+		}
+
+		// Stream compaction of the hits, the widest lanes there are and one at a time for
+		// the rest.
+		template <typename Test>
+		inline size_t test_batch(const Test& t, size_t count, std::uint32_t* hits)
+		{
+			const unsigned width = simd::max_width;
+			size_t num_hits = 0;
+			size_t i = 0;
+
+#ifdef KVANT_SPATIAL_AVX512
+			const __m512i lane_index = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+			for (; i + width <= count; i += width)
+			{
+				const __mmask16 mask = static_cast<__mmask16>(Lanes<width>::test(t, i));
+				const __m512i index = _mm512_add_epi32(_mm512_set1_epi32(static_cast<int>(i)), lane_index);
+				_mm512_mask_compressstoreu_epi32(hits + num_hits, mask, index);
+				num_hits += simd::count_bits(mask);
+			}
+#else
+			for (; i + width <= count; i += width)
+			{
+				for (std::uint32_t mask = Lanes<width>::test(t, i); mask != 0; mask &= mask - 1)
+				{
+					hits[num_hits++] = static_cast<std::uint32_t>(i + simd::lowest_bit(mask));
+				}
+			}
+#endif
+
+			for (; i < count; ++i)
+			{
+				hits[num_hits] = static_cast<std::uint32_t>(i);
+				num_hits += Lanes<1>::test(t, i);
+			}
+
+			return num_hits;
+		}
+	} // namespace detail
+
+	template <unsigned Width>
+	inline std::uint32_t test_point_circle_mask(const Point& point,
+												const float* center_x,
+												const float* center_y,
+												const float* radius)
+	{
+		return detail::test_mask<Width>(detail::Point_circle_lanes{point, center_x, center_y, radius});
+	}
+
+	inline size_t test_point_circle_batch(	const Point& point,
+											const float* center_x,
+											const float* center_y,
+											const float* radius,
+											size_t count,
+											std::uint32_t* hits)
+	{
+		return detail::test_batch(detail::Point_circle_lanes{point, center_x, center_y, radius}, count, hits);
+	}
+
+	template <unsigned Width>
+	inline std::uint32_t test_circle_circle_mask(	const Point& center, float radius,
+													const float* center_x,
+													const float* center_y,
+													const float* radii)
+	{
+		return detail::test_mask<Width>(detail::Circle_circle_lanes{center, radius, center_x, center_y, radii});
+	}
+
+	inline size_t test_circle_circle_batch(	const Point& center, float radius,
+											const float* center_x,
+											const float* center_y,
+											const float* radii,
+											size_t count,
+											std::uint32_t* hits)
+	{
+		return detail::test_batch(detail::Circle_circle_lanes{center, radius, center_x, center_y, radii}, count, hits);
+	}
+
+	template <unsigned Width>
+	inline std::uint32_t test_point_rect_mask(	const Point& point,
+												const float* center_x,
+												const float* center_y,
+												const float* dim_x,
+												const float* dim_y)
+	{
+		return detail::test_mask<Width>(detail::Point_rect_lanes{point, center_x, center_y, dim_x, dim_y});
+	}
+
+	inline size_t test_point_rect_batch(const Point& point,
+										const float* center_x,
+										const float* center_y,
+										const float* dim_x,
+										const float* dim_y,
+										size_t count,
+										std::uint32_t* hits)
+	{
+		return detail::test_batch(detail::Point_rect_lanes{point, center_x, center_y, dim_x, dim_y}, count, hits);
+	}
+
+	template <unsigned Width>
+	inline std::uint32_t test_circle_rect_mask(	const Point& circle_center,
+												float radius,
+												const float* center_x,
+												const float* center_y,
+												const float* dim_x,
+												const float* dim_y)
+	{
+		return detail::test_mask<Width>(detail::Circle_rect_lanes{circle_center, radius, center_x, center_y, dim_x, dim_y});
+	}
+
+	inline size_t test_circle_rect_batch(	const Point& circle_center,
+											float radius,
+											const float* center_x,
+											const float* center_y,
+											const float* dim_x,
+											const float* dim_y,
+											size_t count,
+											std::uint32_t* hits)
+	{
+		return detail::test_batch(detail::Circle_rect_lanes{circle_center, radius, center_x, center_y, dim_x, dim_y}, count, hits);
+	}
 
 	template <typename Point = glm::vec2>
 	struct Circle
 	{
 		using Float = decltype(Point::x);
 
+		Circle() = default;
+
 		Circle(const Point& c, Float r)
 			: center(c)
 			, radius(r)
 		{ }
 
+		// Saturated to the range of integer coordinates.
 		Point min() const
 		{
-			return Point(center.x - radius, center.y - radius);
+			using Traits = Point_traits<Point>;
+			return Point(Traits::subtract(center.x, radius), Traits::subtract(center.y, radius));
 		}
 
 		Point max() const
 		{
-			return Point(center.x + radius, center.y + radius);
+			using Traits = Point_traits<Point>;
+			return Point(Traits::add(center.x, radius), Traits::add(center.y, radius));
 		}
 
 		Point center;
@@ -96,6 +493,10 @@ namespace spatial {
 	struct Rectangle
 	{
 		using Float = decltype(Point::x);
+		using Difference = typename Point_traits<Point>::Difference;
+		using Squared = typename Point_traits<Point>::Squared;
+
+		Rectangle() = default;
 
 		Rectangle(	const Point& min_,
 					const Point& max_)
@@ -135,24 +536,25 @@ namespace spatial {
 						Rectangle(Point(c[0], min[1]), Point(max[0], c[1]))};
 		}
 
-		Float width() const
+		Difference width() const
 		{
-			return max[0] - min[0];
+			return Point_traits<Point>::difference(max[0], min[0]);
 		}
 
-		Float height() const
+		Difference height() const
 		{
-			return max[1] - min[1];
+			return Point_traits<Point>::difference(max[1], min[1]);
 		}
 
-		Float area() const
+		Squared area() const
 		{
-			return width()*height();
+			return static_cast<Squared>(width())*static_cast<Squared>(height());
 		}
 
 		Point center() const
 		{
-			return (max - min)/Point(2) + min;
+			return Point(	static_cast<Float>(min[0] + width()/2),
+							static_cast<Float>(min[1] + height()/2));
 		}
 
 		template <typename Shape>
@@ -174,4 +576,185 @@ namespace spatial {
 		Point max;
 	};
 
+	template <typename Point = glm::vec2>
+	struct Ray
+	{
+		using Float = decltype(Point::x);
+
+		Ray() = default;
+
+		Ray(const Point& origin_,
+			const Point& direction_)
+			: origin(origin_)
+			, direction(direction_)
+		{ }
+
+		Point at(Float t) const
+		{
+			return origin + direction*t;
+		}
+
+		Point origin;
+		Point direction; // Not necessarily normalized, t is in units of its length.
+	};
+
+
+	// Axis aligned bounds of a shape.
+	template <typename Point>
+	inline Rectangle<Point> bounding_rect(const Circle<Point>& circle)
+	{
+		return Rectangle<Point>(circle.min(), circle.max());
+	}
+
+	template <typename Point>
+	inline const Rectangle<Point>& bounding_rect(const Rectangle<Point>& rect)
+	{
+		return rect;
+	}
+
+	// The point type of a Circle or a Rectangle.
+	template <typename Shape>
+	struct Shape_point;
+
+	template <typename Point>
+	struct Shape_point<Circle<Point>>
+	{
+		using type = Point;
+	};
+
+	template <typename Point>
+	struct Shape_point<Rectangle<Point>>
+	{
+		using type = Point;
+	};
+
+	// Overlap tests, touching shapes are considered overlapping.
+	template <typename Point>
+	inline bool intersects(	const Rectangle<Point>& a,
+							const Rectangle<Point>& b)
+	{
+		return	a.min[0] <= b.max[0] &&
+				b.min[0] <= a.max[0] &&
+				a.min[1] <= b.max[1] &&
+				b.min[1] <= a.max[1];
+	}
+
+	template <typename Point>
+	inline bool intersects(	const Circle<Point>& circle,
+							const Rectangle<Point>& rect)
+	{
+		using Traits = Point_traits<Point>;
+		const auto dx = Traits::difference(limit(circle.center[0], rect.min[0], rect.max[0]), circle.center[0]);
+		const auto dy = Traits::difference(limit(circle.center[1], rect.min[1], rect.max[1]), circle.center[1]);
+		return Traits::squared_length(dx, dy) <= Traits::square(circle.radius);
+	}
+
+	template <typename Point>
+	inline bool intersects(	const Rectangle<Point>& rect,
+							const Circle<Point>& circle)
+	{
+		return intersects(circle, rect);
+	}
+
+	template <typename Point>
+	inline bool intersects(	const Circle<Point>& a,
+							const Circle<Point>& b)
+	{
+		using Traits = Point_traits<Point>;
+		const typename Traits::Difference r = static_cast<typename Traits::Difference>(a.radius) + b.radius;
+		return	Traits::squared_length(	Traits::difference(b.center[0], a.center[0]),
+										Traits::difference(b.center[1], a.center[1])) <= Traits::square(r);
+	}
+
+	// First point along a ray within [0, max_t] where it enters a shape. Rays starting inside
+	// hit at t = 0.
+	template <typename Point>
+	inline bool raycast(const Ray<Point>& ray,
+						const Rectangle<Point>& rect,
+						typename Ray<Point>::Float max_t,
+						typename Ray<Point>::Float& t)
+	{
+		// Slab test, the ray is inside the rectangle where it is inside both slabs.
+		typename Ray<Point>::Float t_min = 0;
+		typename Ray<Point>::Float t_max = max_t;
+
+		for (unsigned axis = 0; axis < 2; ++axis)
+		{
+			if (ray.direction[axis] == 0)
+			{
+				if (ray.origin[axis] < rect.min[axis] || rect.max[axis] < ray.origin[axis])
+					return false;
+				continue;
+			}
+
+			const auto inv = 1/ray.direction[axis];
+			auto t0 = (rect.min[axis] - ray.origin[axis])*inv;
+			auto t1 = (rect.max[axis] - ray.origin[axis])*inv;
+			if (inv < 0)
+				std::swap(t0, t1);
+
+			t_min = std::max(t_min, t0);
+			t_max = std::min(t_max, t1);
+			if (t_max < t_min)
+				return false;
+		}
+
+		t = t_min;
+		return true;
+	}
+
+	template <typename Point>
+	inline bool raycast(const Ray<Point>& ray,
+						const Circle<Point>& circle,
+						typename Ray<Point>::Float max_t,
+						typename Ray<Point>::Float& t)
+	{
+		// Solves |m + t*d| = r for the smaller t, with m from the center to the origin.
+		const Point m = ray.origin - circle.center;
+		const auto c = m[0]*m[0] + m[1]*m[1] - circle.radius*circle.radius;
+		if (c <= 0)
+		{
+			t = 0;
+			return 0 <= max_t;
+		}
+
+		const auto b = m[0]*ray.direction[0] + m[1]*ray.direction[1];
+		if (0 <= b)
+			return false; // Outside and pointing away.
+
+		const auto a = ray.direction[0]*ray.direction[0] + ray.direction[1]*ray.direction[1];
+		const auto discriminant = b*b - a*c;
+		if (discriminant < 0)
+			return false;
+
+		const auto hit = (-b - std::sqrt(discriminant))/a;
+		if (max_t < hit)
+			return false;
+
+		t = hit;
+		return true;
+	}
+
+	// Squared distance from a point to the nearest point of a shape, zero inside. Exact for
+	// rectangles, rounded down for circles with integer coordinates.
+	template <typename Point>
+	inline typename Point_traits<Point>::Squared distance_squared(	const Point& point,
+																	const Rectangle<Point>& rect)
+	{
+		using Traits = Point_traits<Point>;
+		return	Traits::squared_length(	Traits::difference(limit(point[0], rect.min[0], rect.max[0]), point[0]),
+										Traits::difference(limit(point[1], rect.min[1], rect.max[1]), point[1]));
+	}
+
+	template <typename Point>
+	inline typename Point_traits<Point>::Squared distance_squared(	const Point& point,
+																	const Circle<Point>& circle)
+	{
+		using Traits = Point_traits<Point>;
+		const auto length_squared = Traits::squared_length(	Traits::difference(point[0], circle.center[0]),
+															Traits::difference(point[1], circle.center[1]));
+		const auto distance = std::sqrt(length_squared) - circle.radius;
+		return distance <= 0 ? 0 : static_cast<typename Traits::Squared>(distance*distance);
+	}
+
 }}
@@ -0,0 +1,344 @@
+#pragma once
+#include <cstdint>
+
+// SSE2 is part of every x86-64 target, and can be enabled on 32 bit x86.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define KVANT_SPATIAL_SSE2
+#endif
+
+// The float instructions eight wide are in AVX, AVX2 adds the integer ones.
+#if defined(__AVX__)
+#include <immintrin.h>
+#define KVANT_SPATIAL_AVX
+#endif
+
+#if defined(__AVX512F__)
+#define KVANT_SPATIAL_AVX512
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace kvant {
+namespace spatial {
+namespace simd {
+
+    // Index of the lowest set bit, the mask must not be zero.
+    inline unsigned lowest_bit(std::uint32_t mask)
+    {
+#if defined(__GNUC__)
+        return static_cast<unsigned>(__builtin_ctz(mask));
+#elif defined(_MSC_VER)
+        unsigned long bit;
+        _BitScanForward(&bit, mask);
+        return static_cast<unsigned>(bit);
+#else
+        unsigned bit = 0;
+        while ((mask & 1u) == 0)
+        {
+            mask >>= 1;
+            ++bit;
+        }
+        return bit;
+#endif
+    }
+
+    inline unsigned count_bits(std::uint32_t mask)
+    {
+#if defined(__GNUC__)
+        return static_cast<unsigned>(__builtin_popcount(mask));
+#else
+        unsigned count = 0;
+        for (; mask != 0; mask &= mask - 1)
+        {
+            ++count;
+        }
+        return count;
+#endif
+    }
+
+    // Lanes of floats, so a test can be written once for every width. Each type has load()
+    // of unaligned floats, set() to broadcast one, arithmetic, min, max and comparisons
+    // giving a mask. bits() turns a mask into an integer, bit i for lane i.
+    //
+    // Float1 is the fallback without vector instructions, and for the tail of arrays.
+    struct Float1 {
+        static const unsigned width = 1;
+        float v;
+
+        static Float1 load(const float* p)
+        {
+            return {*p};
+        }
+
+        static Float1 set(float f)
+        {
+            return {f};
+        }
+    };
+
+    struct Mask1 {
+        bool v;
+    };
+
+    inline Float1 operator+(Float1 a, Float1 b)
+    {
+        return {a.v + b.v};
+    }
+
+    inline Float1 operator-(Float1 a, Float1 b)
+    {
+        return {a.v - b.v};
+    }
+
+    inline Float1 operator*(Float1 a, Float1 b)
+    {
+        return {a.v * b.v};
+    }
+
+    inline Float1 min(Float1 a, Float1 b)
+    {
+        return {b.v < a.v ? b.v : a.v};
+    }
+
+    inline Float1 max(Float1 a, Float1 b)
+    {
+        return {a.v < b.v ? b.v : a.v};
+    }
+
+    inline Mask1 operator<=(Float1 a, Float1 b)
+    {
+        return {a.v <= b.v};
+    }
+
+    inline Mask1 operator<(Float1 a, Float1 b)
+    {
+        return {a.v < b.v};
+    }
+
+    inline Mask1 operator&(Mask1 a, Mask1 b)
+    {
+        return {a.v && b.v};
+    }
+
+    inline std::uint32_t bits(Mask1 m)
+    {
+        return m.v ? 1u : 0u;
+    }
+
+#ifdef KVANT_SPATIAL_SSE2
+    struct Float4 {
+        static const unsigned width = 4;
+        __m128 v;
+
+        static Float4 load(const float* p)
+        {
+            return {_mm_loadu_ps(p)};
+        }
+
+        static Float4 set(float f)
+        {
+            return {_mm_set1_ps(f)};
+        }
+    };
+
+    struct Mask4 {
+        __m128 v;
+    };
+
+    inline Float4 operator+(Float4 a, Float4 b)
+    {
+        return {_mm_add_ps(a.v, b.v)};
+    }
+
+    inline Float4 operator-(Float4 a, Float4 b)
+    {
+        return {_mm_sub_ps(a.v, b.v)};
+    }
+
+    inline Float4 operator*(Float4 a, Float4 b)
+    {
+        return {_mm_mul_ps(a.v, b.v)};
+    }
+
+    inline Float4 min(Float4 a, Float4 b)
+    {
+        return {_mm_min_ps(a.v, b.v)};
+    }
+
+    inline Float4 max(Float4 a, Float4 b)
+    {
+        return {_mm_max_ps(a.v, b.v)};
+    }
+
+    inline Mask4 operator<=(Float4 a, Float4 b)
+    {
+        return {_mm_cmple_ps(a.v, b.v)};
+    }
+
+    inline Mask4 operator<(Float4 a, Float4 b)
+    {
+        return {_mm_cmplt_ps(a.v, b.v)};
+    }
+
+    inline Mask4 operator&(Mask4 a, Mask4 b)
+    {
+        return {_mm_and_ps(a.v, b.v)};
+    }
+
+    inline std::uint32_t bits(Mask4 m)
+    {
+        return static_cast<std::uint32_t>(_mm_movemask_ps(m.v));
+    }
+#endif
+
+#ifdef KVANT_SPATIAL_AVX
+    struct Float8 {
+        static const unsigned width = 8;
+        __m256 v;
+
+        static Float8 load(const float* p)
+        {
+            return {_mm256_loadu_ps(p)};
+        }
+
+        static Float8 set(float f)
+        {
+            return {_mm256_set1_ps(f)};
+        }
+    };
+
+    struct Mask8 {
+        __m256 v;
+    };
+
+    inline Float8 operator+(Float8 a, Float8 b)
+    {
+        return {_mm256_add_ps(a.v, b.v)};
+    }
+
+    inline Float8 operator-(Float8 a, Float8 b)
+    {
+        return {_mm256_sub_ps(a.v, b.v)};
+    }
+
+    inline Float8 operator*(Float8 a, Float8 b)
+    {
+        return {_mm256_mul_ps(a.v, b.v)};
+    }
+
+    inline Float8 min(Float8 a, Float8 b)
+    {
+        return {_mm256_min_ps(a.v, b.v)};
+    }
+
+    inline Float8 max(Float8 a, Float8 b)
+    {
+        return {_mm256_max_ps(a.v, b.v)};
+    }
+
+    inline Mask8 operator<=(Float8 a, Float8 b)
+    {
+        return {_mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ)};
+    }
+
+    inline Mask8 operator<(Float8 a, Float8 b)
+    {
+        return {_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ)};
+    }
+
+    inline Mask8 operator&(Mask8 a, Mask8 b)
+    {
+        return {_mm256_and_ps(a.v, b.v)};
+    }
+
+    inline std::uint32_t bits(Mask8 m)
+    {
+        return static_cast<std::uint32_t>(_mm256_movemask_ps(m.v));
+    }
+#endif
+
+#ifdef KVANT_SPATIAL_AVX512
+    struct Float16 {
+        static const unsigned width = 16;
+        __m512 v;
+
+        static Float16 load(const float* p)
+        {
+            return {_mm512_loadu_ps(p)};
+        }
+
+        static Float16 set(float f)
+        {
+            return {_mm512_set1_ps(f)};
+        }
+    };
+
+    struct Mask16 {
+        __mmask16 v;
+    };
+
+    inline Float16 operator+(Float16 a, Float16 b)
+    {
+        return {_mm512_add_ps(a.v, b.v)};
+    }
+
+    inline Float16 operator-(Float16 a, Float16 b)
+    {
+        return {_mm512_sub_ps(a.v, b.v)};
+    }
+
+    inline Float16 operator*(Float16 a, Float16 b)
+    {
+        return {_mm512_mul_ps(a.v, b.v)};
+    }
+
+    // Masked with every lane set, since GCC implements the unmasked forms with an undefined
+    // pass-through operand, which -Wmaybe-uninitialized reports.
+    inline Float16 min(Float16 a, Float16 b)
+    {
+        return {_mm512_mask_min_ps(a.v, 0xffff, a.v, b.v)};
+    }
+
+    inline Float16 max(Float16 a, Float16 b)
+    {
+        return {_mm512_mask_max_ps(a.v, 0xffff, a.v, b.v)};
+    }
+
+    inline Mask16 operator<=(Float16 a, Float16 b)
+    {
+        return {_mm512_cmp_ps_mask(a.v, b.v, _CMP_LE_OQ)};
+    }
+
+    inline Mask16 operator<(Float16 a, Float16 b)
+    {
+        return {_mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ)};
+    }
+
+    inline Mask16 operator&(Mask16 a, Mask16 b)
+    {
+        return {static_cast<__mmask16>(a.v & b.v)};
+    }
+
+    inline std::uint32_t bits(Mask16 m)
+    {
+        return m.v;
+    }
+#endif
+
+    // The widest lanes there are instructions for.
+#if defined(KVANT_SPATIAL_AVX512)
+    const unsigned max_width = 16;
+#elif defined(KVANT_SPATIAL_AVX)
+    const unsigned max_width = 8;
+#elif defined(KVANT_SPATIAL_SSE2)
+    const unsigned max_width = 4;
+#else
+    const unsigned max_width = 1;
+#endif
+
+} // namespace simd
+} // namespace spatial
+} // namespace kvant
@@ -0,0 +1,231 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+// Define KVANT_SPATIAL_STATS to count nodes visited and shapes tested by the queries of the
+// spatial indices. Without it the counting compiles to nothing, and the counters read zero.
+//
+// The counters are a template parameter of the trees, defaulting to the ones of the setting
+// of the file. A Quad_tree<Item> built with counting is then another type than one built
+// without, so files built either way can be linked together.
+
+namespace kvant {
+namespace spatial {
+
+#ifdef KVANT_SPATIAL_STATS
+    // The counting types get different names with and without counting, so that the
+    // trees using them do too.
+    inline namespace counting {
+
+    class Query_count;
+
+    // Totals over all queries. Queries count locally and add once at the end, so the
+    // counters are only touched once per query even when many threads query at once.
+    struct Query_counters {
+        using Count = Query_count;
+
+        std::atomic<std::uint64_t> queries{0};
+        std::atomic<std::uint64_t> nodes_visited{0};
+        std::atomic<std::uint64_t> shape_tests{0};
+
+        Query_counters() = default;
+
+        Query_counters(const Query_counters& other)
+        {
+            *this = other;
+        }
+
+        Query_counters& operator=(const Query_counters& other)
+        {
+            queries = other.queries.load(std::memory_order_relaxed);
+            nodes_visited = other.nodes_visited.load(std::memory_order_relaxed);
+            shape_tests = other.shape_tests.load(std::memory_order_relaxed);
+            return *this;
+        }
+
+        void reset()
+        {
+            queries = 0;
+            nodes_visited = 0;
+            shape_tests = 0;
+        }
+    };
+
+    // Counts one query, or num_queries run together.
+    class Query_count {
+    public:
+        explicit Query_count(Query_counters& totals, unsigned num_queries = 1)
+            : totals_(totals)
+            , num_queries_(num_queries)
+        {
+        }
+
+        ~Query_count()
+        {
+            totals_.queries.fetch_add(num_queries_, std::memory_order_relaxed);
+            totals_.nodes_visited.fetch_add(nodes_visited_, std::memory_order_relaxed);
+            totals_.shape_tests.fetch_add(shape_tests_, std::memory_order_relaxed);
+        }
+
+        void visit(unsigned count = 1)
+        {
+            nodes_visited_ += count;
+        }
+
+        void test(unsigned count = 1)
+        {
+            shape_tests_ += count;
+        }
+
+    private:
+        Query_counters& totals_;
+        unsigned num_queries_;
+        std::uint64_t nodes_visited_{0};
+        std::uint64_t shape_tests_{0};
+    };
+
+    } // namespace counting
+#else
+    inline namespace not_counting {
+
+    class Query_count;
+
+    struct Query_counters {
+        using Count = Query_count;
+
+        static const std::uint64_t queries = 0;
+        static const std::uint64_t nodes_visited = 0;
+        static const std::uint64_t shape_tests = 0;
+
+        void reset()
+        {
+        }
+    };
+
+    class Query_count {
+    public:
+        explicit Query_count(const Query_counters&, unsigned = 1)
+        {
+        }
+
+        void visit(unsigned = 1)
+        {
+        }
+
+        void test(unsigned = 1)
+        {
+        }
+    };
+
+    } // namespace not_counting
+#endif
+
+    // How full the blocks of a Block_storage are.
+    struct Storage_stats {
+        size_t num_blocks{0};      // Blocks in use.
+        size_t num_free_blocks{0}; // Released blocks kept for reuse.
+        size_t num_items{0};
+        size_t item_capacity{0};   // Room for items in the blocks in use.
+
+        double utilisation() const
+        {
+            return item_capacity == 0 ? 0.0 : static_cast<double>(num_items) / item_capacity;
+        }
+    };
+
+    struct Quad_tree_stats {
+        size_t num_items{0};
+        size_t num_nodes{0};
+        size_t num_leaves{0};
+
+        // Items in nodes with children, which every query passing the node has to test.
+        size_t items_in_inner_nodes{0};
+
+        // Indexed by depth.
+        std::vector<size_t> nodes_per_depth;
+        std::vector<size_t> items_per_depth;
+
+        // Number of nodes with i items, the last entry counts the nodes with more.
+        std::vector<size_t> items_per_node;
+
+        // Since the last reset, zero unless built with KVANT_SPATIAL_STATS.
+        std::uint64_t queries{0};
+        std::uint64_t nodes_visited{0};
+        std::uint64_t shape_tests{0};
+
+        Storage_stats storage;
+
+        double inner_fraction() const
+        {
+            return num_items == 0 ? 0.0 : static_cast<double>(items_in_inner_nodes) / num_items;
+        }
+
+        double nodes_per_query() const
+        {
+            return queries == 0 ? 0.0 : static_cast<double>(nodes_visited) / queries;
+        }
+
+        double tests_per_query() const
+        {
+            return queries == 0 ? 0.0 : static_cast<double>(shape_tests) / queries;
+        }
+
+        void write_text(std::ostream& out) const
+        {
+            out << "items " << num_items << ", nodes " << num_nodes << " (" << num_leaves << " leaves)\n";
+            out << "items in inner nodes " << items_in_inner_nodes << " (" << inner_fraction() * 100.0 << "%)\n";
+
+            out << "depth  nodes  items\n";
+            for (size_t depth = 0; depth < nodes_per_depth.size(); ++depth)
+            {
+                out << depth << "  " << nodes_per_depth[depth] << "  " << items_per_depth[depth] << "\n";
+            }
+
+            out << "items per node";
+            for (size_t i = 0; i < items_per_node.size(); ++i)
+            {
+                out << " " << i << (i + 1 == items_per_node.size() ? "+:" : ":") << items_per_node[i];
+            }
+            out << "\n";
+
+            out << "blocks " << storage.num_blocks << " (" << storage.num_free_blocks << " free), utilisation "
+                << storage.utilisation() * 100.0 << "%\n";
+            out << "queries " << queries << ", nodes/query " << nodes_per_query() << ", tests/query " << tests_per_query() << "\n";
+        }
+
+        void write_json(std::ostream& out) const
+        {
+            const auto write_array = [&out](const std::vector<size_t>& values) {
+                out << "[";
+                for (size_t i = 0; i < values.size(); ++i)
+                {
+                    out << (i == 0 ? "" : ", ") << values[i];
+                }
+                out << "]";
+            };
+
+            out << "{\"items\": " << num_items
+                << ", \"nodes\": " << num_nodes
+                << ", \"leaves\": " << num_leaves
+                << ", \"items_in_inner_nodes\": " << items_in_inner_nodes
+                << ", \"nodes_per_depth\": ";
+            write_array(nodes_per_depth);
+            out << ", \"items_per_depth\": ";
+            write_array(items_per_depth);
+            out << ", \"items_per_node\": ";
+            write_array(items_per_node);
+            out << ", \"storage\": {\"blocks\": " << storage.num_blocks
+                << ", \"free_blocks\": " << storage.num_free_blocks
+                << ", \"items\": " << storage.num_items
+                << ", \"item_capacity\": " << storage.item_capacity << "}"
+                << ", \"queries\": " << queries
+                << ", \"nodes_visited\": " << nodes_visited
+                << ", \"shape_tests\": " << shape_tests << "}";
+        }
+    };
+
+} // namespace spatial
+} // namespace kvant
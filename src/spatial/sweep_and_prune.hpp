@@ -0,0 +1,198 @@
+#pragma once
+#include "shapes.hpp"
+#include "simd.hpp"
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+namespace kvant {
+namespace spatial {
+
+    // Sort and sweep broad-phase. The bounds are kept sorted on their minimum x across
+    // frames, so when items only move a little the insertion sort that restores the order
+    // is close to linear. The sweep then only has to test the y overlap of items whose x
+    // intervals overlap, several at a time.
+    //
+    // Item must provide bounding_shape(), returning a Circle or a Rectangle.
+    template <typename Item>
+    class Sweep_and_prune {
+        using Rectangle = spatial::Rectangle<glm::vec2>;
+
+    public:
+        // Stays valid until the item is removed.
+        using Handle = std::uint32_t;
+
+        Handle insert(const Item& item)
+        {
+            Handle handle;
+            if (free_handles_.empty())
+            {
+                handle = static_cast<Handle>(items_.size());
+                items_.push_back(item);
+                positions_.push_back(0);
+            }
+            else
+            {
+                handle = free_handles_.back();
+                free_handles_.pop_back();
+                items_[handle] = item;
+            }
+
+            // Appended, and sorted into place with the rest.
+            const Rectangle bounds(bounding_rect(item.bounding_shape()));
+            positions_[handle] = static_cast<std::uint32_t>(handles_.size());
+            handles_.push_back(handle);
+            min_x_.push_back(bounds.min.x);
+            max_x_.push_back(bounds.max.x);
+            min_y_.push_back(bounds.min.y);
+            max_y_.push_back(bounds.max.y);
+
+            return handle;
+        }
+
+        void remove(Handle handle)
+        {
+            const std::uint32_t position = positions_[handle];
+            handles_.erase(handles_.begin() + position);
+            min_x_.erase(min_x_.begin() + position);
+            max_x_.erase(max_x_.begin() + position);
+            min_y_.erase(min_y_.begin() + position);
+            max_y_.erase(max_y_.begin() + position);
+
+            for (std::uint32_t i = position; i < handles_.size(); ++i)
+            {
+                positions_[handles_[i]] = i;
+            }
+
+            free_handles_.push_back(handle);
+        }
+
+        template <typename Shape>
+        void update(Handle handle, const Shape& new_bounds)
+        {
+            const Rectangle bounds(bounding_rect(new_bounds));
+            const std::uint32_t position = positions_[handle];
+            min_x_[position] = bounds.min.x;
+            max_x_[position] = bounds.max.x;
+            min_y_[position] = bounds.min.y;
+            max_y_[position] = bounds.max.y;
+        }
+
+        const Item& get(Handle handle) const
+        {
+            return items_[handle];
+        }
+
+        Item& get(Handle handle)
+        {
+            return items_[handle];
+        }
+
+        size_t size() const
+        {
+            return handles_.size();
+        }
+
+    public:
+        // Calls fun(handle_a, handle_b) once for every pair of items with overlapping bounds.
+        template <typename Fun>
+        void for_each_overlapping_pair(Fun&& fun)
+        {
+            sort();
+
+            const std::uint32_t count = static_cast<std::uint32_t>(handles_.size());
+
+            for (std::uint32_t i = 0; i < count; ++i)
+            {
+                // Everything overlapping on x follows directly in the sorted order.
+                const float max_x = max_x_[i];
+                std::uint32_t end = i + 1;
+                while (end < count && min_x_[end] <= max_x)
+                {
+                    ++end;
+                }
+
+                const float min_y = min_y_[i];
+                const float max_y = max_y_[i];
+                std::uint32_t j = i + 1;
+
+#ifdef KVANT_SPATIAL_SSE2
+                const __m128 min_y4 = _mm_set1_ps(min_y);
+                const __m128 max_y4 = _mm_set1_ps(max_y);
+
+                for (; j + 4 <= end; j += 4)
+                {
+                    const __m128 overlap = _mm_and_ps(_mm_cmple_ps(_mm_loadu_ps(&min_y_[j]), max_y4),
+                                                      _mm_cmple_ps(min_y4, _mm_loadu_ps(&max_y_[j])));
+
+                    for (unsigned mask = static_cast<unsigned>(_mm_movemask_ps(overlap)); mask != 0; mask &= mask - 1)
+                    {
+                        fun(handles_[i], handles_[j + simd::lowest_bit(mask)]);
+                    }
+                }
+#endif
+                for (; j < end; ++j)
+                {
+                    if (min_y_[j] <= max_y && min_y <= max_y_[j])
+                    {
+                        fun(handles_[i], handles_[j]);
+                    }
+                }
+            }
+        }
+
+    private:
+        // Insertion sort on min x, cheap when the order from the last frame mostly holds.
+        void sort()
+        {
+            const std::uint32_t count = static_cast<std::uint32_t>(handles_.size());
+
+            for (std::uint32_t i = 1; i < count; ++i)
+            {
+                const float key = min_x_[i];
+                if (min_x_[i - 1] <= key)
+                {
+                    continue;
+                }
+
+                const Handle handle = handles_[i];
+                const float max_x = max_x_[i];
+                const float min_y = min_y_[i];
+                const float max_y = max_y_[i];
+
+                std::uint32_t j = i;
+                for (; j > 0 && key < min_x_[j - 1]; --j)
+                {
+                    handles_[j] = handles_[j - 1];
+                    min_x_[j] = min_x_[j - 1];
+                    max_x_[j] = max_x_[j - 1];
+                    min_y_[j] = min_y_[j - 1];
+                    max_y_[j] = max_y_[j - 1];
+                    positions_[handles_[j]] = j;
+                }
+
+                handles_[j] = handle;
+                min_x_[j] = key;
+                max_x_[j] = max_x;
+                min_y_[j] = min_y;
+                max_y_[j] = max_y;
+                positions_[handle] = j;
+            }
+        }
+
+    private:
+        // By handle.
+        std::vector<Item> items_;
+        std::vector<std::uint32_t> positions_;
+        std::vector<Handle> free_handles_;
+
+        // Bounds in sorted order.
+        std::vector<Handle> handles_;
+        std::vector<float> min_x_;
+        std::vector<float> max_x_;
+        std::vector<float> min_y_;
+        std::vector<float> max_y_;
+    };
+
+} // namespace spatial
+} // namespace kvant
@@ -0,0 +1,441 @@
+#pragma once
+#include "quad_tree.hpp"
+#include "shapes.hpp"
+#include "visitor.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace kvant {
+namespace spatial {
+
+    // A world larger than what is active at once, cut into square tiles. Each tile has a
+    // Quad_tree of its own, over the tile. Tiles are loaded on a thread of their own around
+    // a focus point, and unloaded again when the focus moves away, so only a bounded set of
+    // tiles is resident.
+    //
+    // The load function fills the items of a tile, from a file or generated. It runs on the
+    // loading thread, which also builds the tree of the tile; update() then swaps finished
+    // tiles in on the calling thread. An item belongs to the tile of the center of its
+    // bounds, but may reach into the neighbouring tiles, and queries look into every tile
+    // whose items they may touch.
+    //
+    // update() and the queries are for one thread only. Item must provide bounding_shape(),
+    // returning a Circle or a Rectangle in floats. Counters are those of the trees, see
+    // Quad_tree.
+    template <typename Item, typename Counters = Query_counters>
+    class Tiled_world {
+        using Point = glm::vec2;
+        using Rectangle = spatial::Rectangle<Point>;
+        using Tree = Quad_tree<Item, Block_storage, Counters>;
+
+    public:
+        struct Tile_coord {
+            std::int32_t x;
+            std::int32_t y;
+
+            bool operator==(const Tile_coord& other) const
+            {
+                return x == other.x && y == other.y;
+            }
+        };
+
+        using Load_function = std::function<void(Tile_coord, std::vector<Item>&)>;
+
+        // Tiles up to load_radius tiles away from the tile of the focus are loaded, nearest
+        // first, and tiles more than one tile further away are unloaded. No more than
+        // max_resident tiles are resident or loading at once.
+        Tiled_world(float tile_size,
+                    unsigned load_radius,
+                    unsigned max_resident,
+                    Load_function load)
+            : tile_size_(tile_size)
+            , load_radius_(static_cast<std::int32_t>(load_radius))
+            , max_resident_(max_resident)
+            , load_(std::move(load))
+        {
+            assert(tile_size > 0.0f);
+            assert(max_resident > 0);
+
+            loader_ = std::thread(&Tiled_world::loader_loop, this);
+        }
+
+        ~Tiled_world()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                quit_ = true;
+            }
+            wake_.notify_all();
+            loader_.join();
+        }
+
+        Tiled_world(const Tiled_world&) = delete;
+        Tiled_world& operator=(const Tiled_world&) = delete;
+
+    public:
+        Tile_coord tile_at(const Point& point) const
+        {
+            return {static_cast<std::int32_t>(std::floor(point.x / tile_size_)),
+                    static_cast<std::int32_t>(std::floor(point.y / tile_size_))};
+        }
+
+        Rectangle tile_rect(Tile_coord coord) const
+        {
+            const Point min(coord.x * tile_size_, coord.y * tile_size_);
+            return Rectangle(min, min + Point(tile_size_));
+        }
+
+        // Once per frame. Swaps in the tiles loaded since the last call, unloads the tiles
+        // the focus has left, and queues the loads of the tiles it approaches.
+        void update(const Point& focus)
+        {
+            const Tile_coord center = tile_at(focus);
+            focus_ = center;
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+
+                // Tiles left behind before their load started are dropped from the queue.
+                requests_.erase(std::remove_if(requests_.begin(), requests_.end(), [this](Tile_coord coord) {
+                                    return !should_keep(coord);
+                                }),
+                                requests_.end());
+
+                for (auto& tile : loaded_)
+                {
+                    if (should_keep(tile->coord))
+                    {
+                        resident_.push_back(std::move(tile));
+                    }
+                }
+                loaded_.clear();
+
+                pending_.erase(std::remove_if(pending_.begin(), pending_.end(), [this](Tile_coord coord) {
+                                   return !is_queued(coord) && !(loading_ && coord == current_);
+                               }),
+                               pending_.end());
+            }
+
+            resident_.erase(std::remove_if(resident_.begin(), resident_.end(), [this](const std::unique_ptr<Tile>& tile) {
+                                return !should_keep(tile->coord);
+                            }),
+                            resident_.end());
+
+            // Nearest first, so the tiles around the focus come in before the ones at the edge.
+            wanted_.clear();
+            for (std::int32_t y = center.y - load_radius_; y <= center.y + load_radius_; ++y)
+            {
+                for (std::int32_t x = center.x - load_radius_; x <= center.x + load_radius_; ++x)
+                {
+                    const Tile_coord coord{x, y};
+                    if (!is_resident(coord) && !is_pending(coord))
+                    {
+                        wanted_.push_back(coord);
+                    }
+                }
+            }
+
+            std::sort(wanted_.begin(), wanted_.end(), [this, &focus](Tile_coord a, Tile_coord b) {
+                return distance_squared(focus, tile_rect(a)) < distance_squared(focus, tile_rect(b));
+            });
+
+            bool requested = false;
+            for (Tile_coord coord : wanted_)
+            {
+                // Tiles further away make room for nearer ones.
+                if (resident_.size() + pending_.size() >= max_resident_ &&
+                    !evict_further_than(focus, distance_squared(focus, tile_rect(coord))))
+                {
+                    break;
+                }
+
+                std::lock_guard<std::mutex> lock(mutex_);
+                requests_.push_back(coord);
+                pending_.push_back(coord);
+                requested = true;
+            }
+
+            if (requested)
+            {
+                wake_.notify_one();
+            }
+        }
+
+        // Updates until every tile around the focus that fits in the budget is resident.
+        // For the start of a level, when there is nothing to show until the tiles are there.
+        void wait_until_loaded(const Point& focus)
+        {
+            update(focus);
+
+            while (!pending_.empty())
+            {
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    idle_.wait(lock, [this]() {
+                        return requests_.empty() && !loading_;
+                    });
+                }
+
+                update(focus);
+            }
+        }
+
+        bool is_resident(Tile_coord coord) const
+        {
+            return find_tile(coord) != nullptr;
+        }
+
+        size_t num_resident() const
+        {
+            return resident_.size();
+        }
+
+        // Tiles queued or being loaded.
+        size_t num_pending() const
+        {
+            return pending_.size();
+        }
+
+        // The tree of a resident tile, or null. Valid until the next update().
+        const Tree* tree(Tile_coord coord) const
+        {
+            const Tile* tile = find_tile(coord);
+            return tile != nullptr ? &tile->tree : nullptr;
+        }
+
+    public:
+        // Calls fun for every item of the resident tiles whose bounds intersect the shape
+        // (Circle or Rectangle). Returns false if the visitor stopped the traversal.
+        template <typename Shape, typename Fun>
+        bool for_each_intersecting(const Shape& shape, Fun&& fun) const
+        {
+            const Rectangle query_bounds(bounding_rect(shape));
+
+            for (const auto& tile : resident_)
+            {
+                if (intersects(query_bounds, tile->bounds) && !tile->tree.for_each_intersecting(shape, fun))
+                {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        struct Neighbour {
+            const Item* item; // Valid until the next update().
+            float distance_squared;
+        };
+
+        // Finds the k items nearest to the point in the resident tiles, no further away than
+        // max_distance, and writes them closest first to result, which must have room for
+        // k. Returns the number found.
+        size_t knn(const Point& point,
+                   size_t k,
+                   Neighbour* result,
+                   float max_distance = std::numeric_limits<float>::max()) const
+        {
+            // Nearest tiles first, so the search radius shrinks quickly.
+            struct Queued_tile {
+                float distance_squared;
+                const Tile* tile;
+            };
+            std::vector<Queued_tile> tiles;
+            for (const auto& tile : resident_)
+            {
+                tiles.push_back({distance_squared(point, tile->bounds), tile.get()});
+            }
+            std::sort(tiles.begin(), tiles.end(), [](const Queued_tile& a, const Queued_tile& b) {
+                return a.distance_squared < b.distance_squared;
+            });
+
+            size_t found = 0;
+            std::vector<typename Tree::Neighbour> tile_result(k);
+            std::vector<Neighbour> merged;
+
+            for (const Queued_tile& queued : tiles)
+            {
+                const float bound = found == k ? result[k - 1].distance_squared : max_distance * max_distance;
+                if (k == 0 || bound < queued.distance_squared)
+                {
+                    break;
+                }
+
+                const Tree& tree = queued.tile->tree;
+                const size_t tile_found = tree.knn(point, k, tile_result.data(), max_distance);
+
+                merged.clear();
+                for (size_t i = 0; i < tile_found; ++i)
+                {
+                    merged.push_back({&tree.get(tile_result[i].handle), tile_result[i].distance_squared});
+                }
+
+                const size_t before = merged.size();
+                merged.insert(merged.end(), result, result + found);
+                std::inplace_merge(merged.begin(), merged.begin() + before, merged.end(), [](const Neighbour& a, const Neighbour& b) {
+                    return a.distance_squared < b.distance_squared;
+                });
+
+                found = std::min(k, merged.size());
+                std::copy(merged.begin(), merged.begin() + found, result);
+            }
+
+            return found;
+        }
+
+    private:
+        struct Tile {
+            Tile(Tile_coord coord_, const Rectangle& rect)
+                : coord(coord_)
+                , tree(rect)
+                , bounds(rect)
+            {
+            }
+
+            Tile_coord coord;
+            Tree tree;
+
+            // The tile, grown to the bounds of its items.
+            Rectangle bounds;
+        };
+
+        std::int32_t tile_distance(Tile_coord coord) const
+        {
+            return std::max(std::abs(coord.x - focus_.x), std::abs(coord.y - focus_.y));
+        }
+
+        bool should_keep(Tile_coord coord) const
+        {
+            return tile_distance(coord) <= load_radius_ + 1;
+        }
+
+        // Unloads the resident tile furthest from the focus, if it is further away than
+        // the given distance. Returns false if there is none.
+        bool evict_further_than(const Point& focus, float distance_sq)
+        {
+            auto furthest = resident_.end();
+            float furthest_distance_sq = distance_sq;
+            for (auto it = resident_.begin(); it != resident_.end(); ++it)
+            {
+                const float d = distance_squared(focus, tile_rect((*it)->coord));
+                if (furthest_distance_sq < d)
+                {
+                    furthest = it;
+                    furthest_distance_sq = d;
+                }
+            }
+
+            if (furthest == resident_.end())
+            {
+                return false;
+            }
+
+            resident_.erase(furthest);
+            return true;
+        }
+
+        const Tile* find_tile(Tile_coord coord) const
+        {
+            for (const auto& tile : resident_)
+            {
+                if (tile->coord == coord)
+                {
+                    return tile.get();
+                }
+            }
+            return nullptr;
+        }
+
+        bool is_pending(Tile_coord coord) const
+        {
+            return std::find(pending_.begin(), pending_.end(), coord) != pending_.end();
+        }
+
+        // Only with the mutex held.
+        bool is_queued(Tile_coord coord) const
+        {
+            return std::find(requests_.begin(), requests_.end(), coord) != requests_.end();
+        }
+
+        void loader_loop()
+        {
+            std::vector<Item> items;
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            for (;;)
+            {
+                wake_.wait(lock, [this]() {
+                    return quit_ || !requests_.empty();
+                });
+
+                if (quit_)
+                {
+                    return;
+                }
+
+                current_ = requests_.front();
+                requests_.pop_front();
+                loading_ = true;
+                lock.unlock();
+
+                std::unique_ptr<Tile> tile(new Tile(current_, tile_rect(current_)));
+                items.clear();
+                load_(current_, items);
+
+                for (const Item& item : items)
+                {
+                    const Rectangle bounds(bounding_rect(item.bounding_shape()));
+                    tile->bounds = Rectangle::construct_minmax(glm::min(tile->bounds.min, bounds.min),
+                                                               glm::max(tile->bounds.max, bounds.max));
+                    tile->tree.insert(item);
+                }
+
+                lock.lock();
+                loaded_.push_back(std::move(tile));
+                loading_ = false;
+
+                if (requests_.empty())
+                {
+                    idle_.notify_all();
+                }
+            }
+        }
+
+    private:
+        float tile_size_;
+        std::int32_t load_radius_;
+        size_t max_resident_;
+        Load_function load_;
+
+        Tile_coord focus_{0, 0};
+        std::vector<std::unique_ptr<Tile>> resident_;
+
+        // Queued or being loaded, as seen by update().
+        std::vector<Tile_coord> pending_;
+        std::vector<Tile_coord> wanted_;
+
+        // Shared with the loading thread.
+        std::mutex mutex_;
+        std::condition_variable wake_;
+        std::condition_variable idle_;
+        std::deque<Tile_coord> requests_;
+        std::vector<std::unique_ptr<Tile>> loaded_;
+        Tile_coord current_{0, 0};
+        bool loading_{false};
+        bool quit_{false};
+
+        std::thread loader_;
+    };
+
+} // namespace spatial
+} // namespace kvant
@@ -0,0 +1,680 @@
+#pragma once
+#include "../base/worker_pool.hpp"
+#include "shapes.hpp"
+#include "simd.hpp"
+#include "visitor.hpp"
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <vector>
+
+namespace kvant {
+namespace spatial {
+
+    // Bounding volume hierarchy over the triangles of a mesh, for picking and collision.
+    // Built top down, splitting at the best of a few bins along the longest axis by the
+    // surface area heuristic. The top levels are split on the calling thread, the subtrees
+    // below are built in parallel.
+    //
+    // The triangles are stored in tree order in SoA layout, so the triangles of a leaf are
+    // tested against a ray four at a time. refit() updates the bounds after the vertices
+    // have moved, e.g. by Triangle_mesh::transform, keeping the tree topology.
+    //
+    // The mesh type must provide vertices[i].position and triangles[i].v0, v1, v2, like
+    // graphics::Triangle_mesh.
+    class Triangle_bvh {
+    public:
+        using Box = spatial::Rectangle<glm::vec3>;
+        using Ray = spatial::Ray<glm::vec3>;
+
+        struct Hit {
+            std::uint32_t triangle;
+            float t;
+            float u; // Barycentric coordinates of v1 and v2.
+            float v;
+        };
+
+        static const unsigned max_leaf_size = 4;
+
+    public:
+        template <typename Mesh>
+        void build(const Mesh& mesh)
+        {
+            const std::uint32_t count = static_cast<std::uint32_t>(mesh.triangles.size());
+
+            bounds_.resize(count);
+            centroids_.resize(count);
+            order_.resize(count);
+            std::iota(order_.begin(), order_.end(), 0u);
+
+            base::parallel_for(count, 4 * 1024, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i)
+                {
+                    const auto& triangle = mesh.triangles[i];
+                    Box& bounds = bounds_[i];
+                    bounds = Box(mesh.vertices[triangle.v0].position, mesh.vertices[triangle.v0].position);
+                    grow(bounds, mesh.vertices[triangle.v1].position);
+                    grow(bounds, mesh.vertices[triangle.v2].position);
+                    centroids_[i] = (bounds.min + bounds.max) * 0.5f;
+                }
+            });
+
+            nodes_.clear();
+            if (count > 0)
+            {
+                build_nodes(count);
+            }
+
+            refit_triangles(mesh);
+        }
+
+        // Updates the bounds for moved vertices. The triangles must be the same as when built.
+        template <typename Mesh>
+        void refit(const Mesh& mesh)
+        {
+            assert(mesh.triangles.size() == order_.size());
+            refit_triangles(mesh);
+
+            // Children are always after their parent.
+            for (size_t i = nodes_.size(); i-- > 0;)
+            {
+                Node& node = nodes_[i];
+                Box bounds;
+
+                if (node.count > 0)
+                {
+                    bounds = triangle_bounds(node.first);
+                    for (std::uint32_t j = node.first + 1; j < node.first + node.count; ++j)
+                    {
+                        grow(bounds, triangle_bounds(j));
+                    }
+                }
+                else
+                {
+                    bounds = nodes_[node.first].bounds();
+                    grow(bounds, nodes_[node.first + 1].bounds());
+                }
+
+                node.min = bounds.min;
+                node.max = bounds.max;
+            }
+        }
+
+        size_t size() const
+        {
+            return order_.size();
+        }
+
+        size_t num_nodes() const
+        {
+            return nodes_.size();
+        }
+
+    public:
+        // Finds the first triangle hit by the ray within [0, max_t], from either side.
+        bool raycast(const Ray& ray,
+                     float max_t,
+                     Hit& hit) const
+        {
+            if (nodes_.empty())
+            {
+                return false;
+            }
+
+            // Zero components are nudged so that the slab test never multiplies zero by infinity.
+            const glm::vec3 inv_direction(inverse(ray.direction.x), inverse(ray.direction.y), inverse(ray.direction.z));
+
+            struct Queued_node {
+                std::uint32_t index;
+                float t;
+            };
+
+            std::array<Queued_node, max_stack_size> stack;
+            unsigned stack_size = 0;
+
+            hit.t = max_t;
+            bool found = false;
+
+            float t;
+            if (!raycast_node(ray.origin, inv_direction, nodes_[0], max_t, t))
+            {
+                return false;
+            }
+            stack[stack_size++] = {0, t};
+
+            while (stack_size > 0)
+            {
+                const Queued_node next = stack[--stack_size];
+                if (hit.t < next.t)
+                {
+                    continue;
+                }
+
+                const Node& node = nodes_[next.index];
+                if (node.count > 0)
+                {
+                    found |= raycast_triangles(ray, node.first, node.count, hit);
+                    continue;
+                }
+
+                float t0;
+                float t1;
+                const bool hit0 = raycast_node(ray.origin, inv_direction, nodes_[node.first], hit.t, t0);
+                const bool hit1 = raycast_node(ray.origin, inv_direction, nodes_[node.first + 1], hit.t, t1);
+
+                // The nearer child is pushed last, to be visited first.
+                assert(stack_size + 2 <= max_stack_size);
+                if (hit0 && hit1 && t0 < t1)
+                {
+                    stack[stack_size++] = {node.first + 1, t1};
+                    stack[stack_size++] = {node.first, t0};
+                }
+                else
+                {
+                    if (hit0)
+                    {
+                        stack[stack_size++] = {node.first, t0};
+                    }
+                    if (hit1)
+                    {
+                        stack[stack_size++] = {node.first + 1, t1};
+                    }
+                }
+            }
+
+            return found;
+        }
+
+        // Calls fun(triangle_index) for every triangle whose bounds overlap the box. Returns
+        // false if the visitor stopped the traversal.
+        template <typename Fun>
+        bool for_each_overlapping(const Box& box, Fun&& fun) const
+        {
+            if (nodes_.empty())
+            {
+                return true;
+            }
+
+            std::array<std::uint32_t, max_stack_size> stack;
+            unsigned stack_size = 0;
+            stack[stack_size++] = 0;
+
+            while (stack_size > 0)
+            {
+                const Node& node = nodes_[stack[--stack_size]];
+                if (!overlaps(node.bounds(), box))
+                {
+                    continue;
+                }
+
+                if (node.count > 0)
+                {
+                    for (std::uint32_t i = node.first; i < node.first + node.count; ++i)
+                    {
+                        if (overlaps(triangle_bounds(i), box) && !detail::visit(fun, order_[i]))
+                        {
+                            return false;
+                        }
+                    }
+                }
+                else
+                {
+                    assert(stack_size + 2 <= max_stack_size);
+                    stack[stack_size++] = node.first + 1;
+                    stack[stack_size++] = node.first;
+                }
+            }
+
+            return true;
+        }
+
+    private:
+        static const unsigned num_bins = 16;
+
+        // Deeper than this the triangles are split in half, which bounds the depth of
+        // degenerate meshes and with it the traversal stack.
+        static const unsigned max_sah_depth = 64;
+        static const unsigned max_stack_size = 2 * max_sah_depth;
+
+        // Subtrees are built in parallel when there are at least this many triangles.
+        static const std::uint32_t min_parallel_build = 4 * 1024;
+
+        struct Node {
+            glm::vec3 min;
+            std::uint32_t first; // First triangle of a leaf, otherwise the left child, followed by the right.
+            glm::vec3 max;
+            std::uint32_t count; // Triangles of a leaf, zero for inner nodes.
+
+            Box bounds() const
+            {
+                return Box(min, max);
+            }
+        };
+
+        static_assert(sizeof(Node) == 32, "Nodes are expected to fit two per cache line.");
+
+        struct Build_task {
+            std::uint32_t node;
+            std::uint32_t begin;
+            std::uint32_t end;
+            unsigned depth;
+        };
+
+        struct Bin {
+            Box bounds;
+            std::uint32_t count{0};
+        };
+
+        static void grow(Box& box, const glm::vec3& point)
+        {
+            box.min = glm::min(box.min, point);
+            box.max = glm::max(box.max, point);
+        }
+
+        static void grow(Box& box, const Box& other)
+        {
+            box.min = glm::min(box.min, other.min);
+            box.max = glm::max(box.max, other.max);
+        }
+
+        static Box empty_box()
+        {
+            const float big = std::numeric_limits<float>::max();
+            return Box(glm::vec3(big), glm::vec3(-big));
+        }
+
+        static float surface_area(const Box& box)
+        {
+            const glm::vec3 d = box.max - box.min;
+            return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+        }
+
+        static bool overlaps(const Box& a, const Box& b)
+        {
+            return a.min.x <= b.max.x && b.min.x <= a.max.x &&
+                   a.min.y <= b.max.y && b.min.y <= a.max.y &&
+                   a.min.z <= b.max.z && b.min.z <= a.max.z;
+        }
+
+        static float inverse(float v)
+        {
+            return 1.0f / (v != 0.0f ? v : 1.0e-30f);
+        }
+
+        void build_nodes(std::uint32_t count)
+        {
+            nodes_.reserve(2 * count - 1);
+            nodes_.emplace_back();
+
+            // Split breadth first until there are enough subtrees to keep the workers busy.
+            const size_t num_subtrees = count < min_parallel_build ? 1 : base::Worker_pool::instance().num_threads() * 4;
+
+            std::vector<Build_task> tasks;
+            tasks.push_back({0, 0, count, 0});
+
+            size_t next_task = 0;
+            while (next_task < tasks.size() && tasks.size() - next_task < num_subtrees)
+            {
+                const Build_task task = tasks[next_task++];
+                split(nodes_, task, tasks);
+            }
+
+            tasks.erase(tasks.begin(), tasks.begin() + next_task);
+
+            // Each subtree is built into nodes of its own, with its root first, and the
+            // nodes are then appended.
+            std::vector<std::vector<Node>> subtrees(tasks.size());
+
+            auto job = [&](unsigned i) {
+                std::vector<Node>& nodes = subtrees[i];
+                nodes.resize(1);
+
+                std::vector<Build_task> stack;
+                stack.push_back({0, tasks[i].begin, tasks[i].end, tasks[i].depth});
+
+                while (!stack.empty())
+                {
+                    const Build_task task = stack.back();
+                    stack.pop_back();
+                    split(nodes, task, stack);
+                }
+            };
+
+            if (tasks.size() > 1)
+            {
+                base::Worker_pool::instance().run(static_cast<unsigned>(tasks.size()), job);
+            }
+            else if (tasks.size() == 1)
+            {
+                job(0);
+            }
+
+            for (size_t i = 0; i < tasks.size(); ++i)
+            {
+                // Local index 0 becomes the node of the task, the rest are appended.
+                const std::uint32_t base = static_cast<std::uint32_t>(nodes_.size()) - 1;
+                const auto relocate = [base](Node node) {
+                    if (node.count == 0)
+                    {
+                        node.first += base;
+                    }
+                    return node;
+                };
+
+                nodes_[tasks[i].node] = relocate(subtrees[i][0]);
+                for (size_t j = 1; j < subtrees[i].size(); ++j)
+                {
+                    nodes_.push_back(relocate(subtrees[i][j]));
+                }
+            }
+        }
+
+        // Sets the bounds of the node, and either makes it a leaf or adds its two children
+        // to the nodes and their tasks to the list.
+        void split(std::vector<Node>& nodes,
+                   const Build_task& task,
+                   std::vector<Build_task>& tasks)
+        {
+            Box bounds = empty_box();
+            Box centroid_bounds = empty_box();
+            for (std::uint32_t i = task.begin; i < task.end; ++i)
+            {
+                grow(bounds, bounds_[order_[i]]);
+                grow(centroid_bounds, centroids_[order_[i]]);
+            }
+
+            nodes[task.node].min = bounds.min;
+            nodes[task.node].max = bounds.max;
+
+            const std::uint32_t count = task.end - task.begin;
+            if (count <= max_leaf_size)
+            {
+                nodes[task.node].first = task.begin;
+                nodes[task.node].count = count;
+                return;
+            }
+
+            const std::uint32_t middle = partition(task, centroid_bounds);
+
+            const std::uint32_t left = static_cast<std::uint32_t>(nodes.size());
+            nodes.resize(nodes.size() + 2);
+            nodes[task.node].first = left;
+            nodes[task.node].count = 0;
+
+            tasks.push_back({left + 1, middle, task.end, task.depth + 1});
+            tasks.push_back({left, task.begin, middle, task.depth + 1});
+        }
+
+        // Reorders the triangles of the task in two, returns where the second part begins.
+        std::uint32_t partition(const Build_task& task,
+                                const Box& centroid_bounds)
+        {
+            const glm::vec3 extent = centroid_bounds.max - centroid_bounds.min;
+            const unsigned axis = extent.x < extent.y ? (extent.y < extent.z ? 2 : 1) : (extent.x < extent.z ? 2 : 0);
+
+            auto first = order_.begin() + task.begin;
+            auto last = order_.begin() + task.end;
+            const std::uint32_t half = task.begin + (task.end - task.begin) / 2;
+
+            // All centroids in the same place, or too deep.
+            if (extent[axis] <= 0.0f || max_sah_depth <= task.depth)
+            {
+                std::nth_element(first, order_.begin() + half, last, [&](std::uint32_t a, std::uint32_t b) {
+                    return centroids_[a][axis] < centroids_[b][axis];
+                });
+                return half;
+            }
+
+            const float min = centroid_bounds.min[axis];
+            const float scale = num_bins / extent[axis];
+            const auto bin_of = [&](std::uint32_t triangle) {
+                return std::min(num_bins - 1, static_cast<unsigned>((centroids_[triangle][axis] - min) * scale));
+            };
+
+            std::array<Bin, num_bins> bins;
+            for (Bin& bin : bins)
+            {
+                bin.bounds = empty_box();
+            }
+
+            for (auto it = first; it != last; ++it)
+            {
+                Bin& bin = bins[bin_of(*it)];
+                grow(bin.bounds, bounds_[*it]);
+                ++bin.count;
+            }
+
+            // Cost of splitting after bin i, swept from the right and then from the left.
+            std::array<float, num_bins - 1> right_cost;
+            Box box = empty_box();
+            std::uint32_t count = 0;
+            for (unsigned i = num_bins - 1; i > 0; --i)
+            {
+                grow(box, bins[i].bounds);
+                count += bins[i].count;
+                right_cost[i - 1] = count > 0 ? count * surface_area(box) : 0.0f;
+            }
+
+            unsigned best_split = 0;
+            float best_cost = std::numeric_limits<float>::max();
+            box = empty_box();
+            count = 0;
+            for (unsigned i = 0; i < num_bins - 1; ++i)
+            {
+                grow(box, bins[i].bounds);
+                count += bins[i].count;
+                const float cost = (count > 0 ? count * surface_area(box) : 0.0f) + right_cost[i];
+                if (cost < best_cost)
+                {
+                    best_cost = cost;
+                    best_split = i;
+                }
+            }
+
+            const auto middle = std::partition(first, last, [&](std::uint32_t triangle) {
+                return bin_of(triangle) <= best_split;
+            });
+
+            // The extent along the axis is positive, so both the first and last bin have
+            // triangles, and both sides get some.
+            assert(middle != first && middle != last);
+            return static_cast<std::uint32_t>(middle - order_.begin());
+        }
+
+        // Copies the triangles to the SoA arrays in tree order.
+        template <typename Mesh>
+        void refit_triangles(const Mesh& mesh)
+        {
+            const size_t count = order_.size();
+
+            // Padded, so that the last leaf can be loaded four at a time.
+            for (std::vector<float>* component : {&v0x_, &v0y_, &v0z_, &e1x_, &e1y_, &e1z_, &e2x_, &e2y_, &e2z_})
+            {
+                component->resize(count + 3, 0.0f);
+            }
+
+            base::parallel_for(count, 4 * 1024, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i)
+                {
+                    const auto& triangle = mesh.triangles[order_[i]];
+                    const glm::vec3 v0 = mesh.vertices[triangle.v0].position;
+                    const glm::vec3 e1 = mesh.vertices[triangle.v1].position - v0;
+                    const glm::vec3 e2 = mesh.vertices[triangle.v2].position - v0;
+
+                    v0x_[i] = v0.x;
+                    v0y_[i] = v0.y;
+                    v0z_[i] = v0.z;
+                    e1x_[i] = e1.x;
+                    e1y_[i] = e1.y;
+                    e1z_[i] = e1.z;
+                    e2x_[i] = e2.x;
+                    e2y_[i] = e2.y;
+                    e2z_[i] = e2.z;
+                }
+            });
+        }
+
+        Box triangle_bounds(std::uint32_t i) const
+        {
+            const glm::vec3 v0(v0x_[i], v0y_[i], v0z_[i]);
+            Box box(v0, v0);
+            grow(box, v0 + glm::vec3(e1x_[i], e1y_[i], e1z_[i]));
+            grow(box, v0 + glm::vec3(e2x_[i], e2y_[i], e2z_[i]));
+            return box;
+        }
+
+        static bool raycast_node(const glm::vec3& origin,
+                                 const glm::vec3& inv_direction,
+                                 const Node& node,
+                                 float max_t,
+                                 float& t)
+        {
+            float t_min = 0.0f;
+            float t_max = max_t;
+
+            for (unsigned axis = 0; axis < 3; ++axis)
+            {
+                float t0 = (node.min[axis] - origin[axis]) * inv_direction[axis];
+                float t1 = (node.max[axis] - origin[axis]) * inv_direction[axis];
+                if (t1 < t0)
+                {
+                    std::swap(t0, t1);
+                }
+
+                t_min = std::max(t_min, t0);
+                t_max = std::min(t_max, t1);
+            }
+
+            t = t_min;
+            return t_min <= t_max;
+        }
+
+        // Möller-Trumbore against the triangles [first, first + count). Updates the hit if
+        // one is nearer than hit.t.
+        bool raycast_triangles(const Ray& ray,
+                               std::uint32_t first,
+                               std::uint32_t count,
+                               Hit& hit) const
+        {
+            bool found = false;
+
+#ifdef KVANT_SPATIAL_SSE2
+            const __m128 dx = _mm_set1_ps(ray.direction.x);
+            const __m128 dy = _mm_set1_ps(ray.direction.y);
+            const __m128 dz = _mm_set1_ps(ray.direction.z);
+            const __m128 zero = _mm_setzero_ps();
+            const __m128 one = _mm_set1_ps(1.0f);
+            const __m128 epsilon = _mm_set1_ps(1.0e-12f);
+
+            for (std::uint32_t i = first; i < first + count; i += 4)
+            {
+                const __m128 e1x = _mm_loadu_ps(&e1x_[i]);
+                const __m128 e1y = _mm_loadu_ps(&e1y_[i]);
+                const __m128 e1z = _mm_loadu_ps(&e1z_[i]);
+                const __m128 e2x = _mm_loadu_ps(&e2x_[i]);
+                const __m128 e2y = _mm_loadu_ps(&e2y_[i]);
+                const __m128 e2z = _mm_loadu_ps(&e2z_[i]);
+
+                // p = d x e2, det = e1 . p
+                const __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+                const __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+                const __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+                const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+                const __m128 abs_det = _mm_max_ps(det, _mm_sub_ps(zero, det));
+                const __m128 inv_det = _mm_div_ps(one, det);
+
+                // s = o - v0, u = s . p / det
+                const __m128 sx = _mm_sub_ps(_mm_set1_ps(ray.origin.x), _mm_loadu_ps(&v0x_[i]));
+                const __m128 sy = _mm_sub_ps(_mm_set1_ps(ray.origin.y), _mm_loadu_ps(&v0y_[i]));
+                const __m128 sz = _mm_sub_ps(_mm_set1_ps(ray.origin.z), _mm_loadu_ps(&v0z_[i]));
+                const __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inv_det);
+
+                // q = s x e1, v = d . q / det, t = e2 . q / det
+                const __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+                const __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+                const __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+                const __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv_det);
+                const __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv_det);
+
+                __m128 valid = _mm_cmpgt_ps(abs_det, epsilon);
+                valid = _mm_and_ps(valid, _mm_cmpge_ps(u, zero));
+                valid = _mm_and_ps(valid, _mm_cmpge_ps(v, zero));
+                valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(u, v), one));
+                valid = _mm_and_ps(valid, _mm_cmpge_ps(t, zero));
+                valid = _mm_and_ps(valid, _mm_cmple_ps(t, _mm_set1_ps(hit.t)));
+
+                // Lanes past the leaf hold other triangles or padding.
+                const unsigned lanes = std::min(4u, first + count - i);
+                const unsigned mask = static_cast<unsigned>(_mm_movemask_ps(valid)) & ((1u << lanes) - 1);
+                if (mask == 0)
+                {
+                    continue;
+                }
+
+                alignas(16) float ts[4];
+                alignas(16) float us[4];
+                alignas(16) float vs[4];
+                _mm_store_ps(ts, t);
+                _mm_store_ps(us, u);
+                _mm_store_ps(vs, v);
+
+                for (unsigned lane = 0; lane < 4; ++lane)
+                {
+                    if ((mask & (1u << lane)) && (!found || ts[lane] < hit.t))
+                    {
+                        hit = {order_[i + lane], ts[lane], us[lane], vs[lane]};
+                        found = true;
+                    }
+                }
+            }
+#else
+            for (std::uint32_t i = first; i < first + count; ++i)
+            {
+                const glm::vec3 e1(e1x_[i], e1y_[i], e1z_[i]);
+                const glm::vec3 e2(e2x_[i], e2y_[i], e2z_[i]);
+
+                const glm::vec3 p = glm::cross(ray.direction, e2);
+                const float det = glm::dot(e1, p);
+                if (std::abs(det) <= 1.0e-12f)
+                {
+                    continue;
+                }
+
+                const float inv_det = 1.0f / det;
+                const glm::vec3 s = ray.origin - glm::vec3(v0x_[i], v0y_[i], v0z_[i]);
+                const float u = glm::dot(s, p) * inv_det;
+                const glm::vec3 q = glm::cross(s, e1);
+                const float v = glm::dot(ray.direction, q) * inv_det;
+                const float t = glm::dot(e2, q) * inv_det;
+
+                if (0.0f <= u && 0.0f <= v && u + v <= 1.0f && 0.0f <= t && t <= hit.t && (!found || t < hit.t))
+                {
+                    hit = {order_[i], t, u, v};
+                    found = true;
+                }
+            }
+#endif
+            return found;
+        }
+
+    private:
+        std::vector<Node> nodes_;
+
+        // Triangle index by position in tree order.
+        std::vector<std::uint32_t> order_;
+
+        // Triangles in tree order, v0 and the edges to v1 and v2.
+        std::vector<float> v0x_, v0y_, v0z_;
+        std::vector<float> e1x_, e1y_, e1z_;
+        std::vector<float> e2x_, e2y_, e2z_;
+
+        // Build scratch, by triangle index.
+        std::vector<Box> bounds_;
+        std::vector<glm::vec3> centroids_;
+    };
+
+} // namespace spatial
+} // namespace kvant
@@ -0,0 +1,30 @@
+#pragma once
+#include <type_traits>
+
+namespace kvant {
+namespace spatial {
+namespace detail {
+
+    // Visitors may return void, or bool where false stops the traversal.
+    template <typename Fun, typename Item>
+    inline bool visit(Fun& fun, const Item& item, std::true_type)
+    {
+        fun(item);
+        return true;
+    }
+
+    template <typename Fun, typename Item>
+    inline bool visit(Fun& fun, const Item& item, std::false_type)
+    {
+        return static_cast<bool>(fun(item));
+    }
+
+    template <typename Fun, typename Item>
+    inline bool visit(Fun& fun, const Item& item)
+    {
+        return visit(fun, item, std::is_void<decltype(fun(item))>());
+    }
+
+} // namespace detail
+} // namespace spatial
+} // namespace kvant
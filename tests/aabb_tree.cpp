@@ -0,0 +1,116 @@
+#include "../src/spatial/aabb_tree.hpp"
+#include "catch.hpp"
+#include "test_items.hpp"
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+using namespace kvant::spatial;
+
+TEST_CASE("Aabb_tree")
+{
+	using Point = glm::vec2;
+	using Tree = Aabb_tree<Test_item>;
+
+	std::mt19937 rng(7);
+	std::uniform_real_distribution<float> position(-1000.0f, 1000.0f);
+	std::uniform_real_distribution<float> radius(0.5f, 5.0f);
+	std::uniform_real_distribution<float> step(-2.0f, 2.0f);
+
+	Tree tree(1.0f);
+	std::vector<Test_item> items;
+	std::vector<Tree::Handle> handles;
+	std::vector<bool> alive;
+
+	// Clustered in a few places far apart, which a grid over the world handles badly.
+	for (unsigned i = 0; i < 2000; ++i)
+	{
+		const Point cluster(i % 4 == 0 ? -1.0e5f : 3.0e4f, i % 3 == 0 ? 2.0e5f : 0.0f);
+		items.push_back({Circle<>(cluster + Point(position(rng), position(rng)) * 0.1f, radius(rng)), i});
+		handles.push_back(tree.insert(items.back()));
+		alive.push_back(true);
+	}
+
+	REQUIRE(tree.size() == items.size());
+
+	// Balanced within a small factor of log2 of the number of leaves.
+	REQUIRE(tree.height() <= 2 * static_cast<unsigned>(std::log2(items.size())) + 2);
+
+	const auto check_queries = [&]() {
+		for (unsigned i = 0; i < 100; ++i)
+		{
+			const Test_item& item = items[(i * 97) % items.size()];
+			const Circle<Point> circle(item.shape.center, 20.0f);
+			REQUIRE(query_ids(tree, circle) == brute_force_ids(items, alive, circle));
+
+			const Rectangle<Point> rect(item.shape.center - Point(30.0f, 5.0f), item.shape.center + Point(30.0f, 5.0f));
+			REQUIRE(query_ids(tree, rect) == brute_force_ids(items, alive, rect));
+		}
+	};
+
+	SECTION("Query")
+	{
+		check_queries();
+
+		// Stopping the traversal.
+		unsigned visited = 0;
+		const Rectangle<Point> everything(Point(-1.0e6f), Point(1.0e6f));
+		REQUIRE(!tree.for_each_intersecting(everything, [&visited](const Test_item&) { return ++visited < 10; }));
+		REQUIRE(visited == 10);
+	}
+
+	SECTION("Update")
+	{
+		unsigned reinserted = 0;
+		for (unsigned frame = 0; frame < 20; ++frame)
+		{
+			for (size_t i = 0; i < items.size(); ++i)
+			{
+				items[i].shape.center += Point(step(rng), step(rng));
+				reinserted += tree.update(handles[i], items[i].shape);
+			}
+		}
+
+		// Small moves mostly stay within the fattened bounds.
+		REQUIRE(reinserted < items.size() * 20);
+		REQUIRE(tree.height() <= 2 * static_cast<unsigned>(std::log2(items.size())) + 2);
+		check_queries();
+	}
+
+	SECTION("Remove and reuse")
+	{
+		for (size_t i = 0; i < items.size(); i += 3)
+		{
+			tree.remove(handles[i]);
+			alive[i] = false;
+		}
+		check_queries();
+
+		for (size_t i = 0; i < items.size(); i += 6)
+		{
+			items[i].shape.center += Point(50.0f);
+			handles[i] = tree.insert(items[i]);
+			alive[i] = true;
+		}
+		check_queries();
+
+		for (size_t i = 0; i < items.size(); ++i)
+		{
+			if (alive[i])
+			{
+				REQUIRE(tree.get(handles[i]).id == items[i].id);
+			}
+		}
+	}
+
+	SECTION("Clear")
+	{
+		tree.clear();
+		REQUIRE(tree.size() == 0);
+		REQUIRE(query_ids(tree, Circle<Point>(items[0].shape.center, 100.0f)).empty());
+
+		tree.insert(items[0]);
+		REQUIRE(query_ids(tree, items[0].shape) == std::vector<unsigned>{0});
+	}
+}
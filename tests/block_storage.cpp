@@ -0,0 +1,72 @@
+#include "../src/spatial/block_storage.hpp"
+#include "catch.hpp"
+#include <vector>
+
+using namespace kvant::spatial;
+
+TEST_CASE("Block_storage")
+{
+	using Storage = Block_storage<int>;
+	Storage storage;
+
+	const unsigned a = storage.alloc_block();
+	const unsigned b = storage.alloc_block();
+	REQUIRE(a != b);
+
+	std::vector<Storage::Handle> handles;
+	for (int i = 0; i < 10; ++i)
+	{
+		handles.push_back(storage.add(a, i));
+	}
+
+	SECTION("Swap remove keeps handles")
+	{
+		storage.remove(handles[2]);
+		REQUIRE(!storage.is_valid(handles[2]));
+		REQUIRE(storage.size(a) == 9);
+
+		for (int i = 0; i < 10; ++i)
+		{
+			if (i != 2)
+			{
+				REQUIRE(storage.get(handles[i]) == i);
+			}
+		}
+	}
+
+	SECTION("Reused slots get new generations")
+	{
+		storage.remove(handles[5]);
+		const Storage::Handle reused = storage.add(b, 100);
+		REQUIRE(reused.index == handles[5].index);
+		REQUIRE(reused != handles[5]);
+		REQUIRE(!storage.is_valid(handles[5]));
+		REQUIRE(storage.get(reused) == 100);
+	}
+
+	SECTION("Move between blocks")
+	{
+		storage.move(handles[0], b);
+		REQUIRE(storage.block_of(handles[0]) == b);
+		REQUIRE(storage.get(handles[0]) == 0);
+		REQUIRE(storage.get(handles[9]) == 9);
+		REQUIRE(storage.size(a) == 9);
+		REQUIRE(storage.size(b) == 1);
+	}
+
+	SECTION("Free blocks are reused")
+	{
+		storage.free_block(a);
+		REQUIRE(!storage.is_valid(handles[0]));
+		REQUIRE(storage.num_free_blocks() == 1);
+		REQUIRE(storage.alloc_block() == a);
+		REQUIRE(storage.size(a) == 0);
+	}
+
+	SECTION("Clear")
+	{
+		storage.clear();
+		REQUIRE(storage.num_free_blocks() == storage.num_blocks());
+		REQUIRE(!storage.is_valid(handles[3]));
+	}
+}
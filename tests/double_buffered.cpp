@@ -0,0 +1,180 @@
+#include "../src/spatial/aabb_tree.hpp"
+#include "../src/spatial/double_buffered.hpp"
+#include "../src/spatial/quad_tree.hpp"
+#include "catch.hpp"
+#include "test_items.hpp"
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+using namespace kvant::spatial;
+
+namespace {
+
+	template <typename Index>
+	unsigned count_in(const Index& index, const Rectangle<glm::vec2>& rect)
+	{
+		unsigned count = 0;
+		index.for_each_intersecting(rect, [&count](const Test_item&) { ++count; });
+		return count;
+	}
+
+	const Rectangle<glm::vec2> world(glm::vec2(0.0f), glm::vec2(100.0f));
+	const Rectangle<glm::vec2> left(glm::vec2(0.0f), glm::vec2(49.0f, 100.0f));
+	const Rectangle<glm::vec2> right(glm::vec2(51.0f, 0.0f), glm::vec2(100.0f));
+
+	// Every frame the writer adds an item and moves all of them to the other half of the
+	// world. A snapshot must show all items on one side, and never fewer than before.
+	template <typename Index, typename... Args>
+	void check_concurrent_readers(const Args&... args)
+	{
+		Double_buffered<Index> index(args...);
+		const unsigned num_frames = 200;
+		std::atomic<bool> done{false};
+		std::atomic<unsigned> num_errors{0};
+
+		auto reader = [&]() {
+			unsigned seen = 0;
+			while (!done.load())
+			{
+				const auto snapshot = index.snapshot();
+				const unsigned in_left = count_in(snapshot.index(), left);
+				const unsigned in_right = count_in(snapshot.index(), right);
+
+				if (std::min(in_left, in_right) != 0 || in_left + in_right < seen)
+				{
+					++num_errors;
+				}
+				seen = in_left + in_right;
+			}
+		};
+
+		std::vector<std::thread> readers;
+		for (unsigned i = 0; i < 3; ++i)
+		{
+			readers.emplace_back(reader);
+		}
+
+		std::vector<typename Index::Handle> handles;
+		for (unsigned frame = 0; frame < num_frames; ++frame)
+		{
+			const float x = frame % 2 == 0 ? 20.0f : 80.0f;
+			handles.push_back(index.insert({Circle<>(glm::vec2(x, 50.0f), 1.0f), frame}));
+
+			for (size_t i = 0; i < handles.size(); ++i)
+			{
+				index.update(handles[i], Circle<>(glm::vec2(x, static_cast<float>(i % 90) + 5.0f), 1.0f));
+			}
+
+			index.publish();
+		}
+
+		done = true;
+		for (auto& thread : readers)
+		{
+			thread.join();
+		}
+
+		REQUIRE(num_errors == 0);
+		REQUIRE(count_in(index.snapshot().index(), world) == num_frames);
+		REQUIRE(count_in(index.back_index(), world) == num_frames);
+	}
+}
+
+TEST_CASE("Double_buffered")
+{
+	using Index = Double_buffered<Quad_tree<Test_item>>;
+	Index index(world, 1.0f, 4, 2);
+
+	std::vector<Index::Handle> handles;
+	for (unsigned i = 0; i < 40; ++i)
+	{
+		handles.push_back(index.insert({Circle<>(glm::vec2(static_cast<float>(i * 2 + 5), 25.0f), 1.0f), i}));
+	}
+
+	// Changes are only seen after publishing.
+	REQUIRE(count_in(index.snapshot().index(), world) == 0);
+	REQUIRE(count_in(index.back_index(), world) == 40);
+	index.publish();
+	REQUIRE(count_in(index.snapshot().index(), world) == 40);
+
+	SECTION("Snapshots stay as they were")
+	{
+		const auto before = index.snapshot();
+
+		for (unsigned i = 0; i < 40; i += 2)
+		{
+			index.update(handles[i], Circle<>(glm::vec2(static_cast<float>(i * 2 + 5), 75.0f), 1.0f));
+		}
+		index.remove(handles[1]);
+
+		REQUIRE(count_in(before.index(), Rectangle<glm::vec2>(glm::vec2(0.0f, 50.0f), glm::vec2(100.0f))) == 0);
+		REQUIRE(count_in(index.back_index(), Rectangle<glm::vec2>(glm::vec2(0.0f, 50.0f), glm::vec2(100.0f))) == 20);
+	}
+
+	SECTION("Both copies get every change")
+	{
+		for (unsigned frame = 0; frame < 3; ++frame)
+		{
+			for (unsigned i = frame; i < 40; i += 3)
+			{
+				index.update(handles[i], Circle<>(glm::vec2(static_cast<float>(i * 2 + 5), 75.0f), 1.0f));
+			}
+			index.remove(handles[frame]);
+			handles[frame] = index.insert({Circle<>(glm::vec2(50.0f, 5.0f), 1.0f), 100 + frame});
+			index.publish();
+
+			const auto snapshot = index.snapshot();
+			for (const auto& shape : {world, left, right, Rectangle<glm::vec2>(glm::vec2(0.0f, 50.0f), glm::vec2(100.0f))})
+			{
+				REQUIRE(count_in(snapshot.index(), shape) == count_in(index.back_index(), shape));
+			}
+
+			for (unsigned i = 0; i < 40; ++i)
+			{
+				REQUIRE(snapshot->get(handles[i]).id == index.back_index().get(handles[i]).id);
+			}
+		}
+
+		index.clear();
+		index.publish();
+		REQUIRE(count_in(index.snapshot().index(), world) == 0);
+		REQUIRE(count_in(index.back_index(), world) == 0);
+	}
+
+	SECTION("Moved items are found where they were moved to")
+	{
+		index.update(handles[0], Circle<>(glm::vec2(50.0f, 75.0f), 1.0f));
+		index.publish();
+
+		// The front copy was changed directly, the back copy by the replay.
+		const auto snapshot = index.snapshot();
+		for (const Quad_tree<Test_item>* tree : {&snapshot.index(), &index.back_index()})
+		{
+			Quad_tree<Test_item>::Neighbour nearest;
+			REQUIRE(tree->nearest(glm::vec2(50.0f, 75.0f), 100.0f, nearest));
+			REQUIRE(nearest.handle == handles[0]);
+			REQUIRE(nearest.distance_squared == 0.0f);
+
+			Quad_tree<Test_item>::Ray_hit hit;
+			REQUIRE(tree->raycast(Quad_tree<Test_item>::Ray(glm::vec2(50.0f, 90.0f), glm::vec2(0.0f, -1.0f)), 100.0f, hit));
+			REQUIRE(hit.handle == handles[0]);
+			REQUIRE(hit.t == Approx(14.0f));
+		}
+	}
+
+	SECTION("Memory usage")
+	{
+		const auto usage = index.memory_usage();
+		REQUIRE(usage.front == usage.back);
+		REQUIRE(usage.front == index.snapshot()->memory_usage());
+		REQUIRE(usage.total() == usage.front + usage.back + usage.changes);
+	}
+}
+
+TEST_CASE("Double_buffered concurrent readers")
+{
+	check_concurrent_readers<Quad_tree<Test_item>>(world);
+	check_concurrent_readers<Aabb_tree<Test_item>>();
+}
@@ -0,0 +1,72 @@
+#include "../src/spatial/hash_grid.hpp"
+#include "catch.hpp"
+#include "test_items.hpp"
+#include <algorithm>
+#include <limits>
+#include <random>
+#include <vector>
+
+using namespace kvant::spatial;
+
+TEST_CASE("Hash_grid")
+{
+	using Point = glm::vec2;
+	Hash_grid<Test_item> grid(2.0f, 4); // Small table, to make it grow.
+
+	const Rectangle<Point> rect_query(Point(-12.0f, 3.0f), Point(21.0f, 17.5f));
+	const Circle<Point> circle_query(Point(-5.0f, -5.0f), 13.0f);
+
+	for (unsigned frame = 0; frame < 3; ++frame)
+	{
+		grid.clear();
+
+		// Some span several cells.
+		const auto items = make_random_items(1000, frame, -50.0f, 50.0f, 0.1f, 4.0f);
+		for (const auto& item : items)
+		{
+			const auto handle = grid.insert(item);
+			REQUIRE(grid.get(handle).id == item.id);
+		}
+
+		REQUIRE(grid.size() == items.size());
+		REQUIRE(query_ids(grid, rect_query) == brute_force_ids(items, rect_query));
+		REQUIRE(query_ids(grid, circle_query) == brute_force_ids(items, circle_query));
+	}
+
+	SECTION("Queries over more cells than are in use")
+	{
+		const auto items = make_random_items(1000, 2, -50.0f, 50.0f, 0.1f, 4.0f);
+		const Rectangle<Point> large(Point(-60.0f, -60.0f), Point(60.0f, 10.0f));
+		const Rectangle<Point> huge(Point(-1e30f), Point(1e30f));
+		REQUIRE(query_ids(grid, large) == brute_force_ids(items, large));
+		REQUIRE(query_ids(grid, huge).size() == items.size());
+	}
+
+	SECTION("Beyond the range of cells")
+	{
+		grid.clear();
+		const std::vector<Test_item> items = {{Circle<>(Point(1e12f, -1e12f), 1.0f), 0},
+											  {Circle<>(Point(1e12f, 1e12f), 1.0f), 1},
+											  {Circle<>(Point(-3e38f, 0.0f), 1.0f), 2},
+											  {Circle<>(Point(0.0f), 1.0f), 3}};
+		for (const auto& item : items)
+		{
+			grid.insert(item);
+		}
+
+		const Circle<Point> near_first(Point(1e12f, -1e12f), 1e6f);
+		const Rectangle<Point> far_left(Point(-1e38f), Point(-1e30f, 1e30f));
+		REQUIRE(query_ids(grid, near_first) == brute_force_ids(items, near_first));
+		REQUIRE(query_ids(grid, far_left) == brute_force_ids(items, far_left));
+
+		const float nan = std::numeric_limits<float>::quiet_NaN();
+		REQUIRE(query_ids(grid, Circle<Point>(Point(nan), 1.0f)).empty());
+	}
+
+	SECTION("Stop traversal")
+	{
+		unsigned visited = 0;
+		REQUIRE(!grid.for_each_intersecting(rect_query, [&visited](const Test_item&) { return ++visited < 4; }));
+		REQUIRE(visited == 4);
+	}
+}
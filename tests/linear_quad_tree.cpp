@@ -0,0 +1,55 @@
+#include "../src/spatial/linear_quad_tree.hpp"
+#include "catch.hpp"
+#include "test_items.hpp"
+#include <algorithm>
+#include <random>
+#include <vector>
+
+using namespace kvant::spatial;
+
+TEST_CASE("Linear_quad_tree")
+{
+	using Point = glm::vec2;
+	Linear_quad_tree<Test_item> tree(Rectangle<Point>(Point(0.0f), Point(100.0f)));
+
+	// Some outside of the root.
+	auto items = make_random_items(2000, 42, -10.0f, 110.0f, 0.01f, 3.0f);
+	tree.build(items);
+	REQUIRE(tree.size() == items.size());
+
+	const Rectangle<Point> rect_query(Point(12.0f, 30.0f), Point(61.0f, 47.5f));
+	const Circle<Point> circle_query(Point(50.0f, 50.0f), 17.0f);
+
+	SECTION("Queries")
+	{
+		REQUIRE(query_ids(tree, rect_query) == brute_force_ids(items, rect_query));
+		REQUIRE(query_ids(tree, circle_query) == brute_force_ids(items, circle_query));
+		REQUIRE(query_ids(tree, Rectangle<Point>(Point(-20.0f), Point(120.0f))).size() == items.size());
+	}
+
+	SECTION("Stop traversal")
+	{
+		unsigned visited = 0;
+		REQUIRE(!tree.for_each_intersecting(rect_query, [&visited](const Test_item&) { return ++visited < 5; }));
+		REQUIRE(visited == 5);
+	}
+
+	SECTION("Incremental update")
+	{
+		std::mt19937 rng(7);
+		std::uniform_real_distribution<float> delta(-4.0f, 4.0f);
+
+		for (unsigned frame = 0; frame < 3; ++frame)
+		{
+			for (size_t i = 0; i < items.size(); i += 3)
+			{
+				items[i].shape.center += Point(delta(rng), delta(rng));
+				tree.update(i, items[i]);
+			}
+			tree.commit();
+
+			REQUIRE(query_ids(tree, rect_query) == brute_force_ids(items, rect_query));
+			REQUIRE(query_ids(tree, circle_query) == brute_force_ids(items, circle_query));
+		}
+	}
+}
@@ -0,0 +1,315 @@
+#include "../src/graphics/mesh.hpp"
+#include "catch.hpp"
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+using namespace kvant;
+using graphics::Triangle_mesh;
+using graphics::Vertex;
+
+namespace {
+
+	// The vertices of a grid over [0, size - 1] on x and y, cut into tiles that each have
+	// vertices of their own along the shared edges.
+	Triangle_mesh<> make_tiled_grid(unsigned size, unsigned tile_size)
+	{
+		Triangle_mesh<> mesh;
+		for (unsigned ty = 0; ty + 1 < size; ty += tile_size)
+		{
+			for (unsigned tx = 0; tx + 1 < size; tx += tile_size)
+			{
+				const unsigned w = std::min(tile_size, size - 1 - tx) + 1;
+				const unsigned h = std::min(tile_size, size - 1 - ty) + 1;
+				const unsigned first = static_cast<unsigned>(mesh.vertices.size());
+
+				for (unsigned y = 0; y < h; ++y)
+				{
+					for (unsigned x = 0; x < w; ++x)
+					{
+						mesh.vertices.push_back(Vertex(glm::vec3(static_cast<float>(tx + x), static_cast<float>(ty + y), 0.0f)));
+					}
+				}
+
+				for (unsigned y = 0; y + 1 < h; ++y)
+				{
+					for (unsigned x = 0; x + 1 < w; ++x)
+					{
+						const unsigned v0 = first + x + y * w;
+						mesh.triangles.push_back({v0, v0 + 1, v0 + 1 + w});
+						mesh.triangles.push_back({v0 + 1 + w, v0 + w, v0});
+					}
+				}
+			}
+		}
+		return mesh;
+	}
+
+	// The pairwise welding optimize() replaced: every vertex goes to the first kept vertex
+	// close to it. Returns the kept vertices, and the index each vertex maps to.
+	std::vector<glm::vec3> brute_force_weld(const std::vector<Vertex>& vertices, std::vector<unsigned>& remap)
+	{
+		std::vector<glm::vec3> kept;
+		std::vector<unsigned> kept_index;
+		remap.assign(vertices.size(), ~0u);
+
+		for (size_t a = 0; a < vertices.size(); ++a)
+		{
+			if (remap[a] != ~0u)
+			{
+				continue;
+			}
+
+			remap[a] = static_cast<unsigned>(kept.size());
+			kept.push_back(vertices[a].position);
+
+			for (size_t b = a + 1; b < vertices.size(); ++b)
+			{
+				const glm::vec3 d = vertices[b].position - vertices[a].position;
+				if (remap[b] == ~0u && glm::dot(d, d) < 1.0f / 10000 * 2)
+				{
+					remap[b] = remap[a];
+				}
+			}
+		}
+
+		return kept;
+	}
+
+	// Sums the normals of the triangles around each vertex one triangle at a time.
+	std::vector<glm::vec3> reference_normals(const Triangle_mesh<>& mesh, graphics::Normal_weighting weighting)
+	{
+		std::vector<glm::vec3> sums(mesh.vertices.size(), glm::vec3(0.0f));
+		for (const graphics::Triangle& t : mesh.triangles)
+		{
+			const unsigned corners[3] = {t.v0, t.v1, t.v2};
+			const glm::vec3 p0 = mesh.vertices[t.v0].position;
+			const glm::vec3 p1 = mesh.vertices[t.v1].position;
+			const glm::vec3 p2 = mesh.vertices[t.v2].position;
+			const glm::vec3 cross = glm::cross(p2 - p0, p1 - p0);
+			if (glm::dot(cross, cross) == 0.0f)
+			{
+				continue;
+			}
+
+			for (unsigned k = 0; k < 3; ++k)
+			{
+				const glm::vec3 a = mesh.vertices[corners[k]].position;
+				const glm::vec3 b = mesh.vertices[corners[(k + 1) % 3]].position;
+				const glm::vec3 c = mesh.vertices[corners[(k + 2) % 3]].position;
+
+				switch (weighting)
+				{
+				case graphics::Normal_weighting::uniform:
+					sums[corners[k]] += glm::normalize(cross);
+					break;
+				case graphics::Normal_weighting::area:
+					sums[corners[k]] += cross;
+					break;
+				case graphics::Normal_weighting::angle:
+					sums[corners[k]] += glm::normalize(cross) * std::acos(glm::dot(glm::normalize(b - a), glm::normalize(c - a)));
+					break;
+				}
+			}
+		}
+
+		for (glm::vec3& sum : sums)
+		{
+			if (glm::dot(sum, sum) > 0.0f)
+			{
+				sum = glm::normalize(sum);
+			}
+		}
+		return sums;
+	}
+
+	bool near(const glm::vec3& a, const glm::vec3& b, float epsilon = 1.0e-4f)
+	{
+		return glm::length(a - b) < epsilon;
+	}
+
+	// The faces of a cube, a quad each, so that the corners see one or two triangles of
+	// every face.
+	Triangle_mesh<> make_box()
+	{
+		Triangle_mesh<> mesh;
+		for (unsigned i = 0; i < 8; ++i)
+		{
+			mesh.vertices.push_back(Vertex(glm::vec3(i & 1 ? 1.0f : -1.0f, i & 2 ? 1.0f : -1.0f, i & 4 ? 1.0f : -1.0f)));
+		}
+
+		const unsigned quads[6][4] = {{0, 1, 3, 2}, {4, 6, 7, 5}, {0, 4, 5, 1}, {2, 3, 7, 6}, {0, 2, 6, 4}, {1, 5, 7, 3}};
+		for (const auto& quad : quads)
+		{
+			mesh.triangles.push_back({quad[0], quad[1], quad[2]});
+			mesh.triangles.push_back({quad[0], quad[2], quad[3]});
+		}
+		return mesh;
+	}
+
+	void check_weld(Triangle_mesh<>& mesh)
+	{
+		std::vector<unsigned> expected_remap;
+		const std::vector<glm::vec3> expected = brute_force_weld(mesh.vertices, expected_remap);
+		const graphics::Triangle_array triangles = mesh.triangles;
+
+		mesh.optimize();
+
+		REQUIRE(mesh.vertices.size() == expected.size());
+		for (size_t i = 0; i < expected.size(); ++i)
+		{
+			REQUIRE(mesh.vertices[i].position == expected[i]);
+		}
+
+		REQUIRE(mesh.triangles.size() == triangles.size());
+		for (size_t i = 0; i < triangles.size(); ++i)
+		{
+			REQUIRE(mesh.triangles[i].v0 == expected_remap[triangles[i].v0]);
+			REQUIRE(mesh.triangles[i].v1 == expected_remap[triangles[i].v1]);
+			REQUIRE(mesh.triangles[i].v2 == expected_remap[triangles[i].v2]);
+		}
+	}
+}
+
+TEST_CASE("Triangle_mesh welding")
+{
+	SECTION("Shared edges")
+	{
+		Triangle_mesh<> mesh = make_tiled_grid(33, 8);
+		REQUIRE(mesh.vertices.size() > 33 * 33);
+
+		check_weld(mesh);
+		REQUIRE(mesh.vertices.size() == 33 * 33);
+	}
+
+	SECTION("Clusters and chains")
+	{
+		// Points jittered around the threshold, and lines of points closer than the
+		// threshold to their neighbours but not to the ones after.
+		std::mt19937 rng(48);
+		std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+		std::uniform_real_distribution<float> jitter(-0.01f, 0.01f);
+
+		Triangle_mesh<> mesh;
+		for (unsigned i = 0; i < 3000; ++i)
+		{
+			const glm::vec3 center(glm::vec3(unit(rng), unit(rng), unit(rng)) * 2.0f - glm::vec3(1.0f));
+			const unsigned n = 1 + i % 4;
+			for (unsigned j = 0; j < n; ++j)
+			{
+				mesh.vertices.push_back(Vertex(center + glm::vec3(jitter(rng), jitter(rng), jitter(rng))));
+			}
+		}
+		for (unsigned i = 0; i < 200; ++i)
+		{
+			mesh.vertices.push_back(Vertex(glm::vec3(5.0f + i * 0.01f, -3.0f, 7.0f)));
+		}
+
+		std::uniform_int_distribution<unsigned> index(0, static_cast<unsigned>(mesh.vertices.size() - 1));
+		for (unsigned i = 0; i < 5000; ++i)
+		{
+			mesh.triangles.push_back({index(rng), index(rng), index(rng)});
+		}
+
+		check_weld(mesh);
+	}
+
+	SECTION("Empty")
+	{
+		Triangle_mesh<> mesh;
+		mesh.optimize();
+		REQUIRE(mesh.vertices.empty());
+	}
+}
+
+TEST_CASE("Triangle_mesh vertex normals")
+{
+	using graphics::Normal_weighting;
+
+	SECTION("Weightings")
+	{
+		// A bumpy grid, with triangles of different sizes and shapes, and a vertex no
+		// triangle uses. Large enough to be split into chunks on more than one thread.
+		std::mt19937 rng(49);
+		std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+		Triangle_mesh<> mesh;
+		const unsigned size = 140;
+		for (unsigned y = 0; y < size; ++y)
+		{
+			for (unsigned x = 0; x < size; ++x)
+			{
+				const glm::vec3 jitter(unit(rng) * 0.4f, unit(rng) * 0.4f, 0.0f);
+				mesh.vertices.push_back(Vertex(glm::vec3(static_cast<float>(x), static_cast<float>(y), std::sin(x * 0.4f) * std::cos(y * 0.3f)) + jitter));
+			}
+		}
+		for (unsigned y = 0; y + 1 < size; ++y)
+		{
+			for (unsigned x = 0; x + 1 < size; ++x)
+			{
+				const unsigned v0 = x + y * size;
+				mesh.triangles.push_back({v0, v0 + 1, v0 + 1 + size});
+				mesh.triangles.push_back({v0 + 1 + size, v0 + size, v0});
+			}
+		}
+		mesh.vertices.push_back(Vertex(glm::vec3(100.0f)));
+
+		for (const Normal_weighting weighting : {Normal_weighting::uniform, Normal_weighting::area, Normal_weighting::angle})
+		{
+			INFO("weighting " << static_cast<int>(weighting));
+
+			mesh.calculate_vertex_normals(weighting);
+			const std::vector<glm::vec3> expected = reference_normals(mesh, weighting);
+
+			for (size_t i = 0; i < mesh.vertices.size(); ++i)
+			{
+				REQUIRE(near(mesh.vertices[i].normal, expected[i]));
+			}
+			REQUIRE(mesh.vertices.back().normal == glm::vec3(0.0f));
+		}
+	}
+
+	SECTION("Angle weighting is independent of the triangulation")
+	{
+		Triangle_mesh<> mesh = make_box();
+
+		// All face normals point out of the box.
+		for (const graphics::Triangle& t : mesh.triangles)
+		{
+			const glm::vec3 center = (mesh.vertices[t.v0].position + mesh.vertices[t.v1].position + mesh.vertices[t.v2].position) / 3.0f;
+			REQUIRE(glm::dot(graphics::calculate_normal(mesh.vertices[t.v0].position, mesh.vertices[t.v1].position, mesh.vertices[t.v2].position), center) > 0.0f);
+		}
+
+		mesh.calculate_vertex_normals(Normal_weighting::angle);
+		for (const Vertex& v : mesh.vertices)
+		{
+			REQUIRE(near(v.normal, glm::normalize(v.position)));
+		}
+
+		// Corners with two triangles of a face lean towards it.
+		mesh.calculate_vertex_normals(Normal_weighting::uniform);
+		unsigned leaning = 0;
+		for (const Vertex& v : mesh.vertices)
+		{
+			REQUIRE(near(glm::vec3(glm::length(v.normal)), glm::vec3(1.0f)));
+			leaning += near(v.normal, glm::normalize(v.position)) ? 0 : 1;
+		}
+		REQUIRE(leaning > 0);
+	}
+
+	SECTION("Unindexed")
+	{
+		Triangle_mesh<> mesh = make_box();
+		mesh.make_non_indexed();
+		mesh.calculate_vertex_normals();
+
+		for (size_t i = 0; i < mesh.vertices.size(); i += 3)
+		{
+			const glm::vec3 normal = mesh.vertices[i].normal;
+			REQUIRE(near(glm::vec3(std::abs(normal.x) + std::abs(normal.y) + std::abs(normal.z)), glm::vec3(1.0f)));
+			REQUIRE(mesh.vertices[i + 1].normal == normal);
+			REQUIRE(mesh.vertices[i + 2].normal == normal);
+		}
+	}
+}
@@ -0,0 +1,375 @@
+#include "../src/spatial/narrow_phase.hpp"
+#include "catch.hpp"
+#include <cmath>
+#include <random>
+#include <vector>
+
+using namespace kvant::spatial;
+
+namespace {
+
+	const float tolerance = 1e-3f;
+
+	Convex_polygon make_polygon(const glm::vec2& center, float radius, unsigned count, float angle)
+	{
+		std::vector<glm::vec2> vertices;
+		for (unsigned i = 0; i < count; ++i)
+		{
+			const float a = angle + i * 6.2831853f / count;
+			vertices.push_back(center + glm::vec2(std::cos(a), std::sin(a)) * radius);
+		}
+		return Convex_polygon(vertices.data(), count);
+	}
+
+	Convex_polygon box_polygon(const Oriented_box& box)
+	{
+		const glm::vec2 x = box.axis * box.half_extents.x;
+		const glm::vec2 y = box.up() * box.half_extents.y;
+		const glm::vec2 vertices[] = {box.center - x - y, box.center + x - y, box.center + x + y, box.center - x + y};
+		return Convex_polygon(vertices, 4);
+	}
+
+	template <typename Shape>
+	Shape moved(Shape shape, const glm::vec2& offset);
+
+	template <>
+	Circle<> moved(Circle<> shape, const glm::vec2& offset)
+	{
+		shape.center += offset;
+		return shape;
+	}
+
+	template <>
+	Capsule moved(Capsule shape, const glm::vec2& offset)
+	{
+		shape.a += offset;
+		shape.b += offset;
+		return shape;
+	}
+
+	template <>
+	Rectangle<> moved(Rectangle<> shape, const glm::vec2& offset)
+	{
+		return Rectangle<>(shape.min + offset, shape.max + offset);
+	}
+
+	template <>
+	Oriented_box moved(Oriented_box shape, const glm::vec2& offset)
+	{
+		shape.center += offset;
+		return shape;
+	}
+
+	template <>
+	Convex_polygon moved(Convex_polygon shape, const glm::vec2& offset)
+	{
+		shape.translate(offset);
+		return shape;
+	}
+
+	// The contact is the same both ways around, and moving b along the normal by a little
+	// less than the depth keeps them overlapping, and by a little more separates them.
+	template <typename A, typename B>
+	void check_contact(const A& a, const B& b)
+	{
+		Contact contact;
+		if (!collide(a, b, contact))
+		{
+			return;
+		}
+
+		REQUIRE(std::abs(glm::length(contact.normal) - 1.0f) < tolerance);
+		REQUIRE(contact.depth >= 0.0f);
+
+		Contact reverse = {glm::vec2(0.0f), 0.0f};
+		REQUIRE(collide(b, a, reverse));
+		REQUIRE(std::abs(reverse.depth - contact.depth) < tolerance);
+
+		Contact after;
+		INFO("depth " << contact.depth << " normal " << contact.normal.x << ", " << contact.normal.y);
+		REQUIRE_FALSE(collide(a, moved(b, contact.normal * (contact.depth + 0.01f)), after));
+		if (contact.depth > 0.01f)
+		{
+			REQUIRE(collide(a, moved(b, contact.normal * (contact.depth - 0.01f)), after));
+		}
+	}
+
+	template <typename Shape>
+	Shape random_shape(std::mt19937& rng);
+
+	template <>
+	Circle<> random_shape(std::mt19937& rng)
+	{
+		std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+		return Circle<>(glm::vec2(unit(rng), unit(rng)) * 10.0f, 0.5f + unit(rng) * 2.0f);
+	}
+
+	template <>
+	Capsule random_shape(std::mt19937& rng)
+	{
+		std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+		const glm::vec2 a = glm::vec2(unit(rng), unit(rng)) * 10.0f;
+		return Capsule(a, a + glm::vec2(unit(rng) - 0.5f, unit(rng) - 0.5f) * 6.0f, 0.3f + unit(rng));
+	}
+
+	template <>
+	Rectangle<> random_shape(std::mt19937& rng)
+	{
+		std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+		const glm::vec2 min = glm::vec2(unit(rng), unit(rng)) * 10.0f;
+		return Rectangle<>(min, min + glm::vec2(0.5f + unit(rng) * 3.0f, 0.5f + unit(rng) * 3.0f));
+	}
+
+	template <>
+	Oriented_box random_shape(std::mt19937& rng)
+	{
+		std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+		return Oriented_box(glm::vec2(unit(rng), unit(rng)) * 10.0f, glm::vec2(0.3f + unit(rng) * 2.0f, 0.3f + unit(rng) * 2.0f), unit(rng) * 6.28f);
+	}
+
+	template <>
+	Convex_polygon random_shape(std::mt19937& rng)
+	{
+		std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+		return make_polygon(glm::vec2(unit(rng), unit(rng)) * 10.0f, 0.5f + unit(rng) * 2.0f, 3 + rng() % 6, unit(rng) * 6.28f);
+	}
+
+	template <typename A>
+	bool collide_with(const Shape_set& shapes, const A& a, Shape_ref b, Contact& contact)
+	{
+		switch (b.type)
+		{
+		case Shape_type::circle:
+			return collide(a, shapes.shapes<Circle<>>()[b.index], contact);
+		case Shape_type::capsule:
+			return collide(a, shapes.shapes<Capsule>()[b.index], contact);
+		case Shape_type::rectangle:
+			return collide(a, shapes.shapes<Rectangle<>>()[b.index], contact);
+		case Shape_type::oriented_box:
+			return collide(a, shapes.shapes<Oriented_box>()[b.index], contact);
+		case Shape_type::convex_polygon:
+			return collide(a, shapes.shapes<Convex_polygon>()[b.index], contact);
+		}
+		return false;
+	}
+
+	bool collide_refs(const Shape_set& shapes, Shape_ref a, Shape_ref b, Contact& contact)
+	{
+		switch (a.type)
+		{
+		case Shape_type::circle:
+			return collide_with(shapes, shapes.shapes<Circle<>>()[a.index], b, contact);
+		case Shape_type::capsule:
+			return collide_with(shapes, shapes.shapes<Capsule>()[a.index], b, contact);
+		case Shape_type::rectangle:
+			return collide_with(shapes, shapes.shapes<Rectangle<>>()[a.index], b, contact);
+		case Shape_type::oriented_box:
+			return collide_with(shapes, shapes.shapes<Oriented_box>()[a.index], b, contact);
+		case Shape_type::convex_polygon:
+			return collide_with(shapes, shapes.shapes<Convex_polygon>()[a.index], b, contact);
+		}
+		return false;
+	}
+
+	template <typename A, typename B>
+	void check_random_contacts(std::mt19937& rng)
+	{
+		for (unsigned i = 0; i < 300; ++i)
+		{
+			INFO("types " << +detail::Shape_order<A>::value << " " << +detail::Shape_order<B>::value << " pair " << i);
+			check_contact(random_shape<A>(rng), random_shape<B>(rng));
+		}
+	}
+}
+
+TEST_CASE("Narrow phase contacts")
+{
+	Contact contact;
+
+	SECTION("Circles and capsules")
+	{
+		REQUIRE(collide(Circle<>(glm::vec2(0.0f), 1.0f), Circle<>(glm::vec2(1.5f, 0.0f), 1.0f), contact));
+		REQUIRE(contact.depth == Approx(0.5f));
+		REQUIRE(contact.normal.x == Approx(1.0f));
+
+		REQUIRE_FALSE(collide(Circle<>(glm::vec2(0.0f), 1.0f), Circle<>(glm::vec2(2.5f, 0.0f), 1.0f), contact));
+
+		const Capsule horizontal(glm::vec2(-2.0f, 0.0f), glm::vec2(2.0f, 0.0f), 0.5f);
+		REQUIRE(collide(horizontal, Capsule(glm::vec2(1.0f, 0.8f), glm::vec2(1.0f, 3.0f), 0.5f), contact));
+		REQUIRE(contact.depth == Approx(0.2f));
+		REQUIRE(contact.normal.y == Approx(1.0f));
+
+		REQUIRE(collide(Circle<>(glm::vec2(3.0f, 0.0f), 1.0f), horizontal, contact));
+		REQUIRE(contact.depth == Approx(0.5f));
+		REQUIRE(contact.normal.x == Approx(-1.0f));
+	}
+
+	SECTION("Boxes and polygons")
+	{
+		const Rectangle<> rect(glm::vec2(0.0f), glm::vec2(2.0f));
+		REQUIRE(collide(rect, Rectangle<>(glm::vec2(1.5f, 0.5f), glm::vec2(4.0f)), contact));
+		REQUIRE(contact.depth == Approx(0.5f));
+		REQUIRE(contact.normal.x == Approx(1.0f));
+
+		// A diamond over the corner of the rectangle.
+		const Oriented_box diamond(glm::vec2(3.0f, 3.0f), glm::vec2(1.0f), 0.785398f);
+		REQUIRE_FALSE(collide(rect, diamond, contact));
+		REQUIRE(collide(rect, moved(diamond, glm::vec2(-0.5f)), contact));
+		REQUIRE(contact.depth == Approx(1.0f - std::sqrt(0.5f)).epsilon(1e-4));
+
+		// The same box as a polygon gives the same contact.
+		const Oriented_box box(glm::vec2(1.0f, 2.5f), glm::vec2(1.5f, 0.5f), 0.3f);
+		Contact as_polygon;
+		REQUIRE(collide(rect, box, contact));
+		REQUIRE(collide(rect, box_polygon(box), as_polygon));
+		REQUIRE(contact.depth == Approx(as_polygon.depth));
+		REQUIRE(contact.normal.x == Approx(as_polygon.normal.x));
+		REQUIRE(contact.normal.y == Approx(as_polygon.normal.y));
+	}
+
+	SECTION("Rounded shapes against polygons")
+	{
+		const Rectangle<> rect(glm::vec2(0.0f), glm::vec2(4.0f));
+
+		// Apart, and with the center inside, where EPA finds the depth.
+		REQUIRE(collide(Circle<>(glm::vec2(5.0f, 2.0f), 1.5f), rect, contact));
+		REQUIRE(contact.depth == Approx(0.5f));
+		REQUIRE(contact.normal.x == Approx(-1.0f));
+
+		REQUIRE(collide(Circle<>(glm::vec2(3.5f, 2.0f), 1.0f), rect, contact));
+		REQUIRE(contact.depth == Approx(1.5f));
+		REQUIRE(contact.normal.x == Approx(-1.0f));
+
+		REQUIRE(collide(rect, Circle<>(glm::vec2(2.0f, 0.3f), 1.0f), contact));
+		REQUIRE(contact.depth == Approx(1.3f));
+		REQUIRE(contact.normal.y == Approx(-1.0f));
+
+		REQUIRE_FALSE(collide(Circle<>(glm::vec2(5.0f, 5.0f), 1.4f), rect, contact));
+		REQUIRE(collide(Circle<>(glm::vec2(5.0f, 5.0f), 1.5f), rect, contact));
+
+		// Lying on top of a triangle.
+		const Convex_polygon triangle = make_polygon(glm::vec2(0.0f), 2.0f, 3, 1.5707963f);
+		REQUIRE(collide(Capsule(glm::vec2(-3.0f, 2.3f), glm::vec2(3.0f, 2.3f), 0.5f), triangle, contact));
+		REQUIRE(contact.depth == Approx(0.2f));
+		REQUIRE(contact.normal.y == Approx(-1.0f));
+	}
+
+	SECTION("Random shapes")
+	{
+		std::mt19937 rng(46);
+		check_random_contacts<Circle<>, Circle<>>(rng);
+		check_random_contacts<Circle<>, Capsule>(rng);
+		check_random_contacts<Circle<>, Rectangle<>>(rng);
+		check_random_contacts<Circle<>, Oriented_box>(rng);
+		check_random_contacts<Circle<>, Convex_polygon>(rng);
+		check_random_contacts<Capsule, Capsule>(rng);
+		check_random_contacts<Capsule, Rectangle<>>(rng);
+		check_random_contacts<Capsule, Oriented_box>(rng);
+		check_random_contacts<Capsule, Convex_polygon>(rng);
+		check_random_contacts<Rectangle<>, Rectangle<>>(rng);
+		check_random_contacts<Rectangle<>, Oriented_box>(rng);
+		check_random_contacts<Rectangle<>, Convex_polygon>(rng);
+		check_random_contacts<Oriented_box, Oriented_box>(rng);
+		check_random_contacts<Oriented_box, Convex_polygon>(rng);
+		check_random_contacts<Convex_polygon, Convex_polygon>(rng);
+	}
+}
+
+TEST_CASE("Narrow phase GJK with repeated support points")
+{
+	// A capsule lying across the apex of a triangle has the same support point, at the
+	// apex, for many directions. With contracted multiply-adds it used to be added to the
+	// simplex twice, and the collapsed triangle was taken to contain the origin.
+	SECTION("Collapsed simplex")
+	{
+		detail::Gjk_simplex simplex;
+		simplex.size = 3;
+		simplex.vertices[0].w = glm::vec2(-3.0f, 0.3f);
+		simplex.vertices[1].w = glm::vec2(3.0f, 0.3f);
+		simplex.vertices[2].w = glm::vec2(-3.0f, 0.3f);
+
+		REQUIRE_FALSE(simplex.solve());
+		REQUIRE(simplex.size == 2);
+		REQUIRE(simplex.closest().x == Approx(0.0f).margin(1e-6f));
+		REQUIRE(simplex.closest().y == Approx(0.3f));
+	}
+
+	SECTION("Capsules across an apex")
+	{
+		const Convex_polygon triangle = make_polygon(glm::vec2(0.0f), 2.0f, 3, 1.5707963f);
+		for (int i = 0; i < 40; ++i)
+		{
+			const float gap = 0.05f + 0.01f * i;
+			const float shift = 0.37f * (i % 7) - 1.0f;
+
+			Contact contact;
+			REQUIRE(collide(Capsule(glm::vec2(shift - 3.0f, 2.0f + gap), glm::vec2(shift + 3.0f, 2.0f + gap), 0.5f), triangle, contact));
+			REQUIRE(contact.depth == Approx(0.5f - gap).margin(1e-4f));
+			REQUIRE(contact.normal.y == Approx(-1.0f));
+		}
+	}
+}
+
+TEST_CASE("Narrow phase EPA agrees with SAT")
+{
+	std::mt19937 rng(17);
+	for (unsigned i = 0; i < 1000; ++i)
+	{
+		const Oriented_box a = random_shape<Oriented_box>(rng);
+		const Convex_polygon b = random_shape<Convex_polygon>(rng);
+
+		Contact sat;
+		Contact gjk;
+		const bool hit = collide(a, b, sat);
+		REQUIRE(detail::collide_gjk(a, b, gjk) == hit);
+		if (hit)
+		{
+			REQUIRE(gjk.depth == Approx(sat.depth).epsilon(1e-3).margin(1e-4));
+		}
+	}
+}
+
+TEST_CASE("Narrow phase batch")
+{
+	std::mt19937 rng(7);
+	Shape_set shapes;
+	std::vector<Shape_ref> refs;
+	for (unsigned i = 0; i < 40; ++i)
+	{
+		refs.push_back(shapes.add(random_shape<Circle<>>(rng)));
+		refs.push_back(shapes.add(random_shape<Capsule>(rng)));
+		refs.push_back(shapes.add(random_shape<Rectangle<>>(rng)));
+		refs.push_back(shapes.add(random_shape<Oriented_box>(rng)));
+		refs.push_back(shapes.add(random_shape<Convex_polygon>(rng)));
+	}
+
+	std::vector<Narrow_phase::Pair> pairs;
+	for (unsigned i = 0; i < 2000; ++i)
+	{
+		pairs.push_back({refs[rng() % refs.size()], refs[rng() % refs.size()]});
+	}
+
+	Narrow_phase narrow_phase;
+	std::vector<Narrow_phase::Pair_contact> contacts;
+	narrow_phase.collide(shapes, pairs, contacts);
+	REQUIRE(!contacts.empty());
+
+	// The same as testing the pairs one at a time.
+	size_t next = 0;
+	for (std::uint32_t i = 0; i < pairs.size(); ++i)
+	{
+		Contact expected;
+		if (!collide_refs(shapes, pairs[i].a, pairs[i].b, expected))
+		{
+			continue;
+		}
+
+		REQUIRE(next < contacts.size());
+		REQUIRE(contacts[next].pair == i);
+		REQUIRE(contacts[next].contact.depth == expected.depth);
+		REQUIRE(contacts[next].contact.normal.x == expected.normal.x);
+		REQUIRE(contacts[next].contact.normal.y == expected.normal.y);
+		++next;
+	}
+	REQUIRE(next == contacts.size());
+}
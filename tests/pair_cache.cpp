@@ -0,0 +1,54 @@
+#include "../src/spatial/pair_cache.hpp"
+#include "catch.hpp"
+#include <vector>
+
+using namespace kvant::spatial;
+
+namespace {
+
+	struct Test_pair
+	{
+		int a;
+		int b;
+	};
+
+	struct Events
+	{
+		std::vector<int> begun;
+		std::vector<int> stayed;
+		std::vector<int> ended;
+	};
+
+	// Pairs are encoded as a*10 + b.
+	Events update(Pair_cache<Test_pair>& cache, std::vector<Test_pair> pairs)
+	{
+		Events events;
+		cache.update(pairs,
+					 [&](const Test_pair& p) { events.begun.push_back(p.a * 10 + p.b); },
+					 [&](const Test_pair& p) { events.stayed.push_back(p.a * 10 + p.b); },
+					 [&](const Test_pair& p) { events.ended.push_back(p.a * 10 + p.b); });
+		return events;
+	}
+}
+
+TEST_CASE("Pair_cache")
+{
+	Pair_cache<Test_pair> cache;
+
+	Events events = update(cache, {{1, 2}, {3, 1}, {4, 5}});
+	REQUIRE(events.begun == std::vector<int>({12, 13, 45}));
+	REQUIRE(events.stayed.empty());
+	REQUIRE(events.ended.empty());
+
+	// Reversed and duplicated pairs are the same contact.
+	events = update(cache, {{2, 1}, {5, 4}, {4, 5}, {6, 7}});
+	REQUIRE(events.begun == std::vector<int>({67}));
+	REQUIRE(events.stayed == std::vector<int>({12, 45}));
+	REQUIRE(events.ended == std::vector<int>({13}));
+	REQUIRE(cache.pairs().size() == 3);
+
+	events = update(cache, {});
+	REQUIRE(events.begun.empty());
+	REQUIRE(events.ended == std::vector<int>({12, 45, 67}));
+	REQUIRE(cache.pairs().empty());
+}
@@ -1,8 +1,635 @@
 #include "../src/spatial/quad_tree.hpp"
 #include "catch.hpp"
+#include "test_items.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <vector>
+
+using namespace kvant::spatial;
+
+namespace {
+
+	std::vector<Test_item> make_grid_items()
+	{
+		std::vector<Test_item> items;
+		unsigned id = 0;
+		for (int y = 0; y < 20; ++y)
+		{
+			for (int x = 0; x < 20; ++x)
+			{
+				// Mix of small items and items straddling split lines.
+				const float radius = (x + y) % 7 == 0 ? 6.0f : 0.5f;
+				items.push_back({Circle<>(glm::vec2(x * 5.0f + 2.5f, y * 5.0f + 2.5f), radius), id++});
+			}
+		}
+		return items;
+	}
+}
 
 TEST_CASE("Quad_tree")
 {
-	using Point = glm::ivec2;
-	spatial::tree::Quad_tree<Point, 3> tree();
-}
\ No newline at end of file
+	using Point = glm::vec2;
+	Quad_tree<Test_item> tree(Rectangle<Point>(Point(0.0f), Point(100.0f)));
+
+	const auto items = make_grid_items();
+	for (const auto& item : items)
+	{
+		tree.insert(item);
+	}
+
+	SECTION("Rectangle query")
+	{
+		const Rectangle<Point> query(Point(12.0f, 30.0f), Point(61.0f, 47.5f));
+		REQUIRE(query_ids(tree, query) == brute_force_ids(items, query));
+	}
+
+	SECTION("Circle query")
+	{
+		const Circle<Point> query(Point(50.0f, 50.0f), 17.0f);
+		REQUIRE(query_ids(tree, query) == brute_force_ids(items, query));
+	}
+
+	SECTION("Query outside of root")
+	{
+		const Rectangle<Point> query(Point(200.0f), Point(300.0f));
+		REQUIRE(query_ids(tree, query).empty());
+	}
+
+	SECTION("Stop traversal")
+	{
+		unsigned visited = 0;
+		const bool completed = tree.for_each_intersecting(Rectangle<Point>(Point(0.0f), Point(100.0f)),
+														  [&visited](const Test_item&) { return ++visited < 3; });
+		REQUIRE(!completed);
+		REQUIRE(visited == 3);
+	}
+
+	SECTION("Integrate items")
+	{
+		auto keep_even = [](const Test_item& item) { return item.id % 2 == 0; };
+		tree.integrate_items(keep_even);
+
+		std::vector<Test_item> even_items;
+		std::copy_if(items.begin(), items.end(), std::back_inserter(even_items), keep_even);
+
+		const Rectangle<Point> query(Point(0.0f), Point(60.0f));
+		REQUIRE(query_ids(tree, query) == brute_force_ids(even_items, query));
+	}
+}
+
+TEST_CASE("Loose Quad_tree")
+{
+	using Point = glm::vec2;
+	Quad_tree<Test_item> tree(Rectangle<Point>(Point(0.0f), Point(100.0f)), 2.0f);
+	REQUIRE(tree.is_loose());
+
+	auto items = make_grid_items();
+	items.push_back({Circle<>(Point(150.0f, 50.0f), 1.0f), 1000}); // Outside of root.
+	for (const auto& item : items)
+	{
+		tree.insert(item);
+	}
+
+	SECTION("Rectangle query")
+	{
+		const Rectangle<Point> query(Point(12.0f, 30.0f), Point(61.0f, 47.5f));
+		REQUIRE(query_ids(tree, query) == brute_force_ids(items, query));
+	}
+
+	SECTION("Circle query")
+	{
+		const Circle<Point> query(Point(140.0f, 50.0f), 45.0f);
+		REQUIRE(query_ids(tree, query) == brute_force_ids(items, query));
+	}
+
+	SECTION("Clear")
+	{
+		tree.clear();
+		REQUIRE(query_ids(tree, Rectangle<Point>(Point(-100.0f), Point(200.0f))).empty());
+	}
+}
+
+TEST_CASE("Quad_tree update and remove")
+{
+	using Point = glm::vec2;
+
+	for (const float looseness : {1.0f, 2.0f})
+	{
+		Quad_tree<Test_item> tree(Rectangle<Point>(Point(0.0f), Point(100.0f)), looseness);
+
+		auto items = make_grid_items();
+		std::vector<Quad_tree<Test_item>::Handle> handles;
+		for (const auto& item : items)
+		{
+			handles.push_back(tree.insert(item));
+		}
+
+		// Move every item a little, some across split lines and out of the root.
+		for (size_t i = 0; i < items.size(); ++i)
+		{
+			items[i].shape.center += Point(static_cast<float>(i % 9) - 4.0f, static_cast<float>(i % 5) * 3.0f);
+			tree.update(handles[i], items[i].shape);
+			REQUIRE(tree.get(handles[i]).id == items[i].id);
+		}
+
+		const Rectangle<Point> query(Point(12.0f, 30.0f), Point(61.0f, 47.5f));
+		REQUIRE(query_ids(tree, query) == brute_force_ids(items, query));
+
+		const Circle<Point> circle_query(Point(90.0f, 95.0f), 20.0f);
+		REQUIRE(query_ids(tree, circle_query) == brute_force_ids(items, circle_query));
+
+		// Remove every third item.
+		std::vector<Test_item> remaining;
+		for (size_t i = 0; i < items.size(); ++i)
+		{
+			if (i % 3 == 0)
+			{
+				tree.remove(handles[i]);
+			}
+			else
+			{
+				remaining.push_back(items[i]);
+			}
+		}
+
+		REQUIRE(query_ids(tree, query) == brute_force_ids(remaining, query));
+		REQUIRE(tree.get(handles[1]).id == items[1].id);
+		REQUIRE(!tree.is_valid(handles[0]));
+		REQUIRE(tree.is_valid(handles[1]));
+	}
+}
+
+TEST_CASE("Quad_tree overlapping pairs")
+{
+	using Point = glm::vec2;
+	using Tree = Quad_tree<Test_item>;
+
+	for (const float looseness : {1.0f, 2.0f})
+	{
+		Tree tree(Rectangle<Point>(Point(0.0f), Point(100.0f)), looseness);
+
+		auto items = make_grid_items();
+		items.push_back({Circle<>(Point(101.0f, 50.0f), 3.0f), 1000}); // Partly outside of root.
+		for (const auto& item : items)
+		{
+			tree.insert(item);
+		}
+
+		std::vector<Tree::Pair> pairs;
+		tree.find_overlapping_pairs(pairs);
+
+		std::vector<std::pair<unsigned, unsigned>> ids;
+		for (const auto& pair : pairs)
+		{
+			const unsigned a = tree.get(pair.a).id;
+			const unsigned b = tree.get(pair.b).id;
+			ids.push_back(std::make_pair(std::min(a, b), std::max(a, b)));
+		}
+		std::sort(ids.begin(), ids.end());
+
+		std::vector<std::pair<unsigned, unsigned>> expected;
+		for (size_t a = 0; a < items.size(); ++a)
+		{
+			for (size_t b = a + 1; b < items.size(); ++b)
+			{
+				if (intersects(bounding_rect(items[a].shape), bounding_rect(items[b].shape)))
+				{
+					expected.push_back(std::make_pair(items[a].id, items[b].id));
+				}
+			}
+		}
+
+		REQUIRE(!expected.empty());
+		INFO("looseness " << looseness);
+		REQUIRE(ids == expected);
+	}
+}
+
+TEST_CASE("Quad_tree batch query")
+{
+	using Point = glm::vec2;
+	using Tree = Quad_tree<Test_item>;
+
+	for (const float looseness : {1.0f, 2.0f})
+	{
+		Tree tree(Rectangle<Point>(Point(0.0f), Point(100.0f)), looseness);
+
+		auto items = make_grid_items();
+		items.push_back({Circle<>(Point(101.0f, 50.0f), 3.0f), 1000}); // Partly outside of root.
+		for (const auto& item : items)
+		{
+			tree.insert(item);
+		}
+
+		// Enough queries to be split into several chunks.
+		std::vector<Circle<>> queries;
+		for (unsigned i = 0; i < 2000; ++i)
+		{
+			queries.push_back(Circle<>(Point((i * 37) % 110 - 5.0f, (i * 53) % 110 - 5.0f), 1.0f + i % 9));
+		}
+
+		Tree::Batch_result result;
+		tree.query_batch(queries, result);
+
+		INFO("looseness " << looseness);
+		REQUIRE(result.offsets.size() == queries.size() + 1);
+		REQUIRE(result.items.size() == result.offsets.back());
+
+		for (size_t i = 0; i < queries.size(); ++i)
+		{
+			std::vector<unsigned> ids;
+			for (unsigned j = result.offsets[i]; j < result.offsets[i + 1]; ++j)
+			{
+				ids.push_back(tree.get(result.items[j]).id);
+			}
+			std::sort(ids.begin(), ids.end());
+
+			REQUIRE(ids == query_ids(tree, queries[i]));
+		}
+	}
+}
+
+TEST_CASE("Quad_tree nearest neighbours")
+{
+	using Point = glm::vec2;
+	using Tree = Quad_tree<Test_item>;
+
+	for (const float looseness : {1.0f, 2.0f})
+	{
+		Tree tree(Rectangle<Point>(Point(0.0f), Point(100.0f)), looseness);
+
+		auto items = make_grid_items();
+		items.push_back({Circle<>(Point(101.0f, 50.0f), 3.0f), 1000}); // Partly outside of root.
+		for (const auto& item : items)
+		{
+			tree.insert(item);
+		}
+
+		INFO("looseness " << looseness);
+
+		for (const Point point : {Point(50.0f, 50.0f), Point(3.0f, 97.0f), Point(120.0f, 48.0f), Point(-10.0f, -10.0f)})
+		{
+			std::vector<float> expected;
+			for (const auto& item : items)
+			{
+				expected.push_back(distance_squared(point, item.shape));
+			}
+			std::sort(expected.begin(), expected.end());
+
+			std::vector<Tree::Neighbour> result(10);
+			REQUIRE(tree.knn(point, 10, result.data()) == 10);
+			for (size_t i = 0; i < 10; ++i)
+			{
+				REQUIRE(result[i].distance_squared == expected[i]);
+				REQUIRE(distance_squared(point, tree.get(result[i].handle).shape) == expected[i]);
+			}
+
+			// Fewer found within the distance limit.
+			const float max_distance = std::sqrt(expected[2]);
+			const size_t expected_count = std::upper_bound(expected.begin(), expected.end(), max_distance * max_distance) - expected.begin();
+			REQUIRE(tree.knn(point, 10, result.data(), max_distance) == std::min<size_t>(10, expected_count));
+
+			Tree::Neighbour nearest;
+			REQUIRE(tree.nearest(point, 1000.0f, nearest));
+			REQUIRE(nearest.distance_squared == expected[0]);
+		}
+
+		Tree::Neighbour nearest;
+		REQUIRE(!tree.nearest(Point(-50.0f, -50.0f), 10.0f, nearest));
+
+		// Measured where update() moved it, not where it was inserted.
+		const Tree::Handle moved = tree.insert({Circle<>(Point(10.0f, 10.0f), 1.0f), 2000});
+		tree.update(moved, Circle<>(Point(50.0f, 50.0f), 1.0f));
+		REQUIRE(tree.nearest(Point(50.0f, 50.0f), 1000.0f, nearest));
+		REQUIRE(nearest.handle == moved);
+		REQUIRE(nearest.distance_squared == 0.0f);
+		REQUIRE((!tree.nearest(Point(10.0f, 10.0f), 1000.0f, nearest) || nearest.handle != moved));
+	}
+}
+
+namespace {
+
+	template <typename Point>
+	struct Integer_item
+	{
+		Rectangle<Point> shape;
+		unsigned id;
+
+		Rectangle<Point> bounding_shape() const
+		{
+			return shape;
+		}
+	};
+
+	template <typename Tree, typename Item, typename Shape>
+	void check_integer_query(const Tree& tree, const std::vector<Item>& items, const Shape& shape)
+	{
+		std::vector<unsigned> ids;
+		tree.for_each_intersecting(shape, [&ids](const Item& item) { ids.push_back(item.id); });
+		std::sort(ids.begin(), ids.end());
+
+		std::vector<unsigned> expected;
+		for (const auto& item : items)
+		{
+			if (intersects(shape, item.shape))
+			{
+				expected.push_back(item.id);
+			}
+		}
+		REQUIRE(ids == expected);
+	}
+
+	// Items over the whole range of the coordinates, including its edges.
+	template <typename Point>
+	void check_integer_tree(float looseness)
+	{
+		using Coordinate = decltype(Point::x);
+		using Item = Integer_item<Point>;
+		using Tree = Quad_tree<Item>;
+		static_assert(std::is_same<typename Tree::Point, Point>::value, "The tree takes the coordinates of the items.");
+
+		const std::int64_t lowest = std::numeric_limits<Coordinate>::lowest();
+		const std::int64_t highest = std::numeric_limits<Coordinate>::max();
+		const std::int64_t range = highest - lowest;
+
+		std::mt19937 rng(17);
+		std::uniform_int_distribution<std::int64_t> coordinate(lowest, highest);
+		std::uniform_int_distribution<std::int64_t> size(0, range / 1000);
+
+		const auto random_rect = [&]() {
+			const std::int64_t w = size(rng);
+			const std::int64_t h = size(rng);
+			const std::int64_t x = std::min(coordinate(rng), highest - w);
+			const std::int64_t y = std::min(coordinate(rng), highest - h);
+			return Rectangle<Point>(Point(static_cast<Coordinate>(x), static_cast<Coordinate>(y)),
+									Point(static_cast<Coordinate>(x + w), static_cast<Coordinate>(y + h)));
+		};
+
+		Tree tree(Rectangle<Point>(Point(static_cast<Coordinate>(lowest)), Point(static_cast<Coordinate>(highest))), looseness, 8, 4);
+
+		std::vector<Item> items;
+		for (unsigned i = 0; i < 500; ++i)
+		{
+			items.push_back({random_rect(), i});
+		}
+		items.push_back({Rectangle<Point>(Point(static_cast<Coordinate>(lowest)), Point(static_cast<Coordinate>(lowest))), 500});
+		items.push_back({Rectangle<Point>(Point(static_cast<Coordinate>(highest)), Point(static_cast<Coordinate>(highest))), 501});
+		items.push_back({Rectangle<Point>(Point(0), Point(static_cast<Coordinate>(highest))), 502});
+
+		for (const auto& item : items)
+		{
+			tree.insert(item);
+		}
+
+		for (unsigned i = 0; i < 100; ++i)
+		{
+			const Rectangle<Point> rect = random_rect();
+			check_integer_query(tree, items, rect);
+			check_integer_query(tree, items, Circle<Point>(rect.min, static_cast<Coordinate>(size(rng))));
+		}
+
+		// Circles reaching across the whole range.
+		check_integer_query(tree, items, Circle<Point>(Point(static_cast<Coordinate>(lowest)), static_cast<Coordinate>(highest)));
+		check_integer_query(tree, items, Circle<Point>(Point(static_cast<Coordinate>(highest), static_cast<Coordinate>(lowest)), static_cast<Coordinate>(highest)));
+
+		const Point point(static_cast<Coordinate>(coordinate(rng)), static_cast<Coordinate>(coordinate(rng)));
+		std::vector<typename Point_traits<Point>::Squared> expected;
+		for (const auto& item : items)
+		{
+			expected.push_back(distance_squared(point, item.shape));
+		}
+		std::sort(expected.begin(), expected.end());
+
+		std::vector<typename Tree::Neighbour> result(5);
+		REQUIRE(tree.knn(point, 5, result.data()) == 5);
+		for (size_t i = 0; i < 5; ++i)
+		{
+			REQUIRE(result[i].distance_squared == expected[i]);
+		}
+	}
+}
+
+TEST_CASE("Quad_tree with integer coordinates")
+{
+	for (const float looseness : {1.0f, 1.5f})
+	{
+		INFO("looseness " << looseness);
+		check_integer_tree<glm::i16vec2>(looseness);
+		check_integer_tree<glm::ivec2>(looseness);
+	}
+}
+
+TEST_CASE("Quad_tree raycast")
+{
+	using Point = glm::vec2;
+	using Tree = Quad_tree<Test_item>;
+
+	for (const float looseness : {1.0f, 2.0f})
+	{
+		Tree tree(Rectangle<Point>(Point(0.0f), Point(100.0f)), looseness);
+
+		auto items = make_grid_items();
+		items.push_back({Circle<>(Point(101.0f, 50.0f), 3.0f), 1000}); // Partly outside of root.
+		for (const auto& item : items)
+		{
+			tree.insert(item);
+		}
+
+		std::vector<Tree::Ray> rays;
+		for (unsigned i = 0; i < 500; ++i)
+		{
+			const float angle = i * 0.37f;
+			rays.push_back(Tree::Ray(Point((i * 37) % 120 - 10.0f, (i * 53) % 120 - 10.0f), Point(std::cos(angle), std::sin(angle))));
+		}
+		rays.push_back(Tree::Ray(Point(120.0f, 50.0f), Point(-1.0f, 0.0f)));
+		rays.push_back(Tree::Ray(Point(2.0f, -10.0f), Point(0.0f, 1.0f)));
+
+		const float max_t = 30.0f;
+		std::vector<Tree::Ray_hit> hits;
+		tree.raycast_batch(rays, max_t, hits);
+		REQUIRE(hits.size() == rays.size());
+
+		INFO("looseness " << looseness);
+
+		unsigned num_hits = 0;
+		for (size_t i = 0; i < rays.size(); ++i)
+		{
+			bool expected_hit = false;
+			float expected_t = max_t;
+			for (const auto& item : items)
+			{
+				float t;
+				if (raycast(rays[i], item.shape, expected_t, t))
+				{
+					expected_hit = true;
+					expected_t = t;
+				}
+			}
+
+			Tree::Ray_hit hit;
+			REQUIRE(tree.raycast(rays[i], max_t, hit) == expected_hit);
+			REQUIRE((hits[i].handle != Tree::invalid_handle()) == expected_hit);
+
+			if (expected_hit)
+			{
+				++num_hits;
+				REQUIRE(hit.t == expected_t);
+				REQUIRE(hits[i].t == expected_t);
+
+				float t;
+				REQUIRE(raycast(rays[i], tree.get(hit.handle).shape, max_t, t));
+				REQUIRE(t == expected_t);
+			}
+		}
+
+		REQUIRE(num_hits > 100);
+
+		// Hit where update() moved it, not where it was inserted.
+		const Tree::Handle moved = tree.insert({Circle<>(Point(10.0f, 10.0f), 1.0f), 2000});
+		tree.update(moved, Circle<>(Point(50.0f, 50.0f), 1.0f));
+		Tree::Ray_hit hit;
+		REQUIRE(tree.raycast(Tree::Ray(Point(50.0f, 45.0f), Point(0.0f, 1.0f)), max_t, hit));
+		REQUIRE(hit.handle == moved);
+		REQUIRE(hit.t == Approx(4.0f));
+		REQUIRE((!tree.raycast(Tree::Ray(Point(10.0f, 5.0f), Point(0.0f, 1.0f)), max_t, hit) || hit.handle != moved));
+	}
+}
+
+TEST_CASE("Quad_tree adaptive splitting")
+{
+	using Point = glm::vec2;
+	using Tree = Quad_tree<Test_item>;
+
+	for (const float looseness : {1.0f, 2.0f})
+	{
+		INFO("looseness " << looseness);
+
+		const unsigned max_depth = 5;
+		const unsigned split_threshold = 4;
+		Tree tree(Rectangle<Point>(Point(0.0f), Point(100.0f)), looseness, max_depth, split_threshold);
+		REQUIRE(tree.num_nodes() == 1);
+
+		// A dense cluster in one corner, and a few items spread out.
+		std::vector<Test_item> items;
+		for (unsigned i = 0; i < 200; ++i)
+		{
+			items.push_back({Circle<>(Point(5.0f + (i % 20) * 0.5f, 5.0f + (i / 20) * 0.5f), 0.1f), i});
+		}
+		for (unsigned i = 0; i < 3; ++i)
+		{
+			items.push_back({Circle<>(Point(30.0f + i * 25.0f, 80.0f), 0.5f), 200 + i});
+		}
+
+		std::vector<Tree::Handle> handles;
+		for (const auto& item : items)
+		{
+			handles.push_back(tree.insert(item));
+		}
+
+		// Only the path to the cluster is refined, and not beyond the max depth.
+		REQUIRE(tree.depth() == max_depth);
+		REQUIRE(tree.num_nodes() < 4 * 4 * max_depth);
+
+		const Rectangle<Point> query(Point(4.0f), Point(9.0f, 6.2f));
+		REQUIRE(query_ids(tree, query) == brute_force_ids(items, query));
+
+		// Moving the cluster apart.
+		for (size_t i = 0; i < 200; ++i)
+		{
+			items[i].shape.center = Point(2.5f + (i % 20) * 5.0f, 2.5f + (i / 20) * 10.0f);
+			tree.update(handles[i], items[i].shape);
+		}
+		REQUIRE(tree.depth() < max_depth);
+
+		const Circle<Point> circle_query(Point(50.0f, 40.0f), 22.0f);
+		REQUIRE(query_ids(tree, circle_query) == brute_force_ids(items, circle_query));
+
+		// Nodes merge back as the items go.
+		for (size_t i = 0; i < items.size() - 1; ++i)
+		{
+			tree.remove(handles[i]);
+		}
+		REQUIRE(tree.num_nodes() == 1);
+		REQUIRE(tree.get(handles.back()).id == items.back().id);
+
+		// Pooled nodes are reused.
+		for (size_t i = 0; i < 200; ++i)
+		{
+			items[i].shape.center = Point(90.0f + (i % 20) * 0.2f, 90.0f + (i / 20) * 0.2f);
+			handles[i] = tree.insert(items[i]);
+		}
+		REQUIRE(tree.depth() == max_depth);
+
+		// Removing items in bulk merges too.
+		auto keep_spread = [](const Test_item& item) { return item.id >= 200; };
+		tree.integrate_items(keep_spread);
+		REQUIRE(tree.num_nodes() == 1);
+	}
+}
+
+TEST_CASE("Quad_tree bulk build")
+{
+	using Point = glm::vec2;
+	using Tree = Quad_tree<Test_item>;
+
+	std::mt19937 rng(47);
+	std::uniform_real_distribution<float> coord(-10.0f, 110.0f);
+	std::uniform_real_distribution<float> size(0.0f, 1.0f);
+
+	// Mostly small items, some large ones crossing split lines, some outside of the root.
+	std::vector<Test_item> items;
+	for (unsigned i = 0; i < 20000; ++i)
+	{
+		const float s = size(rng);
+		items.push_back({Circle<>(Point(coord(rng), coord(rng)), s < 0.9f ? s : s * 30.0f), i});
+	}
+
+	for (const float looseness : {1.0f, 2.0f})
+	{
+		INFO("looseness " << looseness);
+
+		const Rectangle<Point> root(Point(0.0f), Point(100.0f));
+		Tree inserted(root, looseness);
+		for (const auto& item : items)
+		{
+			inserted.insert(item);
+		}
+
+		Tree built(root, looseness);
+		std::vector<Tree::Handle> handles;
+		built.build(items, &handles);
+
+		// The same tree as inserting one by one.
+		const Quad_tree_stats inserted_stats = inserted.stats();
+		const Quad_tree_stats built_stats = built.stats();
+		REQUIRE(built_stats.num_items == items.size());
+		REQUIRE(built_stats.num_nodes == inserted_stats.num_nodes);
+		REQUIRE(built_stats.nodes_per_depth == inserted_stats.nodes_per_depth);
+		REQUIRE(built_stats.items_per_depth == inserted_stats.items_per_depth);
+		REQUIRE(built_stats.items_per_node == inserted_stats.items_per_node);
+
+		const Rectangle<Point> query(Point(12.0f, 30.0f), Point(61.0f, 47.5f));
+		REQUIRE(query_ids(built, query) == brute_force_ids(items, query));
+
+		const Circle<Point> circle_query(Point(-5.0f, 50.0f), 20.0f);
+		REQUIRE(query_ids(built, circle_query) == brute_force_ids(items, circle_query));
+
+		for (size_t i = 0; i < items.size(); i += 97)
+		{
+			REQUIRE(built.get(handles[i]).id == items[i].id);
+		}
+
+		// The built tree updates like any other.
+		for (size_t i = 0; i < items.size(); i += 2)
+		{
+			built.remove(handles[i]);
+		}
+		REQUIRE(query_ids(built, query).size() < brute_force_ids(items, query).size());
+
+		built.build(std::vector<Test_item>());
+		REQUIRE(built.num_nodes() == 1);
+		REQUIRE(query_ids(built, query).empty());
+	}
+}
@@ -0,0 +1,198 @@
+#include "../src/base/file_io.hpp"
+#include "../src/spatial/quad_tree_snapshot.hpp"
+#include "catch.hpp"
+#include "test_items.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+using namespace kvant::spatial;
+
+namespace {
+
+	// The same size as Test_item.
+	struct Integer_item
+	{
+		Rectangle<glm::ivec2> rect;
+
+		Rectangle<glm::ivec2> bounding_shape() const
+		{
+			return rect;
+		}
+	};
+
+	struct Other_item
+	{
+		Rectangle<glm::vec2> rect;
+		unsigned id;
+
+		Rectangle<glm::vec2> bounding_shape() const
+		{
+			return rect;
+		}
+	};
+
+	// Checks that the snapshot answers every query like the tree.
+	void check_same_results(const Quad_tree<Test_item>& tree, const Quad_tree_snapshot<Test_item>& snapshot)
+	{
+		using Point = glm::vec2;
+
+		for (unsigned i = 0; i < 50; ++i)
+		{
+			const Point center((i * 37) % 110 - 5.0f, (i * 53) % 110 - 5.0f);
+			const Rectangle<Point> rect(center, center + Point(i % 20 + 1.0f, i % 15 + 1.0f));
+			REQUIRE(query_ids(snapshot, rect) == query_ids(tree, rect));
+			REQUIRE(query_ids(snapshot, Circle<>(center, i % 10 + 0.5f)) == query_ids(tree, Circle<>(center, i % 10 + 0.5f)));
+
+			Quad_tree<Test_item>::Neighbour expected[5];
+			Quad_tree_snapshot<Test_item>::Neighbour result[5];
+			const size_t found = tree.knn(center, 5, expected);
+			REQUIRE(snapshot.knn(center, 5, result) == found);
+			for (size_t n = 0; n < found; ++n)
+			{
+				REQUIRE(result[n].distance_squared == expected[n].distance_squared);
+			}
+
+			const float angle = i * 0.37f;
+			const Quad_tree<Test_item>::Ray ray(center, Point(std::cos(angle), std::sin(angle)));
+			Quad_tree<Test_item>::Ray_hit tree_hit;
+			Quad_tree_snapshot<Test_item>::Ray_hit snapshot_hit;
+			REQUIRE(snapshot.raycast(ray, 30.0f, snapshot_hit) == tree.raycast(ray, 30.0f, tree_hit));
+			REQUIRE(snapshot_hit.t == tree_hit.t);
+			if (snapshot_hit.index != snapshot.invalid_index)
+			{
+				REQUIRE(snapshot.get(snapshot_hit.index).id == tree.get(tree_hit.handle).id);
+			}
+		}
+	}
+}
+
+TEST_CASE("Quad_tree_snapshot")
+{
+	using Point = glm::vec2;
+
+	for (const float looseness : {1.0f, 2.0f})
+	{
+		Quad_tree<Test_item> tree(Rectangle<Point>(Point(0.0f), Point(100.0f)), looseness, 6, 4);
+
+		std::vector<Quad_tree<Test_item>::Handle> handles;
+		unsigned id = 0;
+		for (int y = 0; y < 20; ++y)
+		{
+			for (int x = 0; x < 20; ++x)
+			{
+				const float radius = (x + y) % 7 == 0 ? 6.0f : 0.5f;
+				handles.push_back(tree.insert({Circle<>(Point(x * 5.0f + 2.5f, y * 5.0f + 2.5f), radius), id++}));
+			}
+		}
+		tree.insert({Circle<>(Point(101.0f, 50.0f), 3.0f), id++}); // Partly outside of root.
+
+		// Emptied branches are left out of the snapshot.
+		for (size_t i = 0; i < handles.size(); ++i)
+		{
+			if (handles.size() / 2 <= i && i % 3 != 0)
+			{
+				tree.remove(handles[i]);
+			}
+		}
+
+		// Moved items are written where update() put them.
+		tree.update(handles[0], Circle<>(Point(72.0f, 20.0f), 1.0f));
+
+		std::vector<char> bytes;
+		Quad_tree_snapshot<Test_item>::write(tree, bytes);
+
+		Quad_tree_snapshot<Test_item> snapshot;
+		REQUIRE(snapshot.open(bytes.data(), bytes.size()));
+		REQUIRE(snapshot.size() == query_ids(tree, Rectangle<Point>(Point(-100.0f), Point(200.0f))).size());
+		REQUIRE(snapshot.num_nodes() <= tree.num_nodes());
+
+		INFO("looseness " << looseness);
+		check_same_results(tree, snapshot);
+
+		Quad_tree_snapshot<Test_item>::Neighbour nearest;
+		REQUIRE(snapshot.knn(Point(72.0f, 20.0f), 1, &nearest) == 1);
+		REQUIRE(snapshot.get(nearest.index).id == 0);
+		REQUIRE(nearest.distance_squared == 0.0f);
+
+		Quad_tree_snapshot<Test_item>::Ray_hit hit;
+		REQUIRE(snapshot.raycast(Quad_tree<Test_item>::Ray(Point(72.0f, 18.5f), Point(0.0f, 1.0f)), 30.0f, hit));
+		REQUIRE(snapshot.get(hit.index).id == 0);
+		REQUIRE(hit.t == Approx(0.5f));
+
+		SECTION("Mapped from a file")
+		{
+			const char* filename = "quad_tree_snapshot.bin";
+			REQUIRE(kvant::base::write_file(filename, bytes.data(), bytes.size()));
+
+			{
+				kvant::base::Mapped_file file;
+				REQUIRE(file.open(filename));
+				REQUIRE(file.size() == bytes.size());
+
+				Quad_tree_snapshot<Test_item> mapped;
+				REQUIRE(mapped.open(file.data(), file.size()));
+				check_same_results(tree, mapped);
+			}
+
+			std::remove(filename);
+		}
+
+		SECTION("Rejects other data")
+		{
+			REQUIRE_FALSE(snapshot.open(bytes.data(), bytes.size() - 1));
+			REQUIRE_FALSE(snapshot.is_open());
+			REQUIRE(query_ids(snapshot, Circle<>(Point(50.0f), 100.0f)).empty());
+
+			Quad_tree_snapshot<Other_item> other;
+			REQUIRE_FALSE(other.open(bytes.data(), bytes.size()));
+
+			Quad_tree_snapshot<Integer_item> integer;
+			REQUIRE_FALSE(integer.open(bytes.data(), bytes.size()));
+
+			bytes[0] ^= 1;
+			REQUIRE_FALSE(snapshot.open(bytes.data(), bytes.size()));
+			bytes[0] ^= 1;
+			REQUIRE(snapshot.open(bytes.data(), bytes.size()));
+		}
+
+		SECTION("Rejects corrupt sections and nodes")
+		{
+			using kvant::spatial::detail::Snapshot_header;
+			using kvant::spatial::detail::Snapshot_node;
+
+			const auto corrupted = [&bytes](void (*corrupt)(Snapshot_header&, Snapshot_node*)) {
+				std::vector<char> copy(bytes);
+				Snapshot_header& header = *reinterpret_cast<Snapshot_header*>(copy.data());
+				corrupt(header, reinterpret_cast<Snapshot_node*>(copy.data() + header.nodes_offset));
+
+				Quad_tree_snapshot<Test_item> corrupt_snapshot;
+				return corrupt_snapshot.open(copy.data(), copy.size());
+			};
+
+			REQUIRE(corrupted([](Snapshot_header&, Snapshot_node*) {}));
+			REQUIRE_FALSE(corrupted([](Snapshot_header& header, Snapshot_node*) { header.items_offset -= 4; }));
+			REQUIRE_FALSE(corrupted([](Snapshot_header& header, Snapshot_node*) { header.nodes_offset += 8; }));
+			REQUIRE_FALSE(corrupted([](Snapshot_header&, Snapshot_node* nodes) { nodes[0].children += 4; }));
+			REQUIRE_FALSE(corrupted([](Snapshot_header&, Snapshot_node* nodes) { nodes[0].children = 0; }));
+			REQUIRE_FALSE(corrupted([](Snapshot_header& header, Snapshot_node* nodes) { nodes[header.num_nodes - 1].children = header.num_nodes; }));
+			REQUIRE_FALSE(corrupted([](Snapshot_header& header, Snapshot_node* nodes) { nodes[1].first_item = header.num_items; nodes[1].item_count = 1; }));
+			REQUIRE_FALSE(corrupted([](Snapshot_header&, Snapshot_node* nodes) { nodes[1].item_count = ~0u; }));
+		}
+	}
+}
+
+TEST_CASE("Quad_tree_snapshot of an empty tree")
+{
+	Quad_tree<Test_item> tree(Rectangle<glm::vec2>(glm::vec2(0.0f), glm::vec2(100.0f)));
+
+	std::vector<char> bytes;
+	Quad_tree_snapshot<Test_item>::write(tree, bytes);
+
+	Quad_tree_snapshot<Test_item> snapshot;
+	REQUIRE(snapshot.open(bytes.data(), bytes.size()));
+	REQUIRE(snapshot.size() == 0);
+	REQUIRE(snapshot.num_nodes() == 1);
+	REQUIRE(query_ids(snapshot, Circle<>(glm::vec2(50.0f), 100.0f)).empty());
+}
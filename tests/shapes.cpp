@@ -1,7 +1,11 @@
 #include "../src/spatial/shapes.hpp"
 #include "catch.hpp"
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <vector>
 
-using namespace spatial::shapes;
+using namespace kvant::spatial;
 
 TEST_CASE("Circle basic tests")
 { 
@@ -62,3 +66,204 @@ TEST_CASE("Rectangle basic tests")
 		REQUIRE(!rect.contains(rect_cross));
 	}
 }
+
+TEST_CASE("Point distance")
+{
+	using Point = glm::vec2;
+	const Rectangle<Point> rect(Point(0.0f), Point(10.0f));
+	REQUIRE(distance_squared(Point(5.0f, 5.0f), rect) == 0.0f);
+	REQUIRE(distance_squared(Point(13.0f, 14.0f), rect) == 25.0f);
+	REQUIRE(distance_squared(Point(-2.0f, 5.0f), rect) == 4.0f);
+
+	const Circle<Point> circle(Point(0.0f), 2.0f);
+	REQUIRE(distance_squared(Point(1.0f, 1.0f), circle) == 0.0f);
+	REQUIRE(distance_squared(Point(5.0f, 0.0f), circle) == 9.0f);
+}
+
+TEST_CASE("Ray casting")
+{
+	using Point = glm::vec2;
+	float t = -1.0f;
+
+	SECTION("Rectangle")
+	{
+		const Rectangle<Point> rect(Point(2.0f, 2.0f), Point(4.0f, 4.0f));
+		REQUIRE(raycast(Ray<Point>(Point(0.0f, 3.0f), Point(1.0f, 0.0f)), rect, 10.0f, t));
+		REQUIRE(t == 2.0f);
+		REQUIRE(raycast(Ray<Point>(Point(0.0f, 0.0f), Point(2.0f, 2.0f)), rect, 10.0f, t));
+		REQUIRE(t == 1.0f);
+		REQUIRE(raycast(Ray<Point>(Point(3.0f, 3.0f), Point(1.0f, 0.0f)), rect, 10.0f, t));
+		REQUIRE(t == 0.0f);
+		REQUIRE(raycast(Ray<Point>(Point(3.0f, 10.0f), Point(0.0f, -1.0f)), rect, 10.0f, t));
+		REQUIRE(t == 6.0f);
+		REQUIRE(!raycast(Ray<Point>(Point(0.0f, 3.0f), Point(1.0f, 0.0f)), rect, 1.5f, t));
+		REQUIRE(!raycast(Ray<Point>(Point(0.0f, 3.0f), Point(-1.0f, 0.0f)), rect, 10.0f, t));
+		REQUIRE(!raycast(Ray<Point>(Point(0.0f, 5.0f), Point(1.0f, 0.0f)), rect, 10.0f, t));
+	}
+
+	SECTION("Circle")
+	{
+		const Circle<Point> circle(Point(5.0f, 0.0f), 1.0f);
+		REQUIRE(raycast(Ray<Point>(Point(0.0f, 0.0f), Point(1.0f, 0.0f)), circle, 10.0f, t));
+		REQUIRE(t == 4.0f);
+		REQUIRE(raycast(Ray<Point>(Point(0.0f, 0.0f), Point(0.5f, 0.0f)), circle, 10.0f, t));
+		REQUIRE(t == 8.0f);
+		REQUIRE(raycast(Ray<Point>(Point(5.0f, 0.5f), Point(1.0f, 0.0f)), circle, 10.0f, t));
+		REQUIRE(t == 0.0f);
+		REQUIRE(!raycast(Ray<Point>(Point(0.0f, 0.0f), Point(1.0f, 0.0f)), circle, 3.0f, t));
+		REQUIRE(!raycast(Ray<Point>(Point(0.0f, 0.0f), Point(-1.0f, 0.0f)), circle, 10.0f, t));
+		REQUIRE(!raycast(Ray<Point>(Point(0.0f, 2.0f), Point(1.0f, 0.0f)), circle, 10.0f, t));
+	}
+}
+
+TEST_CASE("Batch shape tests")
+{
+	// Small integers, so some points land exactly on the edges.
+	std::mt19937 rng(3);
+	std::uniform_int_distribution<int> coordinate(-8, 8);
+	std::uniform_int_distribution<int> size(0, 4);
+
+	const size_t count = 83;
+	std::vector<float> x, y, w, h;
+	for (size_t i = 0; i < count; ++i)
+	{
+		x.push_back(static_cast<float>(coordinate(rng)));
+		y.push_back(static_cast<float>(coordinate(rng)));
+		w.push_back(static_cast<float>(size(rng)));
+		h.push_back(static_cast<float>(size(rng)));
+	}
+
+	std::vector<std::uint32_t> hits(count);
+
+	for (unsigned query = 0; query < 50; ++query)
+	{
+		const Point point(static_cast<float>(coordinate(rng)), static_cast<float>(coordinate(rng)) * 0.5f);
+		const float radius = static_cast<float>(size(rng));
+
+		std::vector<std::uint32_t> point_circle, circle_circle, point_rect, circle_rect;
+		for (std::uint32_t i = 0; i < count; ++i)
+		{
+			const Point center(x[i], y[i]);
+			const Point dim(w[i], h[i]);
+			if (test_point_circle(point, center, w[i]))
+				point_circle.push_back(i);
+			if (test_circle_circle(point, radius, center, w[i]))
+				circle_circle.push_back(i);
+			if (test_point_rect(point, center, dim))
+				point_rect.push_back(i);
+			if (test_circle_rect(point, radius, center, dim))
+				circle_rect.push_back(i);
+		}
+
+		const auto check_mask = [](const std::vector<std::uint32_t>& expected, size_t first, unsigned width, std::uint32_t mask) {
+			for (unsigned lane = 0; lane < width; ++lane)
+			{
+				const bool hit = std::find(expected.begin(), expected.end(), first + lane) != expected.end();
+				REQUIRE(((mask >> lane) & 1u) == static_cast<std::uint32_t>(hit));
+			}
+			REQUIRE((mask >> width) == 0);
+		};
+
+		for (size_t first = 0; first + 16 <= count; first += 13)
+		{
+			check_mask(point_circle, first, 4, test_point_circle_mask<4>(point, &x[first], &y[first], &w[first]));
+			check_mask(point_circle, first, 8, test_point_circle_mask<8>(point, &x[first], &y[first], &w[first]));
+			check_mask(point_circle, first, 16, test_point_circle_mask<16>(point, &x[first], &y[first], &w[first]));
+			check_mask(circle_circle, first, 16, test_circle_circle_mask<16>(point, radius, &x[first], &y[first], &w[first]));
+			check_mask(point_rect, first, 8, test_point_rect_mask<8>(point, &x[first], &y[first], &w[first], &h[first]));
+			check_mask(circle_rect, first, 4, test_circle_rect_mask<4>(point, radius, &x[first], &y[first], &w[first], &h[first]));
+		}
+
+		hits.resize(test_point_circle_batch(point, x.data(), y.data(), w.data(), count, hits.data()));
+		REQUIRE(hits == point_circle);
+		hits.resize(count);
+
+		hits.resize(test_circle_circle_batch(point, radius, x.data(), y.data(), w.data(), count, hits.data()));
+		REQUIRE(hits == circle_circle);
+		hits.resize(count);
+
+		hits.resize(test_point_rect_batch(point, x.data(), y.data(), w.data(), h.data(), count, hits.data()));
+		REQUIRE(hits == point_rect);
+		hits.resize(count);
+
+		hits.resize(test_circle_rect_batch(point, radius, x.data(), y.data(), w.data(), h.data(), count, hits.data()));
+		REQUIRE(hits == circle_rect);
+		hits.resize(count);
+	}
+}
+
+TEST_CASE("Integer shapes")
+{
+	SECTION("32 bit")
+	{
+		using Point = glm::ivec2;
+		const int lowest = std::numeric_limits<int>::lowest();
+		const int highest = std::numeric_limits<int>::max();
+
+		REQUIRE(test_point_circle(Point(0, 0), Point(3, 4), 5));
+		REQUIRE(!test_point_circle(Point(0, 0), Point(3, 4), 4));
+		REQUIRE(!test_point_circle(Point(lowest), Point(highest), highest));
+
+		// Exactly touching across the whole range, and one unit apart.
+		REQUIRE(intersects(Circle<Point>(Point(lowest + 1, 0), highest), Circle<Point>(Point(highest, 0), highest)));
+		REQUIRE(!intersects(Circle<Point>(Point(lowest, 0), highest), Circle<Point>(Point(highest, 0), highest)));
+		REQUIRE(test_circle_circle(Point(lowest + 1, 0), highest, Point(highest, 0), highest));
+		REQUIRE(!test_circle_circle(Point(lowest, 0), highest, Point(highest, 0), highest));
+
+		const Rectangle<Point> corner{Point(highest - 1), Point(highest)};
+		REQUIRE(intersects(Circle<Point>(Point(highest - 4, highest - 5), 5), corner));
+		REQUIRE(!intersects(Circle<Point>(Point(highest - 5, highest - 5), 5), corner));
+		REQUIRE(!intersects(Circle<Point>(Point(lowest), highest), corner));
+
+		// The sum of the squares saturates instead of wrapping around.
+		REQUIRE(distance_squared(Point(lowest), corner) == std::numeric_limits<std::uint64_t>::max());
+		REQUIRE(distance_squared(Point(highest - 4, highest - 5), corner) == 9u + 16u);
+
+		// Bounds of circles at the edge of the range saturate.
+		const Circle<Point> edge(Point(highest - 4), 5);
+		REQUIRE(edge.min() == Point(highest - 9));
+		REQUIRE(edge.max() == Point(highest));
+		REQUIRE(bounding_rect(Circle<Point>(Point(lowest + 4, 0), 5)).min == Point(lowest, -5));
+		REQUIRE(bounding_rect(Circle<Point>(Point(0), highest)).min == Point(-highest));
+
+		const Rectangle<Point> all{Point(lowest), Point(highest)};
+		REQUIRE(all.width() == 0xffffffffll);
+		REQUIRE(all.center() == Point(-1));
+		REQUIRE(all.area() == 0xffffffffull * 0xffffffffull);
+	}
+
+	SECTION("16 bit")
+	{
+		using Point = glm::i16vec2;
+		const std::int16_t lowest = std::numeric_limits<std::int16_t>::lowest();
+		const std::int16_t highest = std::numeric_limits<std::int16_t>::max();
+
+		const Rectangle<Point> all{Point(lowest), Point(highest)};
+		REQUIRE(all.width() == 65535);
+		REQUIRE(all.center() == Point(-1));
+
+		const auto split = all.split();
+		REQUIRE(split[1].min == Point(-1));
+		REQUIRE(split[1].max == Point(highest));
+
+		REQUIRE(test_point_rect(Point(highest - 1), Point(0), Point(highest)));
+		REQUIRE(!test_point_rect(Point(highest), Point(0), Point(highest)));
+		REQUIRE(test_circle_rect(Point(lowest), highest, Point(0, lowest), Point(1)));
+		REQUIRE(!test_circle_rect(Point(lowest), highest, Point(1, lowest), Point(1)));
+		REQUIRE(nearest_point_rect(Point(lowest), Point(highest), Point(highest)) == Point(0));
+		REQUIRE(distance_squared(Point(lowest), Rectangle<Point>(Point(highest), Point(highest))) == std::numeric_limits<std::uint32_t>::max());
+
+		const Circle<Point> edge(Point(highest - 4), 5);
+		REQUIRE(edge.max() == Point(highest));
+		REQUIRE(bounding_rect(Circle<Point>(Point(lowest + 4), 5)).min == Point(lowest));
+	}
+
+	SECTION("Unsigned")
+	{
+		using Point = glm::uvec2;
+		const unsigned highest = std::numeric_limits<unsigned>::max();
+		const Circle<Point> edge(Point(4, highest - 4), 5);
+		REQUIRE(edge.min() == Point(0, highest - 9));
+		REQUIRE(edge.max() == Point(9, highest));
+	}
+}
@@ -0,0 +1,104 @@
+#define KVANT_SPATIAL_STATS
+#include "../src/spatial/quad_tree.hpp"
+#include "catch.hpp"
+#include <numeric>
+#include <sstream>
+#include <type_traits>
+
+using namespace kvant::spatial;
+
+namespace {
+
+	struct Stats_item
+	{
+		Circle<> shape;
+
+		Circle<> bounding_shape() const
+		{
+			return shape;
+		}
+	};
+
+	// Counting is part of the type of the tree, so trees of files built without counting
+	// are other types.
+	static_assert(std::is_same<Quad_tree<Stats_item>, Quad_tree<Stats_item, Block_storage, counting::Query_counters>>::value,
+				  "Counting must be part of the type of the tree.");
+
+	size_t sum(const std::vector<size_t>& values)
+	{
+		return std::accumulate(values.begin(), values.end(), size_t(0));
+	}
+}
+
+TEST_CASE("Quad_tree stats")
+{
+	Quad_tree<Stats_item> tree(Rectangle<glm::vec2>(glm::vec2(0.0f), glm::vec2(100.0f)), 1.0f, 5, 4);
+
+	for (unsigned y = 0; y < 20; ++y)
+	{
+		for (unsigned x = 0; x < 20; ++x)
+		{
+			tree.insert({Circle<>(glm::vec2(x * 5.0f + 2.5f, y * 5.0f + 2.5f), 0.5f)});
+		}
+	}
+
+	// Items on the center lines can't go below the root.
+	tree.insert({Circle<>(glm::vec2(50.0f), 1.0f)});
+	tree.insert({Circle<>(glm::vec2(50.0f, 20.0f), 1.0f)});
+
+	const Quad_tree_stats stats = tree.stats();
+
+	SECTION("Shape of the tree")
+	{
+		REQUIRE(stats.num_items == 402);
+		REQUIRE(sum(stats.items_per_depth) == stats.num_items);
+		REQUIRE(sum(stats.nodes_per_depth) == stats.num_nodes);
+		REQUIRE(sum(stats.items_per_node) == stats.num_nodes);
+		REQUIRE(stats.nodes_per_depth[0] == 1);
+		REQUIRE(stats.num_nodes - 1 == (stats.num_nodes - stats.num_leaves) * 4);
+		REQUIRE(stats.items_in_inner_nodes >= 2);
+		REQUIRE(stats.inner_fraction() > 0.0);
+		REQUIRE(stats.inner_fraction() < 0.5);
+	}
+
+	SECTION("Storage")
+	{
+		REQUIRE(stats.storage.num_items == stats.num_items);
+		REQUIRE(stats.storage.utilisation() > 0.0);
+		REQUIRE(stats.storage.utilisation() <= 1.0);
+	}
+
+	SECTION("Query counters")
+	{
+		REQUIRE(stats.queries == 0);
+
+		unsigned found = 0;
+		tree.for_each_intersecting(Rectangle<glm::vec2>(glm::vec2(10.0f), glm::vec2(30.0f)), [&found](const Stats_item&) { ++found; });
+		Quad_tree<Stats_item>::Neighbour nearest[3];
+		REQUIRE(tree.knn(glm::vec2(50.0f), 3, nearest) == 3);
+
+		const Quad_tree_stats after = tree.stats();
+		REQUIRE(found > 0);
+		REQUIRE(after.queries == 2);
+		REQUIRE(after.nodes_visited >= 2);
+		REQUIRE(after.shape_tests >= found);
+		REQUIRE(after.nodes_per_query() >= 1.0);
+
+		tree.reset_query_stats();
+		REQUIRE(tree.stats().queries == 0);
+		REQUIRE(tree.stats().shape_tests == 0);
+	}
+
+	SECTION("Output")
+	{
+		std::ostringstream text;
+		stats.write_text(text);
+		REQUIRE(text.str().find("items 402") != std::string::npos);
+
+		std::ostringstream json;
+		stats.write_json(json);
+		REQUIRE(json.str().front() == '{');
+		REQUIRE(json.str().back() == '}');
+		REQUIRE(json.str().find("\"items\": 402") != std::string::npos);
+	}
+}
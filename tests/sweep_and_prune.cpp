@@ -0,0 +1,87 @@
+#include "../src/spatial/sweep_and_prune.hpp"
+#include "catch.hpp"
+#include "test_items.hpp"
+#include <algorithm>
+#include <random>
+#include <utility>
+#include <vector>
+
+using namespace kvant::spatial;
+
+namespace {
+
+	using Pair = std::pair<unsigned, unsigned>;
+
+	Pair make_pair(unsigned a, unsigned b)
+	{
+		return a < b ? Pair(a, b) : Pair(b, a);
+	}
+
+	std::vector<Pair> overlapping_pairs(Sweep_and_prune<Test_item>& sap)
+	{
+		std::vector<Pair> pairs;
+		sap.for_each_overlapping_pair([&](Sweep_and_prune<Test_item>::Handle a, Sweep_and_prune<Test_item>::Handle b) {
+			pairs.push_back(make_pair(sap.get(a).id, sap.get(b).id));
+		});
+		std::sort(pairs.begin(), pairs.end());
+		return pairs;
+	}
+
+	std::vector<Pair> brute_force_pairs(const std::vector<Test_item>& items, const std::vector<bool>& alive)
+	{
+		std::vector<Pair> pairs;
+		for (size_t a = 0; a < items.size(); ++a)
+		{
+			for (size_t b = a + 1; b < items.size(); ++b)
+			{
+				if (alive[a] && alive[b] && intersects(bounding_rect(items[a].shape), bounding_rect(items[b].shape)))
+				{
+					pairs.push_back(make_pair(items[a].id, items[b].id));
+				}
+			}
+		}
+		std::sort(pairs.begin(), pairs.end());
+		return pairs;
+	}
+}
+
+TEST_CASE("Sweep_and_prune")
+{
+	std::mt19937 rng(3);
+	std::uniform_real_distribution<float> delta(-1.5f, 1.5f);
+
+	Sweep_and_prune<Test_item> sap;
+	std::vector<Test_item> items = make_random_items(500, 3, 0.0f, 100.0f, 0.2f, 3.0f);
+	std::vector<Sweep_and_prune<Test_item>::Handle> handles;
+
+	for (const auto& item : items)
+	{
+		handles.push_back(sap.insert(item));
+	}
+
+	std::vector<bool> alive(items.size(), true);
+	REQUIRE(overlapping_pairs(sap) == brute_force_pairs(items, alive));
+
+	for (unsigned frame = 0; frame < 5; ++frame)
+	{
+		for (size_t i = 0; i < items.size(); ++i)
+		{
+			items[i].shape.center += glm::vec2(delta(rng), delta(rng));
+			sap.update(handles[i], items[i].shape);
+		}
+
+		REQUIRE(overlapping_pairs(sap) == brute_force_pairs(items, alive));
+	}
+
+	SECTION("Remove")
+	{
+		for (size_t i = 0; i < items.size(); i += 4)
+		{
+			sap.remove(handles[i]);
+			alive[i] = false;
+		}
+
+		REQUIRE(sap.size() == items.size() - (items.size() + 3) / 4);
+		REQUIRE(overlapping_pairs(sap) == brute_force_pairs(items, alive));
+	}
+}
@@ -0,0 +1,79 @@
+#pragma once
+#include "../src/spatial/shapes.hpp"
+#include <algorithm>
+#include <random>
+#include <vector>
+
+// The item the tests of the spatial indices insert, and the helpers that check their
+// queries against brute force.
+struct Test_item
+{
+	kvant::spatial::Circle<> shape;
+	unsigned id;
+
+	kvant::spatial::Circle<> bounding_shape() const
+	{
+		return shape;
+	}
+};
+
+// The ids of the items the index finds intersecting the shape, sorted.
+template <typename Index, typename Shape>
+std::vector<unsigned> query_ids(const Index& index, const Shape& shape)
+{
+	std::vector<unsigned> ids;
+	index.for_each_intersecting(shape, [&ids](const Test_item& item) { ids.push_back(item.id); });
+	std::sort(ids.begin(), ids.end());
+	return ids;
+}
+
+// The ids of the items whose bounds intersect the shape, in the order of the items.
+template <typename Shape>
+std::vector<unsigned> brute_force_ids(const std::vector<Test_item>& items, const Shape& shape)
+{
+	std::vector<unsigned> ids;
+	for (const auto& item : items)
+	{
+		if (intersects(shape, bounding_rect(item.shape)))
+		{
+			ids.push_back(item.id);
+		}
+	}
+	return ids;
+}
+
+// As above, for the items that are alive.
+template <typename Shape>
+std::vector<unsigned> brute_force_ids(const std::vector<Test_item>& items, const std::vector<bool>& alive, const Shape& shape)
+{
+	std::vector<unsigned> ids;
+	for (size_t i = 0; i < items.size(); ++i)
+	{
+		if (alive[i] && intersects(shape, bounding_rect(items[i].shape)))
+		{
+			ids.push_back(items[i].id);
+		}
+	}
+	return ids;
+}
+
+// Items with ids from 0, centers in [lowest, highest] on both axes and radii in
+// [min_radius, max_radius].
+inline std::vector<Test_item> make_random_items(unsigned count,
+												unsigned seed,
+												float lowest,
+												float highest,
+												float min_radius,
+												float max_radius)
+{
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution<float> position(lowest, highest);
+	std::uniform_real_distribution<float> radius(min_radius, max_radius);
+
+	std::vector<Test_item> items;
+	for (unsigned i = 0; i < count; ++i)
+	{
+		items.push_back({kvant::spatial::Circle<>(glm::vec2(position(rng), position(rng)), radius(rng)), i});
+	}
+	return items;
+}
@@ -0,0 +1,159 @@
+#include "../src/spatial/tiled_world.hpp"
+#include "catch.hpp"
+#include "test_items.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+using namespace kvant::spatial;
+
+namespace {
+
+	using World = Tiled_world<Test_item>;
+
+	const float tile_size = 100.0f;
+
+	// A 4x4 grid of small items in every tile, and one large item reaching over into the
+	// tile to the right.
+	void make_tile(World::Tile_coord coord, std::vector<Test_item>& items)
+	{
+		const unsigned tile_id = static_cast<unsigned>((coord.x + 1000) * 4096 + (coord.y + 1000)) * 32;
+		const glm::vec2 origin(coord.x * tile_size, coord.y * tile_size);
+
+		for (unsigned i = 0; i < 16; ++i)
+		{
+			const glm::vec2 offset((i % 4) * 25.0f + 12.5f, (i / 4) * 25.0f + 12.5f);
+			items.push_back({Circle<>(origin + offset, 2.0f), tile_id + i});
+		}
+		items.push_back({Circle<>(origin + glm::vec2(90.0f, 50.0f), 20.0f), tile_id + 16});
+	}
+
+	// The items of the resident tiles intersecting the rectangle.
+	std::vector<unsigned> brute_force_ids(const World& world, const Rectangle<glm::vec2>& rect)
+	{
+		std::vector<unsigned> ids;
+		for (std::int32_t y = -50; y <= 50; ++y)
+		{
+			for (std::int32_t x = -50; x <= 50; ++x)
+			{
+				if (!world.is_resident({x, y}))
+				{
+					continue;
+				}
+
+				std::vector<Test_item> items;
+				make_tile({x, y}, items);
+				for (const auto& item : items)
+				{
+					if (intersects(rect, bounding_rect(item.shape)))
+					{
+						ids.push_back(item.id);
+					}
+				}
+			}
+		}
+		std::sort(ids.begin(), ids.end());
+		return ids;
+	}
+}
+
+TEST_CASE("Tiled_world")
+{
+	std::atomic<unsigned> num_loads{0};
+	World world(tile_size, 1, 16, [&num_loads](World::Tile_coord coord, std::vector<Test_item>& items) {
+		++num_loads;
+		make_tile(coord, items);
+	});
+
+	world.wait_until_loaded(glm::vec2(150.0f, 150.0f));
+	REQUIRE(world.num_resident() == 9);
+	REQUIRE(world.num_pending() == 0);
+	REQUIRE(num_loads == 9);
+	for (std::int32_t y = 0; y <= 2; ++y)
+	{
+		for (std::int32_t x = 0; x <= 2; ++x)
+		{
+			REQUIRE(world.is_resident({x, y}));
+			REQUIRE(world.tree({x, y}) != nullptr);
+		}
+	}
+
+	SECTION("Queries span the tiles")
+	{
+		for (unsigned i = 0; i < 50; ++i)
+		{
+			const glm::vec2 min((i * 37) % 300 - 20.0f, (i * 53) % 300 - 20.0f);
+			const Rectangle<glm::vec2> rect(min, min + glm::vec2(i % 40 + 5.0f, i % 30 + 5.0f));
+			REQUIRE(query_ids(world, rect) == brute_force_ids(world, rect));
+		}
+
+		// Only the large item of the tile to the left reaches over the border.
+		const Rectangle<glm::vec2> over_border(glm::vec2(101.0f, 45.0f), glm::vec2(105.0f, 55.0f));
+		REQUIRE(query_ids(world, over_border).size() == 1);
+	}
+
+	SECTION("Nearest items")
+	{
+		for (const glm::vec2 point : {glm::vec2(100.0f, 100.0f), glm::vec2(12.0f, 280.0f), glm::vec2(-50.0f, 150.0f)})
+		{
+			std::vector<float> expected;
+			world.for_each_intersecting(Rectangle<glm::vec2>(glm::vec2(-1000.0f), glm::vec2(1000.0f)), [&](const Test_item& item) {
+				expected.push_back(distance_squared(point, item.shape));
+			});
+			std::sort(expected.begin(), expected.end());
+
+			World::Neighbour result[8];
+			REQUIRE(world.knn(point, 8, result) == 8);
+			for (unsigned i = 0; i < 8; ++i)
+			{
+				REQUIRE(result[i].distance_squared == expected[i]);
+				REQUIRE(distance_squared(point, result[i].item->shape) == expected[i]);
+			}
+		}
+	}
+
+	SECTION("Tiles follow the focus")
+	{
+		// One tile over keeps the old tiles within a tile of the radius.
+		world.wait_until_loaded(glm::vec2(250.0f, 150.0f));
+		REQUIRE(world.num_resident() == 12);
+		REQUIRE(num_loads == 12);
+		REQUIRE(world.is_resident({0, 1}));
+
+		// Back again reloads nothing.
+		world.wait_until_loaded(glm::vec2(150.0f, 150.0f));
+		REQUIRE(num_loads == 12);
+
+		world.wait_until_loaded(glm::vec2(5050.0f, 5050.0f));
+		REQUIRE(world.num_resident() == 9);
+		REQUIRE_FALSE(world.is_resident({1, 1}));
+		REQUIRE(world.is_resident({50, 50}));
+		REQUIRE(query_ids(world, Rectangle<glm::vec2>(glm::vec2(0.0f), glm::vec2(300.0f))).empty());
+	}
+}
+
+TEST_CASE("Tiled_world resident budget")
+{
+	World world(tile_size, 2, 12, make_tile);
+
+	for (unsigned frame = 0; frame < 200; ++frame)
+	{
+		const glm::vec2 focus(frame * 7.0f, frame * 3.0f);
+		world.update(focus);
+		REQUIRE(world.num_resident() + world.num_pending() <= 12);
+	}
+
+	// The tiles nearest the focus are loaded first.
+	const glm::vec2 focus(1450.0f, 650.0f);
+	world.wait_until_loaded(focus);
+	REQUIRE(world.num_resident() == 12);
+	REQUIRE(world.is_resident(world.tile_at(focus)));
+	for (std::int32_t y = 5; y <= 7; ++y)
+	{
+		for (std::int32_t x = 13; x <= 15; ++x)
+		{
+			REQUIRE(world.is_resident({x, y}));
+		}
+	}
+}
@@ -0,0 +1,217 @@
+#include "../src/graphics/mesh.hpp"
+#include "../src/spatial/triangle_bvh.hpp"
+#include "catch.hpp"
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+using namespace kvant;
+using spatial::Triangle_bvh;
+
+namespace {
+
+	// Bumpy height field over [0, size) on x and z, plus some loose triangles above it.
+	graphics::Triangle_mesh<> make_terrain(unsigned size)
+	{
+		graphics::Triangle_mesh<> mesh;
+		for (unsigned z = 0; z < size; ++z)
+		{
+			for (unsigned x = 0; x < size; ++x)
+			{
+				const float height = std::sin(x * 0.3f) * std::cos(z * 0.2f) * 3.0f;
+				mesh.vertices.push_back(graphics::Vertex(glm::vec3(static_cast<float>(x), height, static_cast<float>(z))));
+			}
+		}
+
+		for (unsigned z = 0; z + 1 < size; ++z)
+		{
+			for (unsigned x = 0; x + 1 < size; ++x)
+			{
+				const unsigned v0 = x + z * size;
+				mesh.triangles.push_back({v0, v0 + 1, v0 + 1 + size});
+				mesh.triangles.push_back({v0 + 1 + size, v0 + size, v0});
+			}
+		}
+
+		std::mt19937 rng(5);
+		std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+		for (unsigned i = 0; i < 200; ++i)
+		{
+			const glm::vec3 p(unit(rng) * size, 5.0f + unit(rng) * 10.0f, unit(rng) * size);
+			const unsigned v0 = static_cast<unsigned>(mesh.vertices.size());
+			mesh.vertices.push_back(graphics::Vertex(p));
+			mesh.vertices.push_back(graphics::Vertex(p + glm::vec3(unit(rng) * 4.0f, unit(rng), 0.0f)));
+			mesh.vertices.push_back(graphics::Vertex(p + glm::vec3(0.0f, unit(rng), unit(rng) * 4.0f)));
+			mesh.triangles.push_back({v0, v0 + 1, v0 + 2});
+		}
+
+		return mesh;
+	}
+
+	bool brute_force_raycast(const graphics::Triangle_mesh<>& mesh,
+							 const Triangle_bvh::Ray& ray,
+							 float max_t,
+							 float& nearest)
+	{
+		bool found = false;
+		nearest = max_t;
+		for (const auto& triangle : mesh.triangles)
+		{
+			const glm::vec3 v0 = mesh.vertices[triangle.v0].position;
+			const glm::vec3 e1 = mesh.vertices[triangle.v1].position - v0;
+			const glm::vec3 e2 = mesh.vertices[triangle.v2].position - v0;
+
+			const glm::vec3 p = glm::cross(ray.direction, e2);
+			const float det = glm::dot(e1, p);
+			if (std::abs(det) <= 1.0e-12f)
+				continue;
+
+			const glm::vec3 s = ray.origin - v0;
+			const float u = glm::dot(s, p) / det;
+			const glm::vec3 q = glm::cross(s, e1);
+			const float v = glm::dot(ray.direction, q) / det;
+			const float t = glm::dot(e2, q) / det;
+
+			if (0.0f <= u && 0.0f <= v && u + v <= 1.0f && 0.0f <= t && t <= nearest)
+			{
+				nearest = t;
+				found = true;
+			}
+		}
+		return found;
+	}
+
+	void check_raycasts(const graphics::Triangle_mesh<>& mesh, const Triangle_bvh& bvh, unsigned size)
+	{
+		std::mt19937 rng(9);
+		std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+		unsigned num_hits = 0;
+		for (unsigned i = 0; i < 300; ++i)
+		{
+			const glm::vec3 origin(unit(rng) * size, 20.0f, unit(rng) * size);
+			const glm::vec3 target(unit(rng) * size, -5.0f, unit(rng) * size);
+			const Triangle_bvh::Ray ray(origin, target - origin);
+
+			float expected_t;
+			const bool expected = brute_force_raycast(mesh, ray, 1.0f, expected_t);
+
+			Triangle_bvh::Hit hit;
+			REQUIRE(bvh.raycast(ray, 1.0f, hit) == expected);
+			if (expected)
+			{
+				++num_hits;
+				REQUIRE(hit.t == Approx(expected_t).epsilon(1.0e-4));
+
+				// The hit point is on the reported triangle.
+				const auto& triangle = mesh.triangles[hit.triangle];
+				const glm::vec3 v0 = mesh.vertices[triangle.v0].position;
+				const glm::vec3 point = v0 + (mesh.vertices[triangle.v1].position - v0) * hit.u + (mesh.vertices[triangle.v2].position - v0) * hit.v;
+				REQUIRE(glm::length(point - ray.at(hit.t)) < 1.0e-3f);
+			}
+		}
+
+		REQUIRE(num_hits > 250);
+
+		// Parallel to the ground, under the loose triangles.
+		Triangle_bvh::Hit hit;
+		REQUIRE(!bvh.raycast(Triangle_bvh::Ray(glm::vec3(-1.0f, 4.0f, 3.0f), glm::vec3(1.0f, 0.0f, 0.0f)), 1000.0f, hit));
+	}
+
+	std::vector<std::uint32_t> overlapping(const Triangle_bvh& bvh, const Triangle_bvh::Box& box)
+	{
+		std::vector<std::uint32_t> triangles;
+		bvh.for_each_overlapping(box, [&triangles](std::uint32_t triangle) { triangles.push_back(triangle); });
+		std::sort(triangles.begin(), triangles.end());
+		return triangles;
+	}
+
+	std::vector<std::uint32_t> brute_force_overlapping(const graphics::Triangle_mesh<>& mesh, const Triangle_bvh::Box& box)
+	{
+		std::vector<std::uint32_t> triangles;
+		for (std::uint32_t i = 0; i < mesh.triangles.size(); ++i)
+		{
+			const auto& triangle = mesh.triangles[i];
+			glm::vec3 min = mesh.vertices[triangle.v0].position;
+			glm::vec3 max = min;
+			for (const unsigned v : {triangle.v1, triangle.v2})
+			{
+				min = glm::min(min, mesh.vertices[v].position);
+				max = glm::max(max, mesh.vertices[v].position);
+			}
+
+			if (min.x <= box.max.x && box.min.x <= max.x &&
+				min.y <= box.max.y && box.min.y <= max.y &&
+				min.z <= box.max.z && box.min.z <= max.z)
+			{
+				triangles.push_back(i);
+			}
+		}
+		return triangles;
+	}
+}
+
+TEST_CASE("Triangle_bvh")
+{
+	const unsigned size = 100;
+	auto mesh = make_terrain(size);
+
+	Triangle_bvh bvh;
+	bvh.build(mesh);
+	REQUIRE(bvh.size() == mesh.triangles.size());
+	REQUIRE(bvh.num_nodes() < 2 * mesh.triangles.size());
+
+	SECTION("Raycast")
+	{
+		check_raycasts(mesh, bvh, size);
+	}
+
+	SECTION("Box overlap")
+	{
+		for (const float x : {10.0f, 50.5f, 97.0f})
+		{
+			const Triangle_bvh::Box box(glm::vec3(x - 3.0f, 2.0f, 20.0f), glm::vec3(x + 3.0f, 8.0f, 31.0f));
+			const auto expected = brute_force_overlapping(mesh, box);
+			REQUIRE(!expected.empty());
+			REQUIRE(overlapping(bvh, box) == expected);
+		}
+	}
+
+	SECTION("Refit after transform")
+	{
+		glm::mat4 m(1.0f);
+		m[3] = glm::vec4(-20.0f, 3.0f, 7.0f, 1.0f);
+		m[0][0] = 0.5f; // Squash along x.
+		mesh.transform(m);
+		bvh.refit(mesh);
+
+		const Triangle_bvh::Box box(glm::vec3(5.0f, 0.0f, 30.0f), glm::vec3(12.0f, 10.0f, 40.0f));
+		REQUIRE(overlapping(bvh, box) == brute_force_overlapping(mesh, box));
+
+		Triangle_bvh::Hit hit;
+		const Triangle_bvh::Ray ray(glm::vec3(-5.0f, 30.0f, 50.0f), glm::vec3(0.0f, -1.0f, 0.0f));
+		float expected_t;
+		REQUIRE(brute_force_raycast(mesh, ray, 100.0f, expected_t));
+		REQUIRE(bvh.raycast(ray, 100.0f, hit));
+		REQUIRE(hit.t == Approx(expected_t));
+	}
+
+	SECTION("Empty and small meshes")
+	{
+		graphics::Triangle_mesh<> small;
+		Triangle_bvh empty;
+		empty.build(small);
+		Triangle_bvh::Hit hit;
+		REQUIRE(!empty.raycast(Triangle_bvh::Ray(glm::vec3(0.0f), glm::vec3(1.0f, 0.0f, 0.0f)), 10.0f, hit));
+
+		small.vertices = {graphics::Vertex(glm::vec3(0.0f, 0.0f, 0.0f)),
+						  graphics::Vertex(glm::vec3(1.0f, 0.0f, 0.0f)),
+						  graphics::Vertex(glm::vec3(0.0f, 1.0f, 0.0f))};
+		small.triangles = {{0, 1, 2}};
+		empty.build(small);
+		REQUIRE(empty.raycast(Triangle_bvh::Ray(glm::vec3(0.25f, 0.25f, -1.0f), glm::vec3(0.0f, 0.0f, 2.0f)), 10.0f, hit));
+		REQUIRE(hit.triangle == 0);
+		REQUIRE(hit.t == Approx(0.5f));
+	}
+}
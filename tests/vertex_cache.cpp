@@ -0,0 +1,131 @@
+#include "../src/graphics/vertex_cache.hpp"
+#include "catch.hpp"
+#include <algorithm>
+#include <array>
+#include <vector>
+
+using namespace kvant;
+using graphics::Triangle;
+using graphics::Triangle_array;
+using graphics::Triangle_mesh;
+using graphics::Vertex;
+
+namespace {
+
+	struct Flat_patch {
+		glm::vec3 sample(float x, float y) const
+		{
+			return glm::vec3(x, y, 0.0f);
+		}
+	};
+
+	// The triangles as sorted lists of the vertices they had before the mesh was reordered,
+	// kept in the color.
+	std::vector<std::array<unsigned, 3>> original_triangles(const Triangle_mesh<>& mesh)
+	{
+		std::vector<std::array<unsigned, 3>> result;
+		for (const Triangle& t : mesh.triangles)
+		{
+			std::array<unsigned, 3> corners = {{static_cast<unsigned>(mesh.vertices[t.v0].color.x),
+												static_cast<unsigned>(mesh.vertices[t.v1].color.x),
+												static_cast<unsigned>(mesh.vertices[t.v2].color.x)}};
+
+			// The winding is kept, so only rotations are allowed.
+			std::rotate(corners.begin(), std::min_element(corners.begin(), corners.end()), corners.end());
+			result.push_back(corners);
+		}
+
+		std::sort(result.begin(), result.end());
+		return result;
+	}
+
+	void number_vertices(Triangle_mesh<>& mesh)
+	{
+		for (size_t i = 0; i < mesh.vertices.size(); ++i)
+		{
+			mesh.vertices[i].color = glm::vec3(static_cast<float>(i), 0.0f, 0.0f);
+		}
+	}
+
+} // namespace
+
+TEST_CASE("Vertex cache")
+{
+	SECTION("Measure")
+	{
+		const Triangle_array strip = {{0, 1, 2}, {2, 1, 3}};
+		const graphics::Vertex_cache_stats shared = graphics::measure_vertex_cache(strip, 4, 3);
+		REQUIRE(shared.acmr == Approx(2.0));
+		REQUIRE(shared.atvr == Approx(1.0));
+
+		// The first triangle is pushed out of the cache by the second.
+		const Triangle_array apart = {{0, 1, 2}, {3, 4, 5}, {0, 1, 2}};
+		const graphics::Vertex_cache_stats evicted = graphics::measure_vertex_cache(apart, 6, 3);
+		REQUIRE(evicted.acmr == Approx(3.0));
+		REQUIRE(evicted.atvr == Approx(1.5));
+
+		const graphics::Vertex_cache_stats kept = graphics::measure_vertex_cache(apart, 6, 6);
+		REQUIRE(kept.acmr == Approx(2.0));
+		REQUIRE(kept.atvr == Approx(1.0));
+	}
+
+	SECTION("Grids in generation order")
+	{
+		// Two patches, merged, with a vertex no triangle uses between them.
+		Triangle_mesh<> mesh;
+		mesh.make_patch(Flat_patch(), 64, 64);
+		mesh.vertices.push_back(Vertex(glm::vec3(-1.0f)));
+		Triangle_mesh<> other;
+		other.make_patch(Flat_patch(), 40, 30);
+		mesh.merge(other);
+
+		number_vertices(mesh);
+		const auto expected = original_triangles(mesh);
+
+		const graphics::Vertex_cache_report report = graphics::optimize_for_vertex_cache(mesh);
+		REQUIRE(original_triangles(mesh) == expected);
+
+		REQUIRE(report.before.acmr > 0.95);
+		REQUIRE(report.after.acmr < 0.75);
+		REQUIRE(report.after.atvr < report.before.atvr);
+
+		// In the order of first use.
+		unsigned next = 0;
+		for (const Triangle& t : mesh.triangles)
+		{
+			for (const unsigned v : {t.v0, t.v1, t.v2})
+			{
+				REQUIRE(v <= next);
+				next += v == next ? 1 : 0;
+			}
+		}
+		REQUIRE(next + 1 == mesh.vertices.size());
+		REQUIRE(mesh.vertices.back().position == glm::vec3(-1.0f));
+	}
+
+	SECTION("Degenerate and disconnected triangles")
+	{
+		Triangle_mesh<> mesh;
+		for (unsigned i = 0; i < 9; ++i)
+		{
+			mesh.vertices.push_back(Vertex(glm::vec3(static_cast<float>(i))));
+		}
+		mesh.triangles = {{0, 1, 2}, {3, 3, 4}, {5, 6, 7}, {8, 8, 8}, {2, 1, 5}, {0, 1, 2}};
+
+		number_vertices(mesh);
+		const auto expected = original_triangles(mesh);
+
+		graphics::optimize_for_vertex_cache(mesh);
+		REQUIRE(original_triangles(mesh) == expected);
+		REQUIRE(mesh.vertices.size() == 9);
+	}
+
+	SECTION("Empty")
+	{
+		Triangle_mesh<> mesh;
+		const graphics::Vertex_cache_report report = graphics::optimize_for_vertex_cache(mesh);
+		REQUIRE(report.before.acmr == 0.0);
+		REQUIRE(report.after.acmr == 0.0);
+		REQUIRE(mesh.triangles.empty());
+	}
+}
@@ -0,0 +1,69 @@
+#include "../src/base/worker_pool.hpp"
+#include "catch.hpp"
+#include <atomic>
+#include <thread>
+#include <vector>
+
+using namespace kvant;
+
+TEST_CASE("Worker_pool")
+{
+	SECTION("Every job once")
+	{
+		std::vector<std::atomic<unsigned>> counts(1000);
+		for (auto& count : counts)
+		{
+			count = 0;
+		}
+
+		base::parallel_for(counts.size(), 1, [&counts](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; ++i)
+			{
+				++counts[i];
+			}
+		});
+
+		for (const auto& count : counts)
+		{
+			REQUIRE(count == 1);
+		}
+	}
+
+	SECTION("Callers on several threads")
+	{
+		// Each thread runs its own jobs, in parallel with the pool or serially when the
+		// pool is busy with the run of another thread.
+		const unsigned num_callers = 4;
+		const unsigned num_runs = 50;
+		const unsigned num_jobs = 64;
+
+		std::vector<std::vector<unsigned>> counts(num_callers, std::vector<unsigned>(num_runs * num_jobs, 0));
+		std::vector<std::thread> callers;
+		for (unsigned caller = 0; caller < num_callers; ++caller)
+		{
+			callers.push_back(std::thread([&counts, caller]() {
+				for (unsigned run = 0; run < num_runs; ++run)
+				{
+					std::vector<unsigned>& run_counts = counts[caller];
+					auto job = [&run_counts, run](unsigned job_index) {
+						++run_counts[run * num_jobs + job_index];
+					};
+					base::Worker_pool::instance().run(num_jobs, job);
+				}
+			}));
+		}
+
+		for (auto& caller : callers)
+		{
+			caller.join();
+		}
+
+		for (const auto& caller_counts : counts)
+		{
+			for (const unsigned count : caller_counts)
+			{
+				REQUIRE(count == 1);
+			}
+		}
+	}
+}